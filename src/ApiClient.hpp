@@ -0,0 +1,128 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <WiFiClientSecure.h>
+#include <HTTPClient.h>
+
+#include "Trace.hpp"
+
+static const char *API_CLIENT_TAG = "ApiClient";
+
+typedef struct {
+  // Number of TLS handshakes, i.e. requests that could not reuse the open connection
+  uint32_t handshakes;
+  // Number of requests made, successful or not
+  uint32_t requests;
+  // Number of times the cached server address had to be resolved
+  uint32_t dns_lookups;
+  uint32_t last_request_ms;
+  uint32_t max_request_ms;
+  uint64_t total_request_ms;
+} api_client_stats_t;
+
+// Keeps one keep-alive HTTPS connection to the printi API open and reuses it across polls.
+// HTTPClient drops the connection whenever begin() is called again, so begin() is only used
+// to open a new connection and subsequent requests on the same connection just change the path.
+class ApiClient {
+private:
+  WiFiClientSecure client;
+  HTTPClient http;
+
+  String host;
+  uint16_t port;
+  IPAddress server_ip;
+
+  api_client_stats_t stats = {};
+
+  bool connect() {
+    if (server_ip == INADDR_NONE) {
+      stats.dns_lookups++;
+      TraceSpan span(TRACE_SPAN_DNS);
+      if (!WiFi.hostByName(host.c_str(), server_ip)) {
+        ESP_LOGE(API_CLIENT_TAG, "Could not resolve %s", host.c_str());
+        server_ip = INADDR_NONE;
+        return false;
+      }
+    }
+
+    stats.handshakes++;
+    int64_t connect_start_us = trace_now();
+    bool connected = client.connect(server_ip, port, host.c_str(), NULL, NULL, NULL);
+    trace_record(TRACE_SPAN_CONNECT, connect_start_us);
+    if (connected) {
+      return true;
+    }
+
+    // The cached address may have gone stale, look it up again next time
+    server_ip = INADDR_NONE;
+    return false;
+  }
+
+public:
+  ApiClient(const String &host, uint16_t port = 443) : host(host), port(port), server_ip(INADDR_NONE) {}
+
+  void begin() {
+    // TODO(Leon Handreke): Proper https
+    client.setInsecure();
+    http.setReuse(true);
+  }
+
+  // Request base URL + path. On success, the response is available from response() until end().
+  int get(const String &path, uint32_t timeout_ms) {
+    uint32_t start = millis();
+
+    if (client.connected()) {
+      ESP_LOGD(API_CLIENT_TAG, "Reusing connection for %s", path.c_str());
+      http.setURL(path);
+    } else {
+      http.begin(client, "https://" + host + ":" + String(port) + path);
+    }
+    http.setTimeout(timeout_ms);
+    // Collecting afresh also forgets the header values of the previous response
+    static const char *response_headers[] = {"Content-Type", "Content-Encoding", "X-Printi-Dither",
+                                             "X-Printi-Printer"};
+    http.collectHeaders(response_headers, sizeof(response_headers) / sizeof(response_headers[0]));
+    // Raster jobs are mostly white and compress very well, see InflatePrint
+    http.addHeader("Accept-Encoding", "gzip, deflate");
+
+    int response_code;
+    // Connect ourselves so that the cached address is used, HTTPClient picks up the open connection
+    if (!client.connected() && !connect()) {
+      response_code = HTTPC_ERROR_CONNECTION_REFUSED;
+    } else {
+      // Until the response headers are in, so mostly the server's time to first byte
+      TraceSpan span(TRACE_SPAN_REQUEST);
+      response_code = http.GET();
+    }
+
+    uint32_t duration = millis() - start;
+    stats.requests++;
+    stats.last_request_ms = duration;
+    stats.total_request_ms += duration;
+    if (duration > stats.max_request_ms) {
+      stats.max_request_ms = duration;
+    }
+
+    return response_code;
+  }
+
+  HTTPClient &response() {
+    return http;
+  }
+
+  // Finish the current request, keeping the connection open if the server allows it
+  void end() {
+    http.end();
+  }
+
+  const api_client_stats_t &getStats() {
+    return stats;
+  }
+
+  // True if the request failed because the server could not be reached at all. A read timeout
+  // means the request went through and the server simply had nothing to say in time.
+  static bool isConnectionError(int response_code) {
+    return response_code < 0 && response_code != HTTPC_ERROR_READ_TIMEOUT;
+  }
+};
@@ -0,0 +1,309 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include <mbedtls/sha256.h>
+
+static const char *DELTA_PATCH_TAG = "DeltaPatch";
+
+// Applies a patch made by tools/mkdelta.py, written to it piece by piece, to a source image read
+// through read_source and writes the resulting image to target. Everything is streamed, the only
+// buffer is one small chunk of the source.
+//
+// A patch is a header followed by operations, integers are little endian:
+//
+//   "PDLT", version (1), 3 reserved bytes, source size (4), target size (4),
+//   target version (32, as in esp_app_desc_t), source sha256 (32), target sha256 (32)
+//
+//   'C' offset (4) length (4)          copy length bytes of the source from offset
+//   'A' offset (4) length (4) bytes    add bytes to the source from offset, byte by byte
+//   'I' length (4) bytes               insert bytes as they are
+//   'E'                                end of patch
+//
+// The source is hashed before anything is written, so a patch is only ever applied to exactly the
+// image it was made for. The target hash is checked by finish().
+
+// Source bytes read at a time
+#ifndef DELTA_PATCH_CHUNK_SIZE
+#define DELTA_PATCH_CHUNK_SIZE 256
+#endif
+
+// Read len bytes at offset of the source image into buffer
+typedef bool (*delta_read_cb_t)(void *context, size_t offset, uint8_t *buffer, size_t len);
+
+typedef enum {
+  DELTA_PATCH_OK,
+  // The patch leads to the version that is running already
+  DELTA_PATCH_UP_TO_DATE,
+  DELTA_PATCH_FAILED,
+} delta_patch_result_t;
+
+class DeltaPatch : public Print {
+private:
+  static const size_t HEADER_SIZE = 112;
+  static const uint8_t VERSION = 1;
+
+  delta_read_cb_t read_source;
+  void *source_context;
+  Print *target;
+  char current_version[32];
+
+  enum {
+    STATE_HEADER,
+    STATE_OP,
+    STATE_ADD,
+    STATE_INSERT,
+    STATE_DONE,
+    STATE_UP_TO_DATE,
+    STATE_FAILED,
+  } state = STATE_HEADER;
+
+  uint8_t header[HEADER_SIZE];
+  uint8_t op[9];
+  size_t buffered = 0;
+
+  uint32_t source_size = 0;
+  uint32_t target_size = 0;
+  uint8_t target_sha256[32];
+
+  // Of the ADD or INSERT operation in progress
+  uint32_t op_offset = 0;
+  uint32_t op_remaining = 0;
+
+  size_t bytes_written = 0;
+  // Of bytes_written, how many came from the source rather than the patch
+  size_t bytes_copied = 0;
+  mbedtls_sha256_context target_hash;
+  uint8_t chunk[DELTA_PATCH_CHUNK_SIZE];
+
+  static uint32_t readU32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+  }
+
+  void fail(const char *reason) {
+    ESP_LOGE(DELTA_PATCH_TAG, "Cannot apply patch: %s", reason);
+    state = STATE_FAILED;
+  }
+
+  bool emit(const uint8_t *data, size_t len) {
+    if (bytes_written + len > target_size) {
+      fail("patch makes the image too long");
+      return false;
+    }
+    if (target->write(data, len) != len) {
+      fail("could not write the target");
+      return false;
+    }
+    mbedtls_sha256_update_ret(&target_hash, data, len);
+    bytes_written += len;
+    return true;
+  }
+
+  bool sourceInRange(uint32_t offset, uint32_t len) {
+    if (offset > source_size || len > source_size - offset) {
+      fail("operation reads past the source");
+      return false;
+    }
+    return true;
+  }
+
+  void parseHeader() {
+    if (memcmp(header, "PDLT", 4) != 0 || header[4] != VERSION) {
+      fail("not a version 1 patch");
+      return;
+    }
+    source_size = readU32(header + 8);
+    target_size = readU32(header + 12);
+    const char *target_version = (const char *) header + 16;
+    memcpy(target_sha256, header + 80, sizeof(target_sha256));
+
+    if (strncmp(target_version, current_version, sizeof(current_version)) == 0) {
+      ESP_LOGI(DELTA_PATCH_TAG, "Patch leads to the running version %.32s", current_version);
+      state = STATE_UP_TO_DATE;
+      return;
+    }
+
+    // Hash the source first, patching a different image would produce garbage
+    mbedtls_sha256_context source_hash;
+    mbedtls_sha256_init(&source_hash);
+    mbedtls_sha256_starts_ret(&source_hash, 0);
+    for (size_t offset = 0; offset < source_size; offset += sizeof(chunk)) {
+      size_t len = std::min(sizeof(chunk), (size_t) (source_size - offset));
+      if (!read_source(source_context, offset, chunk, len)) {
+        mbedtls_sha256_free(&source_hash);
+        fail("could not read the source");
+        return;
+      }
+      mbedtls_sha256_update_ret(&source_hash, chunk, len);
+    }
+    uint8_t source_sha256[32];
+    mbedtls_sha256_finish_ret(&source_hash, source_sha256);
+    mbedtls_sha256_free(&source_hash);
+    if (memcmp(source_sha256, header + 48, sizeof(source_sha256)) != 0) {
+      fail("patch was made for a different image");
+      return;
+    }
+
+    ESP_LOGI(DELTA_PATCH_TAG, "Patching %u bytes to %u bytes of version %.32s", source_size, target_size,
+             target_version);
+    state = STATE_OP;
+  }
+
+  void copy(uint32_t offset, uint32_t len) {
+    while (len > 0 && state == STATE_OP) {
+      size_t n = std::min(sizeof(chunk), (size_t) len);
+      if (!read_source(source_context, offset, chunk, n)) {
+        fail("could not read the source");
+        return;
+      }
+      emit(chunk, n);
+      bytes_copied += n;
+      offset += n;
+      len -= n;
+    }
+  }
+
+  void runOp() {
+    uint32_t offset = readU32(op + 1);
+    uint32_t len = readU32(op + 5);
+    switch (op[0]) {
+      case 'C':
+        if (sourceInRange(offset, len)) {
+          copy(offset, len);
+        }
+        break;
+      case 'A':
+        if (sourceInRange(offset, len)) {
+          op_offset = offset;
+          op_remaining = len;
+          state = len > 0 ? STATE_ADD : STATE_OP;
+        }
+        break;
+      case 'I':
+        // Only has a length
+        op_remaining = offset;
+        state = op_remaining > 0 ? STATE_INSERT : STATE_OP;
+        break;
+      case 'E':
+        state = STATE_DONE;
+        break;
+    }
+  }
+
+  static size_t opSize(uint8_t op) {
+    switch (op) {
+      case 'C':
+      case 'A':
+        return 9;
+      case 'I':
+        return 5;
+      case 'E':
+        return 1;
+      default:
+        return 0;
+    }
+  }
+
+  // Consume the data of the ADD operation in progress, returns how many bytes were used
+  size_t add(const uint8_t *buffer, size_t size) {
+    size_t n = std::min(std::min(size, sizeof(chunk)), (size_t) op_remaining);
+    if (!read_source(source_context, op_offset, chunk, n)) {
+      fail("could not read the source");
+      return size;
+    }
+    for (size_t i = 0; i < n; i++) {
+      chunk[i] += buffer[i];
+    }
+    emit(chunk, n);
+    bytes_copied += n;
+    op_offset += n;
+    op_remaining -= n;
+    if (op_remaining == 0 && state == STATE_ADD) {
+      state = STATE_OP;
+    }
+    return n;
+  }
+
+  size_t insert(const uint8_t *buffer, size_t size) {
+    size_t n = std::min(size, (size_t) op_remaining);
+    emit(buffer, n);
+    op_remaining -= n;
+    if (op_remaining == 0 && state == STATE_INSERT) {
+      state = STATE_OP;
+    }
+    return n;
+  }
+
+public:
+  DeltaPatch(delta_read_cb_t read_source, void *source_context, Print *target, const char *current_version)
+      : read_source(read_source), source_context(source_context), target(target) {
+    strncpy(this->current_version, current_version, sizeof(this->current_version));
+    mbedtls_sha256_init(&target_hash);
+    mbedtls_sha256_starts_ret(&target_hash, 0);
+  }
+
+  ~DeltaPatch() {
+    mbedtls_sha256_free(&target_hash);
+  }
+
+  size_t write(uint8_t c) {
+    return write(&c, 1);
+  }
+
+  // Always consumes everything, whatever comes after a failure or the end is dropped
+  size_t write(const uint8_t *buffer, size_t size) {
+    size_t i = 0;
+    while (i < size) {
+      switch (state) {
+        case STATE_HEADER:
+          header[buffered++] = buffer[i++];
+          if (buffered == HEADER_SIZE) {
+            buffered = 0;
+            parseHeader();
+          }
+          break;
+        case STATE_OP:
+          op[buffered++] = buffer[i++];
+          if (opSize(op[0]) == 0) {
+            buffered = 0;
+            fail("unknown operation");
+          } else if (buffered == opSize(op[0])) {
+            buffered = 0;
+            runOp();
+          }
+          break;
+        case STATE_ADD:
+          i += add(buffer + i, size - i);
+          break;
+        case STATE_INSERT:
+          i += insert(buffer + i, size - i);
+          break;
+        default:
+          return size;
+      }
+    }
+    return size;
+  }
+
+  // Check that the patch was complete and produced exactly the image it promised
+  delta_patch_result_t finish() {
+    if (state == STATE_UP_TO_DATE) {
+      return DELTA_PATCH_UP_TO_DATE;
+    }
+    if (state != STATE_DONE) {
+      if (state != STATE_FAILED) {
+        fail("patch cut short");
+      }
+      return DELTA_PATCH_FAILED;
+    }
+    uint8_t sha256[32];
+    mbedtls_sha256_finish_ret(&target_hash, sha256);
+    if (bytes_written != target_size || memcmp(sha256, target_sha256, sizeof(sha256)) != 0) {
+      fail("patched image doesn't match its hash");
+      return DELTA_PATCH_FAILED;
+    }
+    ESP_LOGI(DELTA_PATCH_TAG, "Patched image of %u bytes, %u of them from the running image",
+             bytes_written, bytes_copied);
+    return DELTA_PATCH_OK;
+  }
+};
@@ -32,30 +32,82 @@ Reference: https://reference.epson-biz.com/modules/ref_escpos/index.php?content_
 #define ASCII_GS   29  // Group separator
 
 // Constructor
-ESC_POS_Printer::ESC_POS_Printer(Print *s) :
-    stream(s) {
+ESC_POS_Printer::ESC_POS_Printer(Print *s, size_t bufferSize) :
+    stream(s), bufferLen(0), bufferStart(0),
+    commitTimeout(ESC_POS_COMMIT_TIMEOUT), rasterCommand(RASTER_GS_V_0),
+    maxChunkHeight(256), printerBufferSize(ESC_POS_PRINTER_BUFFER_SIZE),
+    blankRowElision(true), blankRowsElided(0), rasterBytesSaved(0) {
+    buffer = (uint8_t *) malloc(bufferSize);
+    // Without a buffer, everything is passed straight through
+    this->bufferSize = buffer ? bufferSize : 0;
+}
+
+ESC_POS_Printer::~ESC_POS_Printer() {
+    commit();
+    free(buffer);
+}
+
+// Every byte sent to the printer goes through here.  Small writes are
+// collected so that the many tiny commands and characters of a message
+// end up in a few large writes (i.e. USB transfers) instead of one each.
+void ESC_POS_Printer::bufferWrite(const uint8_t *data, size_t size) {
+    if(bufferLen + size > bufferSize) {
+        commit();
+        if(size >= bufferSize) { // Too big to be worth copying
+            stream->write(data, size);
+            return;
+        }
+    }
+    if(bufferLen == 0) bufferStart = millis();
+    memcpy(buffer + bufferLen, data, size);
+    bufferLen += size;
+
+    if((bufferLen == bufferSize) ||
+       (commitTimeout && (millis() - bufferStart >= commitTimeout))) {
+        commit();
+    }
+}
+
+void ESC_POS_Printer::bufferWrite(const char *str) {
+    bufferWrite((const uint8_t *)str, strlen(str));
+}
+
+// Send everything buffered so far.  Must be called once a message is
+// complete, buffered output is only sent on its own when the buffer
+// fills up or on a write after the commit timeout has passed.
+void ESC_POS_Printer::commit() {
+    if(bufferLen) {
+        stream->write(buffer, bufferLen);
+        bufferLen = 0;
     }
+}
+
+// Maximum time in milliseconds that output may stay buffered before the
+// next write sends it out, 0 to only send on commit() or a full buffer.
+void ESC_POS_Printer::setCommitTimeout(unsigned long ms) {
+    commitTimeout = ms;
+}
 
 // The next four helper methods are used when issuing configuration
 // commands, printing bitmaps or barcodes, etc.  Not when printing text.
 
 void ESC_POS_Printer::writeBytes(uint8_t a) {
-    stream->write(a);
+    bufferWrite(&a, 1);
 }
 
 void ESC_POS_Printer::writeBytes(uint8_t a, uint8_t b) {
     uint8_t cmd[2] = {a, b};
-    stream->write(cmd, sizeof(cmd));
+    bufferWrite(cmd, sizeof(cmd));
 }
 
 void ESC_POS_Printer::writeBytes(uint8_t a, uint8_t b, uint8_t c) {
     uint8_t cmd[3] = {a, b, c};
-    stream->write(cmd, sizeof(cmd));
+    bufferWrite(cmd, sizeof(cmd));
 }
 
 void ESC_POS_Printer::writeBytes(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
     uint8_t cmd[4] = {a, b, c, d};
-    stream->write(cmd, sizeof(cmd));
+    bufferWrite(cmd, sizeof(cmd));
 }
 
 // The underlying method for all high-level printing (e.g. println()).
@@ -63,7 +115,7 @@ void ESC_POS_Printer::writeBytes(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
 size_t ESC_POS_Printer::write(uint8_t c) {
 
     if(c != 0x13) { // Strip carriage returns
-        stream->write(c);
+        writeBytes(c);
         if((c == '\n') || (column == maxColumn)) { // If newline or wrap
             column = 0;
             c      = '\n'; // Treat wrap as newline on next pass
@@ -77,8 +129,8 @@ size_t ESC_POS_Printer::write(uint8_t c) {
 }
 
 size_t ESC_POS_Printer::write(const uint8_t *buffer, size_t size) {
-  stream->write(buffer, size);
-  return 1;
+  bufferWrite(buffer, size);
+  return size;
 }
 
 void ESC_POS_Printer::begin() {
@@ -124,7 +176,7 @@ void ESC_POS_Printer::test(){
 
 void ESC_POS_Printer::testPage() {
     char commandTest[] = {ASCII_GS, '(', 'A', 2, 0, 0, 3};
-    stream->write(commandTest, sizeof(commandTest));
+    bufferWrite((const uint8_t *)commandTest, sizeof(commandTest));
 }
 
 void ESC_POS_Printer::setBarcodeHeight(uint8_t val) { // Default is 50
@@ -140,7 +192,7 @@ void ESC_POS_Printer::printBarcode(const char *text, uint8_t type) {
     writeBytes(ASCII_GS, 'w', 3);    // Barcode width 3 (0.375/1.0mm thin/thick)
     writeBytes(ASCII_GS, 'k', type); // Barcode type (listed in .h file)
     // Write text including the terminating '\0'
-    stream->write(text, strlen(text)+1);
+    bufferWrite((const uint8_t *)text, strlen(text)+1);
     prevByte = '\n';
 }
 
@@ -332,15 +384,15 @@ void ESC_POS_Printer::printBitmap(
     bitmap_command[4] = (w >> 8) & 0xFF;// nH = width MS byte
 
     // Line spacing = 16 dots
-    stream->write("\x1b\x33\x10\x1bU\x01");   // Unidirectional print mode on
+    bufferWrite("\x1b\x33\x10\x1bU\x01");   // Unidirectional print mode on
     for (int row = 0; row < h; row += band_height) {
-        stream->write(bitmap_command, sizeof(bitmap_command));
-        stream->write(bitmap, w_bytes);
-        stream->write('\n');
+        bufferWrite(bitmap_command, sizeof(bitmap_command));
+        bufferWrite(bitmap, w_bytes);
+        writeBytes('\n');
         bitmap += w_bytes;
     }
-    stream->write("\x1b\x32\x1bU");     // Default line spacing
-    stream->write((uint8_t)0);          // Unidirectional print mode off
+    bufferWrite("\x1b\x32\x1bU");     // Default line spacing
+    writeBytes(0);                      // Unidirectional print mode off
     prevByte = '\n';
 }
 
@@ -370,7 +422,7 @@ void ESC_POS_Printer::printBitmap_P(
     bitmap_command[4] = (w >> 8) & 0xFF;// nH = width MS byte
 
     // Line spacing = 16 dots
-    stream->write("\x1b\x33\x10\x1bU\x01");   // Unidirectional print mode on
+    bufferWrite("\x1b\x33\x10\x1bU\x01");   // Unidirectional print mode on
     for (int row = 0; row < h; row += band_height) {
         memcpy(buf, bitmap_command, sizeof(bitmap_command));
         size_t len = sizeof(bitmap_command);
@@ -380,83 +432,205 @@ void ESC_POS_Printer::printBitmap_P(
             memcpy_P(buf+len, p, outlen);
             len += outlen;
             p += outlen;
-            stream->write(buf, len);
+            bufferWrite(buf, len);
             len = 0;
         }
-        stream->write('\n');
+        writeBytes('\n');
     }
     // The count correctly includes the trailing '\0'!
-    stream->write("\x1b\x32\x1bU", 5);    // Default line spacing,
+    bufferWrite((const uint8_t *)"\x1b\x32\x1bU", 5); // Default line spacing,
     // Unidirectional print mode off
     prevByte = '\n';
 }
 
+// Starts a raster image chunk of the given size, using whichever raster
+// command the printer was configured for (see setRasterCommand()).
+// ASCII  GS  v  0  m  xL xH yL yH d1...dk
+// ASCII  DC2 *  r  n  d1...dk
+void ESC_POS_Printer::writeRasterHeader(int rowBytes, int rows) {
+    if(rasterCommand == RASTER_DC2_STAR) {
+        writeBytes(ASCII_DC2, '*', rows, rowBytes);
+    } else {
+        uint8_t cmd[8] = {ASCII_GS, 'v', '0', 0, // m = normal density
+                          (uint8_t)(rowBytes & 0xFF), (uint8_t)(rowBytes >> 8),
+                          (uint8_t)(rows & 0xFF), (uint8_t)(rows >> 8)};
+        bufferWrite(cmd, sizeof(cmd));
+    }
+}
+
+// Number of raster rows to send per command so that one chunk fits into
+// the printer's input buffer.
+int ESC_POS_Printer::rasterChunkHeight(int rowBytes) {
+    int rows = printerBufferSize / max(rowBytes, 1);
+    if(rows > maxChunkHeight) rows = maxChunkHeight;
+    // DC2 * can only express up to 255 rows
+    if(rasterCommand == RASTER_DC2_STAR && rows > 255) rows = 255;
+    if(rows < 1) rows = 1;
+    return rows;
+}
+
+// True if none of the len bytes at row has a dot set.  Checks a word at
+// a time once row is aligned, as most rows of a receipt are blank.
+bool ESC_POS_Printer::isBlankRow(const uint8_t *row, int len) {
+    int i = 0;
+    uint32_t word;
+
+    for(; i < len && ((uintptr_t)(row + i) & 3); i++) {
+        if(row[i]) return false;
+    }
+    for(; i + 4 <= len; i += 4) {
+        memcpy(&word, row + i, sizeof(word));
+        if(word) return false;
+    }
+    for(; i < len; i++) {
+        if(row[i]) return false;
+    }
+    return true;
+}
+
+// Sends count rows of rowBytes each, stride bytes apart, as raster data.
+// With blank row elision on, runs of blank rows are replaced by feeds of
+// the same height, which is far less data and lets the printer step over
+// them at feed speed instead of raster speed.  Assumes the vertical
+// motion unit of ESC J equals one raster row (1/203", the default on
+// 203 dpi printers).
+void ESC_POS_Printer::writeRaster(
+        const uint8_t *rows, int rowBytes, int stride, int count) {
+    int chunkHeightLimit, minBlankRun, n, y;
+
+    // A raster header of zero width or height makes some printers take
+    // the bytes that follow for image data
+    if(rowBytes <= 0 || count <= 0) return;
+
+    chunkHeightLimit = rasterChunkHeight(rowBytes);
+    // Only worth it if the skipped data outweighs the extra raster header
+    // (8 bytes) and feed command (3 bytes)
+    minBlankRun = 11 / rowBytes + 1;
+
+    while(count > 0) {
+        n = 0;
+        if(blankRowElision) {
+            while(n < count && isBlankRow(rows + n * stride, rowBytes)) n++;
+        }
+        if(n >= minBlankRun || n == count) {
+            blankRowsElided += n;
+            rasterBytesSaved += n * rowBytes;
+            for(y = n; y > 0; y -= 255) feedRows(min(y, 255));
+            rows += n * stride;
+            count -= n;
+            continue;
+        }
+
+        // Up to chunkHeightLimit rows of raster, ending where the next
+        // long enough blank run begins
+        for(n = 1; n < count && n < chunkHeightLimit; n++) {
+            if(blankRowElision && isBlankRow(rows + n * stride, rowBytes)) {
+                int run = 1;
+                while(run < minBlankRun && n + run < count &&
+                      isBlankRow(rows + (n + run) * stride, rowBytes)) run++;
+                if(run >= minBlankRun || n + run == count) break;
+            }
+        }
+
+        writeRasterHeader(rowBytes, n);
+        if(rowBytes == stride) {
+            // Rows are contiguous, send them all at once
+            bufferWrite(rows, n * rowBytes);
+        } else {
+            for(y = 0; y < n; y++) bufferWrite(rows + y * stride, rowBytes);
+        }
+        rows += n * stride;
+        count -= n;
+    }
+}
+
 void ESC_POS_Printer::printBitmap(
         int w, int h, const uint8_t *bitmap, bool fromProgMem) {
-    int rowBytes, rowBytesClipped, rowStart, chunkHeight, chunkHeightLimit,
-        x, y, i;
+    int rowBytes, rowBytesClipped;
+
+    if(w <= 0 || h <= 0) return;
 
     rowBytes        = (w + 7) / 8; // Round up to next byte boundary
     rowBytesClipped = (rowBytes >= 48) ? 48 : rowBytes; // 384 pixels max width
 
-    chunkHeightLimit = 255; // Buffer doesn't matter, handshake!
+    // PROGMEM is memory mapped on the ESP32, so fromProgMem makes no
+    // difference and rows can be copied out in bulk either way.
+    (void)fromProgMem;
 
-    for(i=rowStart=0; rowStart < h; rowStart += chunkHeightLimit) {
-        // Issue up to chunkHeightLimit rows at a time:
-        chunkHeight = h - rowStart;
-        if(chunkHeight > chunkHeightLimit) chunkHeight = chunkHeightLimit;
+    writeRaster(bitmap, rowBytesClipped, rowBytes, h);
+    prevByte = '\n';
+}
 
-        writeBytes(ASCII_DC2, '*', chunkHeight, rowBytesClipped);
+// Reads size bytes from fromStream.  Sleeps while no data is available
+// instead of spinning on read(), and gives up once the stream's timeout
+// passes without new data.  Returns the number of bytes actually read.
+size_t ESC_POS_Printer::readFully(Stream *fromStream, uint8_t *data, size_t size) {
+    size_t got = 0;
+    unsigned long lastData = millis();
 
-        for(y=0; y < chunkHeight; y++) {
-            for(x=0; x < rowBytesClipped; x++, i++) {
-                stream->write(fromProgMem ? pgm_read_byte(bitmap + i) : *(bitmap+i));
-            }
-            i += rowBytes - rowBytesClipped;
+    while(got < size) {
+        int avail = fromStream->available();
+        if(avail <= 0) {
+            if(millis() - lastData >= fromStream->getTimeout()) break;
+            delay(1); // Let other tasks (e.g. the network stack) run
+            continue;
         }
+        got += fromStream->readBytes(data + got, min((size_t)avail, size - got));
+        lastData = millis();
     }
-    prevByte = '\n';
+    return got;
 }
 
 void ESC_POS_Printer::printBitmap(int w, int h, Stream *fromStream) {
-    int rowBytes, rowBytesClipped, rowStart, chunkHeight, chunkHeightLimit,
-        x, y, i, c;
+    int rowBytes, rowBytesClipped, bufRows, rowsRead, i, n;
+    uint8_t row[48], *rows;
+
+    // Nothing to read either, a stream bitmap has no data without width
+    if(w <= 0 || h <= 0) return;
 
     rowBytes        = (w + 7) / 8; // Round up to next byte boundary
     rowBytesClipped = (rowBytes >= 48) ? 48 : rowBytes; // 384 pixels max width
 
-    // Est. max rows to write at once, assuming 256 byte printer buffer.
-    chunkHeightLimit = 255; // Buffer doesn't matter, handshake!
+    // Rows are collected and handed to the raster writer in batches
+    bufRows = ESC_POS_STREAM_ROWS;
+    rows = (uint8_t *)malloc(bufRows * rowBytesClipped);
+    if(!rows) {
+        rows = row;
+        bufRows = 1;
+    }
 
-    for(rowStart=0; rowStart < h; rowStart += chunkHeightLimit) {
-        // Issue up to chunkHeightLimit rows at a time:
-        chunkHeight = h - rowStart;
-        if(chunkHeight > chunkHeightLimit) chunkHeight = chunkHeightLimit;
+    for(rowsRead = 0; h > 0; h--) {
+        if(readFully(fromStream, rows + rowsRead * rowBytesClipped,
+                     rowBytesClipped) < (size_t)rowBytesClipped) {
+            break; // Stream timed out, print what we got
+        }
+        rowsRead++;
 
-        writeBytes(ASCII_DC2, '*', chunkHeight, rowBytesClipped);
+        // Skip the part of the row beyond the print head in bulk
+        for(i = rowBytes - rowBytesClipped; i > 0; i -= n) {
+            n = min(i, (int)sizeof(row));
+            if(readFully(fromStream, row, n) < (size_t)n) break;
+        }
 
-        for(y=0; y < chunkHeight; y++) {
-            for(x=0; x < rowBytesClipped; x++) {
-                while((c = fromStream->read()) < 0);
-                stream->write((uint8_t)c);
-            }
-            for(i = rowBytes - rowBytesClipped; i>0; i--) {
-                while((c = fromStream->read()) < 0);
-            }
+        if(rowsRead == bufRows) {
+            writeRaster(rows, rowBytesClipped, rowBytesClipped, rowsRead);
+            rowsRead = 0;
         }
     }
+    writeRaster(rows, rowBytesClipped, rowBytesClipped, rowsRead);
+
+    if(rows != row) free(rows);
     prevByte = '\n';
 }
 
 void ESC_POS_Printer::printBitmap(Stream *fromStream) {
-    uint8_t  tmp;
+    uint8_t  header[4];
     uint16_t width, height;
 
-    tmp    =  fromStream->read();
-    width  = (fromStream->read() << 8) + tmp;
+    if(readFully(fromStream, header, sizeof(header)) < sizeof(header)) return;
 
-    tmp    =  fromStream->read();
-    height = (fromStream->read() << 8) + tmp;
+    width  = (header[1] << 8) + header[0];
+    height = (header[3] << 8) + header[2];
 
     printBitmap(width, height, fromStream);
 }
@@ -519,7 +693,37 @@ void ESC_POS_Printer::setLineHeight(int val) {
     writeBytes(ASCII_ESC, '3', val);
 }
 
+// Upper limit on the rows sent per raster command, on top of what the
+// printer buffer size allows.
 void ESC_POS_Printer::setMaxChunkHeight(int val) {
+    if(val < 1) val = 1;
+    if(val > 0xFFFF) val = 0xFFFF;
+    maxChunkHeight = val;
+}
+
+// Size of the printer's input buffer in bytes, used to pick how many
+// raster rows are sent per command.
+void ESC_POS_Printer::setPrinterBufferSize(uint16_t bytes) {
+    printerBufferSize = bytes;
+}
+
+// Replace runs of blank raster rows with paper feeds, see writeRaster()
+void ESC_POS_Printer::setBlankRowElision(bool enabled) {
+    blankRowElision = enabled;
+}
+
+unsigned long ESC_POS_Printer::getBlankRowsElided() {
+    return blankRowsElided;
+}
+
+unsigned long ESC_POS_Printer::getRasterBytesSaved() {
+    return rasterBytesSaved;
+}
+
+// RASTER_GS_V_0 (default) or RASTER_DC2_STAR for models that only know
+// the older DC2 * command.
+void ESC_POS_Printer::setRasterCommand(uint8_t command) {
+    rasterCommand = command;
 }
 
 // Alters some chars in ASCII 0x23-0x7E range; see datasheet
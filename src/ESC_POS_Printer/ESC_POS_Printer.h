@@ -112,13 +112,40 @@
 #define CODEPAGE_CP856       46
 #define CODEPAGE_CP874       47
 
+// Commands and text are collected and sent to the underlying stream in
+// blocks of this size, see commit()
+#ifndef ESC_POS_BUFFER_SIZE
+#define ESC_POS_BUFFER_SIZE      1024
+#endif
+// Pending output older than this many milliseconds goes out with the next
+// write. Nothing sends it on its own, callers must commit() once a message
+// is complete.
+#ifndef ESC_POS_COMMIT_TIMEOUT
+#define ESC_POS_COMMIT_TIMEOUT    100
+#endif
+// Assumed size of the printer's input buffer, bitmaps are sent in raster
+// chunks that fit into it
+#ifndef ESC_POS_PRINTER_BUFFER_SIZE
+#define ESC_POS_PRINTER_BUFFER_SIZE 4096
+#endif
+
+// Rows read per batch when printing a bitmap from a Stream
+#ifndef ESC_POS_STREAM_ROWS
+#define ESC_POS_STREAM_ROWS        24
+#endif
+
+// Raster bitmap commands, see setRasterCommand()
+#define RASTER_GS_V_0    0 // GS v 0, print raster bit image
+#define RASTER_DC2_STAR  1 // DC2 *, older models
+
 class ESC_POS_Printer : public Print {
 
     public:
 
         // IMPORTANT: constructor syntax has changed from prior versions
         // of this library.  Please see notes in the example code!
-        ESC_POS_Printer(Print *s=&Serial);
+        ESC_POS_Printer(Print *s=&Serial, size_t bufferSize=ESC_POS_BUFFER_SIZE);
+        ~ESC_POS_Printer();
 
         size_t
             write(uint8_t c);
@@ -127,6 +154,7 @@ class ESC_POS_Printer : public Print {
             begin(),
             boldOff(),
             boldOn(),
+            commit(),
             doubleHeightOff(),
             doubleHeightOn(),
             doubleWidthOff(),
@@ -151,9 +179,13 @@ class ESC_POS_Printer : public Print {
             setCharSpacing(int spacing=0),
             setCharset(uint8_t val=0),
             setCodePage(uint8_t val=0),
+            setCommitTimeout(unsigned long ms=ESC_POS_COMMIT_TIMEOUT),
             setDefault(),
             setLineHeight(int val=30),
             setMaxChunkHeight(int val=256),
+            setPrinterBufferSize(uint16_t bytes=ESC_POS_PRINTER_BUFFER_SIZE),
+            setRasterCommand(uint8_t command=RASTER_GS_V_0),
+            setBlankRowElision(bool enabled=true),
             setSize(char value),
             setSize(uint8_t height, uint8_t width),
             setTimes(unsigned long, unsigned long),
@@ -171,11 +203,22 @@ class ESC_POS_Printer : public Print {
             wake();
         bool
             hasPaper();
+        unsigned long
+            getBlankRowsElided(),
+            getRasterBytesSaved();
 
     private:
 
         Print
             *stream;
+        uint8_t
+            *buffer;       // Output not yet sent to stream, see commit()
+        size_t
+            bufferSize,
+            bufferLen;
+        unsigned long
+            bufferStart,   // millis() when the oldest buffered byte was written
+            commitTimeout;
         uint8_t
             printMode,
             prevByte,      // Last character issued to printer
@@ -184,7 +227,15 @@ class ESC_POS_Printer : public Print {
             charHeight,    // Height of characters, in 'dots'
             lineSpacing,   // Inter-line spacing (not line height), in dots
             barcodeHeight, // Barcode height in dots, not including text
-            maxChunkHeight;
+            rasterCommand; // RASTER_GS_V_0 or RASTER_DC2_STAR
+        uint16_t
+            maxChunkHeight,    // Max raster rows per command
+            printerBufferSize; // Printer input buffer size in bytes
+        bool
+            blankRowElision;
+        unsigned long
+            blankRowsElided,   // Blank raster rows replaced by feeds so far
+            rasterBytesSaved;  // Raster bytes not sent because of that
         void
             writeBytes(uint8_t a),
             writeBytes(uint8_t a, uint8_t b),
@@ -192,7 +243,17 @@ class ESC_POS_Printer : public Print {
             writeBytes(uint8_t a, uint8_t b, uint8_t c, uint8_t d),
             setPrintMode(uint8_t mask),
             unsetPrintMode(uint8_t mask),
-            writePrintMode();
+            writePrintMode(),
+            writeRasterHeader(int rowBytes, int rows),
+            writeRaster(const uint8_t *rows, int rowBytes, int stride, int count),
+            bufferWrite(const uint8_t *data, size_t size),
+            bufferWrite(const char *str);
+        int
+            rasterChunkHeight(int rowBytes);
+        size_t
+            readFully(Stream *fromStream, uint8_t *data, size_t size);
+        bool
+            isBlankRow(const uint8_t *row, int len);
 
 };
 
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include <atomic>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <FreeRTOS.h>
+#include <freertos/task.h>
+
+// Deferred logging for hot paths such as USB transfer callbacks. Recording an event only copies
+// an id, a timestamp and up to three arguments into a ring buffer. Formatting and printing
+// happens later in a low priority task, so the caller never waits for the UART.
+//
+// The ring has a single producer and a single consumer and needs no lock. All events have to be
+// recorded from the same task, which holds for the USB client task that runs all transfer
+// callbacks. Use ESP_LOG from anywhere else.
+
+static const char *EVENT_LOG_TAG = "EventLog";
+
+// Events above this level are compiled out entirely
+#ifndef EVENT_LOG_LEVEL
+#define EVENT_LOG_LEVEL ESP_LOG_INFO
+#endif
+
+// Events kept until the drain task gets to them, must be a power of two
+#ifndef EVENT_LOG_RING_SIZE
+#define EVENT_LOG_RING_SIZE 256
+#endif
+
+#ifndef EVENT_LOG_DRAIN_MS
+#define EVENT_LOG_DRAIN_MS 50
+#endif
+
+typedef enum {
+  EVENT_TRANSFER_RETRY,
+  EVENT_TRANSFER_FAILED,
+  EVENT_TRANSFER_DONE,
+  EVENT_BENCHMARK,
+  EVENT_COUNT,
+} event_id_t;
+
+typedef struct {
+  const char *tag;
+  esp_log_level_t level;
+  // Gets the three arguments of the event as unsigned ints
+  const char *format;
+} event_def_t;
+
+static const event_def_t EVENT_DEFS[EVENT_COUNT] = {
+  {"Printer", ESP_LOG_WARN, "Transfer failed with status %u, resubmitting (try %u of %u)"},
+  {"Printer", ESP_LOG_ERROR, "Transfer failed with status %u, %u bytes lost"},
+  {"Printer", ESP_LOG_DEBUG, "Transfer %08x returned to pool, status %u, %u bytes"},
+  {"EventLog", ESP_LOG_DEBUG, "Benchmark event %u %u %u"},
+};
+
+typedef struct {
+  uint16_t id;
+  int64_t time_us;
+  uint32_t args[3];
+} event_record_t;
+
+// head is only written by the producer, tail only by the consumer
+typedef struct {
+  event_record_t records[EVENT_LOG_RING_SIZE];
+  std::atomic<uint32_t> head;
+  std::atomic<uint32_t> tail;
+  std::atomic<uint32_t> dropped;
+} event_ring_t;
+
+static event_ring_t event_ring;
+static TaskHandle_t event_log_task_hdl = nullptr;
+
+static inline void event_ring_push(event_ring_t *ring, event_id_t id, uint32_t a, uint32_t b, uint32_t c) {
+  uint32_t head = ring->head.load(std::memory_order_relaxed);
+  if (head - ring->tail.load(std::memory_order_acquire) >= EVENT_LOG_RING_SIZE) {
+    // Never wait in a callback, losing a log line is better
+    ring->dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  event_record_t *record = &ring->records[head % EVENT_LOG_RING_SIZE];
+  record->id = id;
+  record->time_us = esp_timer_get_time();
+  record->args[0] = a;
+  record->args[1] = b;
+  record->args[2] = c;
+  ring->head.store(head + 1, std::memory_order_release);
+}
+
+static inline void event_log_record(event_id_t id, uint32_t a = 0, uint32_t b = 0, uint32_t c = 0) {
+  event_ring_push(&event_ring, id, a, b, c);
+}
+
+// Record event id at level, the level check folds away at compile time
+#define EVENT_LOG(level, id, ...) do {      \
+    if ((level) <= EVENT_LOG_LEVEL) {        \
+      event_log_record(id, ##__VA_ARGS__);   \
+    }                                        \
+  } while (0)
+
+// Format and print everything recorded so far, returns the number of events printed
+static inline size_t event_log_drain() {
+  size_t count = 0;
+  uint32_t tail = event_ring.tail.load(std::memory_order_relaxed);
+  while (tail != event_ring.head.load(std::memory_order_acquire)) {
+    event_record_t record = event_ring.records[tail % EVENT_LOG_RING_SIZE];
+    event_ring.tail.store(++tail, std::memory_order_release);
+
+    const event_def_t *def = &EVENT_DEFS[record.id];
+    char line[128];
+    snprintf(line, sizeof(line), def->format, record.args[0], record.args[1], record.args[2]);
+    ESP_LOG_LEVEL(def->level, def->tag, "[%lld us] %s", record.time_us, line);
+    count++;
+  }
+
+  uint32_t dropped = event_ring.dropped.exchange(0, std::memory_order_relaxed);
+  if (dropped > 0) {
+    ESP_LOGW(EVENT_LOG_TAG, "%u events dropped, the ring was full", dropped);
+  }
+  return count;
+}
+
+static void _event_log_task(void *pvParameters) {
+  while (true) {
+    event_log_drain();
+    vTaskDelay(pdMS_TO_TICKS(EVENT_LOG_DRAIN_MS));
+  }
+}
+
+// Start printing recorded events, events recorded earlier are kept until then
+static inline void event_log_begin() {
+  if (event_log_task_hdl == nullptr) {
+    xTaskCreate(_event_log_task, "Event log", 3072, nullptr, 1, &event_log_task_hdl);
+  }
+}
+
+// Average cost in nanoseconds of what the USB transfer callback used to log per transfer, three
+// ESP_LOGI lines, and of recording the same as one event. Prints a few lines as a side effect.
+static inline void event_log_benchmark(uint32_t *esp_log_ns, uint32_t *event_ns, int iterations = 10) {
+  int64_t start_us = esp_timer_get_time();
+  for (int i = 0; i < iterations; i++) {
+    ESP_LOGI(EVENT_LOG_TAG, "Benchmark return transfer to pool");
+    ESP_LOGI(EVENT_LOG_TAG, "Benchmark transfer context: %d", i);
+    ESP_LOGI(EVENT_LOG_TAG, "Benchmark transfer status %d", 0);
+  }
+  *esp_log_ns = (esp_timer_get_time() - start_us) * 1000 / iterations;
+
+  // A ring of its own, the shared one only takes events from the USB client task
+  static event_ring_t ring;
+  const int event_iterations = 1000;
+  start_us = esp_timer_get_time();
+  for (int i = 0; i < event_iterations; i++) {
+    event_ring_push(&ring, EVENT_BENCHMARK, i, 0, 0);
+    // Consume right away so the ring never fills up
+    ring.tail.store(ring.head.load(std::memory_order_relaxed), std::memory_order_relaxed);
+  }
+  *event_ns = (esp_timer_get_time() - start_us) * 1000 / event_iterations;
+}
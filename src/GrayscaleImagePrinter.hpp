@@ -0,0 +1,231 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "ESC_POS_Printer/ESC_POS_Printer.h"
+#include "dither.hpp"
+
+static const char *GRAYSCALE_IMAGE_TAG = "GrayscaleImage";
+
+// Width of the print head in dots, images are scaled to fill it
+#define GRAYSCALE_PRINT_WIDTH 384
+// Widest input image accepted, one input row is buffered at a time
+#define GRAYSCALE_MAX_INPUT_WIDTH 8192
+// Dithered rows are handed to the raster writer this many at a time
+#define GRAYSCALE_RASTER_ROWS 24
+
+// Accepts a binary PGM (P5) image of any size written to it piece by piece, scales it to the
+// width of the print head and prints it dithered to 1bpp. Works one input row at a time, so
+// memory use only depends on the input width, never on the image height.
+class GrayscaleImagePrinter : public Print {
+private:
+  ESC_POS_Printer *esc_pos_printer;
+  dither_kernel_t kernel;
+  dither_state_t dither = {};
+
+  enum {
+    STATE_HEADER,
+    STATE_PIXELS,
+    STATE_DONE,
+    STATE_FAILED,
+  } state = STATE_HEADER;
+
+  // Header is magic, width, height and maxval separated by whitespace and comments
+  int header_field = 0;
+  bool in_token = false;
+  bool in_comment = false;
+  char magic[3] = {};
+  uint32_t header_values[4] = {};
+
+  uint32_t in_width = 0;
+  uint32_t in_height = 0;
+  uint32_t maxval = 0;
+  uint32_t out_height = 0;
+
+  uint8_t *in_row = nullptr;
+  uint32_t in_row_len = 0;
+  uint32_t in_y = 0;
+  uint32_t out_y = 0;
+
+  uint8_t *scaled_row = nullptr;
+  uint8_t *raster = nullptr;
+  int raster_rows = 0;
+
+  void fail(const char *reason) {
+    ESP_LOGE(GRAYSCALE_IMAGE_TAG, "Cannot print image: %s", reason);
+    state = STATE_FAILED;
+  }
+
+  bool startPixels() {
+    if (strcmp(magic, "P5") != 0) {
+      fail("not a binary PGM");
+      return false;
+    }
+    in_width = header_values[1];
+    in_height = header_values[2];
+    maxval = header_values[3];
+    if (in_width == 0 || in_height == 0 || in_width > GRAYSCALE_MAX_INPUT_WIDTH) {
+      fail("unsupported size");
+      return false;
+    }
+    if (maxval == 0 || maxval > 255) {
+      fail("only 8-bit images are supported");
+      return false;
+    }
+
+    out_height = (uint64_t) in_height * GRAYSCALE_PRINT_WIDTH / in_width;
+    if (out_height == 0) {
+      out_height = 1;
+    }
+
+    in_row = (uint8_t *) malloc(in_width);
+    scaled_row = (uint8_t *) malloc(GRAYSCALE_PRINT_WIDTH);
+    raster = (uint8_t *) malloc(GRAYSCALE_RASTER_ROWS * GRAYSCALE_PRINT_WIDTH / 8);
+    if (in_row == nullptr || scaled_row == nullptr || raster == nullptr ||
+        !dither_begin(&dither, kernel, GRAYSCALE_PRINT_WIDTH)) {
+      fail("out of memory");
+      return false;
+    }
+
+    ESP_LOGI(GRAYSCALE_IMAGE_TAG, "Printing %ux%u image as %ux%u",
+             in_width, in_height, GRAYSCALE_PRINT_WIDTH, out_height);
+    state = STATE_PIXELS;
+    return true;
+  }
+
+  void parseHeader(uint8_t c) {
+    if (in_comment) {
+      in_comment = c != '\n' && c != '\r';
+      return;
+    }
+
+    if (isspace(c)) {
+      if (in_token) {
+        in_token = false;
+        header_field++;
+        // The single whitespace after maxval is the last byte before the pixels
+        if (header_field == 4) {
+          startPixels();
+        }
+      }
+      return;
+    }
+
+    if (c == '#' && !in_token) {
+      in_comment = true;
+      return;
+    }
+
+    in_token = true;
+    if (header_field == 0) {
+      size_t len = strlen(magic);
+      if (len >= sizeof(magic) - 1) {
+        fail("not a binary PGM");
+        return;
+      }
+      magic[len] = c;
+    } else if (isdigit(c) && header_values[header_field] < 100000) {
+      header_values[header_field] = header_values[header_field] * 10 + (c - '0');
+    } else {
+      fail("malformed header");
+    }
+  }
+
+  // Box filter when shrinking, nearest neighbour when growing
+  void scaleRow() {
+    for (uint32_t x = 0; x < GRAYSCALE_PRINT_WIDTH; x++) {
+      uint32_t start = x * in_width / GRAYSCALE_PRINT_WIDTH;
+      uint32_t end = (x + 1) * in_width / GRAYSCALE_PRINT_WIDTH;
+      if (end <= start) {
+        end = start + 1;
+      }
+      uint32_t sum = 0;
+      for (uint32_t i = start; i < end; i++) {
+        sum += in_row[i];
+      }
+      scaled_row[x] = sum * 255 / (maxval * (end - start));
+    }
+  }
+
+  void flushRaster() {
+    if (raster_rows > 0) {
+      esc_pos_printer->printBitmap(GRAYSCALE_PRINT_WIDTH, raster_rows, raster, false);
+      raster_rows = 0;
+    }
+  }
+
+  void processRow() {
+    scaleRow();
+
+    // Nearest neighbour vertically, an input row is printed zero or more times
+    while (out_y < out_height && (uint64_t) out_y * in_height / out_height == in_y) {
+      dither_row(&dither, scaled_row, raster + raster_rows * (GRAYSCALE_PRINT_WIDTH / 8));
+      raster_rows++;
+      out_y++;
+      if (raster_rows == GRAYSCALE_RASTER_ROWS) {
+        flushRaster();
+      }
+    }
+
+    in_y++;
+    if (in_y == in_height) {
+      flushRaster();
+      state = STATE_DONE;
+    }
+  }
+
+public:
+  GrayscaleImagePrinter(ESC_POS_Printer *esc_pos_printer, dither_kernel_t kernel = DITHER_FLOYD_STEINBERG)
+      : esc_pos_printer(esc_pos_printer), kernel(kernel) {}
+
+  ~GrayscaleImagePrinter() {
+    dither_end(&dither);
+    free(in_row);
+    free(scaled_row);
+    free(raster);
+  }
+
+  size_t write(uint8_t c) {
+    return write(&c, 1);
+  }
+
+  // Always consumes everything, bytes of a broken image are dropped so the job still drains
+  size_t write(const uint8_t *buffer, size_t size) {
+    size_t i = 0;
+    while (i < size && state == STATE_HEADER) {
+      parseHeader(buffer[i++]);
+    }
+
+    while (i < size && state == STATE_PIXELS) {
+      size_t n = std::min((size_t) (in_width - in_row_len), size - i);
+      memcpy(in_row + in_row_len, buffer + i, n);
+      in_row_len += n;
+      i += n;
+      if (in_row_len == in_width) {
+        processRow();
+        in_row_len = 0;
+      }
+    }
+    return size;
+  }
+
+  // Print whatever is still buffered. Returns false if the image was broken or cut short.
+  bool finish() {
+    if (state == STATE_PIXELS) {
+      ESP_LOGE(GRAYSCALE_IMAGE_TAG, "Image cut short after %u of %u rows", in_y, in_height);
+    }
+    flushRaster();
+    esc_pos_printer->commit();
+    return state == STATE_DONE;
+  }
+
+  static dither_kernel_t kernelFromName(const String &name) {
+    if (name.equalsIgnoreCase("atkinson")) {
+      return DITHER_ATKINSON;
+    }
+    if (name.equalsIgnoreCase("bayer")) {
+      return DITHER_BAYER;
+    }
+    return DITHER_FLOYD_STEINBERG;
+  }
+};
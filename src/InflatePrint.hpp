@@ -0,0 +1,204 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "rom/miniz.h"
+
+static const char *INFLATE_TAG = "Inflate";
+
+// Decompresses a gzip or deflate (zlib) encoded body written to it piece by piece and passes the
+// result on to sink. Uses the tinfl inflater from ROM with one fixed 32 KiB window as both
+// history and output buffer, so memory use doesn't depend on the size of the body.
+class InflatePrint : public Print {
+private:
+  Print *sink;
+
+  tinfl_decompressor *decompressor = nullptr;
+  uint8_t *window = nullptr;
+  size_t window_ofs = 0;
+
+  enum {
+    STATE_GZIP_HEADER,
+    STATE_GZIP_EXTRA_LEN,
+    STATE_GZIP_EXTRA,
+    STATE_GZIP_NAME,
+    STATE_GZIP_COMMENT,
+    STATE_GZIP_HEADER_CRC,
+    STATE_ZLIB_DETECT,
+    STATE_DEFLATE,
+    STATE_DONE,
+    STATE_FAILED,
+  } state;
+
+  uint8_t header[10];
+  size_t header_len = 0;
+  uint8_t gzip_flags = 0;
+  uint16_t skip = 0;
+  uint32_t inflate_flags = 0;
+
+  size_t bytes_in = 0;
+  size_t bytes_out = 0;
+
+  static const uint8_t GZIP_FEXTRA = 0x04;
+  static const uint8_t GZIP_FNAME = 0x08;
+  static const uint8_t GZIP_FCOMMENT = 0x10;
+  static const uint8_t GZIP_FHCRC = 0x02;
+
+  void fail(const char *reason) {
+    ESP_LOGE(INFLATE_TAG, "Cannot decompress body: %s", reason);
+    state = STATE_FAILED;
+  }
+
+  // Move on to whatever optional gzip header field comes next
+  void nextGzipField() {
+    if (gzip_flags & GZIP_FEXTRA) {
+      gzip_flags &= ~GZIP_FEXTRA;
+      header_len = 0;
+      state = STATE_GZIP_EXTRA_LEN;
+    } else if (gzip_flags & GZIP_FNAME) {
+      gzip_flags &= ~GZIP_FNAME;
+      state = STATE_GZIP_NAME;
+    } else if (gzip_flags & GZIP_FCOMMENT) {
+      gzip_flags &= ~GZIP_FCOMMENT;
+      state = STATE_GZIP_COMMENT;
+    } else if (gzip_flags & GZIP_FHCRC) {
+      gzip_flags &= ~GZIP_FHCRC;
+      skip = 2;
+      state = STATE_GZIP_HEADER_CRC;
+    } else {
+      // gzip members always carry raw deflate data
+      inflate_flags = 0;
+      state = STATE_DEFLATE;
+    }
+  }
+
+  // Consume header bytes, returns how many were used
+  size_t parseHeader(const uint8_t *buffer, size_t size) {
+    size_t i = 0;
+    while (i < size && state < STATE_DEFLATE) {
+      uint8_t c = buffer[i++];
+      switch (state) {
+        case STATE_GZIP_HEADER:
+          header[header_len++] = c;
+          if (header_len == 10) {
+            if (header[0] != 0x1f || header[1] != 0x8b || header[2] != 8) {
+              fail("not a gzip stream");
+              break;
+            }
+            gzip_flags = header[3];
+            nextGzipField();
+          }
+          break;
+        case STATE_GZIP_EXTRA_LEN:
+          header[header_len++] = c;
+          if (header_len == 2) {
+            skip = header[0] | (header[1] << 8);
+            state = STATE_GZIP_EXTRA;
+            if (skip == 0) {
+              nextGzipField();
+            }
+          }
+          break;
+        case STATE_GZIP_EXTRA:
+        case STATE_GZIP_HEADER_CRC:
+          if (--skip == 0) {
+            nextGzipField();
+          }
+          break;
+        case STATE_GZIP_NAME:
+        case STATE_GZIP_COMMENT:
+          if (c == 0) {
+            nextGzipField();
+          }
+          break;
+        case STATE_ZLIB_DETECT:
+          header[header_len++] = c;
+          if (header_len == 2) {
+            // Content-Encoding: deflate is meant to be zlib wrapped, but some servers send raw deflate
+            bool is_zlib = (header[0] & 0x0f) == 8 && ((header[0] << 8) | header[1]) % 31 == 0;
+            inflate_flags = is_zlib ? TINFL_FLAG_PARSE_ZLIB_HEADER : 0;
+            state = STATE_DEFLATE;
+            inflate(header, 2);
+          }
+          break;
+        default:
+          break;
+      }
+    }
+    return i;
+  }
+
+  void inflate(const uint8_t *buffer, size_t size) {
+    while (state == STATE_DEFLATE) {
+      size_t in_bytes = size;
+      size_t out_bytes = TINFL_LZ_DICT_SIZE - window_ofs;
+      tinfl_status status = tinfl_decompress(decompressor, buffer, &in_bytes,
+                                             window, window + window_ofs, &out_bytes,
+                                             inflate_flags | TINFL_FLAG_HAS_MORE_INPUT);
+      buffer += in_bytes;
+      size -= in_bytes;
+
+      if (out_bytes > 0) {
+        sink->write(window + window_ofs, out_bytes);
+        window_ofs = (window_ofs + out_bytes) & (TINFL_LZ_DICT_SIZE - 1);
+        bytes_out += out_bytes;
+      }
+
+      if (status == TINFL_STATUS_DONE) {
+        // The ROM inflater may have read ahead into the gzip trailer, so it isn't checked.
+        // The body already arrived over TLS anyway.
+        state = STATE_DONE;
+      } else if (status < TINFL_STATUS_DONE) {
+        fail("corrupt deflate data");
+      } else if (status == TINFL_STATUS_NEEDS_MORE_INPUT && size == 0) {
+        return;
+      }
+    }
+  }
+
+public:
+  InflatePrint(Print *sink, bool gzip) : sink(sink) {
+    state = gzip ? STATE_GZIP_HEADER : STATE_ZLIB_DETECT;
+    decompressor = (tinfl_decompressor *) malloc(sizeof(tinfl_decompressor));
+    window = (uint8_t *) malloc(TINFL_LZ_DICT_SIZE);
+    if (decompressor == nullptr || window == nullptr) {
+      fail("out of memory");
+      return;
+    }
+    tinfl_init(decompressor);
+  }
+
+  ~InflatePrint() {
+    free(decompressor);
+    free(window);
+  }
+
+  size_t write(uint8_t c) {
+    return write(&c, 1);
+  }
+
+  // Always consumes everything, the rest of a corrupt body is dropped so the response still drains
+  size_t write(const uint8_t *buffer, size_t size) {
+    bytes_in += size;
+    size_t used = parseHeader(buffer, size);
+    inflate(buffer + used, size - used);
+    return size;
+  }
+
+  // Returns false if the body was corrupt or cut short
+  bool finish() {
+    ESP_LOGI(INFLATE_TAG, "Decompressed %u bytes to %u bytes", bytes_in, bytes_out);
+    if (state != STATE_DONE && state != STATE_FAILED) {
+      ESP_LOGE(INFLATE_TAG, "Compressed body cut short");
+    }
+    return state == STATE_DONE;
+  }
+
+  size_t getBytesIn() {
+    return bytes_in;
+  }
+
+  size_t getBytesOut() {
+    return bytes_out;
+  }
+};
@@ -0,0 +1,303 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include <FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+#include "Trace.hpp"
+
+static const char *JOB_PIPELINE_TAG = "JobPipeline";
+
+// Number of blocks that can be queued for the printer, together with the block size this caps
+// how far the network may run ahead of the printer
+#ifndef JOB_PIPELINE_DEPTH
+#define JOB_PIPELINE_DEPTH 8
+#endif
+
+#ifndef JOB_PIPELINE_BLOCK_SIZE
+#define JOB_PIPELINE_BLOCK_SIZE 4096
+#endif
+
+// A partly filled block is handed to the printer once nothing else arrived for this long
+#ifndef JOB_PIPELINE_FLUSH_MS
+#define JOB_PIPELINE_FLUSH_MS 20
+#endif
+
+#ifndef JOB_PIPELINE_TASK_PRIORITY
+#define JOB_PIPELINE_TASK_PRIORITY 5
+#endif
+
+typedef struct {
+  uint32_t jobs;
+  // Bytes the sink took, what it gave up on or couldn't send any more is left out
+  uint32_t bytes;
+  // Most blocks ever waiting for the printer at once
+  uint32_t max_queued;
+  // Time the producer spent waiting because the printer was behind
+  uint32_t backpressure_ms;
+  uint32_t last_job_print_ms;
+} job_pipeline_stats_t;
+
+// Called from the print task where everything passed on to the sink so far ends on a command
+// boundary: before the first block of a job and while idle between jobs
+typedef void (*job_pipeline_boundary_cb_t)(void *context);
+
+// Decouples fetching jobs from printing them. Everything written to the pipeline is copied into
+// a fixed pool of blocks and handed to a print task that writes them to sink, so the next job can
+// be fetched and decoded while the current one is still going out over USB. When all blocks are
+// in use, write() blocks until the printer catches up.
+class JobPipeline : public Print {
+private:
+  typedef struct {
+    size_t len;
+    bool end_of_job;
+    // Job the data belongs to, for tracing
+    uint32_t job_id;
+    uint8_t *data;
+  } job_block_t;
+
+  Print *sink;
+  size_t depth;
+  size_t block_size;
+  job_pipeline_boundary_cb_t boundary_cb;
+  void *boundary_context;
+
+  job_block_t *blocks;
+  uint8_t *block_data;
+  QueueHandle_t free_blocks;
+  QueueHandle_t ready_blocks;
+
+  // Block the producer is filling, guarded by current_lock as the print task may take it over
+  job_block_t *current = nullptr;
+  SemaphoreHandle_t current_lock;
+
+  TaskHandle_t print_task_hdl = nullptr;
+  SemaphoreHandle_t print_task_stopped;
+  volatile bool stopping = false;
+
+  uint32_t job_start_ms = 0;
+  job_pipeline_stats_t stats = {};
+
+  static void _print_task(void *pvParameters) {
+    static_cast<JobPipeline *>(pvParameters)->print_task();
+  }
+
+  void print_task() {
+    while (true) {
+      job_block_t *block = nullptr;
+      if (xQueueReceive(ready_blocks, &block, pdMS_TO_TICKS(JOB_PIPELINE_FLUSH_MS)) != pdTRUE) {
+        // Nothing came in for a while, don't leave a partly filled block waiting. The producer may
+        // have queued a block since, which has to go out before the one it is filling now.
+        bool received = false;
+        xSemaphoreTake(current_lock, portMAX_DELAY);
+        if (xQueueReceive(ready_blocks, &block, 0) == pdTRUE) {
+          received = true;
+        } else if (current != nullptr && current->len > 0) {
+          block = current;
+          current = nullptr;
+        }
+        xSemaphoreGive(current_lock);
+        if (!received && block == nullptr) {
+          if (job_start_ms == 0 && boundary_cb != nullptr && !stopping) {
+            boundary_cb(boundary_context);
+          }
+          continue;
+        }
+      }
+
+      if (block == nullptr) {
+        // Sentinel from the destructor
+        break;
+      }
+
+      if (!stopping) {
+        if (job_start_ms == 0) {
+          if (boundary_cb != nullptr) {
+            boundary_cb(boundary_context);
+          }
+          job_start_ms = millis();
+        }
+        // Spans of the sink, such as USB transfers, count towards the job of the block
+        trace_set_task_job(block->job_id);
+        int64_t write_start_us = trace_now();
+        size_t written = sink->write(block->data, block->len);
+        trace_record(TRACE_SPAN_PRINTER_WRITE, write_start_us);
+        if (written < block->len) {
+          ESP_LOGW(JOB_PIPELINE_TAG, "Printer took %u of %u bytes", written, block->len);
+        }
+        stats.bytes += written;
+        if (block->end_of_job) {
+          stats.jobs++;
+          stats.last_job_print_ms = millis() - job_start_ms;
+          job_start_ms = 0;
+          ESP_LOGI(JOB_PIPELINE_TAG, "Job printed in %u ms", stats.last_job_print_ms);
+          // The last few USB transfers may still be in flight and are missing from this
+          trace_log_job(block->job_id);
+        }
+      }
+
+      block->len = 0;
+      block->end_of_job = false;
+      xQueueSend(free_blocks, &block, 0);
+    }
+
+    trace_clear_task_job();
+    xSemaphoreGive(print_task_stopped);
+    vTaskDelete(NULL);
+  }
+
+  // Take a free block, waiting for the printer if there is none
+  job_block_t *takeFreeBlock() {
+    job_block_t *block;
+    if (xQueueReceive(free_blocks, &block, 0) != pdTRUE) {
+      uint32_t start = millis();
+      xQueueReceive(free_blocks, &block, portMAX_DELAY);
+      stats.backpressure_ms += millis() - start;
+    }
+    return block;
+  }
+
+  // Must be called with current_lock held
+  void sendCurrent() {
+    xQueueSend(ready_blocks, &current, 0);
+    current = nullptr;
+
+    uint32_t queued = uxQueueMessagesWaiting(ready_blocks);
+    if (queued > stats.max_queued) {
+      stats.max_queued = queued;
+    }
+  }
+
+  // Make sure there is a block to write into and take current_lock
+  void lockCurrent() {
+    xSemaphoreTake(current_lock, portMAX_DELAY);
+    if (current == nullptr) {
+      // Never wait for the printer while holding the lock, the print task needs it
+      xSemaphoreGive(current_lock);
+      job_block_t *block = takeFreeBlock();
+      block->job_id = trace_task_job();
+      xSemaphoreTake(current_lock, portMAX_DELAY);
+      current = block;
+    }
+  }
+
+public:
+  JobPipeline(Print *sink, size_t depth = JOB_PIPELINE_DEPTH, size_t block_size = JOB_PIPELINE_BLOCK_SIZE,
+              job_pipeline_boundary_cb_t boundary_cb = nullptr, void *boundary_context = nullptr)
+      : sink(sink), depth(depth), block_size(block_size), boundary_cb(boundary_cb),
+        boundary_context(boundary_context) {
+    ESP_LOGI(JOB_PIPELINE_TAG, "Allocating %u blocks of %u bytes, free heap %d", depth, block_size,
+             ESP.getFreeHeap());
+    blocks = new job_block_t[depth];
+    block_data = (uint8_t *) malloc(depth * block_size);
+    if (block_data == nullptr) {
+      ESP_LOGE(JOB_PIPELINE_TAG, "Out of memory, falling back to a single block");
+      this->depth = depth = 1;
+      block_data = (uint8_t *) malloc(block_size);
+    }
+
+    free_blocks = xQueueCreate(depth, sizeof(job_block_t *));
+    // One extra slot for the sentinel that stops the print task
+    ready_blocks = xQueueCreate(depth + 1, sizeof(job_block_t *));
+    for (size_t i = 0; i < depth; i++) {
+      blocks[i].len = 0;
+      blocks[i].end_of_job = false;
+      blocks[i].job_id = 0;
+      blocks[i].data = block_data + i * block_size;
+      job_block_t *block = &blocks[i];
+      xQueueSend(free_blocks, &block, 0);
+    }
+
+    current_lock = xSemaphoreCreateMutex();
+    print_task_stopped = xSemaphoreCreateBinary();
+    xTaskCreate(_print_task, "Print jobs", 4096, this, JOB_PIPELINE_TASK_PRIORITY, &print_task_hdl);
+  }
+
+  // Drops whatever has not been printed yet, e.g. because the printer is gone
+  ~JobPipeline() {
+    stopping = true;
+    job_block_t *sentinel = nullptr;
+    xQueueSend(ready_blocks, &sentinel, portMAX_DELAY);
+    xSemaphoreTake(print_task_stopped, portMAX_DELAY);
+
+    vSemaphoreDelete(print_task_stopped);
+    vSemaphoreDelete(current_lock);
+    vQueueDelete(ready_blocks);
+    vQueueDelete(free_blocks);
+    free(block_data);
+    delete[] blocks;
+  }
+
+  size_t write(uint8_t c) {
+    return write(&c, 1);
+  }
+
+  size_t write(const uint8_t *buffer, size_t size) {
+    size_t written = 0;
+    while (written < size) {
+      lockCurrent();
+      size_t n = std::min(size - written, block_size - current->len);
+      memcpy(current->data + current->len, buffer + written, n);
+      current->len += n;
+      written += n;
+      if (current->len == block_size) {
+        sendCurrent();
+      }
+      xSemaphoreGive(current_lock);
+    }
+    return size;
+  }
+
+  // Hand whatever is buffered to the printer now, without waiting for it to be printed
+  void flush() {
+    xSemaphoreTake(current_lock, portMAX_DELAY);
+    if (current != nullptr && current->len > 0) {
+      sendCurrent();
+    }
+    xSemaphoreGive(current_lock);
+  }
+
+  // Mark the end of a job, everything written so far is handed to the printer
+  void endJob() {
+    lockCurrent();
+    current->end_of_job = true;
+    sendCurrent();
+    xSemaphoreGive(current_lock);
+  }
+
+  // Block until everything written so far has been passed on to the sink. Returns false if that
+  // took longer than timeout_ms, e.g. because the printer ran out of paper.
+  bool drain(uint32_t timeout_ms = UINT32_MAX) {
+    flush();
+    uint32_t start = millis();
+    while (true) {
+      xSemaphoreTake(current_lock, portMAX_DELAY);
+      // An empty block the producer holds on to isn't waiting to be printed
+      size_t idle = uxQueueMessagesWaiting(free_blocks) + (current != nullptr ? 1 : 0);
+      xSemaphoreGive(current_lock);
+      if (idle == depth) {
+        return true;
+      }
+      if (millis() - start >= timeout_ms) {
+        return false;
+      }
+      vTaskDelay(1);
+    }
+  }
+
+  size_t queued() {
+    return uxQueueMessagesWaiting(ready_blocks);
+  }
+
+  // Bytes written but not yet passed on to the sink, roughly, as blocks are counted as full
+  size_t queuedBytes() {
+    return queued() * block_size;
+  }
+
+  const job_pipeline_stats_t &getStats() {
+    return stats;
+  }
+};
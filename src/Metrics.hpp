@@ -0,0 +1,150 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WebServer.h>
+
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+static const char *METRICS_TAG = "Metrics";
+
+// Port of the metrics endpoint, off port 80 so it never collides with the config server
+#ifndef METRICS_PORT
+#define METRICS_PORT 9100
+#endif
+
+// Most tasks reported on, there are about 20 on a running printi
+#ifndef METRICS_MAX_TASKS
+#define METRICS_MAX_TASKS 32
+#endif
+
+// Builds a response in the Prometheus text exposition format
+class MetricsWriter {
+private:
+  String body;
+
+public:
+  MetricsWriter() {
+    body.reserve(4096);
+  }
+
+  // Start a metric family, must come before its values
+  void family(const char *name, const char *type, const char *help) {
+    body += "# HELP ";
+    body += name;
+    body += " ";
+    body += help;
+    body += "\n# TYPE ";
+    body += name;
+    body += " ";
+    body += type;
+    body += "\n";
+  }
+
+  // labels is either empty or e.g. printer="1"
+  void value(const char *name, const char *labels, double value) {
+    char line[160];
+    snprintf(line, sizeof(line), labels[0] ? "%s{%s} %.17g\n" : "%s%s %.17g\n", name, labels, value);
+    body += line;
+  }
+
+  void value(const char *name, double v) {
+    value(name, "", v);
+  }
+
+  const String &text() {
+    return body;
+  }
+};
+
+typedef void (*metrics_collect_cb_t)(MetricsWriter &metrics);
+
+// Serves /metrics alongside printing, with the heap and task metrics every unit has plus whatever
+// collect adds
+class MetricsServer {
+private:
+  WebServer server;
+  int port;
+  metrics_collect_cb_t collect;
+  TaskHandle_t task_hdl = nullptr;
+  // WebServer keeps every handler it is given, a second one for the same path is never reached
+  bool route_registered = false;
+
+  static void _serverLoop(void *pvParameters) {
+    MetricsServer *metrics_server = static_cast<MetricsServer *>(pvParameters);
+    while (true) {
+      metrics_server->server.handleClient();
+      vTaskDelay(50);
+    }
+  }
+
+  void writeSystemMetrics(MetricsWriter &metrics) {
+    metrics.family("printi_uptime_seconds", "gauge", "Time since boot");
+    metrics.value("printi_uptime_seconds", esp_timer_get_time() / 1000000.0);
+
+    metrics.family("printi_heap_free_bytes", "gauge", "Free heap");
+    metrics.value("printi_heap_free_bytes", ESP.getFreeHeap());
+    metrics.family("printi_heap_min_free_bytes", "gauge", "Lowest free heap since boot");
+    metrics.value("printi_heap_min_free_bytes", ESP.getMinFreeHeap());
+    metrics.family("printi_heap_largest_free_block_bytes", "gauge", "Largest block that can be allocated");
+    metrics.value("printi_heap_largest_free_block_bytes", heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+
+#if configUSE_TRACE_FACILITY
+    TaskStatus_t *tasks = (TaskStatus_t *) malloc(METRICS_MAX_TASKS * sizeof(TaskStatus_t));
+    if (tasks == nullptr) {
+      return;
+    }
+    uint32_t total_runtime = 0;
+    UBaseType_t task_count = uxTaskGetSystemState(tasks, METRICS_MAX_TASKS, &total_runtime);
+    char labels[64];
+
+    metrics.family("printi_task_stack_free_min_bytes", "gauge", "Stack high-water mark, the least free stack a task ever had");
+    for (UBaseType_t i = 0; i < task_count; i++) {
+      snprintf(labels, sizeof(labels), "task=\"%s\",id=\"%u\"", tasks[i].pcTaskName, tasks[i].xTaskNumber);
+      metrics.value("printi_task_stack_free_min_bytes", labels, tasks[i].usStackHighWaterMark);
+    }
+#if configGENERATE_RUN_TIME_STATS
+    metrics.family("printi_task_cpu_seconds_total", "counter", "CPU time used by a task");
+    for (UBaseType_t i = 0; i < task_count; i++) {
+      snprintf(labels, sizeof(labels), "task=\"%s\",id=\"%u\"", tasks[i].pcTaskName, tasks[i].xTaskNumber);
+      // The run time clock is esp_timer, in microseconds
+      metrics.value("printi_task_cpu_seconds_total", labels, tasks[i].ulRunTimeCounter / 1000000.0);
+    }
+#endif
+    free(tasks);
+#endif
+  }
+
+  void handleMetrics() {
+    MetricsWriter metrics;
+    writeSystemMetrics(metrics);
+    if (collect != nullptr) {
+      collect(metrics);
+    }
+    server.send(200, "text/plain; version=0.0.4", metrics.text());
+  }
+
+public:
+  MetricsServer(metrics_collect_cb_t collect, int port = METRICS_PORT) : server(port), port(port), collect(collect) {}
+
+  // Start serving, does nothing if already serving. Can be called again if the task could not be
+  // started.
+  void begin() {
+    if (task_hdl != nullptr) {
+      return;
+    }
+    if (!route_registered) {
+      server.on("/metrics", HTTP_GET, [this]() { handleMetrics(); });
+      route_registered = true;
+    }
+    server.begin();
+    if (xTaskCreate(_serverLoop, "Metrics server", 5000, this, 1, &task_hdl) != pdPASS) {
+      task_hdl = nullptr;
+      ESP_LOGE(METRICS_TAG, "Could not start the metrics server task");
+      return;
+    }
+    ESP_LOGI(METRICS_TAG, "Serving metrics on port %d", port);
+  }
+};
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <Arduino.h>
+#include <HTTPClient.h>
+
+#include "ESC_POS_Printer/ESC_POS_Printer.h"
+
+#include "PrintStream.hpp"
+#include "GrayscaleImagePrinter.hpp"
+#include "InflatePrint.hpp"
+#include "RasterFilter.hpp"
+#include "PrinterRegistry.hpp"
+#include "Trace.hpp"
+
+static const char *PRINT_JOB_TAG = "PrintJob";
+
+// Print the job in the body of a 200 response to /nextinqueue on one of printers. The body is
+// streamed to the printer as it arrives, decoded on the way according to the response headers.
+// Printing carries on in the background once this returns. Returns false if there is no printer
+// to print on, the body is left unread then.
+static inline bool print_job(PrinterRegistry &printers, HTTPClient &http, uint32_t trace_job) {
+  ESP_LOGI(PRINT_JOB_TAG, "reponse length %d", http.getSize());
+
+  // The server may ask for a specific printer, otherwise the least busy one gets the job
+  printer_slot_t *job_slot = printers.pick(http.header("X-Printi-Printer"));
+  if (job_slot == nullptr) {
+    job_slot = printers.primary();
+  }
+  if (job_slot == nullptr) {
+    ESP_LOGE(PRINT_JOB_TAG, "Printer gone, dropping job");
+    return false;
+  }
+  ESP_LOGI(PRINT_JOB_TAG, "Printing job on printer %s", job_slot->name.c_str());
+  ESC_POS_Printer *job_printer = job_slot->esc_pos_printer;
+
+  // Grayscale images are dithered on the device, anything else is ESC/POS for the printer
+  // with blank raster rows turned into paper feeds on the way
+  GrayscaleImagePrinter image_printer(job_printer,
+                                      GrayscaleImagePrinter::kernelFromName(http.header("X-Printi-Dither")));
+  RasterFilter raster_filter(job_printer);
+  bool is_image = http.header("Content-Type").startsWith("image/x-portable-graymap");
+  Print *job_sink = is_image ? (Print *) &image_printer : (Print *) &raster_filter;
+
+  // Compressed bodies are inflated on the fly on their way to the printer
+  String content_encoding = http.header("Content-Encoding");
+  bool is_gzip = content_encoding.equalsIgnoreCase("gzip") || content_encoding.equalsIgnoreCase("x-gzip");
+  bool is_compressed = is_gzip || content_encoding.equalsIgnoreCase("deflate");
+  InflatePrint *inflater = is_compressed ? new InflatePrint(job_sink, is_gzip) : nullptr;
+
+  // Stream the body to the printer as it arrives instead of buffering the whole job.
+  // writeToStream handles both chunked and Content-Length responses.
+  PrintStream printer_stream(inflater != nullptr ? (Print *) inflater : job_sink);
+  int64_t body_start_us = trace_now();
+  int written = http.writeToStream(&printer_stream);
+  trace_record(trace_job, TRACE_SPAN_BODY, body_start_us, trace_now());
+  if (written < 0) {
+    ESP_LOGE(PRINT_JOB_TAG, "Streaming job to printer failed: %s", http.errorToString(written).c_str());
+  }
+  if (inflater != nullptr) {
+    inflater->finish();
+    delete inflater;
+  }
+  if (is_image) {
+    image_printer.finish();
+  } else {
+    raster_filter.finish();
+  }
+
+  job_printer->println("");
+  job_printer->println("");
+  job_printer->println("");
+  if (job_slot->type == XIAMEN_BETTER_LITTLE_BLUE_CUTIE) {
+    job_printer->println("");
+  }
+  job_printer->commit();
+  // Printing carries on in the background while the next job is fetched
+  job_slot->job_pipeline->endJob();
+  printers.release(job_slot);
+  return true;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Write-only Stream that forwards everything to a Print, e.g. a Printer. Lets APIs that
+// insist on a Stream sink (such as HTTPClient::writeToStream) feed the printer directly.
+class PrintStream : public Stream {
+private:
+  Print *sink;
+
+public:
+  PrintStream(Print *sink) : sink(sink) {}
+
+  size_t write(uint8_t c) {
+    return sink->write(c);
+  }
+
+  size_t write(const uint8_t *buffer, size_t size) {
+    return sink->write(buffer, size);
+  }
+
+  int available() {
+    return 0;
+  }
+
+  int read() {
+    return -1;
+  }
+
+  int peek() {
+    return -1;
+  }
+
+  void flush() {
+    sink->flush();
+  }
+};
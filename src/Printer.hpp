@@ -5,68 +5,597 @@
 #include <usb/usb_host.h>
 
 #include <FreeRTOS.h>
+#include <freertos/queue.h>
 #include <freertos/semphr.h>
+#include <esp_timer.h>
+
+#include "Trace.hpp"
+#include "EventLog.hpp"
 
 static const char* PRINTER_TAG = "Printer";
 
+// Number of OUT transfers that may be queued on the printer endpoint at once
+#ifndef PRINTER_OUT_TRANSFER_COUNT
+#define PRINTER_OUT_TRANSFER_COUNT 4
+#endif
+
+// Size of each OUT transfer, i.e. the chunk size that writes are split into
+#ifndef PRINTER_OUT_TRANSFER_SIZE
+#define PRINTER_OUT_TRANSFER_SIZE 1024
+#endif
+
+// How often the printer status is asked for while printing, and how long to wait between asking
+// again while the printer can't accept data
+#ifndef PRINTER_STATUS_POLL_MS
+#define PRINTER_STATUS_POLL_MS 500
+#endif
+
+// DLE EOT is a real-time command that goes out inline with the print data, so it is only sent
+// between jobs, see commandBoundary(), and at most this often
+#ifndef PRINTER_REALTIME_STATUS_MS
+#define PRINTER_REALTIME_STATUS_MS 1000
+#endif
+
+// Size of the printer's own input buffer as assumed by the pacing model. Cheap printers like the
+// HOIN HOP-H58 only have a few KiB.
+#ifndef PRINTER_BUFFER_BYTES
+#define PRINTER_BUFFER_BYTES 4096
+#endif
+
+// Drain rate assumed until the first measurements are in, in bytes per second. About what a
+// 384 dot wide printer manages at 50 mm/s printing raster data.
+#ifndef PRINTER_INITIAL_DRAIN_RATE
+#define PRINTER_INITIAL_DRAIN_RATE 16000
+#endif
+
+// Most a printer on a full speed bus can take, 19 bulk packets of 64 bytes per 1 ms frame, in bytes
+// per second. Transfers that seem to have gone through faster only had their callbacks come in a
+// bunch.
+#ifndef PRINTER_MAX_ACCEPT_RATE
+#define PRINTER_MAX_ACCEPT_RATE 1216000
+#endif
+
+// How often a transfer that failed is resubmitted before its data is given up on
+#ifndef PRINTER_MAX_TRANSFER_RETRIES
+#define PRINTER_MAX_TRANSFER_RETRIES 3
+#endif
+
+// How long write() keeps trying to submit a transfer that the USB host refuses while no recovery
+// is under way, before its data is given up on
+#ifndef PRINTER_SUBMIT_TIMEOUT_MS
+#define PRINTER_SUBMIT_TIMEOUT_MS 1000
+#endif
+
+typedef enum {
+  PRINTER_STATE_READY,
+  PRINTER_STATE_BUSY,
+  PRINTER_STATE_PAPER_OUT,
+  PRINTER_STATE_COVER_OPEN,
+  PRINTER_STATE_OFFLINE,
+  PRINTER_STATE_COUNT,
+} printer_state_t;
+
+static inline const char *printer_state_name(printer_state_t state) {
+  switch (state) {
+    case PRINTER_STATE_READY: return "ready";
+    case PRINTER_STATE_BUSY: return "busy";
+    case PRINTER_STATE_PAPER_OUT: return "paper_out";
+    case PRINTER_STATE_COVER_OPEN: return "cover_open";
+    case PRINTER_STATE_OFFLINE: return "offline";
+    default: return "unknown";
+  }
+}
+
+typedef struct {
+  // Number of times the printer entered each state
+  uint32_t transitions[PRINTER_STATE_COUNT];
+  // Time write() spent waiting for the printer to become ready again
+  uint32_t blocked_ms;
+  uint32_t port_status_polls;
+  uint32_t realtime_status_polls;
+  // Learned drain rate in bytes per second
+  uint32_t drain_rate;
+  // Time write() held data back to keep the printer buffer from overflowing
+  uint32_t paced_ms;
+  uint32_t transfer_retries;
+  // Bytes given up on after PRINTER_MAX_TRANSFER_RETRIES or PRINTER_SUBMIT_TIMEOUT_MS, always
+  // logged as errors
+  uint32_t bytes_dropped;
+  // Times write() waited a full 1000 ticks for a free transfer
+  uint32_t transfer_wait_timeouts;
+} printer_stats_t;
+
 class Printer : public Print {
 private:
-  // Transfer mutex to ensure only one print job is submitted at a time
-  SemaphoreHandle_t transfer_mutex;
+  // Pool of OUT transfers that are not currently submitted. write() takes one out, the
+  // transfer callback puts it back, so up to out_transfer_count chunks can be in flight.
+  QueueHandle_t free_out_transfers;
 
   usb_transfer_t* in_transfer;
-  usb_transfer_t* out_transfer;
+  usb_transfer_t** out_transfers;
+  size_t out_transfer_count;
+  usb_device_handle_t dev_hdl;
+  uint8_t out_endpoint_address;
+
+  // Per OUT transfer bookkeeping, used as the transfer context
+  typedef struct {
+    Printer *printer;
+    int64_t submit_us;
+    uint8_t retries;
+    uint32_t trace_job;
+    // Order in which the transfer was submitted
+    uint32_t seq;
+  } out_transfer_info_t;
+  out_transfer_info_t *out_transfer_infos;
+
+  // A failed OUT transfer halts the endpoint with the transfers submitted after it still queued.
+  // recover() flushes them, they are held as they come back cancelled and requeue counts the ones
+  // still to come. Once all are back, the endpoint is cleared and they are resubmitted in the order
+  // they were first submitted. Writers don't submit until then.
+  SemaphoreHandle_t submit_lock;
+  uint32_t submit_seq = 0;
+  uint32_t requeue = 0;
+  usb_transfer_t **held;
+  size_t held_count = 0;
+
+  // Pacing model. The printer accepts data into its buffer until it is full and prints it at
+  // drain_rate. buffer_fill estimates how much is in there, it grows by every completed transfer
+  // and shrinks with time. write() keeps it from going over printer_buffer_bytes, so printers that
+  // drop data instead of NAKing it when their buffer is full never get more than they can hold.
+  // Once the printer was seen NAKing, it can't be overrun, and the whole transfer pool may be
+  // queued on top of a full buffer so that it stays full.
+  portMUX_TYPE model_lock = portMUX_INITIALIZER_UNLOCKED;
+  size_t printer_buffer_bytes = PRINTER_BUFFER_BYTES;
+  float drain_rate = PRINTER_INITIAL_DRAIN_RATE; // Bytes per second
+  float buffer_fill = 0;
+  int64_t buffer_fill_us = 0;
+  int64_t last_complete_us = 0;
+  size_t bytes_in_flight = 0;
+  // Fastest a transfer was ever accepted, in bytes per second, i.e. the bus speed
+  float accept_rate = 0;
+  bool naks = false;
+
+  // Status comes from two places: GET_PORT_STATUS of the USB printer class on the control
+  // endpoint, which doesn't disturb the print data, and the ESC/POS DLE EOT 2 reply on the IN
+  // endpoint, which tells apart why the printer went offline. Both are asked for asynchronously,
+  // the completion callbacks update state. status_lock guards submitting and freeing the status
+  // transfers, as polls come from the print task and loop() alike.
+  usb_host_client_handle_t client_hdl;
+  uint8_t interface_number;
+  usb_transfer_t* control_transfer;
+  SemaphoreHandle_t status_lock;
+  bool control_pending = false;
+  bool in_pending = false;
+
+  volatile bool port_status_valid = false;
+  volatile uint8_t port_status = 0;
+  volatile bool realtime_status_valid = false;
+  volatile printer_state_t realtime_state = PRINTER_STATE_READY;
+
+  volatile printer_state_t state = PRINTER_STATE_READY;
+  // Set once the device is unplugged, nothing waits for it after that
+  volatile bool gone = false;
+  uint32_t last_poll_ms = 0;
+  uint32_t last_realtime_poll_ms = 0;
+  printer_stats_t stats = {};
+
+  // USB Printer Class 1.1, GET_PORT_STATUS
+  static const uint8_t GET_PORT_STATUS = 1;
+  static const uint8_t PORT_STATUS_PAPER_EMPTY = 0x20;
+  static const uint8_t PORT_STATUS_SELECT = 0x10;
+  static const uint8_t PORT_STATUS_NOT_ERROR = 0x08;
+
+  // DLE EOT 2, offline cause
+  static const uint8_t OFFLINE_COVER_OPEN = 0x04;
+  static const uint8_t OFFLINE_FEED_BUTTON = 0x08;
+  static const uint8_t OFFLINE_PAPER_END = 0x20;
+  static const uint8_t OFFLINE_ERROR = 0x40;
 
   static void _transfer_cb(usb_transfer_t *transfer)
   {
-    Printer* printer = static_cast<Printer*>(transfer->context);
+    Printer* printer = static_cast<out_transfer_info_t*>(transfer->context)->printer;
     printer->transfer_cb(transfer);
   }
 
   void transfer_cb(usb_transfer_t* transfer) {
-    ESP_LOGI(PRINTER_TAG, "Release transfer semaphore");
-    xSemaphoreGive(transfer_mutex);
+    out_transfer_info_t *info = static_cast<out_transfer_info_t*>(transfer->context);
 
-    ESP_LOGI("", "printer_transfer_cb context: %d", transfer->context);
-    ESP_LOGI("", "printer_transfer_cb status %d", transfer->status);
+    if (transfer->status != USB_TRANSFER_STATUS_COMPLETED &&
+        transfer->status != USB_TRANSFER_STATUS_NO_DEVICE &&
+        transfer->status != USB_TRANSFER_STATUS_CANCELED) {
+      if (recover(transfer)) {
+        return;
+      }
+      EVENT_LOG(ESP_LOG_ERROR, EVENT_TRANSFER_FAILED, transfer->status, transfer->num_bytes);
+      stats.bytes_dropped += transfer->num_bytes;
+    } else if ((transfer->status == USB_TRANSFER_STATUS_CANCELED || transfer->status == USB_TRANSFER_STATUS_NO_DEVICE) &&
+               resubmitCancelled(transfer)) {
+      return;
+    } else if (transfer->status == USB_TRANSFER_STATUS_COMPLETED) {
+      transferCompleted(info, transfer->actual_num_bytes);
+      trace_record(info->trace_job, TRACE_SPAN_USB_TRANSFER, info->submit_us, trace_now());
+    }
+    finish(transfer);
+  }
+
+  // Put a transfer that is done with back into the pool
+  void finish(usb_transfer_t *transfer) {
+    portENTER_CRITICAL(&model_lock);
+    bytes_in_flight -= transfer->num_bytes;
+    portEXIT_CRITICAL(&model_lock);
+
+    // Runs for every chunk printed, only ever log through the event log here
+    EVENT_LOG(ESP_LOG_DEBUG, EVENT_TRANSFER_DONE, (uint32_t) (uintptr_t) transfer, transfer->status, transfer->actual_num_bytes);
+    xQueueSend(free_out_transfers, &transfer, 0);
+  }
+
+  // Must be called with submit_lock held
+  bool submit(usb_transfer_t *transfer) {
+    out_transfer_info_t *info = static_cast<out_transfer_info_t*>(transfer->context);
+    info->seq = submit_seq + 1;
+    info->submit_us = esp_timer_get_time();
+    if (usb_host_transfer_submit(transfer) != ESP_OK) {
+      return false;
+    }
+    submit_seq++;
+    return true;
+  }
+
+  // Must be called with submit_lock held
+  void hold(usb_transfer_t *transfer) {
+    uint32_t seq = static_cast<out_transfer_info_t*>(transfer->context)->seq;
+    size_t i = held_count++;
+    while (i > 0 && static_cast<out_transfer_info_t*>(held[i - 1]->context)->seq > seq) {
+      held[i] = held[i - 1];
+      i--;
+    }
+    held[i] = transfer;
+  }
+
+  // Must be called with submit_lock held. Once everything recover() flushed is back, clears the OUT
+  // endpoint and resubmits the held transfers. Resubmitting them as they come back could put one
+  // behind a transfer that has failed again in the meantime.
+  void resubmitHeld() {
+    if (requeue > 0) {
+      return;
+    }
+    usb_host_endpoint_clear(dev_hdl, out_endpoint_address);
+    size_t i = 0;
+    while (i < held_count && !gone && submit(held[i])) {
+      i++;
+    }
+    size_t kept = 0;
+    for (; i < held_count; i++) {
+      if (gone) {
+        finish(held[i]);
+        continue;
+      }
+      // One just resubmitted failed again and halted the endpoint, the rest stays held to go out
+      // after its retry
+      static_cast<out_transfer_info_t*>(held[i]->context)->seq = submit_seq + 1 + kept;
+      held[kept++] = held[i];
+    }
+    held_count = kept;
+  }
+
+  // Get the OUT endpoint going again after transfer failed, and resubmit what is left of it if it
+  // has retries left. Returns true if it was kept for that.
+  bool recover(usb_transfer_t *transfer) {
+    out_transfer_info_t *info = static_cast<out_transfer_info_t*>(transfer->context);
+    // What got through before the error is in the printer, only the rest is sent again
+    int actual = std::max(0, std::min(transfer->actual_num_bytes, transfer->num_bytes));
+    if (actual > 0) {
+      transferCompleted(info, actual);
+      memmove(transfer->data_buffer, transfer->data_buffer + actual, transfer->num_bytes - actual);
+      transfer->num_bytes -= actual;
+      portENTER_CRITICAL(&model_lock);
+      bytes_in_flight -= actual;
+      portEXIT_CRITICAL(&model_lock);
+    }
+
+    bool retry = info->retries < PRINTER_MAX_TRANSFER_RETRIES;
+    if (retry) {
+      info->retries++;
+      stats.transfer_retries++;
+      EVENT_LOG(ESP_LOG_WARN, EVENT_TRANSFER_RETRY, transfer->status, info->retries, PRINTER_MAX_TRANSFER_RETRIES);
+    }
+    xSemaphoreTake(submit_lock, portMAX_DELAY);
+    // Nothing after it went through, everything submitted since comes back cancelled
+    requeue += submit_seq - info->seq;
+    usb_host_endpoint_halt(dev_hdl, out_endpoint_address);
+    usb_host_endpoint_flush(dev_hdl, out_endpoint_address);
+    retry = retry && !gone;
+    if (retry) {
+      hold(transfer);
+    }
+    resubmitHeld();
+    xSemaphoreGive(submit_lock);
+    return retry;
+  }
+
+  // A transfer came back cancelled. Returns true if that was recover() flushing it and it is held
+  // to be submitted again.
+  bool resubmitCancelled(usb_transfer_t *transfer) {
+    bool kept = false;
+    xSemaphoreTake(submit_lock, portMAX_DELAY);
+    if (requeue > 0) {
+      requeue--;
+      kept = !gone;
+      if (kept) {
+        hold(transfer);
+      }
+      resubmitHeld();
+    }
+    xSemaphoreGive(submit_lock);
+    return kept;
+  }
+
+  static void _control_transfer_cb(usb_transfer_t *transfer) {
+    static_cast<Printer*>(transfer->context)->control_transfer_cb(transfer);
+  }
+
+  void control_transfer_cb(usb_transfer_t* transfer) {
+    if (transfer->status == USB_TRANSFER_STATUS_COMPLETED &&
+        transfer->actual_num_bytes > (int) sizeof(usb_setup_packet_t)) {
+      port_status = transfer->data_buffer[sizeof(usb_setup_packet_t)];
+      port_status_valid = true;
+    } else {
+      // Not every printer implements the class requests, DLE EOT has to do then
+      port_status_valid = false;
+    }
+    xSemaphoreTake(status_lock, portMAX_DELAY);
+    control_pending = false;
+    xSemaphoreGive(status_lock);
+    updateState();
+  }
+
+  static void _in_transfer_cb(usb_transfer_t *transfer) {
+    static_cast<Printer*>(transfer->context)->in_transfer_cb(transfer);
+  }
+
+  void in_transfer_cb(usb_transfer_t* transfer) {
+    if (transfer->status == USB_TRANSFER_STATUS_COMPLETED && transfer->actual_num_bytes > 0) {
+      uint8_t status = transfer->data_buffer[transfer->actual_num_bytes - 1];
+      // Bits 1 and 4 are always set and bits 0 and 7 always clear in a status reply
+      if ((status & 0x93) == 0x12) {
+        if (status & OFFLINE_COVER_OPEN) {
+          realtime_state = PRINTER_STATE_COVER_OPEN;
+        } else if (status & OFFLINE_PAPER_END) {
+          realtime_state = PRINTER_STATE_PAPER_OUT;
+        } else if (status & OFFLINE_ERROR) {
+          realtime_state = PRINTER_STATE_OFFLINE;
+        } else if (status & OFFLINE_FEED_BUTTON) {
+          realtime_state = PRINTER_STATE_BUSY;
+        } else {
+          realtime_state = PRINTER_STATE_READY;
+        }
+        realtime_status_valid = true;
+      }
+    }
+    xSemaphoreTake(status_lock, portMAX_DELAY);
+    in_pending = false;
+    xSemaphoreGive(status_lock);
+    updateState();
+  }
+
+  void updateState() {
+    printer_state_t new_state = PRINTER_STATE_READY;
+    if (port_status_valid) {
+      if (port_status & PORT_STATUS_PAPER_EMPTY) {
+        new_state = PRINTER_STATE_PAPER_OUT;
+      } else if (!(port_status & PORT_STATUS_NOT_ERROR) || !(port_status & PORT_STATUS_SELECT)) {
+        new_state = realtime_status_valid && realtime_state != PRINTER_STATE_READY
+                    ? realtime_state : PRINTER_STATE_OFFLINE;
+      }
+    } else if (realtime_status_valid) {
+      new_state = realtime_state;
+    }
+
+    if (new_state != state) {
+      ESP_LOGI(PRINTER_TAG, "Printer state %s -> %s", printer_state_name(state), printer_state_name(new_state));
+      state = new_state;
+      stats.transitions[new_state]++;
+    }
+  }
+
+  // Must be called with model_lock held
+  void drainModel(int64_t now_us) {
+    buffer_fill -= drain_rate * (now_us - buffer_fill_us) / 1000000.0f;
+    if (buffer_fill < 0) {
+      buffer_fill = 0;
+    }
+    buffer_fill_us = now_us;
+  }
+
+  void transferCompleted(out_transfer_info_t *info, size_t bytes) {
+    int64_t now_us = esp_timer_get_time();
+    portENTER_CRITICAL(&model_lock);
+    drainModel(now_us);
+    buffer_fill += bytes;
+
+    // Time the printer took to accept this transfer once it was at the head of the queue. A
+    // transfer that took far longer than the bus needs for it was NAKed because the printer buffer
+    // was full, and a full printer only accepts data as fast as it prints it, so that time tells
+    // the drain rate. Transfers that went through at bus speed say nothing about it, and neither do
+    // ones shorter than a bulk packet, which only take the time every transfer takes.
+    int64_t service_start_us = std::max(info->submit_us, last_complete_us);
+    int64_t service_us = now_us - service_start_us;
+    if (service_us > 0 && bytes >= 64) {
+      float sample = std::min(bytes * 1000000.0f / service_us, (float) PRINTER_MAX_ACCEPT_RATE);
+      if (sample > accept_rate) {
+        accept_rate = sample;
+      } else if (sample < accept_rate / 8) {
+        naks = true;
+        drain_rate += (sample - drain_rate) / 8;
+        if (drain_rate < 100) {
+          drain_rate = 100;
+        }
+        // It was full just now
+        buffer_fill = printer_buffer_bytes;
+      }
+    }
+    last_complete_us = now_us;
+
+    stats.drain_rate = drain_rate;
+    portEXIT_CRITICAL(&model_lock);
+  }
+
+  // Wait until the printer buffer is modelled to have room for size more bytes
+  void pace(size_t size) {
+    uint32_t paced_ms = 0;
+    while (true) {
+      portENTER_CRITICAL(&model_lock);
+      drainModel(esp_timer_get_time());
+      // Transfers in flight will land in the buffer too, a printer that NAKs just holds them
+      size_t room = naks ? printer_buffer_bytes + out_transfer_count * OUT_BUFFER_SIZE : printer_buffer_bytes;
+      float over = buffer_fill + bytes_in_flight + size - room;
+      float rate = drain_rate;
+      portEXIT_CRITICAL(&model_lock);
+
+      if (over <= 0 || size > printer_buffer_bytes || gone) {
+        break;
+      }
+      uint32_t wait_ms = over * 1000 / rate + 1;
+      vTaskDelay(pdMS_TO_TICKS(wait_ms) > 0 ? pdMS_TO_TICKS(wait_ms) : 1);
+      paced_ms += wait_ms;
+    }
+    stats.paced_ms += paced_ms;
+  }
+
+  // Ask the printer for its status without waiting for the answer. Skips requests that were
+  // made too recently or are still outstanding. The real-time status is only asked for if
+  // at_boundary, see commandBoundary().
+  void pollStatus(bool at_boundary) {
+    bool realtime = false;
+    xSemaphoreTake(status_lock, portMAX_DELAY);
+    if (gone) {
+      xSemaphoreGive(status_lock);
+      return;
+    }
+    uint32_t now = millis();
+    if (!control_pending && now - last_poll_ms >= PRINTER_STATUS_POLL_MS) {
+      last_poll_ms = now;
+      usb_setup_packet_t *setup = (usb_setup_packet_t *) control_transfer->data_buffer;
+      setup->bmRequestType = USB_BM_REQUEST_TYPE_DIR_IN | USB_BM_REQUEST_TYPE_TYPE_CLASS |
+                             USB_BM_REQUEST_TYPE_RECIP_INTERFACE;
+      setup->bRequest = GET_PORT_STATUS;
+      setup->wValue = 0;
+      setup->wIndex = interface_number;
+      setup->wLength = 1;
+      control_transfer->num_bytes = sizeof(usb_setup_packet_t) + 1;
+      control_pending = usb_host_transfer_submit_control(client_hdl, control_transfer) == ESP_OK;
+      if (control_pending) {
+        stats.port_status_polls++;
+      }
+    }
+
+    // The real-time status is only needed to find out why the printer is offline, or if the
+    // printer doesn't answer GET_PORT_STATUS at all
+    bool need_realtime = !port_status_valid || state != PRINTER_STATE_READY;
+    if (at_boundary && need_realtime && !in_pending && now - last_realtime_poll_ms >= PRINTER_REALTIME_STATUS_MS) {
+      in_transfer->num_bytes = IN_BUFFER_SIZE;
+      in_pending = usb_host_transfer_submit(in_transfer) == ESP_OK;
+      realtime = in_pending;
+      if (realtime) {
+        last_realtime_poll_ms = now;
+        stats.realtime_status_polls++;
+      }
+    }
+    xSemaphoreGive(status_lock);
+
+    if (realtime) {
+      const uint8_t request[] = {0x10, 0x04, 2}; // DLE EOT 2
+      _write(request, sizeof(request));
+    }
+  }
+
+  // Block while the printer can't take data. Away from a command boundary only the port status
+  // can be asked for, so a printer that doesn't answer it isn't waited for there.
+  void waitUntilReady(bool at_boundary) {
+    if (state == PRINTER_STATE_READY || !(at_boundary || port_status_valid)) {
+      return;
+    }
+    ESP_LOGW(PRINTER_TAG, "Printer is %s, holding back data", printer_state_name(state));
+    uint32_t start = millis();
+    while (state != PRINTER_STATE_READY && (at_boundary || port_status_valid) && !gone) {
+      vTaskDelay(pdMS_TO_TICKS(PRINTER_STATUS_POLL_MS));
+      pollStatus(at_boundary);
+    }
+    uint32_t waited = millis() - start;
+    stats.blocked_ms += waited;
+    ESP_LOGI(PRINTER_TAG, "Printer ready again after %u ms", waited);
   }
 
 public:
   const size_t IN_BUFFER_SIZE = 64;
-  const size_t OUT_BUFFER_SIZE = 1024;
+  const size_t OUT_BUFFER_SIZE;
 
-  Printer(usb_device_handle_t dev_hdl, const usb_ep_desc_t* in_ep_desc, const usb_ep_desc_t* out_ep_desc) {
+  Printer(usb_host_client_handle_t client_hdl, usb_device_handle_t dev_hdl, uint8_t interface_number,
+          const usb_ep_desc_t* in_ep_desc, const usb_ep_desc_t* out_ep_desc,
+          size_t out_transfer_count = PRINTER_OUT_TRANSFER_COUNT,
+          size_t out_transfer_size = PRINTER_OUT_TRANSFER_SIZE)
+      : out_transfer_count(out_transfer_count), dev_hdl(dev_hdl), out_endpoint_address(out_ep_desc->bEndpointAddress),
+        client_hdl(client_hdl), interface_number(interface_number), OUT_BUFFER_SIZE(out_transfer_size) {
     ESP_LOGI(PRINTER_TAG, "Constructing Printer, free heap %d", ESP.getFreeHeap());
+    stats.drain_rate = drain_rate;
+    status_lock = xSemaphoreCreateMutex();
+    submit_lock = xSemaphoreCreateMutex();
 
     ESP_ERROR_CHECK(usb_host_transfer_alloc(IN_BUFFER_SIZE, 0, &in_transfer));
     in_transfer->device_handle = dev_hdl;
     in_transfer->bEndpointAddress = in_ep_desc->bEndpointAddress;
-    in_transfer->callback = _transfer_cb;
+    in_transfer->callback = _in_transfer_cb;
     in_transfer->context = this;
     ESP_LOGI("", "Allocated printer in transfer with data_buffer_size: %d", in_transfer->data_buffer_size);
 
-    ESP_LOGI(PRINTER_TAG, "Constructing out alloc, free heap %d", ESP.getFreeHeap());
-    ESP_ERROR_CHECK(usb_host_transfer_alloc(
-        OUT_BUFFER_SIZE,
-        0, &out_transfer));
-    out_transfer->device_handle = dev_hdl;
-    out_transfer->bEndpointAddress = out_ep_desc->bEndpointAddress;
-    out_transfer->callback = _transfer_cb;
-    out_transfer->context = this;
-    ESP_LOGI("", "Allocated printer out transfer with data_buffer_size: %d", out_transfer->data_buffer_size);
-    ESP_LOGI(PRINTER_TAG, "Constructed out alloc, free heap %d", ESP.getFreeHeap());
+    ESP_ERROR_CHECK(usb_host_transfer_alloc(sizeof(usb_setup_packet_t) + 1, 0, &control_transfer));
+    control_transfer->device_handle = dev_hdl;
+    control_transfer->bEndpointAddress = 0;
+    control_transfer->callback = _control_transfer_cb;
+    control_transfer->context = this;
+
+    free_out_transfers = xQueueCreate(out_transfer_count, sizeof(usb_transfer_t *));
+    out_transfers = new usb_transfer_t*[out_transfer_count];
+    out_transfer_infos = new out_transfer_info_t[out_transfer_count];
+    held = new usb_transfer_t*[out_transfer_count];
 
-    // TODO(Leon Handreke): This should be a mutex but somehow it crashes
-    transfer_mutex = xSemaphoreCreateBinary();
-    // Semaphore is initially empty and must be given before use
-    xSemaphoreGive(transfer_mutex);
+    ESP_LOGI(PRINTER_TAG, "Constructing %d out allocs, free heap %d", out_transfer_count, ESP.getFreeHeap());
+    for (size_t i = 0; i < out_transfer_count; i++) {
+      ESP_ERROR_CHECK(usb_host_transfer_alloc(OUT_BUFFER_SIZE, 0, &out_transfers[i]));
+      out_transfers[i]->device_handle = dev_hdl;
+      out_transfers[i]->bEndpointAddress = out_ep_desc->bEndpointAddress;
+      out_transfers[i]->callback = _transfer_cb;
+      out_transfer_infos[i] = {this, 0, 0, 0, 0};
+      out_transfers[i]->context = &out_transfer_infos[i];
+      xQueueSend(free_out_transfers, &out_transfers[i], 0);
+    }
+    ESP_LOGI("", "Allocated printer out transfers with data_buffer_size: %d", out_transfers[0]->data_buffer_size);
+    ESP_LOGI(PRINTER_TAG, "Constructed out allocs, free heap %d", ESP.getFreeHeap());
   }
 
   ~Printer() {
     ESP_LOGI(PRINTER_TAG, "Starting to destruct, free heap %d", ESP.getFreeHeap());
-    usb_host_transfer_free(in_transfer);
-    usb_host_transfer_free(out_transfer);
-    vSemaphoreDelete(transfer_mutex);
+    xSemaphoreTake(status_lock, portMAX_DELAY);
+    // A status transfer that is still out would be written to after it is freed
+    if (in_pending || control_pending) {
+      ESP_LOGE(PRINTER_TAG, "Status transfers still pending, leaking them");
+    }
+    if (!in_pending) {
+      usb_host_transfer_free(in_transfer);
+    }
+    if (!control_pending) {
+      usb_host_transfer_free(control_transfer);
+    }
+    xSemaphoreGive(status_lock);
+    for (size_t i = 0; i < out_transfer_count; i++) {
+      usb_host_transfer_free(out_transfers[i]);
+    }
+    delete[] out_transfers;
+    delete[] out_transfer_infos;
+    delete[] held;
+    vQueueDelete(free_out_transfers);
+    vSemaphoreDelete(status_lock);
+    vSemaphoreDelete(submit_lock);
     ESP_LOGI(PRINTER_TAG, "Destructed, free heap %d", ESP.getFreeHeap());
   }
 
@@ -76,30 +605,168 @@ public:
     return write(&x, 1);
   }
 
+  // Returns less than size if the printer went away or a chunk had to be given up on, the rest
+  // isn't sent then
   size_t write(const uint8_t *buffer, size_t size) {
     const size_t transferChunkSize = OUT_BUFFER_SIZE;
+    size_t written = 0;
     for (unsigned int i = 0; i < size; i+= transferChunkSize) {
-      // Calls will block until the transfer mutex can be acquired
-      _write(buffer + i, std::min(size - i, transferChunkSize));
+      if (gone) {
+        break;
+      }
+      // Don't push data into a printer that is out of paper or otherwise can't print it
+      pollStatus(false);
+      waitUntilReady(false);
+      size_t chunk = std::min(size - i, transferChunkSize);
+      pace(chunk);
+      // Calls will block until a transfer from the pool becomes free
+      size_t chunk_written = _write(buffer + i, chunk);
+      written += chunk_written;
+      if (chunk_written < chunk) {
+        break;
+      }
+    }
+    return written;
+  }
+
+  // Ask the printer for its port status without waiting for the answer, from any task
+  void pollStatus() {
+    pollStatus(false);
+  }
+
+  // Called by the task writing to the printer where the data written so far ends on a command
+  // boundary, between jobs. Also asks for the real-time status there, which goes out inline with
+  // the data, and blocks while the printer can't print.
+  void commandBoundary() {
+    pollStatus(true);
+    waitUntilReady(true);
+  }
+
+  // The device was unplugged. Transfer callbacks come from the USB client task, which is the one
+  // handling the unplug, so writers must stop waiting for them.
+  void disconnect() {
+    xSemaphoreTake(status_lock, portMAX_DELAY);
+    gone = true;
+    xSemaphoreGive(status_lock);
+    // Held transfers that wait for nothing more to come back go back to the pool now
+    xSemaphoreTake(submit_lock, portMAX_DELAY);
+    if (requeue == 0) {
+      resubmitHeld();
+    }
+    xSemaphoreGive(submit_lock);
+  }
+
+  // Wait until every transfer is back from the USB host, after disconnect(). Must not be called
+  // from the USB client task, which delivers them. Returns false if that took longer than
+  // timeout_ms.
+  bool waitForTransfers(uint32_t timeout_ms) {
+    uint32_t start = millis();
+    while (true) {
+      xSemaphoreTake(status_lock, portMAX_DELAY);
+      bool status_idle = !control_pending && !in_pending;
+      xSemaphoreGive(status_lock);
+      if (status_idle && uxQueueMessagesWaiting(free_out_transfers) == out_transfer_count) {
+        return true;
+      }
+      if (millis() - start >= timeout_ms) {
+        return false;
+      }
+      vTaskDelay(1);
+    }
+  }
+
+  // Tell the pacing model how much the printer can buffer
+  void setPrinterBufferSize(size_t bytes) {
+    printer_buffer_bytes = bytes;
+  }
+
+  // Estimated milliseconds until everything written so far, plus pending_bytes that are still
+  // queued elsewhere, has been printed
+  uint32_t estimatedCompletionMs(size_t pending_bytes = 0) {
+    portENTER_CRITICAL(&model_lock);
+    drainModel(esp_timer_get_time());
+    float bytes = buffer_fill + bytes_in_flight + pending_bytes;
+    float rate = drain_rate;
+    portEXIT_CRITICAL(&model_lock);
+    return bytes * 1000 / rate;
+  }
+
+  printer_state_t getState() {
+    return state;
+  }
+
+  const printer_stats_t &getStats() {
+    return stats;
+  }
+
+  // Block until all queued transfers have completed
+  void flush() {
+    while (uxQueueMessagesWaiting(free_out_transfers) < out_transfer_count) {
+      vTaskDelay(1);
     }
-    return size;
   }
 
   size_t _write(const uint8_t *buffer, size_t size) {
-    if (out_transfer->data_buffer_size < size) {
+    if (OUT_BUFFER_SIZE < size) {
       ESP_LOGE(PRINTER_TAG, "USB transfer buffer size %d too small for response length %d",
-               out_transfer->data_buffer_size, size);
+               OUT_BUFFER_SIZE, size);
       return 0;
     }
 
-    if (xSemaphoreTake(transfer_mutex, (TickType_t) 1000) == pdTRUE) {
-      ESP_LOGD(PRINTER_TAG, "Acquired semaphore for transfer");
-      out_transfer->num_bytes = size;
-      memcpy(out_transfer->data_buffer, buffer, size);
-      ESP_LOGD(PRINTER_TAG, "Submit USB bulk transfer of size: %d", size);
-      ESP_ERROR_CHECK(usb_host_transfer_submit(out_transfer));
-    } else {
-      ESP_LOGE(PRINTER_TAG, "Failed to acquire semaphore to transfer");
+    usb_transfer_t *out_transfer;
+    // A slow printer only holds things up, data is never dropped for taking long
+    while (xQueueReceive(free_out_transfers, &out_transfer, (TickType_t) 1000) != pdTRUE) {
+      if (gone) {
+        return 0;
+      }
+      stats.transfer_wait_timeouts++;
+      ESP_LOGW(PRINTER_TAG, "Still waiting for a free transfer, printer is slow to accept data");
+    }
+    ESP_LOGD(PRINTER_TAG, "Took transfer from pool");
+    out_transfer_info_t *info = static_cast<out_transfer_info_t*>(out_transfer->context);
+    info->retries = 0;
+    info->trace_job = trace_task_job();
+    out_transfer->num_bytes = size;
+    memcpy(out_transfer->data_buffer, buffer, size);
+    portENTER_CRITICAL(&model_lock);
+    bytes_in_flight += size;
+    portEXIT_CRITICAL(&model_lock);
+    ESP_LOGD(PRINTER_TAG, "Submit USB bulk transfer of size: %d", size);
+    // The endpoint refuses transfers while it is halted after one failed, until recover() has it
+    // going again and has resubmitted what was queued. Only that is waited out for as long as it
+    // takes, any other refusal for longer than PRINTER_SUBMIT_TIMEOUT_MS.
+    bool submitted = false;
+    bool refused = false;
+    uint32_t refused_since_ms = 0;
+    xSemaphoreTake(submit_lock, portMAX_DELAY);
+    while (!gone) {
+      if (requeue > 0 || held_count > 0) {
+        refused = false;
+      } else if ((submitted = submit(out_transfer))) {
+        break;
+      } else if (!refused) {
+        refused = true;
+        refused_since_ms = millis();
+      } else if (millis() - refused_since_ms >= PRINTER_SUBMIT_TIMEOUT_MS) {
+        break;
+      }
+      xSemaphoreGive(submit_lock);
+      vTaskDelay(1);
+      xSemaphoreTake(submit_lock, portMAX_DELAY);
+    }
+    xSemaphoreGive(submit_lock);
+    if (!submitted) {
+      portENTER_CRITICAL(&model_lock);
+      bytes_in_flight -= size;
+      if (!gone) {
+        stats.bytes_dropped += size;
+      }
+      portEXIT_CRITICAL(&model_lock);
+      xQueueSend(free_out_transfers, &out_transfer, 0);
+      if (!gone) {
+        ESP_LOGE(PRINTER_TAG, "USB host refused a transfer for %u ms, dropping %d bytes",
+                 PRINTER_SUBMIT_TIMEOUT_MS, size);
+      }
       return 0;
     }
     return size;
@@ -0,0 +1,334 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include <usb/usb_host.h>
+
+#include <FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include "Printer.hpp"
+#include "JobPipeline.hpp"
+#include "ESC_POS_Printer/ESC_POS_Printer.h"
+
+static const char *PRINTER_REGISTRY_TAG = "PrinterRegistry";
+
+// Printers that can be driven at once, each one costs a transfer pool and a job pipeline
+#ifndef PRINTER_REGISTRY_MAX_PRINTERS
+#define PRINTER_REGISTRY_MAX_PRINTERS 3
+#endif
+
+// How long a printer that went away may take to hand back the transfers it still had out. One that
+// takes longer is leaked rather than freed under its callbacks.
+#ifndef PRINTER_REGISTRY_TEARDOWN_MS
+#define PRINTER_REGISTRY_TEARDOWN_MS 2000
+#endif
+
+typedef enum {
+  ORIGINAL_PRINTI,
+  XIAMEN_BETTER_LITTLE_BLUE_CUTIE,
+} printer_type_t;
+
+// Called once a removed printer is torn down and nothing uses its interface any more
+typedef void (*printer_detached_cb_t)(usb_device_handle_t dev_hdl, uint8_t interface_number);
+
+// One claimed printer interface and everything needed to print on it
+typedef struct {
+  usb_device_handle_t dev_hdl;
+  uint8_t interface_number;
+  uint8_t in_endpoint_address;
+  uint8_t out_endpoint_address;
+  printer_type_t type;
+  // Jobs can be sent to this printer specifically by this name, "1" for the first slot etc.
+  String name;
+
+  Printer *printer;
+  JobPipeline *job_pipeline;
+  ESC_POS_Printer *esc_pos_printer;
+
+  // One for the registry while the printer is attached, one for everyone who acquired the slot.
+  // Guarded by the registry lock.
+  uint32_t refs;
+  // Set once the printer is gone, the slot is torn down when the last reference is released
+  bool removed;
+  class PrinterRegistry *registry;
+} printer_slot_t;
+
+// All printers currently attached. Slots are filled as printers are plugged in and keep their
+// number while they stay, so a printer's name doesn't change when another one is unplugged.
+//
+// Slots handed out by pick() and primary() are acquired and must be released again. A printer
+// that is removed stops taking data right away, but is only torn down once the last reference to
+// it is released and its transfers are all back, from a task of its own as transfer callbacks
+// come from the USB client task that reports the unplug.
+class PrinterRegistry {
+private:
+  printer_slot_t slots[PRINTER_REGISTRY_MAX_PRINTERS] = {};
+  SemaphoreHandle_t lock;
+  printer_detached_cb_t detached_cb;
+
+  // Must be called with lock held
+  printer_slot_t *findLocked(usb_device_handle_t dev_hdl) {
+    for (int i = 0; i < PRINTER_REGISTRY_MAX_PRINTERS; i++) {
+      if (attached(&slots[i]) && slots[i].dev_hdl == dev_hdl) {
+        return &slots[i];
+      }
+    }
+    return nullptr;
+  }
+
+  // Must be called with lock held
+  static bool attached(printer_slot_t *slot) {
+    return slot->printer != nullptr && !slot->removed;
+  }
+
+  // Must be called with lock held
+  printer_slot_t *acquireLocked(printer_slot_t *slot) {
+    if (slot != nullptr) {
+      slot->refs++;
+    }
+    return slot;
+  }
+
+  static void _teardown_task(void *pvParameters) {
+    printer_slot_t *slot = static_cast<printer_slot_t *>(pvParameters);
+    slot->registry->teardown(slot);
+    vTaskDelete(NULL);
+  }
+
+  void teardown(printer_slot_t *slot) {
+    Printer *printer = slot->printer;
+    // The print task stops once the printer is disconnected, whatever it still had is dropped
+    delete slot->esc_pos_printer;
+    slot->esc_pos_printer = nullptr;
+    delete slot->job_pipeline;
+    slot->job_pipeline = nullptr;
+    if (printer->waitForTransfers(PRINTER_REGISTRY_TEARDOWN_MS)) {
+      delete printer;
+    } else {
+      ESP_LOGE(PRINTER_REGISTRY_TAG, "Printer %s still has transfers out, leaking it", slot->name.c_str());
+    }
+    if (detached_cb != nullptr) {
+      detached_cb(slot->dev_hdl, slot->interface_number);
+    }
+    ESP_LOGI(PRINTER_REGISTRY_TAG, "Printer %s torn down", slot->name.c_str());
+
+    // Free for the next printer
+    xSemaphoreTake(lock, portMAX_DELAY);
+    slot->printer = nullptr;
+    slot->removed = false;
+    xSemaphoreGive(lock);
+  }
+
+public:
+  PrinterRegistry(printer_detached_cb_t detached_cb = nullptr) : detached_cb(detached_cb) {
+    lock = xSemaphoreCreateMutex();
+  }
+
+  // Removes the printers that are still attached and waits until all of them are torn down
+  ~PrinterRegistry() {
+    for (int i = 0; i < PRINTER_REGISTRY_MAX_PRINTERS; i++) {
+      remove(slots[i].dev_hdl);
+    }
+    while (taken() > 0) {
+      vTaskDelay(1);
+    }
+    vSemaphoreDelete(lock);
+  }
+
+  // Set up a printer on a claimed interface. Returns nullptr if all slots are taken. The slot
+  // isn't acquired for the caller.
+  printer_slot_t *add(usb_host_client_handle_t client_hdl, usb_device_handle_t dev_hdl, uint8_t interface_number,
+                      const usb_ep_desc_t *in_ep_desc, const usb_ep_desc_t *out_ep_desc, printer_type_t type) {
+    xSemaphoreTake(lock, portMAX_DELAY);
+    printer_slot_t *slot = nullptr;
+    for (int i = 0; i < PRINTER_REGISTRY_MAX_PRINTERS && slot == nullptr; i++) {
+      if (slots[i].printer == nullptr) {
+        slot = &slots[i];
+        slot->name = String(i + 1);
+      }
+    }
+    if (slot == nullptr) {
+      xSemaphoreGive(lock);
+      ESP_LOGW(PRINTER_REGISTRY_TAG, "Already driving %d printers, ignoring another one",
+               PRINTER_REGISTRY_MAX_PRINTERS);
+      return nullptr;
+    }
+
+    slot->dev_hdl = dev_hdl;
+    slot->interface_number = interface_number;
+    slot->in_endpoint_address = in_ep_desc->bEndpointAddress;
+    slot->out_endpoint_address = out_ep_desc->bEndpointAddress;
+    slot->type = type;
+    slot->job_pipeline = nullptr;
+    slot->esc_pos_printer = nullptr;
+    slot->refs = 1;
+    slot->removed = false;
+    slot->registry = this;
+    Printer *printer = new Printer(client_hdl, dev_hdl, interface_number, in_ep_desc, out_ep_desc);
+    // Real-time status requests go out from the print task between jobs
+    slot->job_pipeline = new JobPipeline(printer, JOB_PIPELINE_DEPTH, JOB_PIPELINE_BLOCK_SIZE,
+                                         [](void *context) { static_cast<Printer *>(context)->commandBoundary(); },
+                                         printer);
+    slot->esc_pos_printer = new ESC_POS_Printer(slot->job_pipeline);
+    // Set last, a slot counts as taken once it has a printer
+    slot->printer = printer;
+    xSemaphoreGive(lock);
+
+    ESP_LOGI(PRINTER_REGISTRY_TAG, "Printer %s attached", slot->name.c_str());
+    return slot;
+  }
+
+  // Take the printer of a device that went away out of service. Nothing new is written to it, the
+  // transfers it still has out are cancelled and it is torn down once it isn't used any more.
+  void remove(usb_device_handle_t dev_hdl) {
+    xSemaphoreTake(lock, portMAX_DELAY);
+    printer_slot_t *slot = findLocked(dev_hdl);
+    if (slot == nullptr) {
+      xSemaphoreGive(lock);
+      return;
+    }
+    slot->removed = true;
+    xSemaphoreGive(lock);
+
+    ESP_LOGI(PRINTER_REGISTRY_TAG, "Printer %s detached", slot->name.c_str());
+    slot->printer->disconnect();
+    // Cancelled transfers come back through their callbacks, and only then can they be freed
+    usb_host_endpoint_halt(dev_hdl, slot->in_endpoint_address);
+    usb_host_endpoint_halt(dev_hdl, slot->out_endpoint_address);
+    usb_host_endpoint_flush(dev_hdl, slot->in_endpoint_address);
+    usb_host_endpoint_flush(dev_hdl, slot->out_endpoint_address);
+    release(slot);
+  }
+
+  // Hand back a slot from pick() or primary()
+  void release(printer_slot_t *slot) {
+    xSemaphoreTake(lock, portMAX_DELAY);
+    bool last = --slot->refs == 0;
+    xSemaphoreGive(lock);
+    if (last) {
+      // Waits for transfer callbacks, which may be what is running right now
+      xTaskCreate(_teardown_task, "Printer teardown", 4096, slot, 5, NULL);
+    }
+  }
+
+  // The printer that gets status messages, the one that was attached first. Returns nullptr if
+  // there is none, otherwise the slot is acquired.
+  printer_slot_t *primary() {
+    printer_slot_t *slot = nullptr;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (int i = 0; i < PRINTER_REGISTRY_MAX_PRINTERS && slot == nullptr; i++) {
+      if (attached(&slots[i])) {
+        slot = acquireLocked(&slots[i]);
+      }
+    }
+    xSemaphoreGive(lock);
+    return slot;
+  }
+
+  // Pick the printer for a job: the one called name if given, otherwise the ready printer that
+  // is expected to finish what it has soonest. Returns nullptr if there is none, otherwise the
+  // slot is acquired.
+  printer_slot_t *pick(const String &name) {
+    xSemaphoreTake(lock, portMAX_DELAY);
+    printer_slot_t *best = nullptr;
+    uint32_t best_ms = UINT32_MAX;
+    for (int i = 0; i < PRINTER_REGISTRY_MAX_PRINTERS; i++) {
+      printer_slot_t *slot = &slots[i];
+      if (!attached(slot)) {
+        continue;
+      }
+      if (name.length() > 0) {
+        if (slot->name == name) {
+          best = slot;
+          break;
+        }
+        continue;
+      }
+      if (slot->printer->getState() != PRINTER_STATE_READY) {
+        continue;
+      }
+      uint32_t ms = slot->printer->estimatedCompletionMs(slot->job_pipeline->queuedBytes());
+      if (ms < best_ms) {
+        best = slot;
+        best_ms = ms;
+      }
+    }
+    acquireLocked(best);
+    xSemaphoreGive(lock);
+
+    if (best == nullptr && name.length() > 0) {
+      ESP_LOGW(PRINTER_REGISTRY_TAG, "No printer called %s, picking one", name.c_str());
+      return pick("");
+    }
+    return best;
+  }
+
+  // Kick off a status poll on every printer, returns true if any of them can print
+  bool anyReady() {
+    bool ready = false;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (int i = 0; i < PRINTER_REGISTRY_MAX_PRINTERS; i++) {
+      if (attached(&slots[i])) {
+        slots[i].printer->pollStatus();
+        ready = ready || slots[i].printer->getState() == PRINTER_STATE_READY;
+      }
+    }
+    xSemaphoreGive(lock);
+    return ready;
+  }
+
+  // Acquire every attached printer into slots, which has room for PRINTER_REGISTRY_MAX_PRINTERS.
+  // Returns how many there are, each of them must be released again. For work that takes long,
+  // such as draining, which must not hold up the registry meanwhile.
+  size_t acquireAll(printer_slot_t **acquired) {
+    size_t n = 0;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (int i = 0; i < PRINTER_REGISTRY_MAX_PRINTERS; i++) {
+      if (attached(&slots[i])) {
+        acquired[n++] = acquireLocked(&slots[i]);
+      }
+    }
+    xSemaphoreGive(lock);
+    return n;
+  }
+
+  // Call f for every attached printer, with the registry locked. The printers can't go away while
+  // this runs, so f must not wait on anything.
+  template<typename F>
+  void forEach(F f) {
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (int i = 0; i < PRINTER_REGISTRY_MAX_PRINTERS; i++) {
+      if (attached(&slots[i])) {
+        f(&slots[i]);
+      }
+    }
+    xSemaphoreGive(lock);
+  }
+
+  // Number of printers attached
+  size_t count() {
+    size_t n = 0;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (int i = 0; i < PRINTER_REGISTRY_MAX_PRINTERS; i++) {
+      if (attached(&slots[i])) {
+        n++;
+      }
+    }
+    xSemaphoreGive(lock);
+    return n;
+  }
+
+  // Number of slots in use, including printers that are still being torn down
+  size_t taken() {
+    size_t n = 0;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (int i = 0; i < PRINTER_REGISTRY_MAX_PRINTERS; i++) {
+      if (slots[i].printer != nullptr) {
+        n++;
+      }
+    }
+    xSemaphoreGive(lock);
+    return n;
+  }
+};
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WiFiClientSecure.h>
+#include <HTTPClient.h>
+
+static const char *PUSH_CHANNEL_TAG = "PushChannel";
+
+// Server-sent events channel over which the printi server announces new jobs the moment they
+// are enqueued. The job itself is still fetched through /nextinqueue, this only replaces the
+// waiting part of the long poll. Callers fall back to long-polling whenever the channel is down.
+class PushChannel {
+private:
+  WiFiClientSecure client;
+  HTTPClient http;
+
+  String host;
+  bool is_open = false;
+
+  // Don't hammer a server that doesn't offer the channel
+  const uint32_t RECONNECT_INTERVAL_MS = 60 * 1000;
+  uint32_t last_connect_attempt_ms = 0;
+  bool attempted_connect = false;
+
+  const size_t MAX_LINE_LENGTH = 256;
+  String line;
+  String event;
+
+  // Handle one complete line of the event stream, returns true if a job event was dispatched
+  bool handleLine() {
+    if (line.length() == 0) {
+      // Blank line dispatches the event
+      bool is_job = event == "job";
+      event = "";
+      return is_job;
+    }
+    if (line.startsWith("event:")) {
+      event = line.substring(6);
+      event.trim();
+    }
+    // Comments (keep-alives), data and id fields carry nothing we need
+    return false;
+  }
+
+public:
+  PushChannel(const String &host) : host(host) {}
+
+  bool isOpen() {
+    return is_open && client.connected();
+  }
+
+  // Open the event stream at path. Returns false if the server doesn't offer it or if the last
+  // attempt was too recent.
+  bool open(const String &path) {
+    if (attempted_connect && millis() - last_connect_attempt_ms < RECONNECT_INTERVAL_MS) {
+      return false;
+    }
+    attempted_connect = true;
+    last_connect_attempt_ms = millis();
+
+    // TODO(Leon Handreke): Proper https
+    client.setInsecure();
+    // HTTP/1.0 keeps chunked framing out of the event stream
+    http.useHTTP10(true);
+    http.begin(client, "https://" + host + path);
+    http.addHeader("Accept", "text/event-stream");
+    http.addHeader("Cache-Control", "no-cache");
+    int response_code = http.GET();
+    if (response_code != 200) {
+      ESP_LOGI(PUSH_CHANNEL_TAG, "Push channel not available, response code: %d", response_code);
+      http.end();
+      return false;
+    }
+
+    ESP_LOGI(PUSH_CHANNEL_TAG, "Push channel open");
+    line = "";
+    event = "";
+    is_open = true;
+    return true;
+  }
+
+  void close() {
+    if (is_open) {
+      ESP_LOGI(PUSH_CHANNEL_TAG, "Push channel closed");
+    }
+    is_open = false;
+    http.end();
+  }
+
+  // Block until the server announces a job or timeout_ms passes. Returns true if a job was
+  // announced. If the channel drops while waiting, it is closed and false is returned.
+  bool waitForJob(uint32_t timeout_ms) {
+    WiFiClient *stream = http.getStreamPtr();
+    uint32_t start = millis();
+
+    while (millis() - start < timeout_ms) {
+      if (stream == nullptr || (!stream->connected() && stream->available() <= 0)) {
+        close();
+        return false;
+      }
+
+      if (stream->available() <= 0) {
+        vTaskDelay(10);
+        continue;
+      }
+
+      int c = stream->read();
+      if (c == '\n') {
+        if (line.endsWith("\r")) {
+          line.remove(line.length() - 1);
+        }
+        bool is_job = handleLine();
+        line = "";
+        if (is_job) {
+          return true;
+        }
+      } else if (line.length() < MAX_LINE_LENGTH) {
+        line += (char) c;
+      }
+    }
+    return false;
+  }
+};
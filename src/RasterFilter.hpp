@@ -0,0 +1,344 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "ESC_POS_Printer/ESC_POS_Printer.h"
+
+static const char *RASTER_FILTER_TAG = "RasterFilter";
+
+// Raster rows collected before they are handed to the printer, the widest raster is 48 bytes
+#define RASTER_FILTER_ROWS 24
+#define RASTER_FILTER_MAX_ROW_BYTES 48
+
+// Passes an ESC/POS job written to it piece by piece on to the printer, but takes GS v 0 raster
+// images apart and prints them through ESC_POS_Printer::printBitmap, which replaces runs of blank
+// rows with paper feeds. Everything else goes out unchanged. Commands are followed just far
+// enough to skip their parameters and data, so that bytes inside them are never mistaken for a
+// raster command. A command it doesn't know is passed on as is up to the next ESC or GS, where
+// the filter picks up parsing again. Raster headers that are out of spec are dropped, as a
+// printer would take whatever follows for image data.
+class RasterFilter : public Print {
+private:
+  ESC_POS_Printer *esc_pos_printer;
+
+  enum {
+    STATE_TEXT,
+    STATE_COMMAND,
+    STATE_SKIP,
+    STATE_SKIP_TO_NUL,
+    STATE_RASTER,
+    STATE_RESYNC,
+  } state = STATE_TEXT;
+
+  // Command being parsed, up to and including its fixed parameters
+  uint8_t command[8];
+  size_t command_len = 0;
+  uint32_t skip = 0;
+
+  uint8_t *raster = nullptr;
+  uint16_t raster_row_bytes = 0;
+  uint32_t raster_rows_left = 0;
+  size_t raster_len = 0;
+  uint32_t raster_rows = 0;
+  uint32_t unknown_commands = 0;
+  uint32_t dropped_rasters = 0;
+
+  unsigned long elided_at_start;
+  unsigned long saved_at_start;
+
+  static const uint8_t DLE = 0x10;
+  static const uint8_t DC2 = 0x12;
+  static const uint8_t ESC = 0x1b;
+  static const uint8_t FS = 0x1c;
+  static const uint8_t GS = 0x1d;
+
+  // Limits of GS v 0, xL + xH * 256 and yL + yH * 256
+  static const uint16_t RASTER_MAX_ROW_BYTES = 4095;
+  static const uint16_t RASTER_MAX_ROWS = 4095;
+
+  static bool isCommandStart(uint8_t c) {
+    return c == ESC || c == GS || c == DC2 || c == FS || c == DLE;
+  }
+
+  static bool isOneOf(const char *set, uint8_t c) {
+    return c != 0 && strchr(set, c) != nullptr;
+  }
+
+  // Length of the command in command[] including its fixed parameters. 0 if more bytes are
+  // needed to tell, -1 if the command isn't known.
+  int commandLength() {
+    if (command_len < 2) {
+      return 0;
+    }
+    uint8_t c = command[1];
+    switch (command[0]) {
+      case ESC:
+        if (isOneOf("@2<SLimv\f", c)) return 2;
+        if (isOneOf("!-3=?CEGJKMQRTUVadejlrtuz{ %*D", c)) return c == '*' ? 5 : c == 'D' ? 2 : 3;
+        if (isOneOf("$\\Bcf", c)) return 4;
+        if (isOneOf("p7(", c)) return 5;
+        if (c == 'W') return 10;
+        return -1;
+      case GS:
+        if (isOneOf(":<c", c)) return 2;
+        if (isOneOf("!BEHITabfhjrwx/", c)) return 3;
+        if (isOneOf("LWP$\\*", c)) return 4;
+        if (c == '^') return 5;
+        if (command_len < 3) return 0;
+        switch (c) {
+          case 'V': return isOneOf("ABab", command[2]) ? 4 : 3;
+          case 'k': return command[2] <= 6 ? 3 : 4;
+          case '(': return 5;
+          case '8': return command[2] == 'L' ? 7 : -1;
+          case 'g': return isOneOf("02", command[2]) ? 6 : -1;
+          case 'v': return command[2] == '0' ? 8 : -1;
+          case 'z': return command[2] == '0' ? 5 : -1;
+          default: return -1;
+        }
+      case DC2:
+        if (c == 'T') return 2;
+        if (c == '#') return 3;
+        if (c == '*') return 4;
+        return -1;
+      case FS:
+        if (isOneOf(".&", c)) return 2;
+        if (isOneOf("!-CW", c)) return 3;
+        if (isOneOf("pS?2", c)) return 4;
+        if (c == '(') return 5;
+        return -1;
+      case DLE:
+        if (isOneOf("\x04\x05", c)) return 3;
+        if (c == 0x14) return 5;
+        return -1;
+      default:
+        return -1;
+    }
+  }
+
+  // A complete command is in command[], decide what happens with whatever follows it
+  void handleCommand() {
+    uint8_t c = command[1];
+    size_t len = command_len;
+    command_len = 0;
+    state = STATE_TEXT;
+
+    if (command[0] == GS && c == 'v') {
+      startRaster();
+      return;
+    }
+
+    esc_pos_printer->write(command, len);
+    if (command[0] == ESC && c == '*') {
+      skip = (command[3] | (command[4] << 8)) * (command[2] <= 1 ? 1 : 3);
+    } else if (command[0] == ESC && c == 'D') {
+      state = STATE_SKIP_TO_NUL;
+    } else if (command[0] == GS && c == 'k') {
+      if (command[2] <= 6) {
+        state = STATE_SKIP_TO_NUL;
+      } else {
+        skip = command[3];
+      }
+    } else if ((command[0] == GS || command[0] == ESC || command[0] == FS) && c == '(') {
+      skip = command[3] | (command[4] << 8);
+    } else if (command[0] == GS && c == '*') {
+      skip = command[2] * command[3] * 8;
+    } else if (command[0] == FS && c == '2') {
+      // A user defined character, always 24 x 24 dots
+      skip = 72;
+    } else if (command[0] == GS && c == '8') {
+      skip = command[3] | (command[4] << 8) | (command[5] << 16) | ((uint32_t) command[6] << 24);
+    } else if (command[0] == DC2 && c == '*') {
+      skip = command[2] * command[3];
+    }
+    if (skip > 0) {
+      state = STATE_SKIP;
+    }
+  }
+
+  // GS v 0 m xL xH yL yH is in command[]
+  void startRaster() {
+    uint8_t mode = command[3];
+    uint16_t row_bytes = command[4] | (command[5] << 8);
+    uint16_t rows = command[6] | (command[7] << 8);
+
+    if (row_bytes == 0 || rows == 0) {
+      // No data follows, but printers differ in what they make of the header
+      ESP_LOGW(RASTER_FILTER_TAG, "Dropping empty raster of %u x %u", row_bytes, rows);
+      dropped_rasters++;
+      return;
+    }
+    if ((mode > 3 && (mode < '0' || mode > '3')) || row_bytes > RASTER_MAX_ROW_BYTES || rows > RASTER_MAX_ROWS) {
+      // Can't be trusted to say how much data follows either
+      ESP_LOGW(RASTER_FILTER_TAG, "Dropping raster header out of spec, mode %u, %u x %u", mode, row_bytes, rows);
+      dropped_rasters++;
+      state = STATE_RESYNC;
+      return;
+    }
+
+    if (raster == nullptr) {
+      raster = (uint8_t *) malloc(RASTER_FILTER_ROWS * RASTER_FILTER_MAX_ROW_BYTES);
+    }
+    // Only plain single density rasters that fit the print head are taken apart
+    if (raster == nullptr || (mode != 0 && mode != '0') || row_bytes > RASTER_FILTER_MAX_ROW_BYTES) {
+      esc_pos_printer->write(command, 8);
+      skip = (uint32_t) row_bytes * rows;
+      state = STATE_SKIP;
+      return;
+    }
+
+    raster_row_bytes = row_bytes;
+    raster_rows_left = rows;
+    raster_len = 0;
+    raster_rows += rows;
+    state = STATE_RASTER;
+  }
+
+  void flushRaster() {
+    size_t rows = raster_len / raster_row_bytes;
+    if (rows > 0) {
+      esc_pos_printer->printBitmap(raster_row_bytes * 8, rows, raster, false);
+    }
+    raster_len = 0;
+  }
+
+  // Pass an unknown command on and look for the next one from the byte after its first. Its last
+  // byte may already start the next command.
+  void resync() {
+    ESP_LOGW(RASTER_FILTER_TAG, "Unknown command %02x %02x, passing it on up to the next ESC or GS",
+             command[0], command_len > 1 ? command[1] : 0);
+    unknown_commands++;
+    uint8_t last = command[command_len - 1];
+    bool restart = command_len > 1 && (last == ESC || last == GS);
+    esc_pos_printer->write(command, restart ? command_len - 1 : command_len);
+    command_len = 0;
+    state = STATE_RESYNC;
+    if (restart) {
+      command[command_len++] = last;
+      state = STATE_COMMAND;
+    }
+  }
+
+public:
+  RasterFilter(ESC_POS_Printer *esc_pos_printer) : esc_pos_printer(esc_pos_printer) {
+    elided_at_start = esc_pos_printer->getBlankRowsElided();
+    saved_at_start = esc_pos_printer->getRasterBytesSaved();
+  }
+
+  ~RasterFilter() {
+    free(raster);
+  }
+
+  size_t write(uint8_t c) {
+    return write(&c, 1);
+  }
+
+  size_t write(const uint8_t *buffer, size_t size) {
+    size_t i = 0;
+    while (i < size) {
+      size_t n;
+      switch (state) {
+        case STATE_TEXT:
+          // Pass text on in runs up to the next command
+          for (n = 0; i + n < size && !isCommandStart(buffer[i + n]); n++) {
+          }
+          if (n > 0) {
+            esc_pos_printer->write(buffer + i, n);
+            i += n;
+          } else {
+            command[command_len++] = buffer[i++];
+            state = STATE_COMMAND;
+          }
+          break;
+
+        case STATE_COMMAND: {
+          command[command_len++] = buffer[i++];
+          int len = commandLength();
+          if (len < 0) {
+            resync();
+          } else if (len > 0 && command_len == (size_t) len) {
+            handleCommand();
+          }
+          break;
+        }
+
+        case STATE_SKIP:
+          n = std::min((size_t) skip, size - i);
+          esc_pos_printer->write(buffer + i, n);
+          skip -= n;
+          i += n;
+          if (skip == 0) {
+            state = STATE_TEXT;
+          }
+          break;
+
+        case STATE_SKIP_TO_NUL:
+          for (n = 0; i + n < size && buffer[i + n] != 0; n++) {
+          }
+          if (i + n < size) {
+            n++; // The NUL itself
+            state = STATE_TEXT;
+          }
+          esc_pos_printer->write(buffer + i, n);
+          i += n;
+          break;
+
+        case STATE_RASTER: {
+          size_t want = std::min((size_t) raster_rows_left * raster_row_bytes,
+                                 (size_t) RASTER_FILTER_ROWS * raster_row_bytes) - raster_len;
+          n = std::min(want, size - i);
+          memcpy(raster + raster_len, buffer + i, n);
+          raster_len += n;
+          i += n;
+          if (n == want) {
+            raster_rows_left -= raster_len / raster_row_bytes;
+            flushRaster();
+            if (raster_rows_left == 0) {
+              state = STATE_TEXT;
+            }
+          }
+          break;
+        }
+
+        case STATE_RESYNC:
+          for (n = 0; i + n < size && buffer[i + n] != ESC && buffer[i + n] != GS; n++) {
+          }
+          if (n > 0) {
+            esc_pos_printer->write(buffer + i, n);
+            i += n;
+          }
+          if (i < size) {
+            state = STATE_TEXT;
+          }
+          break;
+      }
+    }
+    return size;
+  }
+
+  // Send whatever is still held back. Returns false if the job ended inside a command.
+  bool finish() {
+    bool complete = state == STATE_TEXT || state == STATE_RESYNC;
+    if (state == STATE_RASTER) {
+      flushRaster();
+    } else if (state == STATE_COMMAND) {
+      esc_pos_printer->write(command, command_len);
+    }
+    if (!complete) {
+      ESP_LOGE(RASTER_FILTER_TAG, "Job cut short inside a command");
+    }
+    state = STATE_TEXT;
+    command_len = 0;
+
+    if (raster_rows > 0) {
+      ESP_LOGI(RASTER_FILTER_TAG, "%u raster rows, %lu blank rows fed instead, %lu bytes saved",
+               raster_rows, esc_pos_printer->getBlankRowsElided() - elided_at_start,
+               esc_pos_printer->getRasterBytesSaved() - saved_at_start);
+    }
+    if (unknown_commands > 0 || dropped_rasters > 0) {
+      ESP_LOGW(RASTER_FILTER_TAG, "%u unknown commands passed on, %u bad raster headers dropped",
+               unknown_commands, dropped_rasters);
+    }
+    esc_pos_printer->commit();
+    return complete;
+  }
+};
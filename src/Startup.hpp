@@ -0,0 +1,93 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include <FreeRTOS.h>
+#include <freertos/event_groups.h>
+#include <freertos/task.h>
+
+// Boot is split into stages that run side by side, each one timed from millis() at boot so
+// that slow boots can be traced to a stage. A stage either runs in a task of its own through
+// startup_run() or is marked with startup_begin()/startup_end() where it happens, e.g. a printer
+// being found by the USB host task.
+
+static const char *STARTUP_TAG = "Startup";
+
+typedef enum {
+  STARTUP_STAGE_WIFI,
+  STARTUP_STAGE_CA_STORE,
+  STARTUP_STAGE_PRINTER,
+  STARTUP_STAGE_COUNT,
+} startup_stage_t;
+
+static const char *STARTUP_STAGE_NAMES[STARTUP_STAGE_COUNT] = {
+  "wifi", "ca_store", "printer",
+};
+
+typedef struct {
+  uint32_t start_ms[STARTUP_STAGE_COUNT];
+  // 0 while the stage is running or if it never started
+  uint32_t end_ms[STARTUP_STAGE_COUNT];
+  // When the first job was asked for, 0 until then
+  uint32_t ready_ms;
+} startup_stats_t;
+
+static startup_stats_t startup_stats = {};
+static EventGroupHandle_t startup_events = nullptr;
+
+static inline void startup_begin(startup_stage_t stage) {
+  if (startup_events == nullptr) {
+    startup_events = xEventGroupCreate();
+  }
+  startup_stats.start_ms[stage] = millis();
+}
+
+// Only the first end of a stage counts, later ones are ignored
+static inline void startup_end(startup_stage_t stage) {
+  if (startup_stats.end_ms[stage] != 0 || startup_stats.start_ms[stage] == 0) {
+    return;
+  }
+  startup_stats.end_ms[stage] = millis();
+  ESP_LOGI(STARTUP_TAG, "Stage %s took %u ms", STARTUP_STAGE_NAMES[stage],
+           startup_stats.end_ms[stage] - startup_stats.start_ms[stage]);
+  xEventGroupSetBits(startup_events, BIT(stage));
+}
+
+typedef struct {
+  startup_stage_t stage;
+  void (*run)();
+} startup_task_t;
+
+static void _startup_task(void *pvParameters) {
+  startup_task_t *task = static_cast<startup_task_t *>(pvParameters);
+  task->run();
+  startup_end(task->stage);
+  delete task;
+  vTaskDelete(NULL);
+}
+
+// Run a stage in a task of its own and carry on
+static inline void startup_run(startup_stage_t stage, void (*run)(), uint32_t stack_size = 4096) {
+  startup_begin(stage);
+  xTaskCreate(_startup_task, STARTUP_STAGE_NAMES[stage], stack_size, new startup_task_t{stage, run}, 5, NULL);
+}
+
+// Wait for a stage to end, returns false on timeout
+static inline bool startup_wait(startup_stage_t stage, uint32_t timeout_ms) {
+  if (startup_events == nullptr) {
+    return false;
+  }
+  return xEventGroupWaitBits(startup_events, BIT(stage), pdFALSE, pdTRUE, pdMS_TO_TICKS(timeout_ms)) & BIT(stage);
+}
+
+// Boot is done once the first job is asked for
+static inline void startup_ready() {
+  if (startup_stats.ready_ms == 0) {
+    startup_stats.ready_ms = millis();
+    ESP_LOGI(STARTUP_TAG, "Ready %u ms after boot", startup_stats.ready_ms);
+  }
+}
+
+static inline const startup_stats_t &startup_get_stats() {
+  return startup_stats;
+}
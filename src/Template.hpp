@@ -0,0 +1,130 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WebServer.h>
+
+static const char *TEMPLATE_TAG = "Template";
+
+// Literal runs and placeholders a template may have, further text is sent as one literal
+#ifndef TEMPLATE_MAX_SEGMENTS
+#define TEMPLATE_MAX_SEGMENTS 32
+#endif
+
+// Longest placeholder name, anything longer between braces is left alone
+#ifndef TEMPLATE_MAX_NAME
+#define TEMPLATE_MAX_NAME 31
+#endif
+
+// Streams a page with {{NAME}} placeholders straight from where it is stored, e.g. an embedded
+// file in flash. The page is split into segments once, on first use. Rendering sends the literal
+// segments as they are and the placeholder values HTML-escaped through a small stack buffer, so
+// neither the page nor its values are ever copied whole and any value length is fine.
+class Template {
+private:
+  typedef struct {
+    // Offset and length of the literal text or, for a placeholder, of the name between the braces
+    uint32_t offset;
+    uint32_t len;
+    bool placeholder;
+  } template_segment_t;
+
+  const char *text;
+  size_t text_len;
+  template_segment_t segments[TEMPLATE_MAX_SEGMENTS];
+  size_t segment_count = 0;
+  bool parsed = false;
+
+  void addSegment(size_t offset, size_t len, bool placeholder) {
+    if (len > 0) {
+      segments[segment_count++] = {(uint32_t) offset, (uint32_t) len, placeholder};
+    }
+  }
+
+  void parse() {
+    const char *end = text + text_len;
+    const char *literal = text;
+    const char *p = text;
+    while ((p = (const char *) memmem(p, end - p, "{{", 2)) != nullptr) {
+      const char *name = p + 2;
+      const char *close = (const char *) memmem(name, end - name, "}}", 2);
+      if (close == nullptr) {
+        break;
+      }
+      if (close - name > TEMPLATE_MAX_NAME) {
+        // Not one of ours, e.g. a style rule
+        p = name;
+        continue;
+      }
+      // Keep one segment for the rest of the page
+      if (segment_count + 3 > TEMPLATE_MAX_SEGMENTS) {
+        ESP_LOGW(TEMPLATE_TAG, "More than %d segments, not substituting past offset %u",
+                 TEMPLATE_MAX_SEGMENTS, p - text);
+        break;
+      }
+      addSegment(literal - text, p - literal, false);
+      addSegment(name - text, close - name, true);
+      literal = p = close + 2;
+    }
+    addSegment(literal - text, end - literal, false);
+    parsed = true;
+  }
+
+  static void sendEscaped(WebServer &server, const String &value) {
+    char buffer[64];
+    size_t len = 0;
+    for (size_t i = 0; i < value.length(); i++) {
+      const char *escaped;
+      switch (value[i]) {
+        case '&': escaped = "&amp;"; break;
+        case '<': escaped = "&lt;"; break;
+        case '>': escaped = "&gt;"; break;
+        case '"': escaped = "&quot;"; break;
+        case '\'': escaped = "&#39;"; break;
+        default: escaped = nullptr;
+      }
+      size_t n = escaped != nullptr ? strlen(escaped) : 1;
+      if (len + n > sizeof(buffer)) {
+        server.sendContent(buffer, len);
+        len = 0;
+      }
+      if (escaped != nullptr) {
+        memcpy(buffer + len, escaped, n);
+      } else {
+        buffer[len] = value[i];
+      }
+      len += n;
+    }
+    if (len > 0) {
+      server.sendContent(buffer, len);
+    }
+  }
+
+public:
+  // text has to stay around for as long as the template is used, the template only refers to it
+  Template(const char *text, size_t text_len) : text(text), text_len(text_len) {}
+
+  // Send the page as the response to the current request, with the response chunked as its
+  // length isn't known up front. value(name) gives the text for the placeholder {{name}}.
+  template<typename F>
+  void send(WebServer &server, int code, const char *content_type, F value) {
+    if (!parsed) {
+      parse();
+    }
+
+    server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+    server.send(code, content_type, "");
+    for (size_t i = 0; i < segment_count; i++) {
+      const template_segment_t &segment = segments[i];
+      if (segment.placeholder) {
+        char name[TEMPLATE_MAX_NAME + 1];
+        memcpy(name, text + segment.offset, segment.len);
+        name[segment.len] = '\0';
+        sendEscaped(server, value(name));
+      } else {
+        server.sendContent(text + segment.offset, segment.len);
+      }
+    }
+    // Terminating chunk
+    server.sendContent("");
+  }
+};
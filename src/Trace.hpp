@@ -0,0 +1,217 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include <esp_timer.h>
+#include <FreeRTOS.h>
+#include <freertos/task.h>
+
+// Lightweight span tracing along the job path. Every span is one fixed-size record in a ring
+// buffer, stamped with esp_timer_get_time() and the id of the job it belongs to, so a slow
+// receipt can be broken down into DNS, TLS, server, download and printer time after the fact.
+
+static const char *TRACE_TAG = "Trace";
+
+#ifndef PRINTI_TRACE
+#define PRINTI_TRACE 1
+#endif
+
+// Spans kept, older ones are overwritten. A job produces a handful of network spans plus about
+// two per KiB printed.
+#ifndef TRACE_RING_SIZE
+#define TRACE_RING_SIZE 512
+#endif
+
+// Tasks that can have a job attached at once (loop, one print task per printer)
+#ifndef TRACE_MAX_TASKS
+#define TRACE_MAX_TASKS 8
+#endif
+
+typedef enum {
+  TRACE_SPAN_DNS,
+  TRACE_SPAN_CONNECT,
+  TRACE_SPAN_REQUEST,
+  TRACE_SPAN_BODY,
+  TRACE_SPAN_PRINTER_WRITE,
+  TRACE_SPAN_USB_TRANSFER,
+  TRACE_SPAN_COUNT,
+} trace_span_t;
+
+static const char *TRACE_SPAN_NAMES[TRACE_SPAN_COUNT] = {
+  "dns", "connect", "request", "body", "printer_write", "usb_transfer",
+};
+
+typedef struct {
+  uint32_t job_id;
+  uint8_t span;
+  int64_t start_us;
+  uint32_t duration_us;
+} trace_record_t;
+
+typedef struct {
+  uint32_t job_id;
+  uint32_t count[TRACE_SPAN_COUNT];
+  uint64_t total_us[TRACE_SPAN_COUNT];
+  uint32_t max_us[TRACE_SPAN_COUNT];
+  // From the start of the first to the end of the last span of the job
+  int64_t first_start_us;
+  int64_t last_end_us;
+} trace_job_summary_t;
+
+static trace_record_t trace_ring[TRACE_RING_SIZE];
+static uint32_t trace_head = 0;
+static portMUX_TYPE trace_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static uint32_t trace_next_job_id = 1;
+static struct {
+  TaskHandle_t task;
+  uint32_t job_id;
+} trace_task_jobs[TRACE_MAX_TASKS];
+
+static inline int64_t trace_now() {
+  return esp_timer_get_time();
+}
+
+// Job the calling task currently works for, 0 if none
+static inline uint32_t trace_task_job() {
+  TaskHandle_t task = xTaskGetCurrentTaskHandle();
+  for (int i = 0; i < TRACE_MAX_TASKS; i++) {
+    if (trace_task_jobs[i].task == task) {
+      return trace_task_jobs[i].job_id;
+    }
+  }
+  return 0;
+}
+
+// Attribute spans recorded by the calling task to job_id from now on
+static inline void trace_set_task_job(uint32_t job_id) {
+  TaskHandle_t task = xTaskGetCurrentTaskHandle();
+  int free_slot = -1;
+  portENTER_CRITICAL(&trace_lock);
+  for (int i = 0; i < TRACE_MAX_TASKS; i++) {
+    if (trace_task_jobs[i].task == task) {
+      trace_task_jobs[i].job_id = job_id;
+      portEXIT_CRITICAL(&trace_lock);
+      return;
+    }
+    if (trace_task_jobs[i].task == nullptr && free_slot < 0) {
+      free_slot = i;
+    }
+  }
+  if (free_slot >= 0) {
+    trace_task_jobs[free_slot].task = task;
+    trace_task_jobs[free_slot].job_id = job_id;
+  }
+  portEXIT_CRITICAL(&trace_lock);
+}
+
+// Give up the calling task's slot, for tasks that are about to be deleted. The slot would otherwise
+// stay taken, or be picked up by a new task that gets the same handle.
+static inline void trace_clear_task_job() {
+  TaskHandle_t task = xTaskGetCurrentTaskHandle();
+  portENTER_CRITICAL(&trace_lock);
+  for (int i = 0; i < TRACE_MAX_TASKS; i++) {
+    if (trace_task_jobs[i].task == task) {
+      trace_task_jobs[i].task = nullptr;
+      trace_task_jobs[i].job_id = 0;
+    }
+  }
+  portEXIT_CRITICAL(&trace_lock);
+}
+
+// Start a new job on the calling task and return its id
+static inline uint32_t trace_begin_job() {
+  portENTER_CRITICAL(&trace_lock);
+  uint32_t job_id = trace_next_job_id++;
+  portEXIT_CRITICAL(&trace_lock);
+  trace_set_task_job(job_id);
+  return job_id;
+}
+
+static inline void trace_record(uint32_t job_id, trace_span_t span, int64_t start_us, int64_t end_us) {
+  if (!PRINTI_TRACE || job_id == 0) {
+    return;
+  }
+  portENTER_CRITICAL(&trace_lock);
+  trace_record_t *record = &trace_ring[trace_head++ % TRACE_RING_SIZE];
+  record->job_id = job_id;
+  record->span = span;
+  record->start_us = start_us;
+  record->duration_us = end_us - start_us;
+  portEXIT_CRITICAL(&trace_lock);
+}
+
+// Record a span that started at start_us and ends now, for the job of the calling task
+static inline void trace_record(trace_span_t span, int64_t start_us) {
+  trace_record(trace_task_job(), span, start_us, trace_now());
+}
+
+// Records the span from construction to destruction
+class TraceSpan {
+private:
+  trace_span_t span;
+  int64_t start_us;
+
+public:
+  TraceSpan(trace_span_t span) : span(span), start_us(trace_now()) {}
+
+  ~TraceSpan() {
+    trace_record(span, start_us);
+  }
+};
+
+// Collect what the ring still holds about job_id. Returns false if nothing is left.
+static inline bool trace_job_summary(uint32_t job_id, trace_job_summary_t *summary) {
+  memset(summary, 0, sizeof(*summary));
+  summary->job_id = job_id;
+  bool found = false;
+
+  portENTER_CRITICAL(&trace_lock);
+  for (int i = 0; i < TRACE_RING_SIZE; i++) {
+    const trace_record_t *record = &trace_ring[i];
+    if (record->job_id != job_id) {
+      continue;
+    }
+    int64_t end_us = record->start_us + record->duration_us;
+    if (!found || record->start_us < summary->first_start_us) {
+      summary->first_start_us = record->start_us;
+    }
+    if (!found || end_us > summary->last_end_us) {
+      summary->last_end_us = end_us;
+    }
+    found = true;
+    summary->count[record->span]++;
+    summary->total_us[record->span] += record->duration_us;
+    if (record->duration_us > summary->max_us[record->span]) {
+      summary->max_us[record->span] = record->duration_us;
+    }
+  }
+  portEXIT_CRITICAL(&trace_lock);
+  return found;
+}
+
+static inline void trace_log_job(uint32_t job_id) {
+  trace_job_summary_t summary;
+  if (!PRINTI_TRACE || !trace_job_summary(job_id, &summary)) {
+    return;
+  }
+  String line;
+  for (int span = 0; span < TRACE_SPAN_COUNT; span++) {
+    if (summary.count[span] > 0) {
+      line += String(" ") + TRACE_SPAN_NAMES[span] + "=" + String((uint32_t) (summary.total_us[span] / 1000)) +
+              "ms/" + String(summary.count[span]);
+    }
+  }
+  ESP_LOGI(TRACE_TAG, "Job %u took %u ms:%s", job_id,
+           (uint32_t) ((summary.last_end_us - summary.first_start_us) / 1000), line.c_str());
+}
+
+// Average cost of recording one span in nanoseconds. The records go to a job id no real job
+// gets, so they only push older spans out of the ring.
+static inline uint32_t trace_measure_overhead(int iterations = 1000) {
+  int64_t start_us = trace_now();
+  for (int i = 0; i < iterations; i++) {
+    trace_record(UINT32_MAX, TRACE_SPAN_REQUEST, start_us, trace_now());
+  }
+  return (trace_now() - start_us) * 1000 / iterations;
+}
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Row-by-row dithering of 8-bit grayscale (0 = black, 255 = white) to packed 1bpp ESC/POS raster
+// rows (MSB first, 1 = black dot). Every kernel only ever looks at the current row plus a small
+// amount of carried error, so whole images can be dithered with bounded memory as they arrive.
+
+typedef enum {
+  DITHER_FLOYD_STEINBERG,
+  DITHER_ATKINSON,
+  DITHER_BAYER,
+} dither_kernel_t;
+
+// Error diffusion carries error up to two rows down and two pixels to either side
+#define DITHER_ERROR_MARGIN 2
+
+typedef struct {
+  dither_kernel_t kernel;
+  int width;
+  int y;
+  // Error carried into the current and the next two rows, each with DITHER_ERROR_MARGIN
+  // pixels of padding on both sides so that the inner loops need no bounds checks
+  int16_t *error[3];
+  int16_t *error_buffer;
+} dither_state_t;
+
+static inline bool dither_begin(dither_state_t *state, dither_kernel_t kernel, int width) {
+  state->kernel = kernel;
+  state->width = width;
+  state->y = 0;
+  size_t row_len = width + 2 * DITHER_ERROR_MARGIN;
+  state->error_buffer = (int16_t *) calloc(3 * row_len, sizeof(int16_t));
+  for (int i = 0; i < 3; i++) {
+    state->error[i] = state->error_buffer ? state->error_buffer + i * row_len + DITHER_ERROR_MARGIN : nullptr;
+  }
+  return state->error_buffer != nullptr;
+}
+
+static inline void dither_end(dither_state_t *state) {
+  free(state->error_buffer);
+  state->error_buffer = nullptr;
+  state->error[0] = state->error[1] = state->error[2] = nullptr;
+}
+
+// Rotate the error rows after a row is done and clear the one that is now furthest ahead
+static inline void _dither_next_row(dither_state_t *state) {
+  int16_t *done = state->error[0];
+  state->error[0] = state->error[1];
+  state->error[1] = state->error[2];
+  state->error[2] = done;
+  memset(done - DITHER_ERROR_MARGIN, 0, (state->width + 2 * DITHER_ERROR_MARGIN) * sizeof(int16_t));
+  state->y++;
+}
+
+static inline void dither_floyd_steinberg_row(dither_state_t *state, const uint8_t *gray, uint8_t *out) {
+  int16_t *cur = state->error[0];
+  int16_t *next = state->error[1];
+  memset(out, 0, (state->width + 7) / 8);
+
+  for (int x = 0; x < state->width; x++) {
+    int v = gray[x] + cur[x];
+    int black = v < 128;
+    int err = black ? v : v - 255;
+    out[x >> 3] |= black << (7 - (x & 7));
+
+    cur[x + 1] += (err * 7) >> 4;
+    next[x - 1] += (err * 3) >> 4;
+    next[x] += (err * 5) >> 4;
+    next[x + 1] += err >> 4;
+  }
+  _dither_next_row(state);
+}
+
+static inline void dither_atkinson_row(dither_state_t *state, const uint8_t *gray, uint8_t *out) {
+  int16_t *cur = state->error[0];
+  int16_t *next = state->error[1];
+  int16_t *next2 = state->error[2];
+  memset(out, 0, (state->width + 7) / 8);
+
+  for (int x = 0; x < state->width; x++) {
+    int v = gray[x] + cur[x];
+    int black = v < 128;
+    // Atkinson only passes on 6/8 of the error, which keeps highlights and shadows clean
+    int err = (black ? v : v - 255) >> 3;
+    out[x >> 3] |= black << (7 - (x & 7));
+
+    cur[x + 1] += err;
+    cur[x + 2] += err;
+    next[x - 1] += err;
+    next[x] += err;
+    next[x + 1] += err;
+    next2[x] += err;
+  }
+  _dither_next_row(state);
+}
+
+// 8x8 Bayer matrix, thresholds are (index * 4 + 2) so that they spread evenly over 0-255
+static const uint8_t DITHER_BAYER_THRESHOLDS[8][8] = {
+  {  2, 130,  34, 162,  10, 138,  42, 170},
+  {194,  66, 226,  98, 202,  74, 234, 106},
+  { 50, 178,  18, 146,  58, 186,  26, 154},
+  {242, 114, 210,  82, 250, 122, 218,  90},
+  { 14, 142,  46, 174,   6, 134,  38, 166},
+  {206,  78, 238, 110, 198,  70, 230, 102},
+  { 62, 190,  30, 158,  54, 182,  22, 150},
+  {254, 126, 222,  94, 246, 118, 214,  86},
+};
+
+// Scalar reference for the ordered dither
+static inline void dither_bayer_row_scalar(dither_state_t *state, const uint8_t *gray, uint8_t *out) {
+  const uint8_t *thresholds = DITHER_BAYER_THRESHOLDS[state->y & 7];
+  memset(out, 0, (state->width + 7) / 8);
+
+  for (int x = 0; x < state->width; x++) {
+    int black = gray[x] < thresholds[x & 7];
+    out[x >> 3] |= black << (7 - (x & 7));
+  }
+  state->y++;
+}
+
+// Compare four pixels against four thresholds at once. Bytes are widened into 16-bit lanes and
+// 0x100 + threshold - gray - 1 is computed per lane, bit 8 of a lane is then set exactly when
+// gray < threshold. Returns the four results as a nibble, leftmost pixel in the highest bit.
+static inline uint8_t _dither_bayer_swar4(uint32_t gray, uint32_t thresholds) {
+  const uint32_t LANES = 0x00FF00FF;
+  // Little endian, so byte 0 is the leftmost pixel
+  uint32_t even = ((thresholds & LANES) | 0x01000100) - (gray & LANES) - 0x00010001;
+  uint32_t odd = (((thresholds >> 8) & LANES) | 0x01000100) - ((gray >> 8) & LANES) - 0x00010001;
+  return ((even >> 5) & 0x8) | ((odd >> 6) & 0x4) | ((even >> 23) & 0x2) | ((odd >> 24) & 0x1);
+}
+
+// Word-at-a-time ordered dither, must produce exactly what dither_bayer_row_scalar produces
+static inline void dither_bayer_row_swar(dither_state_t *state, const uint8_t *gray, uint8_t *out) {
+  const uint8_t *thresholds = DITHER_BAYER_THRESHOLDS[state->y & 7];
+  uint32_t t0, t1;
+  memcpy(&t0, thresholds, 4);
+  memcpy(&t1, thresholds + 4, 4);
+
+  int x = 0;
+  for (; x + 8 <= state->width; x += 8) {
+    uint32_t g0, g1;
+    memcpy(&g0, gray + x, 4);
+    memcpy(&g1, gray + x + 4, 4);
+    out[x >> 3] = (_dither_bayer_swar4(g0, t0) << 4) | _dither_bayer_swar4(g1, t1);
+  }
+
+  // Leftover pixels of a width that is not a multiple of 8
+  if (x < state->width) {
+    out[x >> 3] = 0;
+    for (; x < state->width; x++) {
+      int black = gray[x] < thresholds[x & 7];
+      out[x >> 3] |= black << (7 - (x & 7));
+    }
+  }
+  state->y++;
+}
+
+// Dither one row of state->width pixels into (width + 7) / 8 bytes of out
+static inline void dither_row(dither_state_t *state, const uint8_t *gray, uint8_t *out) {
+  switch (state->kernel) {
+    case DITHER_ATKINSON:
+      dither_atkinson_row(state, gray, out);
+      break;
+    case DITHER_BAYER:
+      dither_bayer_row_swar(state, gray, out);
+      break;
+    case DITHER_FLOYD_STEINBERG:
+    default:
+      dither_floyd_steinberg_row(state, gray, out);
+      break;
+  }
+}
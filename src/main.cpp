@@ -41,10 +41,22 @@
 #include "ESC_POS_Printer/ESC_POS_Printer.h"
 
 #include "usbh.hpp"
-#include "string_helper.h"
+#include "usbh_benchmark.hpp"
 
 #include "Printer.hpp"
+#include "ApiClient.hpp"
+#include "PushChannel.hpp"
+#include "JobPipeline.hpp"
+#include "PrinterRegistry.hpp"
+#include "PrintJob.hpp"
+#include "Trace.hpp"
+#include "EventLog.hpp"
+#include "Metrics.hpp"
+#include "Template.hpp"
+#include "Startup.hpp"
 #include "ota.hpp"
+// Generated by tools/webassets.py
+#include "webassets.h"
 
 static const char *TAG = "main";
 
@@ -57,13 +69,7 @@ extern const uint8_t config_html_end[] asm("_binary_resources_config_html_end");
 extern const uint8_t letsencrypt_pem_start[] asm("_binary_resources_letsencrypt_pem_start");
 extern const uint8_t letsencrypt_pem_end[] asm("_binary_resources_letsencrypt_pem_end");
 
-extern const uint8_t logo_svg_start[] asm("_binary_resources_logo_svg_start");
-extern const uint8_t logo_svg_end[] asm("_binary_resources_logo_svg_end");
-
-extern const uint8_t courgette_ttf_start[] asm("_binary_resources_courgette_ttf_start");
-extern const uint8_t courgette_ttf_end[] asm("_binary_resources_courgette_ttf_end");
-
-String PRINTI_API_SERVER_BASE_URL = "https://api.printi.me";
+const char *PRINTI_API_SERVER_HOST = "api.printi.me";
 
 const char *PREFERENCES_KEY_PRINTI_NAME = "printiName";
 const char *PREFERENCES_KEY_WIFI_SSID = "wifiSsid";
@@ -71,39 +77,68 @@ const char *PREFERENCES_KEY_WIFI_PASSKEY = "wifiPasskey";
 // Used to print a success message the first time we connect to a WiFi network
 // Key is abbreviated because otherwise it will crash with TOO_LONG
 const char *PREFERENCES_KEY_WIFI_PREVIOUSLY_CONNECTED = "prevConnected";
+// Access point of the last connection, to connect without scanning first
+const char *PREFERENCES_KEY_WIFI_CHANNEL = "wifiChannel";
+const char *PREFERENCES_KEY_WIFI_BSSID = "wifiBssid";
 
 const char *CONFIG_MODE_AP_SSID = "printi";
 const char *CONFIG_MODE_AP_PASSKEY = "12345678";
 
 Preferences preferences;
 
-WiFiClientSecure wifiClient;
-HTTPClient http;
+ApiClient api(PRINTI_API_SERVER_HOST);
+
+// Push mode needs server support and a second TLS connection, so it is opt-in
+#ifndef PRINTI_PUSH_MODE
+#define PRINTI_PUSH_MODE 0
+#endif
+
+// Measure what tracing and logging cost on the device at boot and log it. Off by default, it
+// delays getting online and test_benchmark measures the same on the host.
+#ifndef PRINTI_BOOT_BENCHMARKS
+#define PRINTI_BOOT_BENCHMARKS 0
+#endif
+
+// How long a pending update waits for each printer to take what was fetched for it already
+#ifndef OTA_DRAIN_TIMEOUT_MS
+#define OTA_DRAIN_TIMEOUT_MS 30000
+#endif
+
+// How long to try the cached access point before scanning for the network
+#ifndef WIFI_FAST_CONNECT_TIMEOUT_MS
+#define WIFI_FAST_CONNECT_TIMEOUT_MS 3000
+#endif
+
+#if PRINTI_PUSH_MODE
+PushChannel push(PRINTI_API_SERVER_HOST);
+// Set while jobs may still be waiting in the queue and should be fetched without waiting for a push
+bool push_drain_queue = true;
+#endif
 
 WebServer *server;
 
 // TODO(Leon Handreke): USB handling is a fucking mess, there should not be three files that this is scattered over
 // Needs much better separation of concerns!
-uint8_t bInterfaceNumber;
-uint8_t bInEndpointAddress;
-uint8_t bOutEndpointAddress;
-
-Printer *printer = NULL;
-// ESC_POS_Printer is just a thin wrapper around Printer to implement some printer controll commands.
-ESC_POS_Printer *esc_pos_printer = NULL;
+// Every attached printer, jobs are spread over them. The primary one, which is acquired with
+// printers.primary() and released again, also gets all status messages. A printer is torn down
+// when the last user releases it, then its device is closed.
+PrinterRegistry printers(usbh_close_device);
 
 bool otaUpdateInProgress = false;
 bool configModeInProgress = false;
 
-typedef enum {
-  ORIGINAL_PRINTI,
-  XIAMEN_BETTER_LITTLE_BLUE_CUTIE,
-} printer_type_t;
-
-printer_type_t printer_type = ORIGINAL_PRINTI;
+// Call f with the primary printer, if there is one, which can't be torn down meanwhile
+template<typename F>
+void withPrimaryPrinter(F f) {
+  printer_slot_t *slot = printers.primary();
+  if (slot != nullptr) {
+    f(slot);
+    printers.release(slot);
+  }
+}
 
 
-void usb_new_device_cb(const usb_host_client_handle_t client_hdl, const usb_device_handle_t dev_hdl) {
+bool usb_new_device_cb(const usb_host_client_handle_t client_hdl, const usb_device_handle_t dev_hdl) {
   const usb_standard_desc_t *cur_desc;
   int cur_desc_offset;
 
@@ -120,7 +155,7 @@ void usb_new_device_cb(const usb_host_client_handle_t client_hdl, const usb_devi
 
     if (cur_desc == NULL) {
       ESP_LOGI(TAG, "Interface Descriptor not found");
-      return;
+      return false;
     }
 
     usb_intf_desc_t *intf_desc = (usb_intf_desc_t *) cur_desc;
@@ -138,8 +173,8 @@ void usb_new_device_cb(const usb_host_client_handle_t client_hdl, const usb_devi
     printer_intf_desc->bAlternateSetting));
 
 
-  const usb_ep_desc_t *in_ep_desc;
-  const usb_ep_desc_t *out_ep_desc;
+  const usb_ep_desc_t *in_ep_desc = nullptr;
+  const usb_ep_desc_t *out_ep_desc = nullptr;
   // Find the printer outgoing endpoint
   for (int i = 0; i < printer_intf_desc->bNumEndpoints; i++) {
     // Strangely, usb_parse_endpoint_descriptor_by_index insists on giving back the offset of the endpoint descriptor
@@ -159,32 +194,29 @@ void usb_new_device_cb(const usb_host_client_handle_t client_hdl, const usb_devi
     }
   }
 
-  if (in_ep_desc != nullptr && out_ep_desc != nullptr) {
-    bInterfaceNumber = printer_intf_desc->bInterfaceNumber;
-    bInEndpointAddress = in_ep_desc->bEndpointAddress;
-    bOutEndpointAddress = out_ep_desc->bEndpointAddress;
-
-    printer = new Printer(dev_hdl, in_ep_desc, out_ep_desc);
-    esc_pos_printer = new ESC_POS_Printer(printer);
-  }
-
+  printer_type_t type = ORIGINAL_PRINTI;
   const usb_device_desc_t *dev_desc;
   ESP_ERROR_CHECK(usb_host_get_device_descriptor(dev_hdl, &dev_desc));
   if (dev_desc->idVendor == 0x28e9 && dev_desc->idProduct == 0x289) {
     ESP_LOGI(TAG, "Detected XIAMEN_BETTER_LITTLE_BLUE_CUTIE printer");
-    printer_type = XIAMEN_BETTER_LITTLE_BLUE_CUTIE;
+    type = XIAMEN_BETTER_LITTLE_BLUE_CUTIE;
   }
+
+  printer_slot_t *slot = nullptr;
+  if (in_ep_desc != nullptr && out_ep_desc != nullptr) {
+    slot = printers.add(client_hdl, dev_hdl, printer_intf_desc->bInterfaceNumber, in_ep_desc, out_ep_desc, type);
+  }
+  if (slot == nullptr) {
+    usb_host_interface_release(client_hdl, dev_hdl, printer_intf_desc->bInterfaceNumber);
+    return false;
+  }
+  startup_end(STARTUP_STAGE_PRINTER);
+  return true;
 }
 
+// The interface is released and the device closed once the printer is torn down
 void usb_device_gone_cb(const usb_host_client_handle_t client_hdl, const usb_device_handle_t dev_hdl) {
-  delete printer;
-  printer = nullptr;
-
-  usb_host_endpoint_halt(dev_hdl, bInEndpointAddress);
-  usb_host_endpoint_halt(dev_hdl, bOutEndpointAddress);
-  usb_host_endpoint_flush(dev_hdl, bInEndpointAddress);
-  usb_host_endpoint_flush(dev_hdl, bOutEndpointAddress);
-  usb_host_interface_release(client_hdl, dev_hdl, bInterfaceNumber);
+  printers.remove(dev_hdl);
 }
 
 String getMacString() {
@@ -204,8 +236,11 @@ String getPrintiName() {
 }
 
 void stopPrinter() {
-  delete printer;
-  printer = nullptr;
+  for (printer_slot_t *slot = printers.primary(); slot != nullptr; slot = printers.primary()) {
+    usb_device_handle_t dev_hdl = slot->dev_hdl;
+    printers.release(slot);
+    printers.remove(dev_hdl);
+  }
 }
 
 void _handleOtaUploadLoop(void *pvParameters) {
@@ -281,12 +316,14 @@ void _configServerLoop(void *pvParameters) {
     server->handleClient();
     vTaskDelay(50);
 
-    if (!printed_startup_message && printer != nullptr && esc_pos_printer != nullptr) {
+    printer_slot_t *slot = printed_startup_message ? nullptr : printers.primary();
+    if (slot != nullptr) {
       ESP_LOGI(TAG, "Print config server startup message");
+      ESC_POS_Printer *esc_pos_printer = slot->esc_pos_printer;
 
       const char *image = (const char *) logo_h58_start;
       size_t image_len = logo_h58_end - logo_h58_start;
-      printer->write((const uint8_t *) image, image_len);
+      slot->job_pipeline->write((const uint8_t *) image, image_len);
 
       esc_pos_printer->println("");
       esc_pos_printer->println("=> Step 1:");
@@ -311,6 +348,8 @@ void _configServerLoop(void *pvParameters) {
       esc_pos_printer->println("");
       esc_pos_printer->println("");
       esc_pos_printer->println("");
+      esc_pos_printer->commit();
+      printers.release(slot);
 
       printed_startup_message = true;
     }
@@ -334,26 +373,18 @@ void startConfigServer() {
   server->on("/", HTTP_GET, []() -> void {
     ESP_LOGI(TAG, "on /");
 
-    size_t config_html_len = config_html_end - config_html_start;
-    char *config_html = (char *) malloc(sizeof(char) * (config_html_len + 1));
-    memcpy(config_html, config_html_start, config_html_len);
-    config_html[config_html_len] = '\0';
-
-    strreplace(config_html,
-               "{{PRINTI_NAME}}",
-               preferences.getString(PREFERENCES_KEY_PRINTI_NAME).c_str());
-    strreplace(config_html,
-               "{{PRINTI_NAME_TITLE}}",
-               preferences.getString(PREFERENCES_KEY_PRINTI_NAME).c_str());
-    strreplace(config_html,
-               "{{SSID}}",
-               preferences.getString(PREFERENCES_KEY_WIFI_SSID).c_str());
-    strreplace(config_html,
-               "{{PASSKEY}}",
-               preferences.getString(PREFERENCES_KEY_WIFI_PASSKEY).c_str());
-
-    server->send(200, "text/html", (const char *) config_html);
-    free(config_html);
+    static Template config_template((const char *) config_html_start, config_html_end - config_html_start);
+    config_template.send(*server, 200, "text/html", [](const char *name) -> String {
+      if (strcmp(name, "PRINTI_NAME") == 0 || strcmp(name, "PRINTI_NAME_TITLE") == 0) {
+        return preferences.getString(PREFERENCES_KEY_PRINTI_NAME);
+      } else if (strcmp(name, "SSID") == 0) {
+        return preferences.getString(PREFERENCES_KEY_WIFI_SSID);
+      } else if (strcmp(name, "PASSKEY") == 0) {
+        return preferences.getString(PREFERENCES_KEY_WIFI_PASSKEY);
+      }
+      ESP_LOGW(TAG, "Unknown placeholder %s in config page", name);
+      return String();
+    });
   });
   server->on("/", HTTP_POST, []() -> void {
     ESP_LOGI(TAG, "on POST /");
@@ -374,12 +405,23 @@ void startConfigServer() {
     server->send(200, "text/plain", "pong");
   });
   
-  server->on("/logo.svg", HTTP_GET, []() -> void {
-    server->send_P(200, PSTR("image/svg+xml"), (const char *) logo_svg_start, logo_svg_end - logo_svg_start);
-  });
-  server->on("/courgette.ttf", HTTP_GET, []() -> void {
-    server->send_P(200, PSTR("font/ttf"), (const char *) courgette_ttf_start, courgette_ttf_end - courgette_ttf_start);
-  });
+  for (size_t i = 0; i < WEB_ASSET_COUNT; i++) {
+    const webasset_t *asset = &WEB_ASSETS[i];
+    server->on(asset->path, HTTP_GET, [asset]() -> void {
+      server->sendHeader("ETag", asset->etag);
+      // Revalidated after a day, which only costs a 304 unless a firmware update changed it
+      server->sendHeader("Cache-Control", "public, max-age=86400");
+      if (server->header("If-None-Match") == asset->etag) {
+        server->send(304);
+        return;
+      }
+      // Stored compressed only, every browser that can show the page accepts gzip
+      server->sendHeader("Content-Encoding", "gzip");
+      server->send_P(200, asset->content_type, (const char *) asset->data, asset->len);
+    });
+  }
+  static const char *request_headers[] = {"If-None-Match"};
+  server->collectHeaders(request_headers, 1);
   
     
 
@@ -422,6 +464,138 @@ void startButtonHandler() {
   );
 }
 
+void collectMetrics(MetricsWriter &metrics) {
+  const api_client_stats_t &api_stats = api.getStats();
+  metrics.family("printi_polls_total", "counter", "Requests made to the printi server");
+  metrics.value("printi_polls_total", api_stats.requests);
+  metrics.family("printi_poll_duration_ms_sum", "counter", "Total time spent in requests to the printi server");
+  metrics.value("printi_poll_duration_ms_sum", api_stats.total_request_ms);
+  metrics.family("printi_poll_duration_ms_max", "gauge", "Slowest request to the printi server");
+  metrics.value("printi_poll_duration_ms_max", api_stats.max_request_ms);
+  metrics.family("printi_poll_duration_ms_last", "gauge", "Duration of the last request to the printi server");
+  metrics.value("printi_poll_duration_ms_last", api_stats.last_request_ms);
+  metrics.family("printi_tls_handshakes_total", "counter", "Connections opened to the printi server");
+  metrics.value("printi_tls_handshakes_total", api_stats.handshakes);
+  metrics.family("printi_dns_lookups_total", "counter", "Lookups of the printi server address");
+  metrics.value("printi_dns_lookups_total", api_stats.dns_lookups);
+
+  const startup_stats_t &startup = startup_get_stats();
+  if (startup.ready_ms != 0) {
+    metrics.family("printi_boot_to_ready_ms", "gauge", "Time from boot until the first job was asked for");
+    metrics.value("printi_boot_to_ready_ms", startup.ready_ms);
+  }
+  metrics.family("printi_startup_stage_ms", "gauge", "Time a boot stage took");
+  for (int stage = 0; stage < STARTUP_STAGE_COUNT; stage++) {
+    if (startup.end_ms[stage] != 0) {
+      char labels[32];
+      snprintf(labels, sizeof(labels), "stage=\"%s\"", STARTUP_STAGE_NAMES[stage]);
+      metrics.value("printi_startup_stage_ms", labels, startup.end_ms[stage] - startup.start_ms[stage]);
+    }
+  }
+
+  metrics.family("printi_printers", "gauge", "Attached printers");
+  metrics.value("printi_printers", printers.count());
+
+  // One family at a time, Prometheus wants the samples of a family together
+  struct printer_metric_t {
+    const char *name;
+    const char *type;
+    const char *help;
+    double (*get)(printer_slot_t *slot);
+  };
+  static const printer_metric_t printer_metrics[] = {
+    {"printi_jobs_printed_total", "counter", "Jobs printed",
+     [](printer_slot_t *slot) -> double { return slot->job_pipeline->getStats().jobs; }},
+    {"printi_usb_bytes_total", "counter", "Bytes sent to the printer over USB",
+     [](printer_slot_t *slot) -> double { return slot->job_pipeline->getStats().bytes; }},
+    {"printi_job_queue_blocks", "gauge", "Blocks waiting in the job pipeline",
+     [](printer_slot_t *slot) -> double { return slot->job_pipeline->queued(); }},
+    {"printi_job_queue_blocks_max", "gauge", "Most blocks ever waiting in the job pipeline",
+     [](printer_slot_t *slot) -> double { return slot->job_pipeline->getStats().max_queued; }},
+    {"printi_job_backpressure_ms_total", "counter", "Time fetching waited for the printer to catch up",
+     [](printer_slot_t *slot) -> double { return slot->job_pipeline->getStats().backpressure_ms; }},
+    {"printi_last_job_print_ms", "gauge", "Time the last job took to go out to the printer",
+     [](printer_slot_t *slot) -> double { return slot->job_pipeline->getStats().last_job_print_ms; }},
+    {"printi_usb_transfer_retries_total", "counter", "USB transfers that failed and were resubmitted",
+     [](printer_slot_t *slot) -> double { return slot->printer->getStats().transfer_retries; }},
+    {"printi_usb_bytes_dropped_total", "counter", "Bytes lost to USB transfers that kept failing",
+     [](printer_slot_t *slot) -> double { return slot->printer->getStats().bytes_dropped; }},
+    {"printi_usb_transfer_wait_timeouts_total", "counter", "Times writing waited 1000 ticks for a free transfer",
+     [](printer_slot_t *slot) -> double { return slot->printer->getStats().transfer_wait_timeouts; }},
+    {"printi_printer_blocked_ms_total", "counter", "Time data was held back because the printer was not ready",
+     [](printer_slot_t *slot) -> double { return slot->printer->getStats().blocked_ms; }},
+    {"printi_printer_paced_ms_total", "counter", "Time data was held back to not overflow the printer buffer",
+     [](printer_slot_t *slot) -> double { return slot->printer->getStats().paced_ms; }},
+    {"printi_printer_drain_rate_bytes_per_second", "gauge", "Learned rate at which the printer prints data",
+     [](printer_slot_t *slot) -> double { return slot->printer->getStats().drain_rate; }},
+    {"printi_printer_ready", "gauge", "Whether the printer can print right now",
+     [](printer_slot_t *slot) -> double { return slot->printer->getState() == PRINTER_STATE_READY; }},
+  };
+  char labels[32];
+  for (const printer_metric_t &metric : printer_metrics) {
+    metrics.family(metric.name, metric.type, metric.help);
+    printers.forEach([&](printer_slot_t *slot) {
+      snprintf(labels, sizeof(labels), "printer=\"%s\"", slot->name.c_str());
+      metrics.value(metric.name, labels, metric.get(slot));
+    });
+  }
+
+  char state_labels[64];
+  metrics.family("printi_printer_state_transitions_total", "counter", "Times the printer entered a state");
+  printers.forEach([&](printer_slot_t *slot) {
+    for (int state = 0; state < PRINTER_STATE_COUNT; state++) {
+      snprintf(state_labels, sizeof(state_labels), "printer=\"%s\",state=\"%s\"", slot->name.c_str(),
+               printer_state_name((printer_state_t) state));
+      metrics.value("printi_printer_state_transitions_total", state_labels,
+                    slot->printer->getStats().transitions[state]);
+    }
+  });
+}
+
+MetricsServer metrics_server(collectMetrics);
+
+// The metrics server starts with the first address, whether connectWifi() got it or one of the
+// reconnects in loop() did. Runs on the WiFi event task, begin() only starts the server task.
+void onWifiGotIp(arduino_event_id_t event, arduino_event_info_t info) {
+  metrics_server.begin();
+}
+
+// Connect to the configured network, directly to the access point of the last connection if
+// there was one and with a scan for the network otherwise
+void connectWifi() {
+  String wifiSsid = preferences.getString(PREFERENCES_KEY_WIFI_SSID, "");
+  String wifiPasskey = preferences.getString(PREFERENCES_KEY_WIFI_PASSKEY, "");
+
+  uint8_t bssid[6] = {};
+  int32_t channel = preferences.getInt(PREFERENCES_KEY_WIFI_CHANNEL, 0);
+  bool cached = channel > 0 && preferences.getBytes(PREFERENCES_KEY_WIFI_BSSID, bssid, sizeof(bssid)) == sizeof(bssid);
+  if (cached) {
+    ESP_LOGI(TAG, "WiFi begin on channel %d", channel);
+    WiFi.begin(wifiSsid.c_str(), wifiPasskey.c_str(), channel, bssid);
+    if (WiFi.waitForConnectResult(WIFI_FAST_CONNECT_TIMEOUT_MS) != WL_CONNECTED) {
+      ESP_LOGW(TAG, "Last access point not there, scanning for %s", wifiSsid.c_str());
+      WiFi.disconnect();
+      cached = false;
+    }
+  }
+  if (!cached) {
+    ESP_LOGI(TAG, "WiFi begin");
+    WiFi.begin(wifiSsid.c_str(), wifiPasskey.c_str());
+    if (WiFi.waitForConnectResult() != WL_CONNECTED) {
+      return;
+    }
+  }
+
+  ESP_LOGI(TAG, "WiFi connected: %s BSSID %s", WiFi.localIP().toString().c_str(),
+           WiFi.BSSIDstr().c_str());
+
+  // Only written when it changed, to spare the flash
+  if (WiFi.channel() != channel || memcmp(WiFi.BSSID(), bssid, sizeof(bssid)) != 0) {
+    preferences.putInt(PREFERENCES_KEY_WIFI_CHANNEL, WiFi.channel());
+    preferences.putBytes(PREFERENCES_KEY_WIFI_BSSID, WiFi.BSSID(), sizeof(bssid));
+  }
+}
+
 void setup() {
   esp_log_level_set("*", ESP_LOG_VERBOSE);
 
@@ -437,14 +611,10 @@ void setup() {
 
   startButtonHandler();
 
-  TaskHandle_t usb_host_driver_task_hdl;
-  void *params[] = {(void *) usb_new_device_cb, (void *) usb_device_gone_cb};
-  xTaskCreate(usbh_task,
-              "usb_host_driver",
-              4096,
-              (void *) params,
-              0,
-              &usb_host_driver_task_hdl);
+  event_log_begin();
+  // Ends when the first printer is attached
+  startup_begin(STARTUP_STAGE_PRINTER);
+  usbh_begin(usb_new_device_cb, usb_device_gone_cb);
 
   WiFi.mode(WIFI_STA);
   WiFi.setSleep(WIFI_PS_NONE);
@@ -457,42 +627,56 @@ void setup() {
     hostname = hostname + "-" + getPrintiName().c_str();
   }
   WiFi.setHostname(hostname.c_str());
-  // Redo WiFi config every time, costs a bit of startup time but avoids locking to one BSSID
+  // Don't let the WiFi driver store its config, connectWifi() keeps its own cache of the access
+  // point and falls back to a scan, so it isn't locked to one BSSID
   WiFi.persistent(false);
 
-  String wifiSsid = preferences.getString(PREFERENCES_KEY_WIFI_SSID, "");
-  String wifiPasskey = preferences.getString(PREFERENCES_KEY_WIFI_PASSKEY, "");
-
-  if (wifiSsid == "") {
+  bool station_mode = preferences.getString(PREFERENCES_KEY_WIFI_SSID, "") != "";
+  if (!station_mode) {
     ESP_LOGI(TAG, "Stored WiFi SSID is empty, starting config server");
     startConfigServer();
   } else {
-    ESP_LOGI(TAG, "WiFi begin");
-    WiFi.begin(wifiSsid.c_str(), wifiPasskey.c_str());
-
-    for (int i = 5; i <= 5; i++) {
-      if (WiFi.waitForConnectResult() == WL_CONNECTED) {
-        ESP_LOGI(TAG, "WiFi connected: %s BSSID %s", WiFi.localIP().toString().c_str(),
-                 WiFi.BSSIDstr().c_str());
-        break;
-      }
-    }
+    WiFi.onEvent(onWifiGotIp, ARDUINO_EVENT_WIFI_STA_GOT_IP);
+    // Associating takes longest, everything below runs meanwhile
+    startup_run(STARTUP_STAGE_WIFI, connectWifi, 6144);
   }
 
   //startOtaUploadService();
 
-  // TODO(Leon Handreke): Proper https
-  wifiClient.setInsecure();
+  startup_begin(STARTUP_STAGE_CA_STORE);
+  api.begin();
   esp_tls_init_global_ca_store();
   //const unsigned int letsencrypt_pem_len = ((char*) letsencrypt_pem_end) - ((char*) letsencrypt_pem_start);
   ESP_ERROR_CHECK(
     esp_tls_set_global_ca_store(letsencrypt_pem_start, letsencrypt_pem_end-letsencrypt_pem_start));
   //ESP_ERROR_CHECK(esp_tls_set_global_ca_store((const unsigned char*) LETSENCRYPT_CA_CERT, strlen(LETSENCRYPT_CA_CERT) + 1));
-
-  checkForOTA("https://ndreke.de/~leon/dump/printi-firmware.bin", 5000, nullptr, true);
+  startup_end(STARTUP_STAGE_CA_STORE);
+
+  startOtaChecks("https://ndreke.de/~leon/dump/printi-firmware.bin", 5000, nullptr, true);
+
+#if PRINTI_BOOT_BENCHMARKS
+  ESP_LOGI(TAG, "Recording a trace span takes %u ns", trace_measure_overhead());
+  uint32_t esp_log_ns, event_ns;
+  event_log_benchmark(&esp_log_ns, &event_ns);
+  ESP_LOGI(TAG, "Logging per USB transfer took %u ns with ESP_LOGI, takes %u ns with the event log",
+           esp_log_ns, event_ns);
+  usbh_wait_stats_t polling, blocking;
+  usbh_wait_benchmark(false, &polling);
+  usbh_wait_benchmark(true, &blocking);
+  ESP_LOGI(TAG, "Polling USB events every tick woke up %u times/s while idle, latency avg %u us max %u us",
+           polling.idle_wakeups, polling.latency_avg_us, polling.latency_max_us);
+  ESP_LOGI(TAG, "Blocking on USB events wakes up %u times/s while idle, latency avg %u us max %u us",
+           blocking.idle_wakeups, blocking.latency_avg_us, blocking.latency_max_us);
+#endif
+
+  // loop() reconnects whenever WiFi is down, which must not interrupt the first connect. That
+  // gives up after the fast connect and the 60 s that waitForConnectResult() waits by default.
+  if (station_mode && !startup_wait(STARTUP_STAGE_WIFI, WIFI_FAST_CONNECT_TIMEOUT_MS + 61 * 1000)) {
+    ESP_LOGW(TAG, "WiFi still not connected, leaving it to the main loop");
+  }
 }
 
-void printWifiConnectionInstructions() {
+void printWifiConnectionInstructions(ESC_POS_Printer *esc_pos_printer) {
   ESP_LOGI(TAG, "Printing WiFi connection instructions");
 
   esc_pos_printer->println("This printi is not connected to the internet :(");
@@ -502,23 +686,13 @@ void printWifiConnectionInstructions() {
   esc_pos_printer->println("printi, press the button labeled");
   esc_pos_printer->println("\"0\" to enter configuration mode.");
   esc_pos_printer->println("");
+  esc_pos_printer->commit();
 }
 
-void printPrintiServerErrorMessage() {
+void printPrintiServerErrorMessage(ESC_POS_Printer *esc_pos_printer) {
   ESP_LOGI(TAG, "Printing printi server error message");
   esc_pos_printer->println("Error: cannot reach printi server.");
-}
-
-bool canReach(String url) {
-  http.begin(wifiClient, url);
-  wifiClient.setInsecure();
-  http.setTimeout(10 * 1000);
-  int response_code = http.GET();
-  if (response_code == 200) {
-    return true;
-  } else {
-    return false;
-  }
+  esc_pos_printer->commit();
 }
 
 typedef enum {
@@ -549,7 +723,27 @@ void loop() {
     return;
   }
 
-  if (printer == nullptr) {
+  // Between jobs, whatever was fetched already goes out to the printers that can take it before
+  // the restart. A printer that is unplugged meanwhile is only torn down once released here.
+  if (otaUpdatePending() && WiFi.status() == WL_CONNECTED) {
+    // No new jobs are fetched from here on
+    uint32_t printing_stopped_ms = millis();
+    printer_slot_t *slots[PRINTER_REGISTRY_MAX_PRINTERS];
+    size_t count = printers.acquireAll(slots);
+    for (size_t i = 0; i < count; i++) {
+      if (slots[i]->printer->getState() != PRINTER_STATE_READY) {
+        ESP_LOGW(TAG, "Printer %s is %s, not waiting for it before the update", slots[i]->name.c_str(),
+                 printer_state_name(slots[i]->printer->getState()));
+      } else if (!slots[i]->job_pipeline->drain(OTA_DRAIN_TIMEOUT_MS)) {
+        ESP_LOGW(TAG, "Printer %s still printing after %u ms, updating anyway", slots[i]->name.c_str(),
+                 OTA_DRAIN_TIMEOUT_MS);
+      }
+      printers.release(slots[i]);
+    }
+    applyPendingOTA(printing_stopped_ms);
+  }
+
+  if (printers.count() == 0) {
     vTaskDelay(500);
     return;
   }
@@ -558,18 +752,90 @@ void loop() {
     set_printi_error_state(PRINTI_STATE_NO_WIFI);
     time_t error_state_duration = time(NULL) - printi_error_state_since;
     if (!printi_error_state_message_printed && error_state_duration > (10 * 60)) {
-      printWifiConnectionInstructions();
+      withPrimaryPrinter([](printer_slot_t *slot) { printWifiConnectionInstructions(slot->esc_pos_printer); });
       printi_error_state_message_printed = true;
     }
     WiFi.reconnect();
     return;
   }
 
-  if (!canReach(PRINTI_API_SERVER_BASE_URL)) {
+  // Print welcome image
+  if (!printed_startup_image) {
+    withPrimaryPrinter([](printer_slot_t *slot) {
+      const char *image = (const char *) logo_h58_start;
+      size_t image_len = logo_h58_end - logo_h58_start;
+      ESP_LOGI(TAG, "Print startup image");
+      slot->job_pipeline->write((const uint8_t *) image, image_len);
+      //printWifiConnectionInstructions();
+    });
+
+    printed_startup_image = true;
+  }
+
+  // Print a connected message the first time we connect to a WiFi network
+  if (!preferences.getBool(PREFERENCES_KEY_WIFI_PREVIOUSLY_CONNECTED, false)) {
+    preferences.putBool(PREFERENCES_KEY_WIFI_PREVIOUSLY_CONNECTED, true);
+
+    withPrimaryPrinter([](printer_slot_t *slot) {
+      ESC_POS_Printer *esc_pos_printer = slot->esc_pos_printer;
+      esc_pos_printer->println("Connected lol! Go to: ");
+      esc_pos_printer->print("  printi.me/");
+      esc_pos_printer->println(getPrintiName());
+      esc_pos_printer->println("");
+      esc_pos_printer->println("");
+      esc_pos_printer->println("");
+      esc_pos_printer->commit();
+    });
+  }
+
+  // Leave jobs on the server while the printer can't print them, instead of losing them to an
+  // empty paper roll
+  if (!printers.anyReady()) {
+    ESP_LOGI(TAG, "No printer ready, not fetching jobs");
+    vTaskDelay(1000);
+    return;
+  }
+
+  uint32_t poll_timeout_ms = 40 * 1000;
+#if PRINTI_PUSH_MODE
+  if (push.isOpen() || push.open("/events/" + getPrintiName())) {
+    // Wait for the server to announce a job instead of holding a long poll open
+    if (!push_drain_queue && !push.waitForJob(40 * 1000)) {
+      if (push.isOpen()) {
+        // Nothing announced in time, keep waiting on the channel
+        return;
+      }
+      // Channel dropped, an announcement may have gone with it, so poll until the queue is empty
+      push_drain_queue = true;
+      return;
+    }
+    poll_timeout_ms = 10 * 1000;
+  } else {
+    // Without a channel we don't know what was announced, so drain once the channel is back
+    push_drain_queue = true;
+  }
+#endif
+
+  // Every poll is traced as a job, polls that come back empty just age out of the trace ring
+  startup_ready();
+  uint32_t trace_job = trace_begin_job();
+  int response_code = api.get("/nextinqueue/" + getPrintiName(), poll_timeout_ms);
+  HTTPClient &http = api.response();
+
+  // USB cable may have been unplugged since we started the request
+  if (printers.count() == 0) {
+    api.end();
+    return;
+  }
+
+  // Whether the server is reachable follows from the outcome of the poll itself
+  if (ApiClient::isConnectionError(response_code)) {
+    ESP_LOGI(TAG, "Cannot reach printi server: %s", http.errorToString(response_code).c_str());
+    api.end();
     set_printi_error_state(PRINTI_STATE_CANNOT_REACH_SERVER);
     time_t error_state_duration = time(NULL) - printi_error_state_since;
     if (!printi_error_state_message_printed && error_state_duration > (10 * 60)) {
-      printPrintiServerErrorMessage();
+      withPrimaryPrinter([](printer_slot_t *slot) { printPrintiServerErrorMessage(slot->esc_pos_printer); });
       printi_error_state_message_printed = true;
     }
     return;
@@ -583,65 +849,48 @@ void loop() {
     // If not, it was just a transient error that users don't have to know about.
     if (printi_error_state_message_printed) {
       ESP_LOGI(TAG, "Print Connected to printi.me message");
-      esc_pos_printer->println("Connected! Go to: ");
-      esc_pos_printer->print("  printi.me/");
-      esc_pos_printer->println(getPrintiName());
+      withPrimaryPrinter([](printer_slot_t *slot) {
+        slot->esc_pos_printer->println("Connected! Go to: ");
+        slot->esc_pos_printer->print("  printi.me/");
+        slot->esc_pos_printer->println(getPrintiName());
+        slot->esc_pos_printer->commit();
+      });
     }
 
     set_printi_error_state(PRINTI_STATE_HEALTHY);
     printi_error_state_message_printed = true;
   }
 
-
-  // Print welcome image
-  if (!printed_startup_image) {
-    const char *image = (const char *) logo_h58_start;
-    size_t image_len = logo_h58_end - logo_h58_start;
-    ESP_LOGI(TAG, "Print startup image");
-    printer->write((const uint8_t *) image, image_len);
-    //printWifiConnectionInstructions();
-
-    printed_startup_image = true;
-  }
-
-  // Print a connected message the first time we connect to a WiFi network
-  if (!preferences.getBool(PREFERENCES_KEY_WIFI_PREVIOUSLY_CONNECTED, false)) {
-    preferences.putBool(PREFERENCES_KEY_WIFI_PREVIOUSLY_CONNECTED, true);
-
-    esc_pos_printer->println("Connected lol! Go to: ");
-    esc_pos_printer->print("  printi.me/");
-    esc_pos_printer->println(getPrintiName());
-    esc_pos_printer->println("");
-    esc_pos_printer->println("");
-    esc_pos_printer->println("");
-  }
-
-  String url = PRINTI_API_SERVER_BASE_URL + "/nextinqueue/" + getPrintiName();
-  http.begin(wifiClient, url);
-  wifiClient.setInsecure();
-  http.setTimeout(40 * 1000);
-  int response_code = http.GET();
-
-  // USB cable may have been unplugged since we started the request
-  if (printer == nullptr) {
-    return;
-  }
-
   if (response_code == 200) {
-    String response = http.getString();
-    ESP_LOGI(TAG, "reponse length %d", response.length());
-
-    printer->write((const uint8_t *) response.c_str(), response.length());
-
-    esc_pos_printer->println("");
-    esc_pos_printer->println("");
-    esc_pos_printer->println("");
-    if (printer_type == XIAMEN_BETTER_LITTLE_BLUE_CUTIE) {
-      esc_pos_printer->println("");
+    if (!print_job(printers, http, trace_job)) {
+      api.end();
+      return;
     }
   } else {
     ESP_LOGI(TAG, "HTTP response code: %x", response_code);
   }
+  api.end();
+
+#if PRINTI_PUSH_MODE
+  // Keep fetching while there are jobs, then go back to waiting for announcements
+  push_drain_queue = response_code == 200;
+#endif
+
+  const api_client_stats_t &stats = api.getStats();
+  ESP_LOGD(TAG, "Poll took %u ms, %u handshakes over %u requests",
+           stats.last_request_ms, stats.handshakes, stats.requests);
+  withPrimaryPrinter([](printer_slot_t *slot) {
+    const job_pipeline_stats_t &pipeline_stats = slot->job_pipeline->getStats();
+    ESP_LOGD(TAG, "%u jobs printed, %u blocks queued, producer waited %u ms for the printer",
+             pipeline_stats.jobs, slot->job_pipeline->queued(), pipeline_stats.backpressure_ms);
+    const printer_stats_t &printer_stats = slot->printer->getStats();
+    ESP_LOGD(TAG, "Printer %s, blocked %u ms, %u times out of paper",
+             printer_state_name(slot->printer->getState()), printer_stats.blocked_ms,
+             printer_stats.transitions[PRINTER_STATE_PAPER_OUT]);
+    ESP_LOGD(TAG, "Printer drains %u B/s, done in about %u ms, paced %u ms, %u bytes lost",
+             printer_stats.drain_rate, slot->printer->estimatedCompletionMs(slot->job_pipeline->queuedBytes()),
+             printer_stats.paced_ms, printer_stats.bytes_dropped);
+  });
 
   vTaskDelay(10);
 }
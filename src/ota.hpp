@@ -1,15 +1,68 @@
 #pragma once
 
 #include <Arduino.h>
+#include <WiFi.h>
 
-#include "esp_https_ota.h"
+#include "esp_http_client.h"
 #include "esp_image_format.h"
 #include "esp_ota_ops.h"
 
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+
 #include <string.h>
 
+#include "DeltaPatch.hpp"
+#include "InflatePrint.hpp"
+
 static const char *HTTP_OTA_TAG = "HTTP OTA";
 
+// Time between checks for a new image. Each wait is stretched by up to a quarter at random, so
+// a fleet that booted together doesn't keep asking at the same moment.
+#ifndef OTA_CHECK_INTERVAL_MS
+#define OTA_CHECK_INTERVAL_MS (60 * 60 * 1000)
+#endif
+
+// The first check after boot, late enough to not compete with fetching the first job
+#ifndef OTA_CHECK_FIRST_MS
+#define OTA_CHECK_FIRST_MS (30 * 1000)
+#endif
+
+// Flash is written in blocks of this size, a multiple of the 4 KiB sector. Two are allocated for
+// the duration of an update.
+#ifndef OTA_WRITE_BLOCK_SIZE
+#define OTA_WRITE_BLOCK_SIZE (16 * 1024)
+#endif
+
+// Receive buffer of the HTTP client, big enough for a full TLS record to be read at once
+#ifndef OTA_HTTP_BUFFER_SIZE
+#define OTA_HTTP_BUFFER_SIZE 4096
+#endif
+
+#ifndef OTA_WRITE_TASK_PRIORITY
+#define OTA_WRITE_TASK_PRIORITY 5
+#endif
+
+#ifndef OTA_CHECK_TASK_PRIORITY
+#define OTA_CHECK_TASK_PRIORITY 1
+#endif
+
+// The app descriptor, which holds the version, follows the image header and the header of the
+// first segment
+static const size_t OTA_APP_DESC_OFFSET = sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t);
+
+static struct {
+  const char *url;
+  int timeout_ms;
+  const char *server_pem;
+  bool skip_cert_common_name_check;
+  // Of the image when it was last found to be the running version
+  String etag;
+  volatile bool update_pending;
+  TaskHandle_t task;
+} ota_check;
+
 
 static inline bool needUpdate(esp_app_desc_t *new_app_info) {
   if (new_app_info == NULL) {
@@ -28,7 +81,317 @@ static inline bool needUpdate(esp_app_desc_t *new_app_info) {
   return true;
 }
 
-void checkForOTA(
+typedef struct {
+  size_t bytes;
+  // From the first byte written until everything was on flash
+  uint32_t total_ms;
+  // Time the writer task spent in esp_ota_write, including erasing
+  uint32_t flash_ms;
+  // Time write() waited for a free block because flash was behind
+  uint32_t backpressure_ms;
+} ota_write_stats_t;
+
+// Writes an image to the OTA partition that isn't running. Data is collected into one of two
+// blocks while a writer task puts the other one on flash, so the download never waits for a
+// flash write unless flash is the slower of the two. Blocks are whole sectors, so flash is
+// programmed in a few large writes instead of one per TLS record.
+//
+// The partition is only erased once the first block is full, so a patch that turns out to be
+// useless doesn't cost an erase.
+class OtaPartitionPrint : public Print {
+private:
+  typedef struct {
+    uint8_t *data;
+    size_t len;
+  } ota_block_t;
+
+  const esp_partition_t *partition;
+  size_t image_size;
+  esp_ota_handle_t handle = 0;
+  bool started = false;
+  volatile bool write_failed = false;
+
+  size_t block_size = 0;
+  ota_block_t blocks[2];
+  ota_block_t *current = nullptr;
+  QueueHandle_t free_blocks;
+  // One extra slot for the sentinel that stops the writer task
+  QueueHandle_t full_blocks;
+  SemaphoreHandle_t writer_stopped;
+  bool writer_running = false;
+
+  uint32_t start_ms = 0;
+  ota_write_stats_t stats = {};
+
+  static void _writer_task(void *pvParameters) {
+    static_cast<OtaPartitionPrint *>(pvParameters)->writer_task();
+  }
+
+  void writer_task() {
+    ota_block_t *block;
+    while (xQueueReceive(full_blocks, &block, portMAX_DELAY) == pdTRUE && block != nullptr) {
+      if (!write_failed) {
+        uint32_t write_start = millis();
+        if (!started) {
+          if (partition == NULL || esp_ota_begin(partition, image_size, &handle) != ESP_OK) {
+            ESP_LOGE(HTTP_OTA_TAG, "Cannot start writing the OTA partition");
+            write_failed = true;
+          }
+          started = !write_failed;
+        }
+        if (!write_failed && esp_ota_write(handle, block->data, block->len) != ESP_OK) {
+          ESP_LOGE(HTTP_OTA_TAG, "Writing the OTA partition failed");
+          write_failed = true;
+        }
+        stats.flash_ms += millis() - write_start;
+      }
+      block->len = 0;
+      xQueueSend(free_blocks, &block, 0);
+    }
+    xSemaphoreGive(writer_stopped);
+    vTaskDelete(NULL);
+  }
+
+  // Hand the current block, if any, and then the sentinel to the writer and wait for it to finish
+  void stopWriter() {
+    if (!writer_running) {
+      return;
+    }
+    if (current != nullptr && current->len > 0) {
+      xQueueSend(full_blocks, &current, portMAX_DELAY);
+      current = nullptr;
+    }
+    ota_block_t *sentinel = nullptr;
+    xQueueSend(full_blocks, &sentinel, portMAX_DELAY);
+    xSemaphoreTake(writer_stopped, portMAX_DELAY);
+    writer_running = false;
+    stats.total_ms = millis() - start_ms;
+  }
+
+public:
+  // image_size is used to only erase as much as needed, OTA_SIZE_UNKNOWN erases the whole partition
+  OtaPartitionPrint(size_t image_size = OTA_SIZE_UNKNOWN, size_t block_size = OTA_WRITE_BLOCK_SIZE)
+      : partition(esp_ota_get_next_update_partition(NULL)), image_size(image_size) {
+    free_blocks = xQueueCreate(2, sizeof(ota_block_t *));
+    full_blocks = xQueueCreate(3, sizeof(ota_block_t *));
+    writer_stopped = xSemaphoreCreateBinary();
+    for (int i = 0; i < 2; i++) {
+      blocks[i].data = (uint8_t *) malloc(block_size);
+      blocks[i].len = 0;
+      ota_block_t *block = &blocks[i];
+      xQueueSend(free_blocks, &block, 0);
+    }
+    if (blocks[0].data == nullptr || blocks[1].data == nullptr) {
+      ESP_LOGE(HTTP_OTA_TAG, "Out of memory for OTA blocks of %u bytes", block_size);
+      write_failed = true;
+      return;
+    }
+    this->block_size = block_size;
+    writer_running = xTaskCreate(_writer_task, "OTA write", 4096, this, OTA_WRITE_TASK_PRIORITY, NULL) == pdPASS;
+    write_failed = !writer_running;
+  }
+
+  ~OtaPartitionPrint() {
+    abort();
+    vSemaphoreDelete(writer_stopped);
+    vQueueDelete(full_blocks);
+    vQueueDelete(free_blocks);
+    free(blocks[0].data);
+    free(blocks[1].data);
+  }
+
+  size_t write(uint8_t c) {
+    return write(&c, 1);
+  }
+
+  size_t write(const uint8_t *buffer, size_t size) {
+    if (write_failed) {
+      return 0;
+    }
+    if (start_ms == 0) {
+      start_ms = millis();
+    }
+    size_t written = 0;
+    while (written < size) {
+      if (current == nullptr) {
+        if (xQueueReceive(free_blocks, &current, 0) != pdTRUE) {
+          uint32_t wait_start = millis();
+          xQueueReceive(free_blocks, &current, portMAX_DELAY);
+          stats.backpressure_ms += millis() - wait_start;
+        }
+      }
+      size_t n = std::min(size - written, block_size - current->len);
+      memcpy(current->data + current->len, buffer + written, n);
+      current->len += n;
+      written += n;
+      if (current->len == block_size) {
+        xQueueSend(full_blocks, &current, portMAX_DELAY);
+        current = nullptr;
+      }
+    }
+    stats.bytes += size;
+    return size;
+  }
+
+  // Put everything on flash, validate the image and boot it next time
+  bool commit() {
+    stopWriter();
+    if (write_failed || !started || esp_ota_end(handle) != ESP_OK) {
+      started = false;
+      return false;
+    }
+    started = false;
+    return esp_ota_set_boot_partition(partition) == ESP_OK;
+  }
+
+  void abort() {
+    write_failed = true;
+    stopWriter();
+    if (started) {
+      esp_ota_abort(handle);
+      started = false;
+    }
+  }
+
+  // Writing the partition went wrong, whatever else is written is dropped
+  bool failed() {
+    return write_failed;
+  }
+
+  const ota_write_stats_t &getStats() {
+    return stats;
+  }
+
+  void logStats(const char *what) {
+    if (stats.bytes == 0) {
+      return;
+    }
+    uint32_t ms = writer_running ? millis() - start_ms : stats.total_ms;
+    ESP_LOGI(HTTP_OTA_TAG, "%s: %u KB in %u ms, %u KB/s, %u ms writing flash, %u ms waiting for it", what,
+             stats.bytes / 1024, ms, (uint32_t) ((uint64_t) stats.bytes * 1000 / 1024 / std::max(ms, (uint32_t) 1)),
+             stats.flash_ms, stats.backpressure_ms);
+  }
+};
+
+static bool readRunningPartition(void *context, size_t offset, uint8_t *buffer, size_t len) {
+  return esp_partition_read(static_cast<const esp_partition_t *>(context), offset, buffer, len) == ESP_OK;
+}
+
+// Try to update with a patch from the running version, made by tools/mkdelta.py and served at the
+// URL of the full image plus ".from-<running version>". Anything but DELTA_PATCH_UP_TO_DATE or a
+// restart into the new image means the full image has to be downloaded instead.
+static delta_patch_result_t deltaOTA(esp_http_client_config_t config) {
+  const esp_partition_t *running = esp_ota_get_running_partition();
+  esp_app_desc_t running_app_info;
+  esp_ota_get_partition_description(running, &running_app_info);
+
+  String url = String(config.url) + ".from-" + running_app_info.version;
+  config.url = url.c_str();
+  esp_http_client_handle_t client = esp_http_client_init(&config);
+  if (client == NULL) {
+    return DELTA_PATCH_FAILED;
+  }
+  if (esp_http_client_open(client, 0) != ESP_OK) {
+    esp_http_client_cleanup(client);
+    return DELTA_PATCH_FAILED;
+  }
+  esp_http_client_fetch_headers(client);
+  int status = esp_http_client_get_status_code(client);
+  if (status != 200) {
+    ESP_LOGI(HTTP_OTA_TAG, "No patch from %s (HTTP %d), trying the full image", running_app_info.version, status);
+    esp_http_client_close(client);
+    esp_http_client_cleanup(client);
+    return DELTA_PATCH_FAILED;
+  }
+
+  ESP_LOGI(HTTP_OTA_TAG, "Downloading patch from %s", running_app_info.version);
+  uint32_t start = millis();
+  OtaPartitionPrint partition;
+  DeltaPatch patch(readRunningPartition, (void *) running, &partition, running_app_info.version);
+  InflatePrint inflater(&patch, false);
+  uint8_t *buffer = (uint8_t *) malloc(OTA_HTTP_BUFFER_SIZE);
+  int len;
+  while (buffer != nullptr && !partition.failed() &&
+         (len = esp_http_client_read(client, (char *) buffer, OTA_HTTP_BUFFER_SIZE)) > 0) {
+    inflater.write(buffer, len);
+  }
+  free(buffer);
+  esp_http_client_close(client);
+  esp_http_client_cleanup(client);
+
+  bool inflated = inflater.finish();
+  delta_patch_result_t result = patch.finish();
+  if (result == DELTA_PATCH_OK && (!inflated || !partition.commit())) {
+    ESP_LOGE(HTTP_OTA_TAG, "Patched image is not valid");
+    result = DELTA_PATCH_FAILED;
+  }
+  ESP_LOGI(HTTP_OTA_TAG, "Patch of %u bytes took %u ms", inflater.getBytesIn(), millis() - start);
+  partition.logStats("Patched image");
+  return result;
+}
+
+// Download the full image into the OTA partition if it has a different version than the one
+// running. Returns true if the image was written and will be booted next.
+static bool fullOTA(esp_http_client_config_t config) {
+  esp_http_client_handle_t client = esp_http_client_init(&config);
+  if (client == NULL) {
+    return false;
+  }
+  if (esp_http_client_open(client, 0) != ESP_OK) {
+    ESP_LOGE(HTTP_OTA_TAG, "Cannot connect to %s", config.url);
+    esp_http_client_cleanup(client);
+    return false;
+  }
+  int content_length = esp_http_client_fetch_headers(client);
+  int status = esp_http_client_get_status_code(client);
+  uint8_t *buffer = (uint8_t *) malloc(OTA_HTTP_BUFFER_SIZE);
+  if (status != 200 || buffer == nullptr) {
+    ESP_LOGE(HTTP_OTA_TAG, "Cannot download %s (HTTP %d)", config.url, status);
+    free(buffer);
+    esp_http_client_close(client);
+    esp_http_client_cleanup(client);
+    return false;
+  }
+
+  // The version is in the first few hundred bytes, nothing is written before it was checked
+  const size_t desc_end = OTA_APP_DESC_OFFSET + sizeof(esp_app_desc_t);
+  size_t received = 0;
+  int len = 0;
+  while (received < desc_end &&
+         (len = esp_http_client_read(client, (char *) buffer + received, OTA_HTTP_BUFFER_SIZE - received)) > 0) {
+    received += len;
+  }
+  bool ok = false;
+  if (received < desc_end) {
+    ESP_LOGE(HTTP_OTA_TAG, "Image cut short");
+  } else if (!needUpdate((esp_app_desc_t *) (buffer + OTA_APP_DESC_OFFSET))) {
+    ESP_LOGI(HTTP_OTA_TAG, "No update needed");
+  } else {
+    ESP_LOGI(HTTP_OTA_TAG, "Downloading %d bytes", content_length);
+    OtaPartitionPrint partition(content_length > 0 ? content_length : OTA_SIZE_UNKNOWN);
+    partition.write(buffer, received);
+    while (!partition.failed() && (len = esp_http_client_read(client, (char *) buffer, OTA_HTTP_BUFFER_SIZE)) > 0) {
+      partition.write(buffer, len);
+    }
+    if (partition.failed()) {
+      ESP_LOGE(HTTP_OTA_TAG, "Cannot write the image, download stopped");
+    } else if (len < 0 || !esp_http_client_is_complete_data_received(client)) {
+      ESP_LOGE(HTTP_OTA_TAG, "Download cut short");
+    } else if (!partition.commit()) {
+      ESP_LOGE(HTTP_OTA_TAG, "Image validation failed, image is corrupted");
+    } else {
+      ok = true;
+    }
+    partition.logStats("Image");
+  }
+
+  free(buffer);
+  esp_http_client_close(client);
+  esp_http_client_cleanup(client);
+  return ok;
+}
+
+static esp_http_client_config_t otaHttpConfig(
     const char *firmware_upgrade_url,
     int ota_recv_timeout,
     const char *ota_server_pem_start,
@@ -42,54 +405,156 @@ void checkForOTA(
   config.use_global_ca_store = true;
   config.timeout_ms = ota_recv_timeout,
   config.skip_cert_common_name_check = skip_cert_common_name_check;
-  config.buffer_size = 128;
-  config.buffer_size_tx = 128;
+  config.buffer_size = OTA_HTTP_BUFFER_SIZE;
+  config.buffer_size_tx = 512;
+  return config;
+}
 
-  esp_https_ota_config_t ota_config;
-  // Initialize config with null values to prevent undefined behaviour!
-  memset(&ota_config, 0, sizeof(ota_config));
-  ota_config.http_config = &config;
+static void logPrintingStopped(uint32_t printing_stopped_ms) {
+  if (printing_stopped_ms != 0) {
+    ESP_LOGI(HTTP_OTA_TAG, "Printing stopped for %u ms", millis() - printing_stopped_ms);
+  }
+}
 
-  esp_https_ota_handle_t https_ota_handle = NULL;
-  esp_err_t err = esp_https_ota_begin(&ota_config, &https_ota_handle);
-  if (err != ESP_OK) {
-    ESP_LOGE(HTTP_OTA_TAG, "ESP HTTPS OTA Begin failed");
-    return;
+// printing_stopped_ms is the millis() at which the caller stopped printing for the update, if it
+// did, for the log
+void checkForOTA(
+    const char *firmware_upgrade_url,
+    int ota_recv_timeout,
+    const char *ota_server_pem_start,
+    bool skip_cert_common_name_check,
+    uint32_t printing_stopped_ms = 0) {
+  esp_http_client_config_t config = otaHttpConfig(firmware_upgrade_url, ota_recv_timeout, ota_server_pem_start,
+                                                  skip_cert_common_name_check);
+
+  switch (deltaOTA(config)) {
+    case DELTA_PATCH_OK:
+      ESP_LOGI(HTTP_OTA_TAG, "Delta OTA upgrade successful. Rebooting ...");
+      logPrintingStopped(printing_stopped_ms);
+      esp_restart();
+      break;
+    case DELTA_PATCH_UP_TO_DATE:
+      logPrintingStopped(printing_stopped_ms);
+      return;
+    case DELTA_PATCH_FAILED:
+      break;
   }
 
-  esp_app_desc_t app_desc;
-  err = esp_https_ota_get_img_desc(https_ota_handle, &app_desc);
-  if (err != ESP_OK) {
-    ESP_LOGE(HTTP_OTA_TAG, "esp_https_ota_read_img_desc failed");
-  } else {
-    if (!needUpdate(&app_desc)) {
-      err = ESP_FAIL;
-      ESP_LOGI(HTTP_OTA_TAG, "ESP_HTTPS_OTA no update needed!");
-    } else {
-      ESP_LOGI(HTTP_OTA_TAG, "Starting OTA Update!");
+  if (fullOTA(config)) {
+    ESP_LOGI(HTTP_OTA_TAG, "OTA upgrade successful. Rebooting ...");
+    logPrintingStopped(printing_stopped_ms);
+    esp_restart();
+  }
+  ESP_LOGE(HTTP_OTA_TAG, "OTA upgrade failed!");
+  logPrintingStopped(printing_stopped_ms);
+}
 
-      while (1) {
-        err = esp_https_ota_perform(https_ota_handle);
-        if (err != ESP_ERR_HTTPS_OTA_IN_PROGRESS) {
-          break;
-        }
-      }
+static esp_err_t _otaProbeEvent(esp_http_client_event_t *event) {
+  if (event->event_id == HTTP_EVENT_ON_HEADER && strcasecmp(event->header_key, "ETag") == 0) {
+    *static_cast<String *>(event->user_data) = event->header_value;
+  }
+  return ESP_OK;
+}
+
+// Ask the server whether the image changed since the last probe, fetching no more than its app
+// descriptor. Returns true if the image has a different version than the one running.
+static bool probeForOTA() {
+  esp_http_client_config_t config = otaHttpConfig(ota_check.url, ota_check.timeout_ms, ota_check.server_pem,
+                                                  ota_check.skip_cert_common_name_check);
+  String etag;
+  config.event_handler = _otaProbeEvent;
+  config.user_data = &etag;
+  esp_http_client_handle_t client = esp_http_client_init(&config);
+  if (client == NULL) {
+    return false;
+  }
+
+  char range[32];
+  snprintf(range, sizeof(range), "bytes=%u-%u", OTA_APP_DESC_OFFSET,
+           OTA_APP_DESC_OFFSET + sizeof(esp_app_desc_t) - 1);
+  esp_http_client_set_header(client, "Range", range);
+  if (ota_check.etag.length() > 0) {
+    esp_http_client_set_header(client, "If-None-Match", ota_check.etag.c_str());
+  }
 
-      if (esp_https_ota_is_complete_data_received(https_ota_handle) != true) {
-        // the OTA image was not completely received and user can customise the response to this situation.
-        ESP_LOGE(HTTP_OTA_TAG, "Complete data was not received.");
+  int status = -1;
+  size_t received = 0;
+  esp_app_desc_t app_desc;
+  if (esp_http_client_open(client, 0) == ESP_OK) {
+    esp_http_client_fetch_headers(client);
+    status = esp_http_client_get_status_code(client);
+    // A server that ignores Range sends the whole image, which is cut off after the descriptor
+    size_t skip = status == 200 ? OTA_APP_DESC_OFFSET : 0;
+    while ((status == 200 || status == 206) && received < sizeof(app_desc)) {
+      char buffer[64];
+      int len = esp_http_client_read(client, buffer, std::min(sizeof(buffer), skip + sizeof(app_desc) - received));
+      if (len <= 0) {
+        break;
       }
+      size_t used = std::min(skip, (size_t) len);
+      skip -= used;
+      memcpy((uint8_t *) &app_desc + received, buffer + used, len - used);
+      received += len - used;
     }
+    esp_http_client_close(client);
   }
+  esp_http_client_cleanup(client);
 
-  esp_err_t ota_finish_err = esp_https_ota_finish(https_ota_handle);
-  if ((err == ESP_OK) && (ota_finish_err == ESP_OK)) {
-    ESP_LOGI(HTTP_OTA_TAG, "ESP_HTTPS_OTA upgrade successful. Rebooting ...");
-    esp_restart();
-  } else {
-    if (ota_finish_err == ESP_ERR_OTA_VALIDATE_FAILED) {
-      ESP_LOGE(HTTP_OTA_TAG, "Image validation failed, image is corrupted");
+  if (status == 304) {
+    ESP_LOGD(HTTP_OTA_TAG, "Image unchanged");
+    return false;
+  }
+  if (received < sizeof(app_desc) || app_desc.magic_word != ESP_APP_DESC_MAGIC_WORD) {
+    ESP_LOGW(HTTP_OTA_TAG, "Could not read the version of the image (HTTP %d)", status);
+    return false;
+  }
+  if (!needUpdate(&app_desc)) {
+    // Only remembered now, a newer image that failed to install has to be found again
+    ota_check.etag = etag;
+    return false;
+  }
+  ESP_LOGI(HTTP_OTA_TAG, "Version %.32s is available, updating between jobs", app_desc.version);
+  return true;
+}
+
+static void _otaCheckTask(void *pvParameters) {
+  uint32_t wait_ms = OTA_CHECK_FIRST_MS;
+  while (true) {
+    vTaskDelay(pdMS_TO_TICKS(wait_ms + esp_random() % (wait_ms / 4)));
+    wait_ms = OTA_CHECK_INTERVAL_MS;
+    if (!ota_check.update_pending && WiFi.status() == WL_CONNECTED && probeForOTA()) {
+      ota_check.update_pending = true;
     }
-    ESP_LOGE(HTTP_OTA_TAG, "ESP_HTTPS_OTA upgrade failed!");
   }
-}
\ No newline at end of file
+}
+
+// Check for a new image in the background from now on. Found updates are only downloaded by
+// applyPendingOTA(), so that the caller can pick a moment when no job is printing.
+void startOtaChecks(
+    const char *firmware_upgrade_url,
+    int ota_recv_timeout,
+    const char *ota_server_pem_start,
+    bool skip_cert_common_name_check) {
+  if (ota_check.task != nullptr) {
+    return;
+  }
+  ota_check.url = firmware_upgrade_url;
+  ota_check.timeout_ms = ota_recv_timeout;
+  ota_check.server_pem = ota_server_pem_start;
+  ota_check.skip_cert_common_name_check = skip_cert_common_name_check;
+  // TLS needs a lot of stack
+  xTaskCreate(_otaCheckTask, "OTA check", 8192, NULL, OTA_CHECK_TASK_PRIORITY, &ota_check.task);
+}
+
+bool otaUpdatePending() {
+  return ota_check.update_pending;
+}
+
+// Download and install the update the background check found, restarts if that worked.
+// printing_stopped_ms is when the caller stopped printing for it.
+void applyPendingOTA(uint32_t printing_stopped_ms) {
+  checkForOTA(ota_check.url, ota_check.timeout_ms, ota_check.server_pem, ota_check.skip_cert_common_name_check,
+              printing_stopped_ms);
+  // Still here, so it failed. The next check looks again.
+  ota_check.update_pending = false;
+}
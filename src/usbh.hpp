@@ -24,20 +24,56 @@
 
 #include <usb/usb_host.h>
 
-const TickType_t HOST_EVENT_TIMEOUT = 1;
-const TickType_t CLIENT_EVENT_TIMEOUT = 1;
-
-typedef void (*usb_host_new_device_cb_t)(usb_host_client_handle_t client_hdl, usb_device_handle_t dev_hdl);
+// Both USB tasks block until there is an event for them, so they cost nothing while idle. They
+// are pinned away from core 0, where the WiFi and lwIP tasks run.
+#ifndef USBH_TASK_CORE
+#define USBH_TASK_CORE 1
+#endif
+
+#ifndef USBH_HOST_TASK_PRIORITY
+#define USBH_HOST_TASK_PRIORITY 2
+#endif
+
+#ifndef USBH_CLIENT_TASK_PRIORITY
+#define USBH_CLIENT_TASK_PRIORITY 3
+#endif
+
+// Devices that can be open at once, e.g. several printers behind a hub
+#ifndef USBH_MAX_DEVICES
+#define USBH_MAX_DEVICES 4
+#endif
+
+// Returns true if the device was taken, otherwise it is closed again
+typedef bool (*usb_host_new_device_cb_t)(usb_host_client_handle_t client_hdl, usb_device_handle_t dev_hdl);
+// A device that was taken is gone. It stays open until usbh_close_device() is called for it.
 typedef void (*usb_host_device_gone_cb_t)(usb_host_client_handle_t client_hdl, usb_device_handle_t dev_hdl);
 
 typedef struct {
-  usb_host_client_handle_t client_hdl;
-  uint8_t dev_addr;
   usb_device_handle_t dev_hdl;
+  uint8_t interface_number;
+} usbh_close_request_t;
+
+typedef struct {
+  usb_host_client_handle_t client_hdl;
+  // Devices opened and taken by new_device_cb, NULL for free slots
+  usb_device_handle_t dev_hdls[USBH_MAX_DEVICES];
   usb_host_new_device_cb_t new_device_cb;
   usb_host_device_gone_cb_t device_gone_cb;
+  // Devices to close, handled by the client task
+  QueueHandle_t close_requests;
 } class_driver_t;
 
+static class_driver_t *usbh_driver = NULL;
+
+int _usbh_find_device(class_driver_t *driver_obj, usb_device_handle_t dev_hdl) {
+  for (int i = 0; i < USBH_MAX_DEVICES; i++) {
+    if (driver_obj->dev_hdls[i] == dev_hdl) {
+      return i;
+    }
+  }
+  return -1;
+}
+
 void _client_event_callback(const usb_host_client_event_msg_t *event_msg, void *arg)
 {
   class_driver_t *driver_obj = (class_driver_t *)arg;
@@ -47,68 +83,95 @@ void _client_event_callback(const usb_host_client_event_msg_t *event_msg, void *
   {
     /**< A new device has been enumerated and added to the USB Host Library */
     case USB_HOST_CLIENT_EVENT_NEW_DEV:
-      // If we're already attached to a device, just ignore
-      if (driver_obj->dev_addr != 0) {
-        ESP_LOGI("", "Ignoring new device event, already got device with address: %x", driver_obj->dev_addr);
+    {
+      int slot = _usbh_find_device(driver_obj, NULL);
+      if (slot < 0) {
+        ESP_LOGI("", "Ignoring new device with address %x, already got %d devices",
+                 event_msg->new_dev.address, USBH_MAX_DEVICES);
+        break;
       }
-
-      driver_obj->dev_addr = event_msg->new_dev.address;
       ESP_LOGI("", "New device address: %d", event_msg->new_dev.address);
 
-      err = usb_host_device_open(driver_obj->client_hdl, event_msg->new_dev.address, &driver_obj->dev_hdl);
-      if (err != ESP_OK) ESP_LOGI("", "usb_host_device_open: %x", err);
+      usb_device_handle_t dev_hdl;
+      err = usb_host_device_open(driver_obj->client_hdl, event_msg->new_dev.address, &dev_hdl);
+      if (err != ESP_OK) {
+        ESP_LOGI("", "usb_host_device_open: %x", err);
+        break;
+      }
 
       usb_device_info_t dev_info;
-      err = usb_host_device_info(driver_obj->dev_hdl, &dev_info);
+      err = usb_host_device_info(dev_hdl, &dev_info);
       if (err != ESP_OK) ESP_LOGI("", "usb_host_device_info: %x", err);
       ESP_LOGI("", "speed: %d dev_addr %d vMaxPacketSize0 %d bConfigurationValue %d",
           dev_info.speed, dev_info.dev_addr, dev_info.bMaxPacketSize0,
           dev_info.bConfigurationValue);
 
       const usb_device_desc_t *dev_desc;
-      err = usb_host_get_device_descriptor(driver_obj->dev_hdl, &dev_desc);
+      err = usb_host_get_device_descriptor(dev_hdl, &dev_desc);
       if (err != ESP_OK) ESP_LOGI("", "usb_host_get_device_descriptor: %x", err);
       usb_print_device_descriptor(dev_desc);
 
       const usb_config_desc_t *config_desc;
-      err = usb_host_get_active_config_descriptor(driver_obj->dev_hdl, &config_desc);
+      err = usb_host_get_active_config_descriptor(dev_hdl, &config_desc);
       if (err != ESP_OK) ESP_LOGI("", "usb_host_get_config_descriptor: %x", err);
       //usb_print_config_descriptor(config_desc, NULL);
 
-      driver_obj->new_device_cb(driver_obj->client_hdl, driver_obj->dev_hdl);
-
+      if (driver_obj->new_device_cb(driver_obj->client_hdl, dev_hdl)) {
+        driver_obj->dev_hdls[slot] = dev_hdl;
+      } else {
+        // Not a printer, or nothing left to drive it with
+        usb_host_device_close(driver_obj->client_hdl, dev_hdl);
+      }
       break;
+    }
     /**< A device opened by the client is now gone */
     case USB_HOST_CLIENT_EVENT_DEV_GONE:
-      if (event_msg->dev_gone.dev_hdl != driver_obj->dev_hdl) {
+    {
+      int slot = _usbh_find_device(driver_obj, event_msg->dev_gone.dev_hdl);
+      if (slot < 0) {
         // We don't care about devices not managed by us
         return;
       }
+      usb_device_handle_t dev_hdl = driver_obj->dev_hdls[slot];
       ESP_LOGI("", "Device Gone handle: %x", event_msg->dev_gone.dev_hdl);
-      driver_obj->device_gone_cb(driver_obj->client_hdl, driver_obj->dev_hdl);
+      // Transfers still out come back through this task, the device is closed once they are
+      driver_obj->device_gone_cb(driver_obj->client_hdl, dev_hdl);
       ESP_LOGI("", "Device Gone callback executed: %x", event_msg->dev_gone.dev_hdl);
-      ESP_ERROR_CHECK(usb_host_device_close(driver_obj->client_hdl, driver_obj->dev_hdl));
-      driver_obj->dev_hdl = NULL;
-      driver_obj->dev_addr = 0;
       break;
+    }
     default:
       ESP_LOGI("", "Unknown value %d", event_msg->event);
       break;
   }
 }
 
-// Reference: esp-idf/examples/peripherals/usb/host/usb_host_lib/main/usb_host_lib_main.c
+// Release interface_number of a device that was taken and close it, once nothing uses it any more.
+// Can be called from any task, the client task does it.
+void usbh_close_device(usb_device_handle_t dev_hdl, uint8_t interface_number) {
+  usbh_close_request_t request = {dev_hdl, interface_number};
+  xQueueSend(usbh_driver->close_requests, &request, portMAX_DELAY);
+  usb_host_client_unblock(usbh_driver->client_hdl);
+}
 
-class_driver_t* usbh_setup(usb_host_new_device_cb_t new_device_cb, usb_host_device_gone_cb_t device_gone_cb) {
-  class_driver_t *driver_obj = (class_driver_t *) malloc(sizeof(class_driver_t));
-  // Initialize dev_addr because that's how we know we're not yet attached to a device;
-  driver_obj->dev_addr = 0;
+void _usbh_handle_close_requests(class_driver_t *driver_obj) {
+  usbh_close_request_t request;
+  while (xQueueReceive(driver_obj->close_requests, &request, 0) == pdTRUE) {
+    esp_err_t err = usb_host_interface_release(driver_obj->client_hdl, request.dev_hdl, request.interface_number);
+    if (err != ESP_OK) ESP_LOGI("", "usb_host_interface_release: %x", err);
+    err = usb_host_device_close(driver_obj->client_hdl, request.dev_hdl);
+    if (err != ESP_OK) ESP_LOGI("", "usb_host_device_close: %x", err);
+    int slot = _usbh_find_device(driver_obj, request.dev_hdl);
+    if (slot >= 0) {
+      driver_obj->dev_hdls[slot] = NULL;
+    }
+  }
+}
 
-  const usb_host_config_t config = {
-    .intr_flags = ESP_INTR_FLAG_LEVEL1,
-  };
-  esp_err_t err = usb_host_install(&config);
-  ESP_LOGI("", "usb_host_install: %x", err);
+// Reference: esp-idf/examples/peripherals/usb/host/usb_host_lib/main/usb_host_lib_main.c
+
+// Handles client events, which includes calling the callbacks of completed transfers
+void usbh_client_task(void *arg) {
+  class_driver_t *driver_obj = (class_driver_t *) arg;
 
   const usb_host_client_config_t client_config = {
     .is_synchronous = false,
@@ -118,52 +181,71 @@ class_driver_t* usbh_setup(usb_host_new_device_cb_t new_device_cb, usb_host_devi
         .callback_arg = driver_obj
     }
   };
-  err = usb_host_client_register(&client_config, &driver_obj->client_hdl);
+  esp_err_t err = usb_host_client_register(&client_config, &driver_obj->client_hdl);
   ESP_LOGI("", "usb_host_client_register: %x", err);
 
-  driver_obj->new_device_cb = new_device_cb;
-  driver_obj->device_gone_cb = device_gone_cb;
-
-  return driver_obj;
+  while (true) {
+    err = usb_host_client_handle_events(driver_obj->client_hdl, portMAX_DELAY);
+    if (err != ESP_OK && err != ESP_ERR_TIMEOUT) {
+      ESP_LOGI("", "usb_host_client_handle_events: %x", err);
+    }
+    _usbh_handle_close_requests(driver_obj);
+  }
 }
 
-void usbh_handle(class_driver_t *driver_obj)
-{
-  uint32_t event_flags;
-  static bool all_clients_gone = false;
-  static bool all_dev_free = false;
+// Runs the USB Host Library itself. Installs it first, then starts the client task, which can
+// only register once the library is installed.
+void usbh_host_task(void *arg) {
+  class_driver_t *driver_obj = (class_driver_t *) arg;
+
+  const usb_host_config_t config = {
+    .intr_flags = ESP_INTR_FLAG_LEVEL1,
+  };
+  esp_err_t err = usb_host_install(&config);
+  ESP_LOGI("", "usb_host_install: %x", err);
+
+  xTaskCreatePinnedToCore(usbh_client_task,
+                          "usb_host_client",
+                          4096,
+                          (void *) driver_obj,
+                          USBH_CLIENT_TASK_PRIORITY,
+                          NULL,
+                          USBH_TASK_CORE);
 
-  esp_err_t err = usb_host_lib_handle_events(HOST_EVENT_TIMEOUT, &event_flags);
-  if (err == ESP_OK) {
+  while (true) {
+    uint32_t event_flags;
+    err = usb_host_lib_handle_events(portMAX_DELAY, &event_flags);
+    if (err != ESP_OK) {
+      ESP_LOGI("", "usb_host_lib_handle_events: %x flags: %x", err, event_flags);
+      continue;
+    }
     if (event_flags & USB_HOST_LIB_EVENT_FLAGS_NO_CLIENTS) {
       ESP_LOGI("", "No more clients");
-      all_clients_gone = true;
+      usb_host_device_free_all();
     }
     if (event_flags & USB_HOST_LIB_EVENT_FLAGS_ALL_FREE) {
       ESP_LOGI("", "No more devices");
-      all_dev_free = true;
     }
-  } else {
-    if (err != ESP_ERR_TIMEOUT) {
-      ESP_LOGI("", "usb_host_lib_handle_events: %x flags: %x", err, event_flags);
-    }
-  }
-
-  err = usb_host_client_handle_events(driver_obj->client_hdl, CLIENT_EVENT_TIMEOUT);
-  if ((err != ESP_OK) && (err != ESP_ERR_TIMEOUT)) {
-    ESP_LOGI("", "usb_host_client_handle_events: %x", err);
   }
 }
 
-void usbh_task(void *arg) {
-  void** args = (void**) arg;
-  usb_host_new_device_cb_t new_device_cb = (usb_host_new_device_cb_t) args[0];
-  usb_host_device_gone_cb_t device_gone_cb = (usb_host_device_gone_cb_t) args[1];
-  class_driver_t *driver_obj = usbh_setup(new_device_cb, device_gone_cb);
-
-  while (true) {
-    usbh_handle(driver_obj);
+// Start USB host handling, the callbacks are called from the client task
+void usbh_begin(usb_host_new_device_cb_t new_device_cb, usb_host_device_gone_cb_t device_gone_cb) {
+  class_driver_t *driver_obj = (class_driver_t *) malloc(sizeof(class_driver_t));
+  // No devices attached yet
+  for (int i = 0; i < USBH_MAX_DEVICES; i++) {
+    driver_obj->dev_hdls[i] = NULL;
   }
-
-  vTaskSuspend(NULL);
-}
\ No newline at end of file
+  driver_obj->new_device_cb = new_device_cb;
+  driver_obj->device_gone_cb = device_gone_cb;
+  driver_obj->close_requests = xQueueCreate(USBH_MAX_DEVICES, sizeof(usbh_close_request_t));
+  usbh_driver = driver_obj;
+
+  xTaskCreatePinnedToCore(usbh_host_task,
+                          "usb_host_lib",
+                          4096,
+                          (void *) driver_obj,
+                          USBH_HOST_TASK_PRIORITY,
+                          NULL,
+                          USBH_TASK_CORE);
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include <esp_timer.h>
+#include <FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+// What waiting for USB host and client events costs the way usbh_task used to do it, one task
+// polling both with 1 tick timeouts, against the way usbh.hpp does it now, a task blocking on
+// each. Semaphores stand in for the events, the USB Host Library waits on the same inside.
+
+typedef struct {
+  // Times the tasks woke up over the idle window, when there was nothing to handle
+  uint32_t idle_wakeups;
+  // From a client event coming in to it being handled
+  uint32_t latency_avg_us;
+  uint32_t latency_max_us;
+} usbh_wait_stats_t;
+
+typedef struct {
+  SemaphoreHandle_t host_event;
+  SemaphoreHandle_t client_event;
+  SemaphoreHandle_t handled;
+  SemaphoreHandle_t stopped;
+  std::atomic<bool> stopping;
+  std::atomic<uint32_t> host_wakeups;
+  std::atomic<uint32_t> client_wakeups;
+  std::atomic<int64_t> handled_us;
+} _usbh_wait_benchmark_t;
+
+static void _usbh_handle_client_event(_usbh_wait_benchmark_t *benchmark) {
+  benchmark->handled_us = esp_timer_get_time();
+  xSemaphoreGive(benchmark->handled);
+}
+
+// As usbh_task was
+static void _usbh_polling_task(void *arg) {
+  _usbh_wait_benchmark_t *benchmark = (_usbh_wait_benchmark_t *) arg;
+  while (!benchmark->stopping) {
+    xSemaphoreTake(benchmark->host_event, 1);
+    benchmark->host_wakeups++;
+    if (xSemaphoreTake(benchmark->client_event, 1) == pdTRUE && !benchmark->stopping) {
+      _usbh_handle_client_event(benchmark);
+    }
+    benchmark->client_wakeups++;
+  }
+  xSemaphoreGive(benchmark->stopped);
+  vTaskDelete(NULL);
+}
+
+// As usbh_host_task and usbh_client_task are
+static void _usbh_host_task(void *arg) {
+  _usbh_wait_benchmark_t *benchmark = (_usbh_wait_benchmark_t *) arg;
+  while (!benchmark->stopping) {
+    xSemaphoreTake(benchmark->host_event, portMAX_DELAY);
+    benchmark->host_wakeups++;
+  }
+  xSemaphoreGive(benchmark->stopped);
+  vTaskDelete(NULL);
+}
+
+static void _usbh_client_task(void *arg) {
+  _usbh_wait_benchmark_t *benchmark = (_usbh_wait_benchmark_t *) arg;
+  while (!benchmark->stopping) {
+    if (xSemaphoreTake(benchmark->client_event, portMAX_DELAY) == pdTRUE && !benchmark->stopping) {
+      _usbh_handle_client_event(benchmark);
+    }
+    benchmark->client_wakeups++;
+  }
+  xSemaphoreGive(benchmark->stopped);
+  vTaskDelete(NULL);
+}
+
+// Count the wakeups of the blocking or the polling tasks over idle_ms without events, then time
+// how long events take to be handled. All tasks run at the same priority, so only the way they
+// wait differs.
+static inline void usbh_wait_benchmark(bool blocking, usbh_wait_stats_t *stats, uint32_t idle_ms = 1000,
+                                       int events = 20) {
+  _usbh_wait_benchmark_t benchmark;
+  benchmark.host_event = xSemaphoreCreateBinary();
+  benchmark.client_event = xSemaphoreCreateBinary();
+  benchmark.handled = xSemaphoreCreateBinary();
+  benchmark.stopped = xSemaphoreCreateCounting(2, 0);
+  benchmark.stopping = false;
+  benchmark.host_wakeups = 0;
+  benchmark.client_wakeups = 0;
+  benchmark.handled_us = 0;
+
+  int tasks = blocking ? 2 : 1;
+  if (blocking) {
+    xTaskCreate(_usbh_host_task, "usbh_benchmark_host", 2048, &benchmark, 2, NULL);
+    xTaskCreate(_usbh_client_task, "usbh_benchmark_client", 2048, &benchmark, 2, NULL);
+  } else {
+    xTaskCreate(_usbh_polling_task, "usbh_benchmark_poll", 2048, &benchmark, 2, NULL);
+  }
+
+  // Let the tasks get to waiting first
+  vTaskDelay(pdMS_TO_TICKS(10));
+  uint32_t start_wakeups = benchmark.host_wakeups + benchmark.client_wakeups;
+  vTaskDelay(pdMS_TO_TICKS(idle_ms));
+  stats->idle_wakeups = benchmark.host_wakeups + benchmark.client_wakeups - start_wakeups;
+
+  int64_t total_us = 0;
+  int64_t max_us = 0;
+  int handled = 0;
+  for (int i = 0; i < events; i++) {
+    // Anywhere within a tick, as transfers complete whenever the printer is done with them
+    int64_t until_us = esp_timer_get_time() + 2000 + i * 397 % 1000;
+    while (esp_timer_get_time() < until_us) {
+    }
+    int64_t given_us = esp_timer_get_time();
+    xSemaphoreGive(benchmark.client_event);
+    if (xSemaphoreTake(benchmark.handled, pdMS_TO_TICKS(100)) == pdTRUE) {
+      int64_t latency_us = benchmark.handled_us - given_us;
+      total_us += latency_us;
+      max_us = std::max(max_us, latency_us);
+      handled++;
+    }
+  }
+  stats->latency_avg_us = handled > 0 ? total_us / handled : 0;
+  stats->latency_max_us = max_us;
+
+  benchmark.stopping = true;
+  xSemaphoreGive(benchmark.host_event);
+  xSemaphoreGive(benchmark.client_event);
+  for (int i = 0; i < tasks; i++) {
+    xSemaphoreTake(benchmark.stopped, portMAX_DELAY);
+  }
+  vSemaphoreDelete(benchmark.host_event);
+  vSemaphoreDelete(benchmark.client_event);
+  vSemaphoreDelete(benchmark.handled);
+  vSemaphoreDelete(benchmark.stopped);
+}
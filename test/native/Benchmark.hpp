@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <vector>
+
+// Collects per-job latencies of a benchmark run and prints a summary line that is easy to compare
+// between runs:
+//
+//   text 16000 B/s: 20 jobs, 5.8 jobs/s, 14.2 KiB/s, latency p50 512.0 ms p95 801.3 ms p99 845.0 ms
+
+typedef struct {
+  uint32_t jobs;
+  double seconds;
+  uint64_t bytes;
+  double p50_ms;
+  double p95_ms;
+  double p99_ms;
+  double max_ms;
+} benchmark_result_t;
+
+class Benchmark {
+private:
+  const char *name;
+  std::vector<double> latencies_ms;
+  uint64_t bytes = 0;
+  int64_t start_us;
+  int64_t end_us;
+
+  // Nearest rank percentile of sorted samples
+  static double percentile(const std::vector<double> &sorted, double p) {
+    if (sorted.empty()) {
+      return 0;
+    }
+    size_t rank = (size_t) (p / 100 * sorted.size() + 0.999999);
+    return sorted[std::min(std::max(rank, (size_t) 1), sorted.size()) - 1];
+  }
+
+public:
+  Benchmark(const char *name, int64_t start_us) : name(name), start_us(start_us), end_us(start_us) {}
+
+  // A job of bytes that took from start_us to end_us, in esp_timer_get_time() microseconds
+  void job(int64_t job_start_us, int64_t job_end_us, uint64_t job_bytes) {
+    latencies_ms.push_back((job_end_us - job_start_us) / 1000.0);
+    bytes += job_bytes;
+    end_us = std::max(end_us, job_end_us);
+  }
+
+  benchmark_result_t result() {
+    std::vector<double> sorted = latencies_ms;
+    std::sort(sorted.begin(), sorted.end());
+    benchmark_result_t result = {};
+    result.jobs = sorted.size();
+    result.seconds = (end_us - start_us) / 1000000.0;
+    result.bytes = bytes;
+    result.p50_ms = percentile(sorted, 50);
+    result.p95_ms = percentile(sorted, 95);
+    result.p99_ms = percentile(sorted, 99);
+    result.max_ms = sorted.empty() ? 0 : sorted.back();
+    return result;
+  }
+
+  benchmark_result_t report() {
+    benchmark_result_t r = result();
+    double seconds = r.seconds > 0 ? r.seconds : 1e-9;
+    printf("%s: %u jobs, %.1f jobs/s, %.1f KiB/s, latency p50 %.1f ms p95 %.1f ms p99 %.1f ms\n", name, r.jobs,
+           r.jobs / seconds, r.bytes / 1024.0 / seconds, r.p50_ms, r.p95_ms, r.p99_ms);
+    return r;
+  }
+};
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include <string>
+
+// A Print that keeps everything written to it, for checking what a writer produced
+class CapturePrint : public Print {
+private:
+  std::string data;
+  size_t writes = 0;
+
+public:
+  size_t write(uint8_t c) {
+    return write(&c, 1);
+  }
+
+  size_t write(const uint8_t *buffer, size_t size) {
+    data.append((const char *) buffer, size);
+    writes++;
+    return size;
+  }
+
+  const std::string &str() {
+    return data;
+  }
+
+  // Number of write calls, i.e. how many pieces the data came in
+  size_t getWrites() {
+    return writes;
+  }
+
+  void clear() {
+    data.clear();
+    writes = 0;
+  }
+};
@@ -0,0 +1,392 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include <usb/usb_host.h>
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// A USB receipt printer on the host, behind the usb_host shim. OUT data goes into an input buffer
+// that empties at drain_rate bytes per second as it is printed. While the buffer is full, the
+// printer NAKs and the transfer waits, like a real one, or drops the data if drop_when_full is
+// set, like the cheapest ones. Answers GET_PORT_STATUS and DLE EOT 2 from its paper state.
+//
+// Jobs are told apart by markers in the text, #job-<n>#, which the job server appends to every
+// job. The time the marker would come out of the printer is when the job is done.
+
+typedef struct {
+  // Bytes per second printed, i.e. taken out of the buffer
+  uint32_t drain_rate;
+  uint32_t buffer_bytes;
+  // Bytes per second over the bus, about what full speed bulk transfers reach
+  uint32_t usb_rate;
+  // Drop data instead of NAKing it while the buffer is full
+  bool drop_when_full;
+  // Whether the printer answers the GET_PORT_STATUS class request
+  bool port_status;
+  // Keep everything received for data(), off for jobs too big to keep around
+  bool keep_data;
+} fake_printer_config_t;
+
+static const fake_printer_config_t FAKE_PRINTER_DEFAULTS = {16000, 4096, 1000000, false, true, true};
+
+typedef struct {
+  uint64_t bytes_received;
+  uint64_t bytes_dropped;
+  uint32_t out_transfers;
+  uint32_t control_transfers;
+  uint32_t status_requests;
+  // DLE EOT that arrived inside the data of a raster command, where the printer takes it for
+  // image data
+  uint32_t status_requests_mid_command;
+  // Most OUT transfers submitted at once
+  uint32_t max_queued_transfers;
+  uint32_t max_fill;
+} fake_printer_stats_t;
+
+class FakePrinter : public usb_device_handle_s {
+public:
+  static const uint8_t OUT_EP = 0x01;
+  static const uint8_t IN_EP = 0x81;
+
+private:
+  fake_printer_config_t config;
+
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::deque<usb_transfer_t *> out_queue;
+  std::deque<usb_transfer_t *> in_queue;
+  bool halted = false;
+  // OUT transfer whose data is being taken in, it can't be cancelled any more
+  usb_transfer_t *receiving = nullptr;
+  bool gone = false;
+  bool stopping = false;
+  bool paper_out = false;
+  bool refuse_submits = false;
+  uint32_t status_replies_due = 0;
+  uint32_t fail_transfers = 0;
+  size_t fail_after_bytes = 0;
+  std::thread thread;
+
+  // Only touched by the printer thread, apart from received
+  double fill = 0;
+  int64_t fill_us = 0;
+  std::string received;
+  fake_printer_stats_t stats = {};
+
+  // ESC/POS parsing, just far enough to know whether a byte is raster data
+  uint8_t command[8];
+  size_t command_len = 0;
+  uint32_t raster_left = 0;
+
+  std::string marker;
+  std::map<uint32_t, int64_t> jobs_printed_us;
+
+  void drain(int64_t now_us) {
+    fill -= config.drain_rate * (now_us - fill_us) / 1000000.0;
+    if (fill < 0) {
+      fill = 0;
+    }
+    fill_us = now_us;
+  }
+
+  bool inCommand() {
+    return raster_left > 0 || command_len > 0;
+  }
+
+  void parse(uint8_t c, int64_t now_us) {
+    if (raster_left > 0) {
+      raster_left--;
+    } else if (command_len > 0 || c == 0x1d) {
+      command[command_len++] = c;
+      if ((command_len == 2 && command[1] != 'v') || (command_len == 3 && command[2] != '0')) {
+        command_len = 0;
+      } else if (command_len == 8) {
+        raster_left = (command[4] | (command[5] << 8)) * (command[6] | (command[7] << 8));
+        command_len = 0;
+      }
+    }
+
+    // #job-<n>#
+    static const char PREFIX[] = "#job-";
+    if (marker.length() < sizeof(PREFIX) - 1) {
+      marker = c == PREFIX[marker.length()] ? marker + (char) c : std::string(c == '#' ? "#" : "");
+    } else if (isdigit(c)) {
+      marker += (char) c;
+    } else {
+      if (c == '#' && marker.length() > sizeof(PREFIX) - 1) {
+        uint32_t job = atoi(marker.c_str() + sizeof(PREFIX) - 1);
+        // Comes out once everything before it in the buffer is printed
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs_printed_us[job] = now_us + (int64_t) (fill * 1000000 / config.drain_rate);
+        changed.notify_all();
+      }
+      marker = c == '#' ? "#" : "";
+    }
+  }
+
+  void accept(const uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+      fill++;
+      parse(data[i], fill_us);
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    if (config.keep_data) {
+      received.append((const char *) data, len);
+    }
+    stats.bytes_received += len;
+    if (fill > stats.max_fill) {
+      stats.max_fill = fill;
+    }
+  }
+
+  // Take the data of an OUT transfer into the buffer, as fast as the bus and the buffer allow. The
+  // caller completes the transfer.
+  void receive(usb_transfer_t *transfer) {
+    size_t len = transfer->num_bytes;
+    bool fail = false;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stats.out_transfers++;
+      if (fail_transfers > 0) {
+        fail_transfers--;
+        fail = true;
+        len = std::min(len, fail_after_bytes);
+      }
+    }
+
+    if (transfer->num_bytes == 3 && transfer->data_buffer[0] == 0x10 && transfer->data_buffer[1] == 0x04) {
+      std::lock_guard<std::mutex> lock(mutex);
+      stats.status_requests++;
+      if (inCommand()) {
+        stats.status_requests_mid_command++;
+      }
+      status_replies_due++;
+      changed.notify_all();
+    }
+
+    std::this_thread::sleep_for(std::chrono::microseconds((int64_t) len * 1000000 / config.usb_rate));
+    size_t done = 0;
+    while (done < len) {
+      drain(esp_timer_get_time());
+      size_t room = fill < config.buffer_bytes ? config.buffer_bytes - (size_t) fill : 0;
+      if (room == 0 && config.drop_when_full) {
+        std::lock_guard<std::mutex> lock(mutex);
+        stats.bytes_dropped += len - done;
+        break;
+      }
+      if (room == 0) {
+        // NAK until a few packets worth has been printed
+        std::this_thread::sleep_for(std::chrono::microseconds(64 * 1000000 / config.drain_rate));
+        continue;
+      }
+      size_t n = std::min(room, len - done);
+      accept(transfer->data_buffer + done, n);
+      done += n;
+    }
+
+    transfer->actual_num_bytes = done;
+    transfer->status = fail ? USB_TRANSFER_STATUS_ERROR : USB_TRANSFER_STATUS_COMPLETED;
+  }
+
+  // Must be called with mutex held
+  void control(usb_transfer_t *transfer) {
+    usb_setup_packet_t *setup = (usb_setup_packet_t *) transfer->data_buffer;
+    stats.control_transfers++;
+    // GET_PORT_STATUS
+    if (config.port_status && setup->bRequest == 1) {
+      transfer->data_buffer[sizeof(usb_setup_packet_t)] = paper_out ? 0x20 : 0x18;
+      transfer->actual_num_bytes = sizeof(usb_setup_packet_t) + 1;
+      transfer->status = USB_TRANSFER_STATUS_COMPLETED;
+    } else {
+      transfer->actual_num_bytes = 0;
+      transfer->status = USB_TRANSFER_STATUS_STALL;
+    }
+    usb_host_complete(transfer);
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping) {
+      changed.wait(lock, [this]() {
+        return stopping || (!halted && !out_queue.empty()) || (status_replies_due > 0 && !in_queue.empty());
+      });
+      if (status_replies_due > 0 && !in_queue.empty()) {
+        usb_transfer_t *transfer = in_queue.front();
+        in_queue.pop_front();
+        status_replies_due--;
+        // DLE EOT 2: bits 1 and 4 always set, paper end in bit 5
+        transfer->data_buffer[0] = 0x12 | (paper_out ? 0x20 : 0);
+        transfer->actual_num_bytes = 1;
+        transfer->status = USB_TRANSFER_STATUS_COMPLETED;
+        usb_host_complete(transfer);
+      }
+      if (!halted && !out_queue.empty()) {
+        usb_transfer_t *transfer = out_queue.front();
+        receiving = transfer;
+        lock.unlock();
+        receive(transfer);
+        lock.lock();
+        // Only leaves the queue once done, so that a flush can't complete it a second time
+        out_queue.pop_front();
+        receiving = nullptr;
+        if (transfer->status != USB_TRANSFER_STATUS_COMPLETED) {
+          halted = true;
+        }
+        usb_host_complete(transfer);
+      }
+    }
+  }
+
+  void completeAll(std::deque<usb_transfer_t *> &queue, usb_transfer_status_t status) {
+    for (usb_transfer_t *transfer : queue) {
+      transfer->actual_num_bytes = 0;
+      transfer->status = status;
+      usb_host_complete(transfer);
+    }
+    queue.clear();
+  }
+
+  // Complete the OUT transfers that are still queued, in order, apart from the one being received
+  void completeOut(usb_transfer_status_t status) {
+    std::deque<usb_transfer_t *> kept;
+    std::deque<usb_transfer_t *> cancelled;
+    for (usb_transfer_t *transfer : out_queue) {
+      (transfer == receiving ? kept : cancelled).push_back(transfer);
+    }
+    out_queue.swap(kept);
+    completeAll(cancelled, status);
+  }
+
+public:
+  FakePrinter(const fake_printer_config_t &config = FAKE_PRINTER_DEFAULTS) : config(config) {
+    fill_us = esp_timer_get_time();
+    thread = std::thread(&FakePrinter::run, this);
+  }
+
+  ~FakePrinter() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+      changed.notify_all();
+    }
+    thread.join();
+  }
+
+  esp_err_t submit(usb_transfer_t *transfer) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (gone || (halted && transfer->bEndpointAddress == OUT_EP)) {
+      return ESP_ERR_INVALID_STATE;
+    }
+    if (refuse_submits && transfer->bEndpointAddress == OUT_EP) {
+      return ESP_ERR_NO_MEM;
+    }
+    if (transfer->bEndpointAddress == 0) {
+      // Answered right away, the callback still comes from the client thread
+      control(transfer);
+      return ESP_OK;
+    }
+    std::deque<usb_transfer_t *> &queue = transfer->bEndpointAddress & 0x80 ? in_queue : out_queue;
+    queue.push_back(transfer);
+    if (&queue == &out_queue && out_queue.size() > stats.max_queued_transfers) {
+      stats.max_queued_transfers = out_queue.size();
+    }
+    changed.notify_all();
+    return ESP_OK;
+  }
+
+  esp_err_t halt(uint8_t endpoint_address) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!(endpoint_address & 0x80)) {
+      halted = true;
+    }
+    return ESP_OK;
+  }
+
+  // Cancels whatever is queued on a halted endpoint
+  esp_err_t flush(uint8_t endpoint_address) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (endpoint_address & 0x80) {
+      completeAll(in_queue, USB_TRANSFER_STATUS_CANCELED);
+      return ESP_OK;
+    }
+    if (!halted) {
+      return ESP_ERR_INVALID_STATE;
+    }
+    completeOut(USB_TRANSFER_STATUS_CANCELED);
+    return ESP_OK;
+  }
+
+  // Lets a halted endpoint go on with the transfers submitted from now on
+  esp_err_t clear(uint8_t endpoint_address) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!(endpoint_address & 0x80) && !gone) {
+      halted = false;
+      changed.notify_all();
+    }
+    return ESP_OK;
+  }
+
+  // Pull the plug, transfers still queued come back with USB_TRANSFER_STATUS_NO_DEVICE
+  void unplug() {
+    std::lock_guard<std::mutex> lock(mutex);
+    gone = true;
+    halted = true;
+    completeAll(in_queue, USB_TRANSFER_STATUS_NO_DEVICE);
+    completeOut(USB_TRANSFER_STATUS_NO_DEVICE);
+  }
+
+  void setPaperOut(bool paper_out) {
+    std::lock_guard<std::mutex> lock(mutex);
+    this->paper_out = paper_out;
+    changed.notify_all();
+  }
+
+  // The next count OUT transfers fail after after_bytes of their data got through, each one halts
+  // the OUT endpoint until it is cleared
+  void failTransfers(uint32_t count, size_t after_bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    fail_transfers = count;
+    fail_after_bytes = after_bytes;
+  }
+
+  // OUT transfers are refused while set, as the host library does when it runs out of resources,
+  // without the endpoint being halted
+  void refuseSubmits(bool refuse) {
+    std::lock_guard<std::mutex> lock(mutex);
+    refuse_submits = refuse;
+  }
+
+  // Wait until job has come out of the printer, returns the time it did in esp_timer_get_time()
+  // microseconds or -1 on timeout
+  int64_t waitForJob(uint32_t job, uint32_t timeout_ms) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!changed.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+                          [&]() { return jobs_printed_us.count(job) > 0; })) {
+      return -1;
+    }
+    int64_t printed_us = jobs_printed_us[job];
+    lock.unlock();
+    int64_t now_us = esp_timer_get_time();
+    if (printed_us > now_us) {
+      std::this_thread::sleep_for(std::chrono::microseconds(printed_us - now_us));
+    }
+    return printed_us;
+  }
+
+  // Everything received so far, in order
+  std::string data() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return received;
+  }
+
+  fake_printer_stats_t getStats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+  }
+};
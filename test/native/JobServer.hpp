@@ -0,0 +1,287 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include <esp_timer.h>
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A printi server on 127.0.0.1 with a queue of jobs. GET /nextinqueue/<name> hands out the next
+// one, or 204 once the queue is empty, on a keep-alive connection like the real server. With
+// setLongPoll() it holds a request on an empty queue until a job comes, like the real server does.
+// GET /events/<name> is a server-sent events channel that announces every job as it is queued.
+//
+// Every job gets a marker appended, #job-<n>#, before it is compressed, so that FakePrinter can
+// tell when it came out of the printer.
+
+typedef struct {
+  std::string body;
+  std::string content_type;
+  // Sent gzip compressed with Content-Encoding: gzip
+  bool gzip;
+  // Sent with Transfer-Encoding: chunked instead of Content-Length
+  bool chunked;
+  // X-Printi-Printer, empty to leave the choice to the firmware
+  std::string printer;
+} job_server_job_t;
+
+static const job_server_job_t JOB_SERVER_TEXT_JOB = {"", "application/octet-stream", false, false, ""};
+
+class JobServer {
+private:
+  int listen_fd = -1;
+  uint16_t port = 0;
+  std::thread thread;
+  std::vector<std::thread> connections;
+
+  std::mutex mutex;
+  std::condition_variable job_added;
+  bool stopping = false;
+  // Connections still open, and those of them that are event channels
+  std::set<int> connection_fds;
+  std::set<int> event_fds;
+  uint32_t long_poll_ms = 0;
+  std::deque<std::pair<uint32_t, std::string>> queue;
+  std::map<uint32_t, int64_t> added_us;
+  std::map<uint32_t, int64_t> requested_us;
+  uint32_t next_job = 1;
+  uint32_t requests = 0;
+  uint64_t body_bytes = 0;
+
+  static std::string gzip(const std::string &data) {
+    z_stream stream = {};
+    // 16 on top of the window bits for a gzip header
+    deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY);
+    std::string out(deflateBound(&stream, data.length()), '\0');
+    stream.next_in = (Bytef *) data.data();
+    stream.avail_in = data.length();
+    stream.next_out = (Bytef *) &out[0];
+    stream.avail_out = out.length();
+    deflate(&stream, Z_FINISH);
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+    return out;
+  }
+
+  static bool sendAll(int fd, const std::string &data) {
+    size_t sent = 0;
+    while (sent < data.length()) {
+      ssize_t n = send(fd, data.data() + sent, data.length() - sent, MSG_NOSIGNAL);
+      if (n <= 0) {
+        return false;
+      }
+      sent += n;
+    }
+    return true;
+  }
+
+  void closeConnection(int fd) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      connection_fds.erase(fd);
+      event_fds.erase(fd);
+    }
+    close(fd);
+  }
+
+  // Serve requests on one connection until the client closes it
+  void serve(int fd) {
+    std::string buffer;
+    char chunk[1024];
+    while (true) {
+      size_t end;
+      while ((end = buffer.find("\r\n\r\n")) == std::string::npos) {
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0) {
+          closeConnection(fd);
+          return;
+        }
+        buffer.append(chunk, n);
+      }
+      std::string request = buffer.substr(0, end);
+      buffer.erase(0, end + 4);
+
+      std::string response;
+      if (request.compare(0, 12, "GET /events/") == 0) {
+        // Announcements go out from add() from now on, the connection stays open until either
+        // side closes it
+        std::lock_guard<std::mutex> lock(mutex);
+        if (sendAll(fd, "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\n"
+                        "Cache-Control: no-cache\r\n\r\n")) {
+          event_fds.insert(fd);
+        }
+        continue;
+      } else if (request.compare(0, 17, "GET /nextinqueue/") != 0) {
+        response = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+      } else {
+        std::unique_lock<std::mutex> lock(mutex);
+        requests++;
+        job_added.wait_for(lock, std::chrono::milliseconds(long_poll_ms), [this]() { return stopping || !queue.empty(); });
+        if (queue.empty()) {
+          response = "HTTP/1.1 204 No Content\r\n\r\n";
+        } else {
+          requested_us[queue.front().first] = esp_timer_get_time();
+          // Moved, jobs can be megabytes
+          response = std::move(queue.front().second);
+          queue.pop_front();
+        }
+      }
+      if (!sendAll(fd, response)) {
+        closeConnection(fd);
+        return;
+      }
+    }
+  }
+
+  void run() {
+    while (true) {
+      int fd = accept(listen_fd, nullptr, nullptr);
+      if (fd < 0) {
+        // Closed by the destructor
+        return;
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      connection_fds.insert(fd);
+      connections.emplace_back(&JobServer::serve, this, fd);
+    }
+  }
+
+public:
+  JobServer() {
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    // Any free port
+    addr.sin_port = 0;
+    bind(listen_fd, (sockaddr *) &addr, sizeof(addr));
+    listen(listen_fd, 4);
+    socklen_t len = sizeof(addr);
+    getsockname(listen_fd, (sockaddr *) &addr, &len);
+    port = ntohs(addr.sin_port);
+    thread = std::thread(&JobServer::run, this);
+  }
+
+  ~JobServer() {
+    shutdown(listen_fd, SHUT_RDWR);
+    close(listen_fd);
+    thread.join();
+    // Wake up held requests and close what clients left open
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+      job_added.notify_all();
+      for (int fd : connection_fds) {
+        shutdown(fd, SHUT_RDWR);
+      }
+    }
+    for (std::thread &connection : connections) {
+      connection.join();
+    }
+  }
+
+  uint16_t getPort() {
+    return port;
+  }
+
+  // Hold requests on an empty queue for up to ms until a job comes, 0 to answer 204 right away
+  void setLongPoll(uint32_t ms) {
+    std::lock_guard<std::mutex> lock(mutex);
+    long_poll_ms = ms;
+  }
+
+  // Drop every event channel, as a proxy that cuts idle connections would
+  void closeEvents() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (int fd : event_fds) {
+      shutdown(fd, SHUT_RDWR);
+    }
+  }
+
+  size_t eventChannels() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return event_fds.size();
+  }
+
+  // Queue a job, returns its number
+  uint32_t add(const job_server_job_t &job) {
+    std::lock_guard<std::mutex> lock(mutex);
+    uint32_t id = next_job++;
+    std::string body = job.body + "#job-" + std::to_string(id) + "#";
+    if (job.gzip) {
+      body = gzip(body);
+    }
+    body_bytes += body.length();
+
+    std::string response = "HTTP/1.1 200 OK\r\nContent-Type: " + job.content_type + "\r\n";
+    if (job.gzip) {
+      response += "Content-Encoding: gzip\r\n";
+    }
+    if (!job.printer.empty()) {
+      response += "X-Printi-Printer: " + job.printer + "\r\n";
+    }
+    if (job.chunked) {
+      response += "Transfer-Encoding: chunked\r\n\r\n";
+      // Chunks of about what the real server flushes at a time
+      for (size_t i = 0; i < body.length(); i += 1400) {
+        std::string chunk = body.substr(i, 1400);
+        char size[16];
+        snprintf(size, sizeof(size), "%zx\r\n", chunk.length());
+        response += size + chunk + "\r\n";
+      }
+      response += "0\r\n\r\n";
+    } else {
+      response += "Content-Length: " + std::to_string(body.length()) + "\r\n\r\n" + body;
+    }
+    queue.push_back({id, response});
+    added_us[id] = esp_timer_get_time();
+    job_added.notify_all();
+    std::string event = "event: job\ndata: " + std::to_string(id) + "\n\n";
+    for (int fd : event_fds) {
+      sendAll(fd, event);
+    }
+    return id;
+  }
+
+  // When the job was queued in esp_timer_get_time() microseconds, -1 if there is no such job
+  int64_t addedUs(uint32_t job) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = added_us.find(job);
+    return it != added_us.end() ? it->second : -1;
+  }
+
+  // When the job was handed out in esp_timer_get_time() microseconds, -1 if it wasn't yet
+  int64_t requestedUs(uint32_t job) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = requested_us.find(job);
+    return it != requested_us.end() ? it->second : -1;
+  }
+
+  size_t queued() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return queue.size();
+  }
+
+  uint32_t getRequests() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return requests;
+  }
+
+  // Bytes of all job bodies as sent, i.e. compressed
+  uint64_t getBodyBytes() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return body_bytes;
+  }
+};
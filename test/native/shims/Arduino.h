@@ -0,0 +1,444 @@
+#pragma once
+
+// Host stand-in for the Arduino core: String, Print, Stream, Serial, ESP and IPAddress, with
+// time taken from esp_timer and delays mapped onto FreeRTOS.
+
+#include <ctype.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <algorithm>
+#include <string>
+
+// The socket headers define INADDR_NONE as a macro, the Arduino core has an IPAddress of that
+// name. They have to come first, so that later includes of them don't bring the macro back.
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#undef INADDR_NONE
+
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+using std::max;
+using std::min;
+
+#define BIT(nr) (1UL << (nr))
+
+#define DEC 10
+#define HEX 16
+
+#define LOW 0
+#define HIGH 1
+
+// Flash is memory mapped on the ESP32 as well, PROGMEM is plain memory
+#define PROGMEM
+#define PGM_P const char *
+#define F(string_literal) (string_literal)
+#define memcpy_P memcpy
+#define pgm_read_byte(addr) (*(const uint8_t *) (addr))
+
+static inline unsigned long millis() {
+  return esp_timer_get_time() / 1000;
+}
+
+static inline unsigned long micros() {
+  return esp_timer_get_time();
+}
+
+static inline void delay(uint32_t ms) {
+  vTaskDelay(pdMS_TO_TICKS(ms));
+}
+
+class String {
+private:
+  std::string s;
+
+public:
+  String() {}
+  String(const char *cstr) : s(cstr != nullptr ? cstr : "") {}
+  String(const char *cstr, size_t len) : s(cstr, len) {}
+  String(const std::string &str) : s(str) {}
+  explicit String(char c) : s(1, c) {}
+  explicit String(int value, unsigned char base = DEC) : String((long) value, base) {}
+  explicit String(unsigned int value, unsigned char base = DEC) : String((unsigned long) value, base) {}
+  explicit String(long value, unsigned char base = DEC) {
+    char buffer[24];
+    snprintf(buffer, sizeof(buffer), base == HEX ? "%lx" : "%ld", value);
+    s = buffer;
+  }
+  explicit String(unsigned long value, unsigned char base = DEC) {
+    char buffer[24];
+    snprintf(buffer, sizeof(buffer), base == HEX ? "%lx" : "%lu", value);
+    s = buffer;
+  }
+  explicit String(double value, unsigned int decimal_places = 2) {
+    char buffer[48];
+    snprintf(buffer, sizeof(buffer), "%.*f", decimal_places, value);
+    s = buffer;
+  }
+
+  const char *c_str() const {
+    return s.c_str();
+  }
+
+  unsigned int length() const {
+    return s.length();
+  }
+
+  bool isEmpty() const {
+    return s.empty();
+  }
+
+  bool reserve(unsigned int size) {
+    s.reserve(size);
+    return true;
+  }
+
+  char operator[](unsigned int index) const {
+    return index < s.length() ? s[index] : 0;
+  }
+
+  char &operator[](unsigned int index) {
+    return s[index];
+  }
+
+  char charAt(unsigned int index) const {
+    return (*this)[index];
+  }
+
+  String &operator+=(const String &other) {
+    s += other.s;
+    return *this;
+  }
+
+  String &operator+=(const char *cstr) {
+    s += cstr;
+    return *this;
+  }
+
+  String &operator+=(char c) {
+    s += c;
+    return *this;
+  }
+
+  bool concat(const char *cstr, unsigned int len) {
+    s.append(cstr, len);
+    return true;
+  }
+
+  bool operator==(const String &other) const {
+    return s == other.s;
+  }
+
+  bool operator==(const char *cstr) const {
+    return s == cstr;
+  }
+
+  bool operator!=(const String &other) const {
+    return s != other.s;
+  }
+
+  bool operator!=(const char *cstr) const {
+    return s != cstr;
+  }
+
+  bool equals(const String &other) const {
+    return s == other.s;
+  }
+
+  bool equalsIgnoreCase(const String &other) const {
+    return s.length() == other.s.length() && strcasecmp(s.c_str(), other.s.c_str()) == 0;
+  }
+
+  bool startsWith(const String &prefix) const {
+    return s.compare(0, prefix.s.length(), prefix.s) == 0;
+  }
+
+  bool endsWith(const String &suffix) const {
+    return s.length() >= suffix.s.length() &&
+           s.compare(s.length() - suffix.s.length(), suffix.s.length(), suffix.s) == 0;
+  }
+
+  int indexOf(char c, unsigned int from = 0) const {
+    size_t index = s.find(c, from);
+    return index == std::string::npos ? -1 : (int) index;
+  }
+
+  int indexOf(const String &str, unsigned int from = 0) const {
+    size_t index = s.find(str.s, from);
+    return index == std::string::npos ? -1 : (int) index;
+  }
+
+  String substring(unsigned int begin) const {
+    return begin < s.length() ? String(s.substr(begin)) : String();
+  }
+
+  String substring(unsigned int begin, unsigned int end) const {
+    return begin < end && begin < s.length() ? String(s.substr(begin, end - begin)) : String();
+  }
+
+  // Everything from index on
+  void remove(unsigned int index) {
+    if (index < s.length()) {
+      s.erase(index);
+    }
+  }
+
+  void trim() {
+    size_t begin = 0;
+    while (begin < s.length() && isspace((unsigned char) s[begin])) {
+      begin++;
+    }
+    size_t end = s.length();
+    while (end > begin && isspace((unsigned char) s[end - 1])) {
+      end--;
+    }
+    s = s.substr(begin, end - begin);
+  }
+
+  void toLowerCase() {
+    for (char &c : s) {
+      c = tolower((unsigned char) c);
+    }
+  }
+
+  long toInt() const {
+    return atol(s.c_str());
+  }
+
+  friend String operator+(const String &a, const String &b) {
+    return String(a.s + b.s);
+  }
+
+  friend String operator+(const String &a, const char *b) {
+    return String(a.s + b);
+  }
+
+  friend String operator+(const char *a, const String &b) {
+    return String(a + b.s);
+  }
+
+  friend String operator+(const String &a, char b) {
+    return String(a.s + b);
+  }
+};
+
+class Print {
+public:
+  virtual ~Print() {}
+
+  virtual size_t write(uint8_t c) = 0;
+
+  virtual size_t write(const uint8_t *buffer, size_t size) {
+    size_t n = 0;
+    while (size--) {
+      if (write(*buffer++) == 0) {
+        break;
+      }
+      n++;
+    }
+    return n;
+  }
+
+  size_t write(const char *str) {
+    return str != nullptr ? write((const uint8_t *) str, strlen(str)) : 0;
+  }
+
+  size_t write(const char *buffer, size_t size) {
+    return write((const uint8_t *) buffer, size);
+  }
+
+  virtual void flush() {}
+
+  size_t printf(const char *format, ...) {
+    char buffer[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    return len > 0 ? write((const uint8_t *) buffer, std::min((size_t) len, sizeof(buffer) - 1)) : 0;
+  }
+
+  size_t print(const String &str) {
+    return write((const uint8_t *) str.c_str(), str.length());
+  }
+
+  size_t print(const char *str) {
+    return write(str);
+  }
+
+  size_t print(char c) {
+    return write((uint8_t) c);
+  }
+
+  size_t print(int value, int base = DEC) {
+    return print(String(value, base));
+  }
+
+  size_t print(unsigned int value, int base = DEC) {
+    return print(String(value, base));
+  }
+
+  size_t print(long value, int base = DEC) {
+    return print(String(value, base));
+  }
+
+  size_t print(unsigned long value, int base = DEC) {
+    return print(String(value, base));
+  }
+
+  size_t print(double value, int digits = 2) {
+    return print(String(value, digits));
+  }
+
+  size_t println() {
+    return write("\r\n");
+  }
+
+  template<typename T>
+  size_t println(const T &value) {
+    size_t n = print(value);
+    return n + println();
+  }
+};
+
+class Stream : public Print {
+protected:
+  unsigned long timeout = 1000;
+
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+
+  void setTimeout(unsigned long timeout) {
+    this->timeout = timeout;
+  }
+
+  unsigned long getTimeout() {
+    return timeout;
+  }
+
+  virtual size_t readBytes(uint8_t *buffer, size_t length) {
+    size_t count = 0;
+    unsigned long start = millis();
+    while (count < length) {
+      int c = read();
+      if (c < 0) {
+        if (millis() - start >= timeout) {
+          break;
+        }
+        delay(1);
+        continue;
+      }
+      buffer[count++] = c;
+    }
+    return count;
+  }
+
+  size_t readBytes(char *buffer, size_t length) {
+    return readBytes((uint8_t *) buffer, length);
+  }
+};
+
+// Writes to stdout, never has anything to read
+class HardwareSerial : public Stream {
+public:
+  void begin(unsigned long baud) {}
+
+  void setDebugOutput(bool enable) {}
+
+  size_t write(uint8_t c) {
+    return fwrite(&c, 1, 1, stdout);
+  }
+
+  size_t write(const uint8_t *buffer, size_t size) {
+    return fwrite(buffer, 1, size, stdout);
+  }
+
+  int available() {
+    return 0;
+  }
+
+  int read() {
+    return -1;
+  }
+
+  int peek() {
+    return -1;
+  }
+};
+
+inline HardwareSerial Serial;
+
+class EspClass {
+public:
+  // There is no fixed heap on the host, these only keep log lines working
+  uint32_t getFreeHeap() {
+    return 0;
+  }
+
+  uint32_t getMinFreeHeap() {
+    return 0;
+  }
+
+  uint64_t getEfuseMac() {
+    return 0x0000a1b2c3d4e5f6ULL;
+  }
+
+  void restart() {
+    fprintf(stderr, "ESP.restart() called\n");
+    exit(0);
+  }
+};
+
+inline EspClass ESP;
+
+class IPAddress {
+private:
+  // Network byte order, as in the core
+  uint32_t address = 0;
+
+public:
+  IPAddress() {}
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : address(htonl((a << 24) | (b << 16) | (c << 8) | d)) {}
+  IPAddress(uint32_t address) : address(address) {}
+
+  operator uint32_t() const {
+    return address;
+  }
+
+  bool operator==(const IPAddress &other) const {
+    return address == other.address;
+  }
+
+  bool operator!=(const IPAddress &other) const {
+    return address != other.address;
+  }
+
+  bool fromString(const char *str) {
+    struct in_addr parsed;
+    if (inet_pton(AF_INET, str, &parsed) != 1) {
+      return false;
+    }
+    address = parsed.s_addr;
+    return true;
+  }
+
+  String toString() const {
+    char buffer[INET_ADDRSTRLEN];
+    struct in_addr in = {address};
+    return String(inet_ntop(AF_INET, &in, buffer, sizeof(buffer)));
+  }
+};
+
+inline const IPAddress INADDR_NONE(0, 0, 0, 0);
@@ -0,0 +1,4 @@
+#pragma once
+
+// Arduino's shortcut for freertos/FreeRTOS.h
+#include "freertos/FreeRTOS.h"
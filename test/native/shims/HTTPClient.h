@@ -0,0 +1,286 @@
+#pragma once
+
+// Host stand-in for the Arduino HTTPClient, HTTP/1.1 over a WiFiClient with keep-alive, chunked
+// and Content-Length bodies. Only what the firmware uses.
+
+#include <Arduino.h>
+#include <WiFi.h>
+
+#include <utility>
+#include <vector>
+
+#define HTTPC_ERROR_CONNECTION_REFUSED (-1)
+#define HTTPC_ERROR_SEND_HEADER_FAILED (-2)
+#define HTTPC_ERROR_SEND_PAYLOAD_FAILED (-3)
+#define HTTPC_ERROR_NOT_CONNECTED (-4)
+#define HTTPC_ERROR_CONNECTION_LOST (-5)
+#define HTTPC_ERROR_NO_STREAM (-6)
+#define HTTPC_ERROR_NO_HTTP_SERVER (-7)
+#define HTTPC_ERROR_TOO_LESS_RAM (-8)
+#define HTTPC_ERROR_ENCODING (-9)
+#define HTTPC_ERROR_STREAM_WRITE (-10)
+#define HTTPC_ERROR_READ_TIMEOUT (-11)
+
+#define HTTP_CODE_OK 200
+#define HTTP_CODE_NO_CONTENT 204
+#define HTTP_CODE_PARTIAL_CONTENT 206
+#define HTTP_CODE_NOT_MODIFIED 304
+
+class HTTPClient {
+private:
+  WiFiClient *client = nullptr;
+  String host;
+  uint16_t port = 80;
+  String uri;
+  bool reuse = true;
+  bool http10 = false;
+  uint32_t timeout_ms = 5000;
+
+  String request_headers;
+  std::vector<std::pair<String, String>> collected;
+
+  int size = -1;
+  bool chunked = false;
+  bool keep_alive = false;
+  bool body_read = false;
+
+  // One line without its line ending, false on timeout or a closed connection
+  bool readLine(String &line) {
+    line = String();
+    while (true) {
+      int c = client->read();
+      if (c < 0) {
+        return false;
+      }
+      if (c == '\n') {
+        if (line.length() > 0 && line[line.length() - 1] == '\r') {
+          line = line.substring(0, line.length() - 1);
+        }
+        return true;
+      }
+      line += (char) c;
+    }
+  }
+
+  // Copy len bytes of the body to stream, returns 0 or an error
+  int copy(Stream *stream, size_t len, size_t *total) {
+    uint8_t buffer[1460];
+    while (len > 0) {
+      int n = client->read(buffer, std::min(len, sizeof(buffer)));
+      if (n <= 0) {
+        return client->connected() ? HTTPC_ERROR_READ_TIMEOUT : HTTPC_ERROR_CONNECTION_LOST;
+      }
+      if (stream->write(buffer, n) != (size_t) n) {
+        return HTTPC_ERROR_STREAM_WRITE;
+      }
+      len -= n;
+      *total += n;
+    }
+    return 0;
+  }
+
+  int sendRequest(const char *method) {
+    if (client == nullptr) {
+      return HTTPC_ERROR_NOT_CONNECTED;
+    }
+    if (!client->connected()) {
+      IPAddress ip;
+      if (!WiFi.hostByName(host.c_str(), ip) || !client->connect(ip, port)) {
+        return HTTPC_ERROR_CONNECTION_REFUSED;
+      }
+    }
+    client->setTimeout(timeout_ms);
+
+    String request = String(method) + " " + uri + (http10 ? " HTTP/1.0" : " HTTP/1.1") + "\r\nHost: " + host + "\r\n" +
+                     "User-Agent: ESP32HTTPClient\r\n" + (reuse ? "Connection: keep-alive\r\n" : "Connection: close\r\n") +
+                     request_headers + "\r\n";
+    if (client->write((const uint8_t *) request.c_str(), request.length()) != request.length()) {
+      return HTTPC_ERROR_SEND_HEADER_FAILED;
+    }
+
+    for (auto &header : collected) {
+      header.second = String();
+    }
+    size = -1;
+    chunked = false;
+    keep_alive = reuse;
+    body_read = false;
+
+    String line;
+    if (!readLine(line)) {
+      return client->connected() ? HTTPC_ERROR_READ_TIMEOUT : HTTPC_ERROR_CONNECTION_LOST;
+    }
+    if (!line.startsWith("HTTP/1.")) {
+      return HTTPC_ERROR_NO_HTTP_SERVER;
+    }
+    int code = line.substring(9, 12).toInt();
+
+    while (readLine(line) && line.length() > 0) {
+      int colon = line.indexOf(':');
+      if (colon < 0) {
+        continue;
+      }
+      String name = line.substring(0, colon);
+      String value = line.substring(colon + 1);
+      value.trim();
+      if (name.equalsIgnoreCase("Content-Length")) {
+        size = value.toInt();
+      } else if (name.equalsIgnoreCase("Transfer-Encoding")) {
+        chunked = value.equalsIgnoreCase("chunked");
+      } else if (name.equalsIgnoreCase("Connection")) {
+        keep_alive = keep_alive && !value.equalsIgnoreCase("close");
+      }
+      for (auto &header : collected) {
+        if (header.first.equalsIgnoreCase(name)) {
+          header.second = value;
+        }
+      }
+    }
+    if (size == 0 || code == HTTP_CODE_NO_CONTENT || code == HTTP_CODE_NOT_MODIFIED) {
+      body_read = true;
+    }
+    return code;
+  }
+
+public:
+  bool begin(WiFiClient &client, const String &url) {
+    this->client = &client;
+    int scheme_end = url.indexOf("://");
+    String rest = scheme_end >= 0 ? url.substring(scheme_end + 3) : url;
+    int path_start = rest.indexOf('/');
+    String authority = path_start >= 0 ? rest.substring(0, path_start) : rest;
+    uri = path_start >= 0 ? rest.substring(path_start) : String("/");
+    int colon = authority.indexOf(':');
+    host = colon >= 0 ? authority.substring(0, colon) : authority;
+    port = colon >= 0 ? authority.substring(colon + 1).toInt() : (url.startsWith("https") ? 443 : 80);
+    return true;
+  }
+
+  // Only a path is supported, as on the device that keeps the connection
+  bool setURL(const String &url) {
+    if (!url.startsWith("/")) {
+      return false;
+    }
+    uri = url;
+    return true;
+  }
+
+  void setReuse(bool reuse) {
+    this->reuse = reuse;
+  }
+
+  // Keeps chunked framing out of the body, which is then read from getStreamPtr() until the server
+  // closes the connection
+  void useHTTP10(bool http10) {
+    this->http10 = http10;
+    reuse = reuse && !http10;
+  }
+
+  void setTimeout(uint32_t timeout_ms) {
+    this->timeout_ms = timeout_ms;
+  }
+
+  void collectHeaders(const char *keys[], size_t count) {
+    collected.clear();
+    for (size_t i = 0; i < count; i++) {
+      collected.push_back({String(keys[i]), String()});
+    }
+  }
+
+  void addHeader(const String &name, const String &value) {
+    request_headers += name + ": " + value + "\r\n";
+  }
+
+  int GET() {
+    return sendRequest("GET");
+  }
+
+  String header(const char *name) {
+    for (auto &header : collected) {
+      if (header.first.equalsIgnoreCase(name)) {
+        return header.second;
+      }
+    }
+    return String();
+  }
+
+  int getSize() {
+    return size;
+  }
+
+  WiFiClient *getStreamPtr() {
+    return client != nullptr && client->connected() ? client : nullptr;
+  }
+
+  // Write the whole body to stream, returns the number of bytes written or an error
+  int writeToStream(Stream *stream) {
+    if (stream == nullptr) {
+      return HTTPC_ERROR_NO_STREAM;
+    }
+    if (client == nullptr || !client->connected()) {
+      return HTTPC_ERROR_NOT_CONNECTED;
+    }
+    size_t total = 0;
+    int error = 0;
+    if (chunked) {
+      String line;
+      while (error == 0) {
+        if (!readLine(line)) {
+          return HTTPC_ERROR_READ_TIMEOUT;
+        }
+        size_t chunk = strtoul(line.c_str(), nullptr, 16);
+        if (chunk == 0) {
+          // Trailer up to the empty line
+          while (readLine(line) && line.length() > 0) {
+          }
+          break;
+        }
+        error = copy(stream, chunk, &total);
+        if (error == 0 && !readLine(line)) {
+          error = HTTPC_ERROR_READ_TIMEOUT;
+        }
+      }
+    } else if (size >= 0) {
+      error = copy(stream, size, &total);
+    } else {
+      // Until the server closes the connection
+      uint8_t buffer[1460];
+      int n;
+      while ((n = client->read(buffer, sizeof(buffer))) > 0) {
+        stream->write(buffer, n);
+        total += n;
+      }
+      keep_alive = false;
+    }
+    if (error != 0) {
+      return error;
+    }
+    body_read = true;
+    return total;
+  }
+
+  // Keeps the connection for the next request if the body was read and the server allows it
+  void end() {
+    if (client != nullptr && !(reuse && keep_alive && body_read)) {
+      client->stop();
+    }
+    request_headers = String();
+  }
+
+  static String errorToString(int error) {
+    switch (error) {
+      case HTTPC_ERROR_CONNECTION_REFUSED: return "connection refused";
+      case HTTPC_ERROR_SEND_HEADER_FAILED: return "send header failed";
+      case HTTPC_ERROR_SEND_PAYLOAD_FAILED: return "send payload failed";
+      case HTTPC_ERROR_NOT_CONNECTED: return "not connected";
+      case HTTPC_ERROR_CONNECTION_LOST: return "connection lost";
+      case HTTPC_ERROR_NO_STREAM: return "no stream";
+      case HTTPC_ERROR_NO_HTTP_SERVER: return "no HTTP server";
+      case HTTPC_ERROR_TOO_LESS_RAM: return "too less ram";
+      case HTTPC_ERROR_ENCODING: return "Transfer-Encoding not supported";
+      case HTTPC_ERROR_STREAM_WRITE: return "Stream write error";
+      case HTTPC_ERROR_READ_TIMEOUT: return "read Timeout";
+      default: return String();
+    }
+  }
+};
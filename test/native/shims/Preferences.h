@@ -0,0 +1,94 @@
+#pragma once
+
+// Host stand-in for the NVS backed Preferences, kept in memory for the run of the program
+
+#include <Arduino.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+class Preferences {
+private:
+  std::map<std::string, std::vector<uint8_t>> values;
+
+  template<typename T>
+  T get(const char *key, T default_value) {
+    auto found = values.find(key);
+    if (found == values.end() || found->second.size() != sizeof(T)) {
+      return default_value;
+    }
+    T value;
+    memcpy(&value, found->second.data(), sizeof(T));
+    return value;
+  }
+
+  template<typename T>
+  size_t put(const char *key, T value) {
+    values[key].assign((const uint8_t *) &value, (const uint8_t *) &value + sizeof(T));
+    return sizeof(T);
+  }
+
+public:
+  bool begin(const char *name, bool read_only = false) {
+    return true;
+  }
+
+  void end() {}
+
+  bool clear() {
+    values.clear();
+    return true;
+  }
+
+  bool remove(const char *key) {
+    return values.erase(key) > 0;
+  }
+
+  bool isKey(const char *key) {
+    return values.count(key) > 0;
+  }
+
+  String getString(const char *key, const String &default_value = String()) {
+    auto found = values.find(key);
+    if (found == values.end()) {
+      return default_value;
+    }
+    return String((const char *) found->second.data(), found->second.size());
+  }
+
+  size_t putString(const char *key, const String &value) {
+    values[key].assign(value.c_str(), value.c_str() + value.length());
+    return value.length();
+  }
+
+  bool getBool(const char *key, bool default_value = false) {
+    return get<uint8_t>(key, default_value) != 0;
+  }
+
+  size_t putBool(const char *key, bool value) {
+    return put<uint8_t>(key, value);
+  }
+
+  int32_t getInt(const char *key, int32_t default_value = 0) {
+    return get<int32_t>(key, default_value);
+  }
+
+  size_t putInt(const char *key, int32_t value) {
+    return put<int32_t>(key, value);
+  }
+
+  size_t getBytes(const char *key, void *buffer, size_t len) {
+    auto found = values.find(key);
+    if (found == values.end() || found->second.size() > len) {
+      return 0;
+    }
+    memcpy(buffer, found->second.data(), found->second.size());
+    return found->second.size();
+  }
+
+  size_t putBytes(const char *key, const void *value, size_t len) {
+    values[key].assign((const uint8_t *) value, (const uint8_t *) value + len);
+    return len;
+  }
+};
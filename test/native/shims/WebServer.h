@@ -0,0 +1,78 @@
+#pragma once
+
+// Host stand-in for the Arduino WebServer. Nothing listens, a response is only recorded, so that
+// tests can check what a page renders to and how many pieces it is sent in.
+
+#include <Arduino.h>
+
+#include <functional>
+
+#define CONTENT_LENGTH_UNKNOWN ((size_t) -1)
+
+typedef enum {
+  HTTP_ANY,
+  HTTP_GET,
+  HTTP_HEAD,
+  HTTP_POST,
+} HTTPMethod;
+
+class WebServer {
+private:
+  int code = 0;
+  String content_type;
+  String body;
+  size_t sends = 0;
+
+public:
+  WebServer(int port = 80) {}
+
+  void on(const String &uri, HTTPMethod method, std::function<void()> handler) {}
+
+  void begin() {}
+
+  void handleClient() {}
+
+  void collectHeaders(const char *keys[], size_t count) {}
+
+  String header(const char *name) {
+    return String();
+  }
+
+  void sendHeader(const String &name, const String &value, bool first = false) {}
+
+  void setContentLength(size_t len) {}
+
+  void send(int code, const char *content_type = nullptr, const String &content = String()) {
+    this->code = code;
+    this->content_type = content_type;
+    body = content;
+    sends = content.length() > 0 ? 1 : 0;
+  }
+
+  void send_P(int code, const char *content_type, const char *content, size_t len) {
+    send(code, content_type, String(content, len));
+  }
+
+  void sendContent(const char *content, size_t len) {
+    body.concat(content, len);
+    sends++;
+  }
+
+  void sendContent(const String &content) {
+    sendContent(content.c_str(), content.length());
+  }
+
+  // What the last response sent, for checking
+  int sentCode() {
+    return code;
+  }
+
+  const String &sentBody() {
+    return body;
+  }
+
+  // Number of pieces the body went out in, the terminating chunk included
+  size_t sentPieces() {
+    return sends;
+  }
+};
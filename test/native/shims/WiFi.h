@@ -0,0 +1,183 @@
+#pragma once
+
+// Host stand-in for the WiFi library. The host is always connected, clients are plain TCP sockets.
+
+#include <Arduino.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+typedef enum {
+  WL_IDLE_STATUS = 0,
+  WL_NO_SSID_AVAIL = 1,
+  WL_CONNECTED = 3,
+  WL_CONNECT_FAILED = 4,
+  WL_CONNECTION_LOST = 5,
+  WL_DISCONNECTED = 6,
+} wl_status_t;
+
+class WiFiClient : public Stream {
+protected:
+  int fd = -1;
+  int peeked = -1;
+
+  // Wait up to timeout for data, returns false if none came
+  bool waitReadable(unsigned long timeout_ms) {
+    struct pollfd p = {fd, POLLIN, 0};
+    return poll(&p, 1, timeout_ms) > 0;
+  }
+
+public:
+  virtual ~WiFiClient() {
+    stop();
+  }
+
+  virtual int connect(IPAddress ip, uint16_t port) {
+    stop();
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+      return 0;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = (uint32_t) ip;
+    if (::connect(fd, (struct sockaddr *) &address, sizeof(address)) != 0) {
+      stop();
+      return 0;
+    }
+    return 1;
+  }
+
+  // Connected while the peer hasn't closed its side
+  uint8_t connected() {
+    if (fd < 0) {
+      return 0;
+    }
+    if (peeked >= 0) {
+      return 1;
+    }
+    uint8_t c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+      stop();
+      return 0;
+    }
+    return 1;
+  }
+
+  void stop() {
+    if (fd >= 0) {
+      close(fd);
+      fd = -1;
+    }
+    peeked = -1;
+  }
+
+  size_t write(uint8_t c) {
+    return write(&c, 1);
+  }
+
+  size_t write(const uint8_t *buffer, size_t size) {
+    size_t sent = 0;
+    while (fd >= 0 && sent < size) {
+      ssize_t n = send(fd, buffer + sent, size - sent, MSG_NOSIGNAL);
+      if (n <= 0) {
+        stop();
+        break;
+      }
+      sent += n;
+    }
+    return sent;
+  }
+
+  int available() {
+    if (fd < 0) {
+      return 0;
+    }
+    if (peeked >= 0) {
+      return 1;
+    }
+    int n = 0;
+    ioctl(fd, FIONREAD, &n);
+    return n;
+  }
+
+  int read() {
+    uint8_t c;
+    return read(&c, 1) == 1 ? c : -1;
+  }
+
+  // Reads what is there, waiting up to the timeout for the first byte
+  int read(uint8_t *buffer, size_t size) {
+    if (fd < 0 || size == 0) {
+      return -1;
+    }
+    size_t n = 0;
+    if (peeked >= 0) {
+      buffer[n++] = peeked;
+      peeked = -1;
+      if (n == size) {
+        return n;
+      }
+    }
+    if (n == 0 && !waitReadable(timeout)) {
+      return -1;
+    }
+    ssize_t got = recv(fd, buffer + n, size - n, n == 0 ? 0 : MSG_DONTWAIT);
+    if (got == 0) {
+      stop();
+    }
+    return got > 0 ? n + got : (n > 0 ? (int) n : -1);
+  }
+
+  int peek() {
+    if (peeked < 0) {
+      peeked = read();
+    }
+    return peeked;
+  }
+};
+
+class WiFiClass {
+public:
+  wl_status_t status() {
+    return WL_CONNECTED;
+  }
+
+  int hostByName(const char *host, IPAddress &result) {
+    struct addrinfo hints = {};
+    hints.ai_family = AF_INET;
+    struct addrinfo *info = nullptr;
+    if (getaddrinfo(host, nullptr, &hints, &info) != 0 || info == nullptr) {
+      return 0;
+    }
+    result = IPAddress((uint32_t) ((struct sockaddr_in *) info->ai_addr)->sin_addr.s_addr);
+    freeaddrinfo(info);
+    return 1;
+  }
+
+  IPAddress localIP() {
+    return IPAddress(127, 0, 0, 1);
+  }
+
+  const char *getHostname() {
+    return "printi";
+  }
+
+  bool setHostname(const char *name) {
+    return true;
+  }
+
+  void reconnect() {}
+};
+
+inline WiFiClass WiFi;
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdarg.h>
+#include <stdio.h>
+
+#include <mutex>
+
+#include "esp_timer.h"
+
+typedef enum {
+  ESP_LOG_NONE,
+  ESP_LOG_ERROR,
+  ESP_LOG_WARN,
+  ESP_LOG_INFO,
+  ESP_LOG_DEBUG,
+  ESP_LOG_VERBOSE,
+} esp_log_level_t;
+
+// Warnings and errors only by default, so that benchmark output stays readable. Tests can turn
+// it up with esp_log_level_set().
+#ifndef ESP_LOG_HOST_DEFAULT_LEVEL
+#define ESP_LOG_HOST_DEFAULT_LEVEL ESP_LOG_WARN
+#endif
+
+namespace esp_log_host {
+
+static inline esp_log_level_t &level() {
+  static esp_log_level_t level = ESP_LOG_HOST_DEFAULT_LEVEL;
+  return level;
+}
+
+static inline void write(esp_log_level_t level, const char *tag, const char *format, ...) {
+  static std::mutex lock;
+  static const char LETTERS[] = "NEWIDV";
+  std::lock_guard<std::mutex> guard(lock);
+  fprintf(stderr, "%c (%lld) %s: ", LETTERS[level], (long long) (esp_timer_get_time() / 1000), tag);
+  va_list args;
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  fputc('\n', stderr);
+}
+
+} // namespace esp_log_host
+
+// Per tag levels aren't kept, any tag sets the level for all
+static inline void esp_log_level_set(const char *tag, esp_log_level_t level) {
+  esp_log_host::level() = level;
+}
+
+#define ESP_LOG_LEVEL(log_level, tag, format, ...) do {              \
+    if ((log_level) <= esp_log_host::level()) {                      \
+      esp_log_host::write(log_level, tag, format, ##__VA_ARGS__);    \
+    }                                                                \
+  } while (0)
+
+#define ESP_LOGE(tag, format, ...) ESP_LOG_LEVEL(ESP_LOG_ERROR, tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) ESP_LOG_LEVEL(ESP_LOG_WARN, tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) ESP_LOG_LEVEL(ESP_LOG_INFO, tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) ESP_LOG_LEVEL(ESP_LOG_DEBUG, tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...) ESP_LOG_LEVEL(ESP_LOG_VERBOSE, tag, format, ##__VA_ARGS__)
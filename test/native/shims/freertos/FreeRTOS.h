@@ -0,0 +1,57 @@
+#pragma once
+
+// Host stand-in for the parts of FreeRTOS the firmware uses, built on std::thread. Tasks are
+// threads, queues and semaphores are a mutex and a condition variable. One tick is a millisecond.
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS pdTRUE
+#define pdFAIL pdFALSE
+
+#define configTICK_RATE_HZ 1000
+#define portTICK_PERIOD_MS 1
+#define portMAX_DELAY ((TickType_t) 0xffffffffUL)
+#define pdMS_TO_TICKS(ms) ((TickType_t) (ms))
+#define configUSE_TRACE_FACILITY 0
+
+// Critical sections lock a mutex of their own instead of masking interrupts
+typedef struct {
+  std::recursive_mutex mutex;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED {}
+#define portENTER_CRITICAL(mux) (mux)->mutex.lock()
+#define portEXIT_CRITICAL(mux) (mux)->mutex.unlock()
+#define portENTER_CRITICAL_ISR(mux) portENTER_CRITICAL(mux)
+#define portEXIT_CRITICAL_ISR(mux) portEXIT_CRITICAL(mux)
+
+#define tskNO_AFFINITY 0x7fffffff
+
+namespace freertos_host {
+
+// Wait on cv until ready() or for ticks at most, portMAX_DELAY waits forever
+static inline bool wait(std::condition_variable &cv, std::unique_lock<std::mutex> &lock, TickType_t ticks,
+                        const std::function<bool()> &ready) {
+  if (ticks == portMAX_DELAY) {
+    cv.wait(lock, ready);
+    return true;
+  }
+  return cv.wait_for(lock, std::chrono::milliseconds(ticks), ready);
+}
+
+} // namespace freertos_host
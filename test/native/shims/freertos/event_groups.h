@@ -0,0 +1,54 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+typedef uint32_t EventBits_t;
+
+typedef struct EventGroupDef_t {
+  std::mutex mutex;
+  std::condition_variable changed;
+  EventBits_t bits;
+} *EventGroupHandle_t;
+
+static inline EventGroupHandle_t xEventGroupCreate() {
+  EventGroupHandle_t group = new EventGroupDef_t();
+  group->bits = 0;
+  return group;
+}
+
+static inline void vEventGroupDelete(EventGroupHandle_t group) {
+  delete group;
+}
+
+static inline EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits) {
+  std::lock_guard<std::mutex> lock(group->mutex);
+  group->bits |= bits;
+  group->changed.notify_all();
+  return group->bits;
+}
+
+// Returns the bits before they were cleared
+static inline EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits) {
+  std::lock_guard<std::mutex> lock(group->mutex);
+  EventBits_t before = group->bits;
+  group->bits &= ~bits;
+  return before;
+}
+
+static inline EventBits_t xEventGroupGetBits(EventGroupHandle_t group) {
+  std::lock_guard<std::mutex> lock(group->mutex);
+  return group->bits;
+}
+
+// Returns the bits when the wait ended, before any were cleared
+static inline EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, BaseType_t clear_on_exit,
+                                              BaseType_t wait_for_all, TickType_t ticks) {
+  std::unique_lock<std::mutex> lock(group->mutex);
+  auto done = [&]() { return wait_for_all ? (group->bits & bits) == bits : (group->bits & bits) != 0; };
+  bool satisfied = freertos_host::wait(group->changed, lock, ticks, done);
+  EventBits_t result = group->bits;
+  if (satisfied && clear_on_exit) {
+    group->bits &= ~bits;
+  }
+  return result;
+}
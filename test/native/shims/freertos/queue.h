@@ -0,0 +1,72 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct QueueDefinition {
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::vector<uint8_t> items;
+  UBaseType_t length;
+  size_t item_size;
+  UBaseType_t head;
+  UBaseType_t count;
+} *QueueHandle_t;
+
+#define errQUEUE_FULL pdFALSE
+#define errQUEUE_EMPTY pdFALSE
+
+static inline QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+  QueueHandle_t queue = new QueueDefinition();
+  queue->items.resize(length * item_size);
+  queue->length = length;
+  queue->item_size = item_size;
+  queue->head = 0;
+  queue->count = 0;
+  return queue;
+}
+
+static inline void vQueueDelete(QueueHandle_t queue) {
+  delete queue;
+}
+
+static inline BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks) {
+  std::unique_lock<std::mutex> lock(queue->mutex);
+  if (!freertos_host::wait(queue->changed, lock, ticks, [queue]() { return queue->count < queue->length; })) {
+    return errQUEUE_FULL;
+  }
+  if (queue->item_size > 0) {
+    size_t slot = (queue->head + queue->count) % queue->length;
+    memcpy(&queue->items[slot * queue->item_size], item, queue->item_size);
+  }
+  queue->count++;
+  queue->changed.notify_all();
+  return pdTRUE;
+}
+
+static inline BaseType_t xQueueSendToBack(QueueHandle_t queue, const void *item, TickType_t ticks) {
+  return xQueueSend(queue, item, ticks);
+}
+
+static inline BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks) {
+  std::unique_lock<std::mutex> lock(queue->mutex);
+  if (!freertos_host::wait(queue->changed, lock, ticks, [queue]() { return queue->count > 0; })) {
+    return errQUEUE_EMPTY;
+  }
+  if (queue->item_size > 0) {
+    memcpy(item, &queue->items[queue->head * queue->item_size], queue->item_size);
+  }
+  queue->head = (queue->head + 1) % queue->length;
+  queue->count--;
+  queue->changed.notify_all();
+  return pdTRUE;
+}
+
+static inline UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+  std::lock_guard<std::mutex> lock(queue->mutex);
+  return queue->count;
+}
+
+static inline UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue) {
+  std::lock_guard<std::mutex> lock(queue->mutex);
+  return queue->length - queue->count;
+}
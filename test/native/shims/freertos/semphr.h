@@ -0,0 +1,35 @@
+#pragma once
+
+#include "freertos/queue.h"
+
+// As in FreeRTOS, a semaphore is a queue of items without data
+typedef QueueHandle_t SemaphoreHandle_t;
+
+static inline SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max_count, UBaseType_t initial_count) {
+  SemaphoreHandle_t semaphore = xQueueCreate(max_count, 0);
+  for (UBaseType_t i = 0; i < initial_count; i++) {
+    xQueueSend(semaphore, nullptr, 0);
+  }
+  return semaphore;
+}
+
+static inline SemaphoreHandle_t xSemaphoreCreateBinary() {
+  return xSemaphoreCreateCounting(1, 0);
+}
+
+// No priority inheritance, which only matters for scheduling on the device
+static inline SemaphoreHandle_t xSemaphoreCreateMutex() {
+  return xSemaphoreCreateCounting(1, 1);
+}
+
+static inline BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks) {
+  return xQueueReceive(semaphore, nullptr, ticks);
+}
+
+static inline BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+  return xQueueSend(semaphore, nullptr, 0);
+}
+
+static inline void vSemaphoreDelete(SemaphoreHandle_t semaphore) {
+  vQueueDelete(semaphore);
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "freertos/FreeRTOS.h"
+
+typedef void (*TaskFunction_t)(void *);
+
+typedef struct tskTaskControlBlock {
+  const char *name;
+} *TaskHandle_t;
+
+namespace freertos_host {
+
+static inline TaskHandle_t &current_task() {
+  static thread_local TaskHandle_t task = nullptr;
+  return task;
+}
+
+static inline std::chrono::steady_clock::time_point boot_time() {
+  static const std::chrono::steady_clock::time_point boot = std::chrono::steady_clock::now();
+  return boot;
+}
+
+} // namespace freertos_host
+
+static inline TaskHandle_t xTaskGetCurrentTaskHandle() {
+  TaskHandle_t &task = freertos_host::current_task();
+  if (task == nullptr) {
+    // A thread that wasn't started by xTaskCreate, such as the one running main()
+    task = new tskTaskControlBlock{"main"};
+  }
+  return task;
+}
+
+// Handles are never freed, so that a task that is gone can't be mistaken for a new one
+static inline BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char *name, uint32_t stack_depth,
+                                                 void *parameters, UBaseType_t priority, TaskHandle_t *created,
+                                                 BaseType_t core_id) {
+  TaskHandle_t task = new tskTaskControlBlock{name};
+  if (created != nullptr) {
+    *created = task;
+  }
+  std::thread([=]() {
+    freertos_host::current_task() = task;
+    function(parameters);
+  }).detach();
+  return pdPASS;
+}
+
+static inline BaseType_t xTaskCreate(TaskFunction_t function, const char *name, uint32_t stack_depth,
+                                     void *parameters, UBaseType_t priority, TaskHandle_t *created) {
+  return xTaskCreatePinnedToCore(function, name, stack_depth, parameters, priority, created, tskNO_AFFINITY);
+}
+
+// Only a task deleting itself is supported, threads can't be killed from outside
+static inline void vTaskDelete(TaskHandle_t task) {
+  if (task != nullptr && task != xTaskGetCurrentTaskHandle()) {
+    fprintf(stderr, "vTaskDelete of another task is not supported on the host\n");
+    abort();
+  }
+  pthread_exit(nullptr);
+}
+
+static inline void vTaskDelay(TickType_t ticks) {
+  if (ticks == 0) {
+    std::this_thread::yield();
+  } else {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ticks));
+  }
+}
+
+static inline TickType_t xTaskGetTickCount() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() -
+                                                               freertos_host::boot_time()).count();
+}
+
+static inline UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task) {
+  return 0;
+}
+
+#define taskYIELD() std::this_thread::yield()
@@ -0,0 +1,120 @@
+#pragma once
+
+// Host stand-in for mbedtls SHA-256, a plain implementation of FIPS 180-4
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef struct {
+  uint32_t state[8];
+  uint64_t total;
+  uint8_t buffer[64];
+} mbedtls_sha256_context;
+
+namespace mbedtls_host {
+
+static const uint32_t K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t rotr(uint32_t x, int n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+static inline void block(mbedtls_sha256_context *ctx, const uint8_t *data) {
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++) {
+    w[i] = (data[i * 4] << 24) | (data[i * 4 + 1] << 16) | (data[i * 4 + 2] << 8) | data[i * 4 + 3];
+  }
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+  uint32_t e = ctx->state[4], f = ctx->state[5], g = ctx->state[6], h = ctx->state[7];
+  for (int i = 0; i < 64; i++) {
+    uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+    uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  ctx->state[0] += a;
+  ctx->state[1] += b;
+  ctx->state[2] += c;
+  ctx->state[3] += d;
+  ctx->state[4] += e;
+  ctx->state[5] += f;
+  ctx->state[6] += g;
+  ctx->state[7] += h;
+}
+
+} // namespace mbedtls_host
+
+static inline void mbedtls_sha256_init(mbedtls_sha256_context *ctx) {
+  memset(ctx, 0, sizeof(*ctx));
+}
+
+static inline void mbedtls_sha256_free(mbedtls_sha256_context *ctx) {}
+
+// Only SHA-256, is224 has to be 0
+static inline int mbedtls_sha256_starts_ret(mbedtls_sha256_context *ctx, int is224) {
+  static const uint32_t INITIAL[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+  };
+  memcpy(ctx->state, INITIAL, sizeof(INITIAL));
+  ctx->total = 0;
+  return is224 == 0 ? 0 : -1;
+}
+
+static inline int mbedtls_sha256_update_ret(mbedtls_sha256_context *ctx, const unsigned char *input, size_t len) {
+  size_t used = ctx->total % 64;
+  ctx->total += len;
+  if (used > 0) {
+    size_t n = len < 64 - used ? len : 64 - used;
+    memcpy(ctx->buffer + used, input, n);
+    input += n;
+    len -= n;
+    if (used + n < 64) {
+      return 0;
+    }
+    mbedtls_host::block(ctx, ctx->buffer);
+  }
+  for (; len >= 64; input += 64, len -= 64) {
+    mbedtls_host::block(ctx, input);
+  }
+  memcpy(ctx->buffer, input, len);
+  return 0;
+}
+
+static inline int mbedtls_sha256_finish_ret(mbedtls_sha256_context *ctx, unsigned char output[32]) {
+  uint64_t bits = ctx->total * 8;
+  uint8_t padding[72] = {0x80};
+  size_t used = ctx->total % 64;
+  size_t padding_len = (used < 56 ? 56 : 120) - used;
+  for (int i = 0; i < 8; i++) {
+    padding[padding_len + i] = bits >> (56 - i * 8);
+  }
+  mbedtls_sha256_update_ret(ctx, padding, padding_len + 8);
+  for (int i = 0; i < 8; i++) {
+    output[i * 4] = ctx->state[i] >> 24;
+    output[i * 4 + 1] = ctx->state[i] >> 16;
+    output[i * 4 + 2] = ctx->state[i] >> 8;
+    output[i * 4 + 3] = ctx->state[i];
+  }
+  return 0;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+// Host stand-in for the tinfl inflater in the ESP32 ROM, on top of zlib. Only what InflatePrint
+// uses: output goes into a caller provided window and the input may come in any pieces.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <zlib.h>
+
+#define TINFL_LZ_DICT_SIZE 32768
+
+enum {
+  TINFL_FLAG_PARSE_ZLIB_HEADER = 1,
+  TINFL_FLAG_HAS_MORE_INPUT = 2,
+  TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF = 4,
+  TINFL_FLAG_COMPUTE_ADLER32 = 8,
+};
+
+typedef enum {
+  TINFL_STATUS_BAD_PARAM = -3,
+  TINFL_STATUS_ADLER32_MISMATCH = -2,
+  TINFL_STATUS_FAILED = -1,
+  TINFL_STATUS_DONE = 0,
+  TINFL_STATUS_NEEDS_MORE_INPUT = 1,
+  TINFL_STATUS_HAS_MORE_OUTPUT = 2,
+} tinfl_status;
+
+// zlib keeps a window of its own, so the one passed in is only written to. The stream is set up
+// on the first call, as that is when the flags are known.
+typedef struct {
+  z_stream stream;
+  bool started;
+} tinfl_decompressor;
+
+#define tinfl_init(r) ((r)->started = false)
+
+static inline tinfl_status tinfl_decompress(tinfl_decompressor *r, const uint8_t *in_buf, size_t *in_buf_size,
+                                            uint8_t *out_buf_start, uint8_t *out_buf_next, size_t *out_buf_size,
+                                            uint32_t flags) {
+  if (!r->started) {
+    r->stream = {};
+    // Negative window bits for raw deflate, without the zlib header
+    if (inflateInit2(&r->stream, flags & TINFL_FLAG_PARSE_ZLIB_HEADER ? 15 : -15) != Z_OK) {
+      return TINFL_STATUS_FAILED;
+    }
+    r->started = true;
+  }
+  r->stream.next_in = (Bytef *) in_buf;
+  r->stream.avail_in = *in_buf_size;
+  r->stream.next_out = out_buf_next;
+  r->stream.avail_out = *out_buf_size;
+  int result = inflate(&r->stream, Z_NO_FLUSH);
+  *in_buf_size -= r->stream.avail_in;
+  *out_buf_size -= r->stream.avail_out;
+
+  if (result == Z_STREAM_END) {
+    inflateEnd(&r->stream);
+    r->started = false;
+    return TINFL_STATUS_DONE;
+  }
+  if (result != Z_OK && result != Z_BUF_ERROR) {
+    inflateEnd(&r->stream);
+    r->started = false;
+    return TINFL_STATUS_FAILED;
+  }
+  return r->stream.avail_out == 0 ? TINFL_STATUS_HAS_MORE_OUTPUT : TINFL_STATUS_NEEDS_MORE_INPUT;
+}
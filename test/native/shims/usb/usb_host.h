@@ -0,0 +1,185 @@
+#pragma once
+
+// Host stand-in for the ESP-IDF USB host library. There is no bus: a device handle is an object
+// that takes the transfers submitted to it, see FakePrinter.hpp. Completed transfers are called
+// back one after another from a single thread, as the USB client task does on the device.
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "esp_err.h"
+
+typedef enum {
+  USB_TRANSFER_STATUS_COMPLETED,
+  USB_TRANSFER_STATUS_ERROR,
+  USB_TRANSFER_STATUS_TIMED_OUT,
+  USB_TRANSFER_STATUS_CANCELED,
+  USB_TRANSFER_STATUS_STALL,
+  USB_TRANSFER_STATUS_OVERFLOW,
+  USB_TRANSFER_STATUS_SKIPPED,
+  USB_TRANSFER_STATUS_NO_DEVICE,
+} usb_transfer_status_t;
+
+typedef struct usb_host_client_handle_s *usb_host_client_handle_t;
+typedef struct usb_device_handle_s *usb_device_handle_t;
+typedef struct usb_transfer_s usb_transfer_t;
+typedef void (*usb_transfer_cb_t)(usb_transfer_t *transfer);
+
+struct usb_transfer_s {
+  uint8_t *data_buffer;
+  size_t data_buffer_size;
+  int num_bytes;
+  int actual_num_bytes;
+  uint32_t flags;
+  usb_device_handle_t device_handle;
+  uint8_t bEndpointAddress;
+  usb_transfer_status_t status;
+  uint32_t timeout_ms;
+  usb_transfer_cb_t callback;
+  void *context;
+};
+
+typedef struct __attribute__((packed)) {
+  uint8_t bmRequestType;
+  uint8_t bRequest;
+  uint16_t wValue;
+  uint16_t wIndex;
+  uint16_t wLength;
+} usb_setup_packet_t;
+
+#define USB_BM_REQUEST_TYPE_DIR_OUT (0X00 << 7)
+#define USB_BM_REQUEST_TYPE_DIR_IN (0x01 << 7)
+#define USB_BM_REQUEST_TYPE_TYPE_STANDARD (0x00 << 5)
+#define USB_BM_REQUEST_TYPE_TYPE_CLASS (0x01 << 5)
+#define USB_BM_REQUEST_TYPE_TYPE_VENDOR (0x02 << 5)
+#define USB_BM_REQUEST_TYPE_RECIP_DEVICE 0x00
+#define USB_BM_REQUEST_TYPE_RECIP_INTERFACE 0x01
+#define USB_BM_REQUEST_TYPE_RECIP_ENDPOINT 0x02
+
+#define USB_B_ENDPOINT_ADDRESS_EP_DIR_MASK 0x80
+#define USB_BM_ATTRIBUTES_XFER_BULK 0x02
+
+typedef struct __attribute__((packed)) {
+  uint8_t bLength;
+  uint8_t bDescriptorType;
+  uint8_t bEndpointAddress;
+  uint8_t bmAttributes;
+  uint16_t wMaxPacketSize;
+  uint8_t bInterval;
+} usb_ep_desc_t;
+
+// A simulated device. Transfers handed to submit() must eventually be passed to
+// usb_host_complete(), also on halt and flush. As on the device, a transfer that fails halts its
+// endpoint until it is cleared.
+struct usb_device_handle_s {
+  virtual ~usb_device_handle_s() {}
+  virtual esp_err_t submit(usb_transfer_t *transfer) = 0;
+  virtual esp_err_t halt(uint8_t endpoint_address) = 0;
+  virtual esp_err_t flush(uint8_t endpoint_address) = 0;
+  virtual esp_err_t clear(uint8_t endpoint_address) = 0;
+};
+
+namespace usb_host_shim {
+
+typedef struct {
+  std::mutex mutex;
+  std::condition_variable changed;
+  // Transfers with when their callback is due
+  std::deque<std::pair<usb_transfer_t *, std::chrono::steady_clock::time_point>> completed;
+  std::chrono::microseconds callback_latency;
+  bool started;
+} client_t;
+
+// Never destroyed, the client thread still waits on it at exit
+static inline client_t &client() {
+  static client_t *client = new client_t();
+  return *client;
+}
+
+static inline void client_task() {
+  client_t &c = client();
+  while (true) {
+    usb_transfer_t *transfer;
+    std::chrono::steady_clock::time_point due;
+    {
+      std::unique_lock<std::mutex> lock(c.mutex);
+      c.changed.wait(lock, [&]() { return !c.completed.empty(); });
+      transfer = c.completed.front().first;
+      due = c.completed.front().second;
+      c.completed.pop_front();
+    }
+    std::this_thread::sleep_until(due);
+    transfer->callback(transfer);
+  }
+}
+
+// How long callbacks come after the device is done with a transfer, as the USB host library and
+// client task take on the device. None by default.
+static inline void set_callback_latency_us(int64_t latency_us) {
+  client_t &c = client();
+  std::lock_guard<std::mutex> lock(c.mutex);
+  c.callback_latency = std::chrono::microseconds(latency_us);
+}
+
+} // namespace usb_host_shim
+
+// Hand a transfer the device is done with back to its owner, from the client thread
+static inline void usb_host_complete(usb_transfer_t *transfer) {
+  usb_host_shim::client_t &c = usb_host_shim::client();
+  std::lock_guard<std::mutex> lock(c.mutex);
+  if (!c.started) {
+    c.started = true;
+    std::thread(usb_host_shim::client_task).detach();
+  }
+  c.completed.push_back({transfer, std::chrono::steady_clock::now() + c.callback_latency});
+  c.changed.notify_one();
+}
+
+static inline esp_err_t usb_host_transfer_alloc(size_t data_buffer_size, int num_isoc_packets,
+                                                usb_transfer_t **transfer) {
+  usb_transfer_t *t = (usb_transfer_t *) calloc(1, sizeof(usb_transfer_t));
+  t->data_buffer = (uint8_t *) calloc(1, data_buffer_size);
+  t->data_buffer_size = data_buffer_size;
+  *transfer = t;
+  return ESP_OK;
+}
+
+static inline esp_err_t usb_host_transfer_free(usb_transfer_t *transfer) {
+  if (transfer != nullptr) {
+    free(transfer->data_buffer);
+    free(transfer);
+  }
+  return ESP_OK;
+}
+
+static inline esp_err_t usb_host_transfer_submit(usb_transfer_t *transfer) {
+  return transfer->device_handle->submit(transfer);
+}
+
+static inline esp_err_t usb_host_transfer_submit_control(usb_host_client_handle_t client_hdl,
+                                                         usb_transfer_t *transfer) {
+  return transfer->device_handle->submit(transfer);
+}
+
+static inline esp_err_t usb_host_endpoint_halt(usb_device_handle_t dev_hdl, uint8_t bEndpointAddress) {
+  return dev_hdl->halt(bEndpointAddress);
+}
+
+static inline esp_err_t usb_host_endpoint_flush(usb_device_handle_t dev_hdl, uint8_t bEndpointAddress) {
+  return dev_hdl->flush(bEndpointAddress);
+}
+
+static inline esp_err_t usb_host_endpoint_clear(usb_device_handle_t dev_hdl, uint8_t bEndpointAddress) {
+  return dev_hdl->clear(bEndpointAddress);
+}
+
+static inline esp_err_t usb_host_interface_release(usb_host_client_handle_t client_hdl,
+                                                   usb_device_handle_t dev_hdl, uint8_t bInterfaceNumber) {
+  return ESP_OK;
+}
@@ -0,0 +1,430 @@
+// End to end benchmarks of the job path on the host: jobs come from a local job server over a
+// keep-alive connection, go through ApiClient and print_job() as in loop(), through the job
+// pipeline and the Printer transfer pool to a simulated printer that prints at a fixed rate.
+//
+//   pio test -e native -f test_benchmark
+
+#include <Arduino.h>
+#include <unity.h>
+
+#include <memory>
+
+#include "ApiClient.hpp"
+#include "EventLog.hpp"
+#include "PrinterRegistry.hpp"
+#include "PrintJob.hpp"
+#include "Trace.hpp"
+#include "usbh_benchmark.hpp"
+
+#include "Benchmark.hpp"
+#include "FakePrinter.hpp"
+#include "JobServer.hpp"
+
+static const usb_ep_desc_t IN_EP_DESC = {7, 5, FakePrinter::IN_EP, USB_BM_ATTRIBUTES_XFER_BULK, 64, 0};
+static const usb_ep_desc_t OUT_EP_DESC = {7, 5, FakePrinter::OUT_EP, USB_BM_ATTRIBUTES_XFER_BULK, 64, 0};
+
+// Width of a 58 mm printer
+static const size_t ROW_BYTES = 48;
+
+static std::string text_job(size_t lines) {
+  std::string job;
+  for (size_t i = 0; i < lines; i++) {
+    job += "The quick brown fox jumps over the lazy dog " + std::to_string(i) + "\n";
+  }
+  return job;
+}
+
+// A label with bands of black bars and blank space between them, as jobs rendered on the server
+// look like
+static std::string raster_job(size_t rows) {
+  std::string job = "\x1b@";
+  job += std::string("\x1dv0\x00", 4);
+  job += (char) (ROW_BYTES & 0xff);
+  job += (char) (ROW_BYTES >> 8);
+  job += (char) (rows & 0xff);
+  job += (char) (rows >> 8);
+  for (size_t row = 0; row < rows; row++) {
+    bool blank = (row / 16) % 2 == 1;
+    for (size_t x = 0; x < ROW_BYTES; x++) {
+      job += blank ? (char) 0 : (char) (x % 3 == 0 ? 0xff : 0x0f);
+    }
+  }
+  return job;
+}
+
+typedef struct {
+  const char *name;
+  fake_printer_config_t printer;
+  job_server_job_t job;
+  uint32_t jobs;
+} benchmark_case_t;
+
+// Fetch and print all jobs queued on server the way loop() does, then wait for the last one to
+// come out of the printer. Everything the printer got goes to printed if it is given.
+static benchmark_result_t run(const benchmark_case_t &c, std::string *printed = nullptr) {
+  JobServer server;
+  FakePrinter *device = new FakePrinter(c.printer);
+  std::unique_ptr<PrinterRegistry> printers(new PrinterRegistry());
+  printer_slot_t *slot = printers->add(nullptr, device, 0, &IN_EP_DESC, &OUT_EP_DESC, ORIGINAL_PRINTI);
+  TEST_ASSERT_NOT_NULL(slot);
+
+  std::vector<uint32_t> jobs;
+  for (uint32_t i = 0; i < c.jobs; i++) {
+    jobs.push_back(server.add(c.job));
+  }
+
+  ApiClient api("127.0.0.1", server.getPort());
+  api.begin();
+  Benchmark benchmark(c.name, esp_timer_get_time());
+  while (server.queued() > 0) {
+    uint32_t trace_job = trace_begin_job();
+    int response_code = api.get("/nextinqueue/bench", 10 * 1000);
+    TEST_ASSERT_EQUAL_INT(200, response_code);
+    TEST_ASSERT_TRUE(print_job(*printers, api.response(), trace_job));
+    api.end();
+  }
+
+  // Twice what printing everything should take
+  uint32_t timeout_ms = 2000 + 2 * 1000 * (uint64_t) c.job.body.length() * c.jobs / c.printer.drain_rate;
+  for (uint32_t job : jobs) {
+    int64_t printed_us = device->waitForJob(job, timeout_ms);
+    TEST_ASSERT_TRUE_MESSAGE(printed_us >= 0, "Job did not come out of the printer");
+    benchmark.job(server.requestedUs(job), printed_us, c.job.body.length());
+  }
+  benchmark_result_t result = benchmark.report();
+
+  fake_printer_stats_t stats = device->getStats();
+  const printer_stats_t &printer_stats = slot->printer->getStats();
+  printf("  %u transfers, at most %u queued, buffer filled up to %u bytes, learned %u B/s, paced %u ms\n",
+         stats.out_transfers, stats.max_queued_transfers, stats.max_fill, printer_stats.drain_rate,
+         printer_stats.paced_ms);
+  job_pipeline_stats_t pipeline_stats = slot->job_pipeline->getStats();
+  printf("  pipeline held at most %u blocks, fetching waited %u ms for the printer\n", pipeline_stats.max_queued,
+         pipeline_stats.backpressure_ms);
+  TEST_ASSERT_EQUAL_UINT64(0, stats.bytes_dropped);
+  TEST_ASSERT_EQUAL_UINT32(0, printer_stats.bytes_dropped);
+  TEST_ASSERT_EQUAL_UINT32(1, api.getStats().handshakes);
+
+  // Nothing may be in flight when the printer goes
+  slot->job_pipeline->drain();
+  slot->printer->flush();
+  if (printed != nullptr) {
+    *printed = device->data();
+  }
+  printers->remove(device);
+  printers.reset();
+  delete device;
+  return result;
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+void test_text_jobs() {
+  job_server_job_t job = JOB_SERVER_TEXT_JOB;
+  job.body = text_job(40);
+  run({"text 16000 B/s", FAKE_PRINTER_DEFAULTS, job, 10});
+}
+
+void test_text_jobs_chunked() {
+  job_server_job_t job = JOB_SERVER_TEXT_JOB;
+  job.body = text_job(40);
+  job.chunked = true;
+  run({"text chunked 16000 B/s", FAKE_PRINTER_DEFAULTS, job, 10});
+}
+
+void test_raster_jobs() {
+  job_server_job_t job = JOB_SERVER_TEXT_JOB;
+  job.body = raster_job(192);
+  run({"raster 16000 B/s", FAKE_PRINTER_DEFAULTS, job, 6});
+}
+
+void test_raster_jobs_slow_printer() {
+  fake_printer_config_t printer = FAKE_PRINTER_DEFAULTS;
+  printer.drain_rate = 8000;
+  job_server_job_t job = JOB_SERVER_TEXT_JOB;
+  job.body = raster_job(96);
+  run({"raster 8000 B/s", printer, job, 6});
+}
+
+// A printer that drops what doesn't fit into its buffer instead of NAKing it, the pacing model is
+// all that keeps data from getting lost
+void test_raster_jobs_dropping_printer() {
+  fake_printer_config_t printer = FAKE_PRINTER_DEFAULTS;
+  printer.drop_when_full = true;
+  job_server_job_t job = JOB_SERVER_TEXT_JOB;
+  job.body = raster_job(192);
+  run({"raster dropping 16000 B/s", printer, job, 6});
+}
+
+void test_gzip_raster_jobs() {
+  job_server_job_t job = JOB_SERVER_TEXT_JOB;
+  job.body = raster_job(192);
+  job.chunked = true;
+  std::string uncompressed;
+  run({"raster chunked 16000 B/s", FAKE_PRINTER_DEFAULTS, job, 6}, &uncompressed);
+  job.gzip = true;
+  std::string inflated;
+  run({"raster gzip 16000 B/s", FAKE_PRINTER_DEFAULTS, job, 6}, &inflated);
+
+  // Inflating on the way changes nothing about what gets printed
+  TEST_ASSERT_EQUAL(uncompressed.length(), inflated.length());
+  TEST_ASSERT_TRUE(inflated == uncompressed);
+}
+
+// A queue full of short jobs, fetching them must keep ahead of the printer all the way
+void test_burst_of_100_jobs() {
+  job_server_job_t job = JOB_SERVER_TEXT_JOB;
+  job.body = text_job(8);
+  benchmark_result_t result = run({"text burst 16000 B/s", FAKE_PRINTER_DEFAULTS, job, 100});
+  printf("  %u jobs took %.2f s in total\n", result.jobs, result.seconds);
+  TEST_ASSERT_EQUAL_UINT32(100, result.jobs);
+}
+
+// Raw Printer throughput against how many OUT transfers it keeps in flight. The printer takes data
+// as fast as the bus brings it and callbacks come an assumed 300 us after a transfer is done, so
+// only the gaps between transfers count. Best of three, as a scheduling hiccup on the host can look
+// like a NAK to the pacing model.
+void test_out_transfer_pool_depth() {
+  fake_printer_config_t config = FAKE_PRINTER_DEFAULTS;
+  config.drain_rate = 4000000;
+  config.buffer_bytes = 1 << 20;
+  usb_host_shim::set_callback_latency_us(300);
+  std::string data = text_job(2000);
+  for (size_t count : {1, 2, 4, 8}) {
+    double best_seconds = 0;
+    uint32_t max_queued = 0;
+    for (int run = 0; run < 3; run++) {
+      FakePrinter *device = new FakePrinter(config);
+      Printer *printer = new Printer(nullptr, device, 0, &IN_EP_DESC, &OUT_EP_DESC, count);
+      printer->setPrinterBufferSize(config.buffer_bytes);
+      int64_t start_us = esp_timer_get_time();
+      TEST_ASSERT_EQUAL(data.length(), printer->write((const uint8_t *) data.data(), data.length()));
+      printer->flush();
+      double seconds = (esp_timer_get_time() - start_us) / 1000000.0;
+      TEST_ASSERT_TRUE(device->data() == data);
+      if (run == 0 || seconds < best_seconds) {
+        best_seconds = seconds;
+      }
+      max_queued = std::max(max_queued, device->getStats().max_queued_transfers);
+      // Let the last status poll come back
+      delay(10);
+      delete printer;
+      delete device;
+    }
+    printf("pool of %u transfers: %.1f KiB/s, at most %u queued\n", (unsigned) count,
+           data.length() / 1024.0 / best_seconds, max_queued);
+  }
+  usb_host_shim::set_callback_latency_us(0);
+}
+
+// printBitmap(int, int, const uint8_t *, bool) as it was before the bulk GS v 0 path, one write
+// and so one USB transfer per byte, for comparison
+static void print_bitmap_per_byte(Print *stream, int w, int h, const uint8_t *bitmap) {
+  int row_bytes = (w + 7) / 8;
+  int row_bytes_clipped = row_bytes >= 48 ? 48 : row_bytes;
+  for (int i = 0, row_start = 0; row_start < h; row_start += 255) {
+    int chunk_height = std::min(h - row_start, 255);
+    const uint8_t command[4] = {18, '*', (uint8_t) chunk_height, (uint8_t) row_bytes_clipped};
+    stream->write(command, sizeof(command));
+    for (int y = 0; y < chunk_height; y++) {
+      for (int x = 0; x < row_bytes_clipped; x++, i++) {
+        stream->write(bitmap[i]);
+      }
+      i += row_bytes - row_bytes_clipped;
+    }
+  }
+}
+
+// printBitmap(int, int, Stream *) as it was before bulk reads, spinning on read() for every byte
+static void print_stream_bitmap_per_byte(Print *stream, int w, int h, Stream *from_stream) {
+  int row_bytes = (w + 7) / 8;
+  int row_bytes_clipped = row_bytes >= 48 ? 48 : row_bytes;
+  int c;
+  for (int row_start = 0; row_start < h; row_start += 255) {
+    int chunk_height = std::min(h - row_start, 255);
+    const uint8_t command[4] = {18, '*', (uint8_t) chunk_height, (uint8_t) row_bytes_clipped};
+    stream->write(command, sizeof(command));
+    for (int y = 0; y < chunk_height; y++) {
+      for (int x = 0; x < row_bytes_clipped; x++) {
+        while ((c = from_stream->read()) < 0);
+        stream->write((uint8_t) c);
+      }
+      for (int i = row_bytes - row_bytes_clipped; i > 0; i--) {
+        while ((c = from_stream->read()) < 0);
+      }
+    }
+  }
+}
+
+// A bitmap that arrives at rate bytes per second from when it is constructed, as a job body does
+// over WiFi
+class TrickleStream : public Stream {
+private:
+  std::string data;
+  uint32_t rate;
+  int64_t start_us;
+  size_t pos = 0;
+
+  size_t arrived() {
+    return std::min(data.length(), (size_t) ((esp_timer_get_time() - start_us) * rate / 1000000));
+  }
+
+public:
+  TrickleStream(const std::string &data, uint32_t rate) : data(data), rate(rate) {
+    start_us = esp_timer_get_time();
+  }
+
+  int available() {
+    return arrived() - pos;
+  }
+
+  int read() {
+    return pos < arrived() ? (uint8_t) data[pos++] : -1;
+  }
+
+  int peek() {
+    return pos < arrived() ? (uint8_t) data[pos] : -1;
+  }
+
+  size_t readBytes(uint8_t *buffer, size_t length) {
+    size_t n = std::min(length, arrived() - pos);
+    memcpy(buffer, data.data() + pos, n);
+    pos += n;
+    return n;
+  }
+
+  size_t write(uint8_t c) {
+    return 0;
+  }
+};
+
+static int64_t thread_cpu_us() {
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Time and CPU time of the calling thread that printing a bitmap takes with print, through a
+// Printer to a printer that takes data as fast as the bus brings it
+template<typename F>
+static void run_bitmap(const char *name, size_t bitmap_bytes, F print) {
+  fake_printer_config_t config = FAKE_PRINTER_DEFAULTS;
+  config.drain_rate = 4000000;
+  config.buffer_bytes = 1 << 20;
+  FakePrinter *device = new FakePrinter(config);
+  Printer *printer = new Printer(nullptr, device, 0, &IN_EP_DESC, &OUT_EP_DESC);
+  printer->setPrinterBufferSize(config.buffer_bytes);
+  int64_t start_us = esp_timer_get_time();
+  int64_t start_cpu_us = thread_cpu_us();
+  print(printer);
+  printer->flush();
+  double seconds = (esp_timer_get_time() - start_us) / 1000000.0;
+  double cpu_ms = (thread_cpu_us() - start_cpu_us) / 1000.0;
+  printf("%s: %.1f KiB/s, %.1f ms CPU, %u transfers\n", name, bitmap_bytes / 1024.0 / seconds, cpu_ms,
+         device->getStats().out_transfers);
+  // The bitmap and the raster commands around it
+  TEST_ASSERT_UINT32_WITHIN(100, bitmap_bytes + 50, device->getStats().bytes_received);
+  // Let the last status poll come back
+  delay(10);
+  delete printer;
+  delete device;
+}
+
+void test_bitmap_per_byte_against_bulk() {
+  const int rows = 400;
+  std::string bitmap = raster_job(rows).substr(8);
+  run_bitmap("bitmap per byte", bitmap.length(), [&](Printer *printer) {
+    print_bitmap_per_byte(printer, ROW_BYTES * 8, rows, (const uint8_t *) bitmap.data());
+  });
+  run_bitmap("bitmap bulk GS v 0", bitmap.length(), [&](Printer *printer) {
+    ESC_POS_Printer esc_pos_printer(printer);
+    esc_pos_printer.setBlankRowElision(false);
+    esc_pos_printer.printBitmap(ROW_BYTES * 8, rows, (const uint8_t *) bitmap.data(), false);
+    esc_pos_printer.commit();
+  });
+
+}
+
+void test_stream_bitmap_per_byte_against_bulk() {
+  // A bitmap that comes in slower than the printer takes it, like a job over a poor WiFi link, the
+  // old loop spins while it waits
+  const int stream_rows = 100;
+  const uint32_t rate = 10000;
+  std::string stream_bitmap = raster_job(stream_rows).substr(8);
+  run_bitmap("stream bitmap per byte", stream_bitmap.length(), [&](Printer *printer) {
+    TrickleStream from_stream(stream_bitmap, rate);
+    print_stream_bitmap_per_byte(printer, ROW_BYTES * 8, stream_rows, &from_stream);
+  });
+  run_bitmap("stream bitmap bulk", stream_bitmap.length(), [&](Printer *printer) {
+    TrickleStream from_stream(stream_bitmap, rate);
+    ESC_POS_Printer esc_pos_printer(printer);
+    esc_pos_printer.setBlankRowElision(false);
+    esc_pos_printer.printBitmap(ROW_BYTES * 8, stream_rows, &from_stream);
+    esc_pos_printer.commit();
+  });
+}
+
+void test_trace_overhead() {
+  printf("recording a trace span takes %u ns\n", trace_measure_overhead(100000));
+}
+
+void test_event_log_overhead() {
+  // The ESP_LOGI lines have to be written out to cost what they do on the device
+  esp_log_level_set("*", ESP_LOG_INFO);
+  uint32_t esp_log_ns, event_ns;
+  event_log_benchmark(&esp_log_ns, &event_ns);
+  esp_log_level_set("*", ESP_LOG_HOST_DEFAULT_LEVEL);
+  printf("logging per USB transfer took %u ns with ESP_LOGI, takes %u ns with the event log\n", esp_log_ns,
+         event_ns);
+}
+
+static int64_t process_cpu_us() {
+  timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// CPU time of the whole process over an idle window of the tasks waiting the one way or the other,
+// the tasks are threads of their own here
+static int64_t usb_event_wait_idle_cpu_us(bool blocking) {
+  usbh_wait_stats_t stats;
+  int64_t start_cpu_us = process_cpu_us();
+  usbh_wait_benchmark(blocking, &stats, 1000, 0);
+  return process_cpu_us() - start_cpu_us;
+}
+
+void test_usb_event_wait_blocking_against_polling() {
+  usbh_wait_stats_t polling, blocking;
+  usbh_wait_benchmark(false, &polling);
+  usbh_wait_benchmark(true, &blocking);
+  int64_t polling_cpu_us = usb_event_wait_idle_cpu_us(false);
+  int64_t blocking_cpu_us = usb_event_wait_idle_cpu_us(true);
+
+  printf("USB events polled every tick: %u idle wakeups/s, %.1f ms CPU/s, latency avg %u us max %u us\n",
+         polling.idle_wakeups, polling_cpu_us / 1000.0, polling.latency_avg_us, polling.latency_max_us);
+  printf("USB events blocked on: %u idle wakeups/s, %.1f ms CPU/s, latency avg %u us max %u us\n",
+         blocking.idle_wakeups, blocking_cpu_us / 1000.0, blocking.latency_avg_us, blocking.latency_max_us);
+  TEST_ASSERT_EQUAL_UINT32(0, blocking.idle_wakeups);
+  TEST_ASSERT_TRUE(polling.idle_wakeups > 100);
+  TEST_ASSERT_TRUE(blocking_cpu_us < polling_cpu_us);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_text_jobs);
+  RUN_TEST(test_text_jobs_chunked);
+  RUN_TEST(test_raster_jobs);
+  RUN_TEST(test_raster_jobs_slow_printer);
+  RUN_TEST(test_raster_jobs_dropping_printer);
+  RUN_TEST(test_gzip_raster_jobs);
+  RUN_TEST(test_burst_of_100_jobs);
+  RUN_TEST(test_out_transfer_pool_depth);
+  RUN_TEST(test_bitmap_per_byte_against_bulk);
+  RUN_TEST(test_stream_bitmap_per_byte_against_bulk);
+  RUN_TEST(test_trace_overhead);
+  RUN_TEST(test_event_log_overhead);
+  RUN_TEST(test_usb_event_wait_blocking_against_polling);
+  return UNITY_END();
+}
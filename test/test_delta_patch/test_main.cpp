@@ -0,0 +1,230 @@
+// DeltaPatch on patches built here the way tools/mkdelta.py encodes them, good ones and bad ones
+//
+//   pio test -e native -f test_delta_patch
+
+#include <Arduino.h>
+#include <unity.h>
+
+#include <string>
+
+#include "DeltaPatch.hpp"
+
+#include "CapturePrint.hpp"
+
+// Offset and length of esp_app_desc_t.version in an image, as in tools/mkdelta.py
+static const size_t APP_DESC_VERSION_OFFSET = 48;
+static const size_t APP_DESC_VERSION_LEN = 32;
+
+static const size_t IMAGE_SIZE = 20000;
+
+// Operations start after the header
+static const size_t PATCH_HEADER_SIZE = 112;
+
+// Pseudo-random image with version stamped in where the device looks for it
+static std::string image(const char *version, uint32_t seed) {
+  std::string data(IMAGE_SIZE, '\0');
+  for (size_t i = 0; i < data.length(); i++) {
+    seed = seed * 1103515245 + 12345;
+    data[i] = (char) (seed >> 16);
+  }
+  std::string stamped(version);
+  stamped.resize(APP_DESC_VERSION_LEN, '\0');
+  data.replace(APP_DESC_VERSION_OFFSET, APP_DESC_VERSION_LEN, stamped);
+  return data;
+}
+
+static std::string u32(uint32_t value) {
+  std::string bytes(4, '\0');
+  for (int i = 0; i < 4; i++) {
+    bytes[i] = (char) (value >> (8 * i));
+  }
+  return bytes;
+}
+
+static std::string sha256(const std::string &data) {
+  mbedtls_sha256_context ctx;
+  uint8_t digest[32];
+  mbedtls_sha256_init(&ctx);
+  mbedtls_sha256_starts_ret(&ctx, 0);
+  mbedtls_sha256_update_ret(&ctx, (const uint8_t *) data.data(), data.length());
+  mbedtls_sha256_finish_ret(&ctx, digest);
+  mbedtls_sha256_free(&ctx);
+  return std::string((const char *) digest, sizeof(digest));
+}
+
+// An uncompressed patch from source to target, as tools/mkdelta.py encodes it
+class PatchBuilder {
+private:
+  const std::string &source;
+  const std::string &target;
+  std::string ops;
+
+public:
+  PatchBuilder(const std::string &source, const std::string &target) : source(source), target(target) {}
+
+  PatchBuilder &copy(uint32_t offset, uint32_t len) {
+    ops += "C" + u32(offset) + u32(len);
+    return *this;
+  }
+
+  // Add the bytes to make target[target_offset..] from source[offset..]
+  PatchBuilder &add(uint32_t offset, uint32_t target_offset, uint32_t len) {
+    ops += "A" + u32(offset) + u32(len);
+    for (uint32_t i = 0; i < len; i++) {
+      ops += (char) (target[target_offset + i] - source[offset + i]);
+    }
+    return *this;
+  }
+
+  PatchBuilder &insert(const std::string &bytes) {
+    ops += "I" + u32(bytes.length()) + bytes;
+    return *this;
+  }
+
+  std::string build() {
+    std::string patch("PDLT\x01\x00\x00\x00", 8);
+    patch += u32(source.length()) + u32(target.length());
+    patch += target.substr(APP_DESC_VERSION_OFFSET, APP_DESC_VERSION_LEN);
+    patch += sha256(source) + sha256(target);
+    return patch + ops + "E";
+  }
+};
+
+static bool read_source(void *context, size_t offset, uint8_t *buffer, size_t len) {
+  const std::string *source = static_cast<const std::string *>(context);
+  if (offset + len > source->length()) {
+    return false;
+  }
+  memcpy(buffer, source->data() + offset, len);
+  return true;
+}
+
+static bool read_fails(void *context, size_t offset, uint8_t *buffer, size_t len) {
+  return false;
+}
+
+static std::string source;
+static std::string target;
+static CapturePrint *out;
+
+// Apply patch to source, written in pieces of piece bytes
+static delta_patch_result_t patch_image(const std::string &patch, const std::string &source, size_t piece = 100,
+                                        delta_read_cb_t read = read_source) {
+  DeltaPatch delta_patch(read, (void *) &source, out, "1.0.0");
+  for (size_t i = 0; i < patch.length(); i += piece) {
+    std::string part = patch.substr(i, piece);
+    TEST_ASSERT_EQUAL(part.length(), delta_patch.write((const uint8_t *) part.data(), part.length()));
+  }
+  return delta_patch.finish();
+}
+
+// The target made from the source: a stretch moved, a stretch changed a little and a stretch new,
+// with a patch that has every operation
+static std::string good_patch() {
+  return PatchBuilder(source, target)
+      .copy(0, APP_DESC_VERSION_OFFSET)
+      .insert(target.substr(APP_DESC_VERSION_OFFSET, APP_DESC_VERSION_LEN))
+      .copy(APP_DESC_VERSION_OFFSET + APP_DESC_VERSION_LEN, 4000 - APP_DESC_VERSION_OFFSET - APP_DESC_VERSION_LEN)
+      .add(4000, 4000, 6000)
+      .insert(target.substr(10000, 1000))
+      .copy(12000, 8000)
+      .copy(11000, 1000)
+      .build();
+}
+
+void setUp() {
+  out = new CapturePrint();
+  source = image("1.0.0", 1);
+  target = source;
+  target.replace(APP_DESC_VERSION_OFFSET, 5, "1.1.0");
+  // Addresses that moved by a little
+  for (size_t i = 4000; i < 10000; i += 4) {
+    target[i] += 3;
+  }
+  target.replace(10000, 1000, image("", 2).substr(0, 1000));
+  target.replace(11000, 9000, source.substr(12000, 8000) + source.substr(11000, 1000));
+}
+
+void tearDown() {
+  delete out;
+}
+
+void test_patch_gives_target() {
+  TEST_ASSERT_EQUAL(DELTA_PATCH_OK, patch_image(good_patch(), source));
+  TEST_ASSERT_EQUAL(target.length(), out->str().length());
+  TEST_ASSERT_TRUE(out->str() == target);
+}
+
+void test_patch_written_byte_by_byte_gives_target() {
+  TEST_ASSERT_EQUAL(DELTA_PATCH_OK, patch_image(good_patch(), source, 1));
+  TEST_ASSERT_TRUE(out->str() == target);
+}
+
+void test_patch_to_running_version_is_up_to_date() {
+  std::string patch = PatchBuilder(source, source).copy(0, source.length()).build();
+  TEST_ASSERT_EQUAL(DELTA_PATCH_UP_TO_DATE, patch_image(patch, source));
+  TEST_ASSERT_EQUAL(0, out->str().length());
+}
+
+void test_wrong_source_is_rejected_before_writing() {
+  std::string other = source;
+  other[15000] ^= 1;
+  TEST_ASSERT_EQUAL(DELTA_PATCH_FAILED, patch_image(good_patch(), other));
+  TEST_ASSERT_EQUAL(0, out->str().length());
+}
+
+void test_unreadable_source_is_rejected() {
+  TEST_ASSERT_EQUAL(DELTA_PATCH_FAILED, patch_image(good_patch(), source, 100, read_fails));
+  TEST_ASSERT_EQUAL(0, out->str().length());
+}
+
+void test_truncated_patch_is_rejected() {
+  std::string patch = good_patch();
+  // Without the end, in the middle of an operation and in the middle of the header
+  TEST_ASSERT_EQUAL(DELTA_PATCH_FAILED, patch_image(patch.substr(0, patch.length() - 1), source));
+  out->clear();
+  TEST_ASSERT_EQUAL(DELTA_PATCH_FAILED, patch_image(patch.substr(0, patch.length() - 500), source));
+  out->clear();
+  TEST_ASSERT_EQUAL(DELTA_PATCH_FAILED, patch_image(patch.substr(0, 50), source));
+}
+
+void test_corrupted_patch_is_rejected() {
+  // Inserted data that is off only shows in the target hash
+  std::string patch = good_patch();
+  size_t inserted = patch.find(target.substr(10000, 1000));
+  patch[inserted + 10] ^= 0x40;
+  TEST_ASSERT_EQUAL(DELTA_PATCH_FAILED, patch_image(patch, source));
+  out->clear();
+
+  // An operation that doesn't exist
+  patch = good_patch();
+  patch[PATCH_HEADER_SIZE] = 'X';
+  TEST_ASSERT_EQUAL(DELTA_PATCH_FAILED, patch_image(patch, source));
+  TEST_ASSERT_EQUAL(0, out->str().length());
+}
+
+void test_copy_past_source_is_rejected() {
+  std::string patch = PatchBuilder(source, target).copy(source.length() - 10, 20).build();
+  TEST_ASSERT_EQUAL(DELTA_PATCH_FAILED, patch_image(patch, source));
+  TEST_ASSERT_EQUAL(0, out->str().length());
+}
+
+void test_patch_longer_than_target_is_rejected() {
+  std::string patch = PatchBuilder(source, target).copy(0, source.length()).copy(0, 1).build();
+  TEST_ASSERT_EQUAL(DELTA_PATCH_FAILED, patch_image(patch, source));
+  TEST_ASSERT_EQUAL(target.length(), out->str().length());
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_patch_gives_target);
+  RUN_TEST(test_patch_written_byte_by_byte_gives_target);
+  RUN_TEST(test_patch_to_running_version_is_up_to_date);
+  RUN_TEST(test_wrong_source_is_rejected_before_writing);
+  RUN_TEST(test_unreadable_source_is_rejected);
+  RUN_TEST(test_truncated_patch_is_rejected);
+  RUN_TEST(test_corrupted_patch_is_rejected);
+  RUN_TEST(test_copy_past_source_is_rejected);
+  RUN_TEST(test_patch_longer_than_target_is_rejected);
+  return UNITY_END();
+}
@@ -0,0 +1,144 @@
+// Dither kernels against their scalar reference, and grayscale PGM images through to raster rows
+//
+//   pio test -e native -f test_dither
+
+#include <Arduino.h>
+#include <unity.h>
+
+#include <string>
+#include <vector>
+
+#include "GrayscaleImagePrinter.hpp"
+#include "dither.hpp"
+
+#include "CapturePrint.hpp"
+
+static CapturePrint *out;
+static ESC_POS_Printer *printer;
+
+// Rows of raster data in the GS v 0 commands of data, each row_bytes wide
+static std::vector<std::string> raster_rows(const std::string &data, size_t row_bytes) {
+  std::vector<std::string> rows;
+  size_t pos = 0;
+  while (pos + 8 <= data.length()) {
+    TEST_ASSERT_EQUAL_MEMORY("\x1dv0\x00", data.data() + pos, 4);
+    size_t width = (uint8_t) data[pos + 4] | (uint8_t) data[pos + 5] << 8;
+    size_t height = (uint8_t) data[pos + 6] | (uint8_t) data[pos + 7] << 8;
+    TEST_ASSERT_EQUAL(row_bytes, width);
+    pos += 8;
+    for (size_t y = 0; y < height && pos + width <= data.length(); y++, pos += width) {
+      rows.push_back(data.substr(pos, width));
+    }
+  }
+  TEST_ASSERT_EQUAL(data.length(), pos);
+  return rows;
+}
+
+static std::string pgm(uint32_t width, uint32_t height, const std::string &pixels) {
+  return "P5\n# made by test_dither\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n" + pixels;
+}
+
+void setUp() {
+  out = new CapturePrint();
+  printer = new ESC_POS_Printer(out);
+}
+
+void tearDown() {
+  delete printer;
+  delete out;
+}
+
+void test_bayer_swar_matches_scalar() {
+  // Widths around the 8 pixel words and the print head, odd ones leave pixels over
+  const int widths[] = {1, 3, 7, 8, 9, 15, 17, 31, 63, 100, 383, 384, 385, 1001};
+  srand(9);
+  for (int width : widths) {
+    dither_state_t scalar, swar;
+    TEST_ASSERT_TRUE(dither_begin(&scalar, DITHER_BAYER, width));
+    TEST_ASSERT_TRUE(dither_begin(&swar, DITHER_BAYER, width));
+    std::vector<uint8_t> gray(width);
+    size_t row_bytes = (width + 7) / 8;
+    // Rubbish in the output past the row shows if a kernel leaves bits of it alone
+    std::vector<uint8_t> expected(row_bytes, 0xa5), actual(row_bytes, 0x5a);
+    for (int y = 0; y < 16; y++) {
+      for (int x = 0; x < width; x++) {
+        // Values at and around the thresholds as well as anywhere
+        gray[x] = rand() % 2 ? DITHER_BAYER_THRESHOLDS[y & 7][x & 7] + rand() % 3 - 1 : rand() % 256;
+      }
+      dither_bayer_row_scalar(&scalar, gray.data(), expected.data());
+      dither_bayer_row_swar(&swar, gray.data(), actual.data());
+      TEST_ASSERT_EQUAL_MEMORY(expected.data(), actual.data(), row_bytes);
+    }
+    dither_end(&scalar);
+    dither_end(&swar);
+  }
+}
+
+void test_bayer_swar_prints_black_and_white_as_such() {
+  dither_state_t state;
+  TEST_ASSERT_TRUE(dither_begin(&state, DITHER_BAYER, 20));
+  uint8_t black[20] = {}, white[20], row[3];
+  memset(white, 255, sizeof(white));
+  dither_bayer_row_swar(&state, black, row);
+  TEST_ASSERT_EQUAL_MEMORY("\xff\xff\xf0", row, 3);
+  dither_bayer_row_swar(&state, white, row);
+  TEST_ASSERT_EQUAL_MEMORY("\x00\x00\x00", row, 3);
+  dither_end(&state);
+}
+
+void test_pgm_is_printed_as_raster() {
+  // Black on the left, white on the right, scaled up 8 times to the width of the print head
+  const uint32_t width = GRAYSCALE_PRINT_WIDTH / 8;
+  const uint32_t height = 5;
+  std::string pixels;
+  for (uint32_t y = 0; y < height; y++) {
+    pixels += std::string(width / 2, (char) 0) + std::string(width / 2, (char) 255);
+  }
+  std::string image = pgm(width, height, pixels);
+
+  GrayscaleImagePrinter image_printer(printer, DITHER_BAYER);
+  // In pieces that split the header and the rows
+  for (size_t i = 0; i < image.length(); i += 7) {
+    std::string piece = image.substr(i, 7);
+    TEST_ASSERT_EQUAL(piece.length(), image_printer.write((const uint8_t *) piece.data(), piece.length()));
+  }
+  TEST_ASSERT_TRUE(image_printer.finish());
+
+  std::vector<std::string> rows = raster_rows(out->str(), GRAYSCALE_PRINT_WIDTH / 8);
+  TEST_ASSERT_EQUAL(height * 8, rows.size());
+  std::string expected = std::string(GRAYSCALE_PRINT_WIDTH / 16, (char) 0xff) +
+                         std::string(GRAYSCALE_PRINT_WIDTH / 16, (char) 0);
+  for (const std::string &row : rows) {
+    TEST_ASSERT_TRUE(row == expected);
+  }
+}
+
+void test_pgm_cut_short_prints_what_came() {
+  const uint32_t width = GRAYSCALE_PRINT_WIDTH;
+  std::string image = pgm(width, 10, std::string(3 * width + 5, (char) 0));
+  GrayscaleImagePrinter image_printer(printer, DITHER_FLOYD_STEINBERG);
+  image_printer.write((const uint8_t *) image.data(), image.length());
+  TEST_ASSERT_FALSE(image_printer.finish());
+
+  std::vector<std::string> rows = raster_rows(out->str(), GRAYSCALE_PRINT_WIDTH / 8);
+  TEST_ASSERT_EQUAL(3, rows.size());
+  TEST_ASSERT_TRUE(rows[0] == std::string(GRAYSCALE_PRINT_WIDTH / 8, (char) 0xff));
+}
+
+void test_ascii_pgm_is_refused() {
+  std::string image = "P2\n2 1\n255\n0 255\n";
+  GrayscaleImagePrinter image_printer(printer);
+  TEST_ASSERT_EQUAL(image.length(), image_printer.write((const uint8_t *) image.data(), image.length()));
+  TEST_ASSERT_FALSE(image_printer.finish());
+  TEST_ASSERT_EQUAL(0, out->str().length());
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_bayer_swar_matches_scalar);
+  RUN_TEST(test_bayer_swar_prints_black_and_white_as_such);
+  RUN_TEST(test_pgm_is_printed_as_raster);
+  RUN_TEST(test_pgm_cut_short_prints_what_came);
+  RUN_TEST(test_ascii_pgm_is_refused);
+  return UNITY_END();
+}
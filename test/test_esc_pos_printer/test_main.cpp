@@ -0,0 +1,169 @@
+// Raster bitmap output of ESC_POS_Printer, and how many USB transfers its buffer saves
+//
+//   pio test -e native -f test_esc_pos_printer
+
+#include <Arduino.h>
+#include <unity.h>
+
+#include "ESC_POS_Printer/ESC_POS_Printer.h"
+
+#include "Printer.hpp"
+
+#include "CapturePrint.hpp"
+#include "FakePrinter.hpp"
+
+static const usb_ep_desc_t IN_EP_DESC = {7, 5, FakePrinter::IN_EP, USB_BM_ATTRIBUTES_XFER_BULK, 64, 0};
+static const usb_ep_desc_t OUT_EP_DESC = {7, 5, FakePrinter::OUT_EP, USB_BM_ATTRIBUTES_XFER_BULK, 64, 0};
+
+// Stream over a fixed buffer, counts what was read from it
+class BufferStream : public Stream {
+private:
+  std::string data;
+  size_t pos = 0;
+
+public:
+  BufferStream(const std::string &data) : data(data) {
+    setTimeout(10);
+  }
+
+  int available() {
+    return data.length() - pos;
+  }
+
+  int read() {
+    return pos < data.length() ? (uint8_t) data[pos++] : -1;
+  }
+
+  int peek() {
+    return pos < data.length() ? (uint8_t) data[pos] : -1;
+  }
+
+  size_t write(uint8_t c) {
+    return 0;
+  }
+
+  size_t consumed() {
+    return pos;
+  }
+};
+
+static CapturePrint *out;
+static ESC_POS_Printer *printer;
+
+void setUp() {
+  out = new CapturePrint();
+  printer = new ESC_POS_Printer(out);
+}
+
+void tearDown() {
+  delete printer;
+  delete out;
+}
+
+void test_zero_width_bitmap_writes_nothing() {
+  static const uint8_t bitmap[48 * 4] = {0xff};
+  printer->printBitmap(0, 4, bitmap, true);
+  printer->commit();
+  TEST_ASSERT_EQUAL(0, out->str().length());
+}
+
+void test_zero_height_bitmap_writes_nothing() {
+  static const uint8_t bitmap[48] = {0xff};
+  printer->printBitmap(384, 0, bitmap, true);
+  printer->commit();
+  TEST_ASSERT_EQUAL(0, out->str().length());
+}
+
+void test_zero_width_stream_bitmap_reads_and_writes_nothing() {
+  BufferStream stream(std::string(16, '\xff'));
+  printer->printBitmap(0, 16, &stream);
+  printer->commit();
+  TEST_ASSERT_EQUAL(0, out->str().length());
+  TEST_ASSERT_EQUAL(0, stream.consumed());
+}
+
+void test_zero_size_stream_header_writes_nothing() {
+  // Width and height both 0, followed by data that is not part of the bitmap
+  BufferStream stream(std::string("\x00\x00\x00\x00\xff\xff", 6));
+  printer->printBitmap(&stream);
+  printer->commit();
+  TEST_ASSERT_EQUAL(0, out->str().length());
+  TEST_ASSERT_EQUAL(4, stream.consumed());
+}
+
+void test_bitmap_is_sent_as_gs_v_0() {
+  uint8_t bitmap[48 * 2];
+  memset(bitmap, 0xaa, sizeof(bitmap));
+  printer->printBitmap(384, 2, bitmap, true);
+  printer->commit();
+  const std::string &data = out->str();
+  TEST_ASSERT_EQUAL(8 + sizeof(bitmap), data.length());
+  TEST_ASSERT_EQUAL_MEMORY("\x1dv0\x00\x30\x00\x02\x00", data.data(), 8);
+  TEST_ASSERT_EQUAL_MEMORY(bitmap, data.data() + 8, sizeof(bitmap));
+}
+
+void test_narrow_bitmap_gets_one_byte_rows() {
+  uint8_t bitmap[3] = {0x80, 0x80, 0x80};
+  printer->printBitmap(1, 3, bitmap, true);
+  printer->commit();
+  const std::string &data = out->str();
+  TEST_ASSERT_EQUAL(8 + 3, data.length());
+  TEST_ASSERT_EQUAL_MEMORY("\x1dv0\x00\x01\x00\x03\x00", data.data(), 8);
+}
+
+// A message like the setup instructions in main.cpp, text with a few commands in between, sent
+// through a Printer with an ESC_POS_Printer buffer of buffer_size. Returns the OUT transfers it took.
+static uint32_t message_transfers(size_t buffer_size, std::string *printed) {
+  FakePrinter *device = new FakePrinter();
+  Printer *usb_printer = new Printer(nullptr, device, 0, &IN_EP_DESC, &OUT_EP_DESC);
+  ESC_POS_Printer *esc_pos_printer = new ESC_POS_Printer(usb_printer, buffer_size);
+  esc_pos_printer->justify('C');
+  esc_pos_printer->boldOn();
+  esc_pos_printer->println("Welcome to printi");
+  esc_pos_printer->boldOff();
+  esc_pos_printer->justify('L');
+  for (int step = 1; step <= 3; step++) {
+    esc_pos_printer->println("");
+    esc_pos_printer->underlineOn();
+    esc_pos_printer->print("=> Step ");
+    esc_pos_printer->println(step);
+    esc_pos_printer->underlineOff();
+    esc_pos_printer->println("On your phone/laptop, connect to");
+    esc_pos_printer->println("the WiFi network emitted by this");
+  }
+  esc_pos_printer->feed(3);
+  esc_pos_printer->commit();
+  usb_printer->flush();
+  uint32_t transfers = device->getStats().out_transfers;
+  *printed = device->data();
+
+  delete esc_pos_printer;
+  // Let the last status poll come back
+  delay(10);
+  delete usb_printer;
+  delete device;
+  return transfers;
+}
+
+void test_buffer_coalesces_text_and_commands_into_few_transfers() {
+  std::string unbuffered_data, buffered_data;
+  uint32_t unbuffered = message_transfers(0, &unbuffered_data);
+  uint32_t buffered = message_transfers(ESC_POS_BUFFER_SIZE, &buffered_data);
+  printf("message of %u bytes: %u transfers unbuffered, %u with a %u byte buffer\n",
+         (unsigned) buffered_data.length(), unbuffered, buffered, ESC_POS_BUFFER_SIZE);
+  TEST_ASSERT_TRUE(buffered_data == unbuffered_data);
+  TEST_ASSERT_EQUAL_UINT32(1, buffered);
+  TEST_ASSERT_TRUE(unbuffered > 10 * buffered);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_zero_width_bitmap_writes_nothing);
+  RUN_TEST(test_zero_height_bitmap_writes_nothing);
+  RUN_TEST(test_zero_width_stream_bitmap_reads_and_writes_nothing);
+  RUN_TEST(test_zero_size_stream_header_writes_nothing);
+  RUN_TEST(test_bitmap_is_sent_as_gs_v_0);
+  RUN_TEST(test_narrow_bitmap_gets_one_byte_rows);
+  RUN_TEST(test_buffer_coalesces_text_and_commands_into_few_transfers);
+  return UNITY_END();
+}
@@ -0,0 +1,115 @@
+// JobPipeline ordering and flushing
+//
+//   pio test -e native -f test_job_pipeline
+
+#include <Arduino.h>
+#include <unity.h>
+
+#include <thread>
+
+#include "JobPipeline.hpp"
+
+#include "CapturePrint.hpp"
+
+static CapturePrint *out;
+
+// A sink that takes its time over every write, like a printer without paper
+class SlowPrint : public Print {
+public:
+  size_t write(uint8_t c) {
+    return write(&c, 1);
+  }
+
+  size_t write(const uint8_t *buffer, size_t size) {
+    delay(100);
+    return size;
+  }
+};
+
+void setUp() {
+  out = new CapturePrint();
+}
+
+void tearDown() {
+  delete out;
+}
+
+void test_partial_block_is_flushed_when_idle() {
+  JobPipeline pipeline(out, 2, 64);
+  pipeline.write((const uint8_t *) "abc", 3);
+  delay(JOB_PIPELINE_FLUSH_MS * 5);
+  TEST_ASSERT_TRUE(out->str() == "abc");
+}
+
+void test_order_is_kept_around_idle_flushes() {
+  // Pauses close to the flush interval let the print task take over the block being filled while
+  // full blocks are being queued, none of that may reorder the data
+  JobPipeline pipeline(out, 4, 16);
+  std::string sent;
+  srand(12);
+  for (int i = 0; i < 400; i++) {
+    std::string piece;
+    size_t len = 1 + rand() % 24;
+    for (size_t j = 0; j < len; j++) {
+      piece += (char) ('a' + sent.length() % 26);
+      sent += piece.back();
+    }
+    pipeline.write((const uint8_t *) piece.data(), piece.length());
+    if (rand() % 4 == 0) {
+      delay(JOB_PIPELINE_FLUSH_MS - 2 + rand() % 4);
+    }
+  }
+  pipeline.drain();
+  TEST_ASSERT_EQUAL(sent.length(), out->str().length());
+  TEST_ASSERT_TRUE(out->str() == sent);
+}
+
+void test_end_of_job_counts_jobs() {
+  JobPipeline pipeline(out, 2, 64);
+  pipeline.write((const uint8_t *) "one", 3);
+  pipeline.endJob();
+  pipeline.write((const uint8_t *) "two", 3);
+  pipeline.endJob();
+  pipeline.drain();
+  TEST_ASSERT_TRUE(out->str() == "onetwo");
+  TEST_ASSERT_EQUAL_UINT32(2, pipeline.getStats().jobs);
+}
+
+void test_stopped_print_task_gives_up_its_trace_slot() {
+  // Printers come and go more often than there are slots for tasks to trace
+  for (int i = 0; i < 2 * TRACE_MAX_TASKS; i++) {
+    JobPipeline pipeline(out, 2, 64);
+    pipeline.write((const uint8_t *) "x", 1);
+    pipeline.drain();
+  }
+  // A task that comes after them still gets one
+  uint32_t job_id = 0;
+  uint32_t task_job_id = 0;
+  std::thread task([&]() {
+    job_id = trace_begin_job();
+    task_job_id = trace_task_job();
+  });
+  task.join();
+  TEST_ASSERT_EQUAL_UINT32(job_id, task_job_id);
+}
+
+void test_drain_gives_up_after_timeout() {
+  SlowPrint slow;
+  JobPipeline pipeline(&slow, 4, 16);
+  std::string data(64, 'x');
+  pipeline.write((const uint8_t *) data.data(), data.length());
+  uint32_t start = millis();
+  TEST_ASSERT_FALSE(pipeline.drain(50));
+  TEST_ASSERT_UINT32_WITHIN(40, 50, millis() - start);
+  TEST_ASSERT_TRUE(pipeline.drain(1000));
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_partial_block_is_flushed_when_idle);
+  RUN_TEST(test_order_is_kept_around_idle_flushes);
+  RUN_TEST(test_end_of_job_counts_jobs);
+  RUN_TEST(test_stopped_print_task_gives_up_its_trace_slot);
+  RUN_TEST(test_drain_gives_up_after_timeout);
+  return UNITY_END();
+}
@@ -0,0 +1,132 @@
+// print_job() streaming job bodies of several MB from a local job server to the simulated printer,
+// with heap use that doesn't grow with the job
+//
+//   pio test -e native -f test_print_job
+
+// The printer here prints as fast as the bus brings data, the pacing model starts out knowing that
+#define PRINTER_INITIAL_DRAIN_RATE 4000000
+
+#include <Arduino.h>
+#include <unity.h>
+
+#include <malloc.h>
+
+#include <atomic>
+#include <memory>
+#include <thread>
+
+#include "ApiClient.hpp"
+#include "PrinterRegistry.hpp"
+#include "PrintJob.hpp"
+
+#include "FakePrinter.hpp"
+#include "JobServer.hpp"
+
+static const usb_ep_desc_t IN_EP_DESC = {7, 5, FakePrinter::IN_EP, USB_BM_ATTRIBUTES_XFER_BULK, 64, 0};
+static const usb_ep_desc_t OUT_EP_DESC = {7, 5, FakePrinter::OUT_EP, USB_BM_ATTRIBUTES_XFER_BULK, 64, 0};
+
+static JobServer *server;
+static FakePrinter *device;
+static PrinterRegistry *printers;
+static printer_slot_t *slot;
+
+// Bytes allocated on the heap right now, including big blocks that malloc maps on their own
+static size_t heap_in_use() {
+  struct mallinfo2 info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+}
+
+static std::string text_job(size_t len) {
+  std::string job;
+  for (size_t i = 0; job.length() < len; i++) {
+    job += "The quick brown fox jumps over the lazy dog " + std::to_string(i) + "\n";
+  }
+  return job;
+}
+
+// Fetch and print the jobs queued on the server as loop() does, until they came out of the
+// printer. Returns how far the heap went up meanwhile.
+static size_t print_queued_jobs(const std::vector<uint32_t> &jobs) {
+  ApiClient api("127.0.0.1", server->getPort());
+  api.begin();
+  size_t start_heap = heap_in_use();
+  std::atomic<size_t> peak_heap(start_heap);
+  std::atomic<bool> done(false);
+  std::thread sampler([&]() {
+    while (!done) {
+      peak_heap = std::max(peak_heap.load(), heap_in_use());
+      delay(1);
+    }
+  });
+
+  while (server->queued() > 0) {
+    TEST_ASSERT_EQUAL_INT(200, api.get("/nextinqueue/test", 10 * 1000));
+    TEST_ASSERT_TRUE(print_job(*printers, api.response(), trace_begin_job()));
+    api.end();
+  }
+  for (uint32_t job : jobs) {
+    TEST_ASSERT_TRUE_MESSAGE(device->waitForJob(job, 60 * 1000) >= 0, "Job did not come out of the printer");
+  }
+  done = true;
+  sampler.join();
+  return peak_heap - start_heap;
+}
+
+void setUp() {
+  server = new JobServer();
+  fake_printer_config_t config = FAKE_PRINTER_DEFAULTS;
+  config.drain_rate = 4000000;
+  config.buffer_bytes = 1 << 20;
+  // Only the job markers matter, megabytes of received data would count towards the heap
+  config.keep_data = false;
+  device = new FakePrinter(config);
+  printers = new PrinterRegistry();
+  slot = printers->add(nullptr, device, 0, &IN_EP_DESC, &OUT_EP_DESC, ORIGINAL_PRINTI);
+  TEST_ASSERT_NOT_NULL(slot);
+  slot->printer->setPrinterBufferSize(config.buffer_bytes);
+}
+
+void tearDown() {
+  slot->job_pipeline->drain();
+  slot->printer->flush();
+  printers->remove(device);
+  delete printers;
+  delete device;
+  delete server;
+}
+
+static void test_job_streams_with_bounded_heap(bool chunked, bool gzip) {
+  job_server_job_t job = JOB_SERVER_TEXT_JOB;
+  job.body = text_job(4 << 20);
+  job.chunked = chunked;
+  job.gzip = gzip;
+  std::vector<uint32_t> jobs = {server->add(job)};
+  int64_t start_us = esp_timer_get_time();
+  size_t peak = print_queued_jobs(jobs);
+
+  printf("%.1f MiB job in %.1f s, heap peaked %u KiB above where it started\n", job.body.length() / 1048576.0,
+         (esp_timer_get_time() - start_us) / 1000000.0, (unsigned) (peak / 1024));
+  TEST_ASSERT_TRUE(peak < 256 * 1024);
+  TEST_ASSERT_EQUAL_UINT32(0, slot->printer->getStats().bytes_dropped);
+  TEST_ASSERT_TRUE(device->getStats().bytes_received > job.body.length());
+}
+
+void test_content_length_job_streams_with_bounded_heap() {
+  test_job_streams_with_bounded_heap(false, false);
+}
+
+void test_chunked_job_streams_with_bounded_heap() {
+  test_job_streams_with_bounded_heap(true, false);
+}
+
+void test_gzip_job_streams_with_bounded_heap() {
+  test_job_streams_with_bounded_heap(true, true);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_content_length_job_streams_with_bounded_heap);
+  RUN_TEST(test_chunked_job_streams_with_bounded_heap);
+  RUN_TEST(test_gzip_job_streams_with_bounded_heap);
+  return UNITY_END();
+}
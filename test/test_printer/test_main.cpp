@@ -0,0 +1,142 @@
+// Printer transfer retries and the pacing model, against the simulated printer
+//
+//   pio test -e native -f test_printer
+
+#include <Arduino.h>
+#include <unity.h>
+
+#include "Printer.hpp"
+
+#include "FakePrinter.hpp"
+
+static const usb_ep_desc_t IN_EP_DESC = {7, 5, FakePrinter::IN_EP, USB_BM_ATTRIBUTES_XFER_BULK, 64, 0};
+static const usb_ep_desc_t OUT_EP_DESC = {7, 5, FakePrinter::OUT_EP, USB_BM_ATTRIBUTES_XFER_BULK, 64, 0};
+
+static FakePrinter *device;
+static Printer *printer;
+
+static void attach(const fake_printer_config_t &config) {
+  device = new FakePrinter(config);
+  printer = new Printer(nullptr, device, 0, &IN_EP_DESC, &OUT_EP_DESC);
+}
+
+// Text that tells where in it a piece came from
+static std::string numbered(size_t len) {
+  std::string data;
+  for (size_t i = 0; data.length() < len; i++) {
+    data += std::to_string(i) + " ";
+  }
+  return data.substr(0, len);
+}
+
+void setUp() {}
+
+void tearDown() {
+  printer->flush();
+  // Let the last status poll come back
+  delay(10);
+  delete printer;
+  delete device;
+}
+
+void test_retry_resends_only_the_rest() {
+  attach(FAKE_PRINTER_DEFAULTS);
+  device->failTransfers(1, 300);
+  std::string data = numbered(2000);
+  TEST_ASSERT_EQUAL(data.length(), printer->write((const uint8_t *) data.data(), data.length()));
+  printer->flush();
+
+  TEST_ASSERT_EQUAL_UINT32(1, printer->getStats().transfer_retries);
+  TEST_ASSERT_EQUAL_UINT32(0, printer->getStats().bytes_dropped);
+  TEST_ASSERT_EQUAL(data.length(), device->data().length());
+  TEST_ASSERT_TRUE(device->data() == data);
+}
+
+void test_failed_transfers_keep_data_in_order() {
+  // Transfers queued behind failing ones go out after their retries, not before
+  attach(FAKE_PRINTER_DEFAULTS);
+  device->failTransfers(3, 100);
+  std::string data = numbered(12000);
+  printer->write((const uint8_t *) data.data(), data.length());
+  printer->flush();
+
+  TEST_ASSERT_EQUAL_UINT32(3, printer->getStats().transfer_retries);
+  TEST_ASSERT_TRUE(device->data() == data);
+}
+
+void test_transfer_given_up_on_is_counted() {
+  attach(FAKE_PRINTER_DEFAULTS);
+  device->failTransfers(PRINTER_MAX_TRANSFER_RETRIES + 1, 0);
+  std::string data = numbered(3 * PRINTER_OUT_TRANSFER_SIZE);
+  printer->write((const uint8_t *) data.data(), data.length());
+  printer->flush();
+
+  TEST_ASSERT_EQUAL_UINT32(PRINTER_OUT_TRANSFER_SIZE, printer->getStats().bytes_dropped);
+  TEST_ASSERT_TRUE(device->data() == data.substr(PRINTER_OUT_TRANSFER_SIZE));
+}
+
+void test_refused_transfers_are_given_up_on() {
+  // The USB host keeps refusing transfers with the printer still there, write() gives up on them
+  // and says so instead of hanging
+  attach(FAKE_PRINTER_DEFAULTS);
+  device->refuseSubmits(true);
+  std::string data = numbered(3 * PRINTER_OUT_TRANSFER_SIZE);
+  uint32_t start = millis();
+  TEST_ASSERT_EQUAL(0, printer->write((const uint8_t *) data.data(), data.length()));
+  TEST_ASSERT_UINT32_WITHIN(500, PRINTER_SUBMIT_TIMEOUT_MS, millis() - start);
+  TEST_ASSERT_EQUAL_UINT32(PRINTER_OUT_TRANSFER_SIZE, printer->getStats().bytes_dropped);
+
+  // Once taken again the printer goes on with what comes next
+  device->refuseSubmits(false);
+  TEST_ASSERT_EQUAL(data.length(), printer->write((const uint8_t *) data.data(), data.length()));
+  printer->flush();
+  TEST_ASSERT_TRUE(device->data() == data);
+}
+
+void test_write_to_gone_printer_returns_what_was_sent() {
+  attach(FAKE_PRINTER_DEFAULTS);
+  std::string data = numbered(2000);
+  TEST_ASSERT_EQUAL(data.length(), printer->write((const uint8_t *) data.data(), data.length()));
+  device->unplug();
+  printer->disconnect();
+  TEST_ASSERT_EQUAL(0, printer->write((const uint8_t *) data.data(), data.length()));
+  TEST_ASSERT_EQUAL_UINT32(0, printer->getStats().bytes_dropped);
+}
+
+void test_learns_drain_rate_of_slow_printer() {
+  fake_printer_config_t config = FAKE_PRINTER_DEFAULTS;
+  config.drain_rate = 6000;
+  attach(config);
+  std::string data = numbered(24000);
+  printer->write((const uint8_t *) data.data(), data.length());
+  printer->flush();
+
+  uint32_t drain_rate = printer->getStats().drain_rate;
+  TEST_ASSERT_UINT32_WITHIN(1500, 6000, drain_rate);
+  TEST_ASSERT_TRUE(device->data() == data);
+}
+
+void test_drain_rate_is_kept_without_naks() {
+  // Nothing is known about a printer that never holds data back, the model stays where it was
+  fake_printer_config_t config = FAKE_PRINTER_DEFAULTS;
+  config.drop_when_full = true;
+  attach(config);
+  std::string data = numbered(16000);
+  printer->write((const uint8_t *) data.data(), data.length());
+  printer->flush();
+
+  TEST_ASSERT_EQUAL_UINT32(PRINTER_INITIAL_DRAIN_RATE, printer->getStats().drain_rate);
+  TEST_ASSERT_EQUAL_UINT64(0, device->getStats().bytes_dropped);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_retry_resends_only_the_rest);
+  RUN_TEST(test_failed_transfers_keep_data_in_order);
+  RUN_TEST(test_transfer_given_up_on_is_counted);
+  RUN_TEST(test_refused_transfers_are_given_up_on);
+  RUN_TEST(test_write_to_gone_printer_returns_what_was_sent);
+  RUN_TEST(test_learns_drain_rate_of_slow_printer);
+  RUN_TEST(test_drain_rate_is_kept_without_naks);
+  return UNITY_END();
+}
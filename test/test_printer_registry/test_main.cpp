@@ -0,0 +1,161 @@
+// PrinterRegistry slots as printers come and go while jobs use them
+//
+//   pio test -e native -f test_printer_registry
+
+#include <Arduino.h>
+#include <unity.h>
+
+#include "PrinterRegistry.hpp"
+
+#include "FakePrinter.hpp"
+
+static const usb_ep_desc_t IN_EP_DESC = {7, 5, FakePrinter::IN_EP, USB_BM_ATTRIBUTES_XFER_BULK, 64, 0};
+static const usb_ep_desc_t OUT_EP_DESC = {7, 5, FakePrinter::OUT_EP, USB_BM_ATTRIBUTES_XFER_BULK, 64, 0};
+
+static PrinterRegistry *printers;
+static uint32_t detached;
+static usb_device_handle_t detached_dev_hdl;
+static uint8_t detached_interface_number;
+
+static void detached_cb(usb_device_handle_t dev_hdl, uint8_t interface_number) {
+  detached++;
+  detached_dev_hdl = dev_hdl;
+  detached_interface_number = interface_number;
+}
+
+static printer_slot_t *attach(FakePrinter *device, uint8_t interface_number = 0) {
+  printer_slot_t *slot = printers->add(nullptr, device, interface_number, &IN_EP_DESC, &OUT_EP_DESC, ORIGINAL_PRINTI);
+  TEST_ASSERT_NOT_NULL(slot);
+  return slot;
+}
+
+// Wait until no more than taken slots are left, printers that were removed are torn down
+static bool wait_for_teardown(size_t taken = 0) {
+  uint32_t start = millis();
+  while (printers->taken() > taken && millis() - start < PRINTER_REGISTRY_TEARDOWN_MS + 1000) {
+    delay(1);
+  }
+  return printers->taken() == taken;
+}
+
+void setUp() {
+  detached = 0;
+  detached_dev_hdl = nullptr;
+  detached_interface_number = 0;
+  printers = new PrinterRegistry(detached_cb);
+}
+
+void tearDown() {
+  delete printers;
+}
+
+void test_unplugged_printer_is_kept_until_released() {
+  FakePrinter *device = new FakePrinter();
+  attach(device, 2);
+  printer_slot_t *slot = printers->pick("");
+  TEST_ASSERT_NOT_NULL(slot);
+
+  std::string data(8000, 'x');
+  slot->esc_pos_printer->write((const uint8_t *) data.data(), data.length());
+  device->unplug();
+  printers->remove(device);
+
+  // Gone for everyone else, but the job that has it can still write to it
+  TEST_ASSERT_EQUAL(0, printers->count());
+  TEST_ASSERT_NULL(printers->pick(""));
+  TEST_ASSERT_NULL(printers->primary());
+  slot->esc_pos_printer->write((const uint8_t *) data.data(), data.length());
+  slot->job_pipeline->endJob();
+  delay(50);
+  TEST_ASSERT_EQUAL(1, printers->taken());
+  TEST_ASSERT_EQUAL_UINT32(0, detached);
+
+  printers->release(slot);
+  TEST_ASSERT_TRUE(wait_for_teardown());
+  TEST_ASSERT_EQUAL_UINT32(1, detached);
+  TEST_ASSERT_TRUE(detached_dev_hdl == device);
+  TEST_ASSERT_EQUAL_UINT8(2, detached_interface_number);
+  delete device;
+}
+
+void test_removed_printer_without_users_is_torn_down() {
+  FakePrinter *device = new FakePrinter();
+  attach(device);
+  printers->remove(device);
+  TEST_ASSERT_TRUE(wait_for_teardown());
+  TEST_ASSERT_EQUAL_UINT32(1, detached);
+
+  // Removing it again is nothing
+  printers->remove(device);
+  delay(10);
+  TEST_ASSERT_EQUAL_UINT32(1, detached);
+  delete device;
+}
+
+void test_slot_is_reused_once_torn_down() {
+  FakePrinter *first = new FakePrinter();
+  FakePrinter *second = new FakePrinter();
+  attach(first);
+  attach(second);
+  printers->remove(first);
+  TEST_ASSERT_TRUE(wait_for_teardown(1));
+
+  // The second printer keeps its name, the next one takes the free slot
+  printer_slot_t *slot = printers->primary();
+  TEST_ASSERT_NOT_NULL(slot);
+  TEST_ASSERT_TRUE(slot->name == "2");
+  printers->release(slot);
+  FakePrinter *third = new FakePrinter();
+  TEST_ASSERT_TRUE(attach(third)->name == "1");
+  TEST_ASSERT_EQUAL(2, printers->count());
+
+  delete printers;
+  printers = nullptr;
+  TEST_ASSERT_EQUAL_UINT32(3, detached);
+  printers = new PrinterRegistry(detached_cb);
+  delete first;
+  delete second;
+  delete third;
+}
+
+void test_acquired_printers_outlast_removal() {
+  // As the OTA drain in loop() does it, without holding the registry up meanwhile
+  FakePrinter *first = new FakePrinter();
+  FakePrinter *second = new FakePrinter();
+  attach(first);
+  attach(second);
+  printer_slot_t *acquired[PRINTER_REGISTRY_MAX_PRINTERS];
+  TEST_ASSERT_EQUAL(2, printers->acquireAll(acquired));
+
+  first->unplug();
+  printers->remove(first);
+  TEST_ASSERT_EQUAL(1, printers->count());
+  for (int i = 0; i < 2; i++) {
+    acquired[i]->esc_pos_printer->println("before the update");
+    acquired[i]->esc_pos_printer->commit();
+    TEST_ASSERT_TRUE(acquired[i]->job_pipeline->drain(1000));
+  }
+  acquired[1]->printer->flush();
+  TEST_ASSERT_TRUE(second->data() == "before the update\r\n");
+  TEST_ASSERT_EQUAL(2, printers->taken());
+  TEST_ASSERT_EQUAL_UINT32(0, detached);
+
+  printers->release(acquired[0]);
+  printers->release(acquired[1]);
+  TEST_ASSERT_TRUE(wait_for_teardown(1));
+  TEST_ASSERT_EQUAL_UINT32(1, detached);
+  delete printers;
+  printers = nullptr;
+  printers = new PrinterRegistry(detached_cb);
+  delete first;
+  delete second;
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_unplugged_printer_is_kept_until_released);
+  RUN_TEST(test_removed_printer_without_users_is_torn_down);
+  RUN_TEST(test_slot_is_reused_once_torn_down);
+  RUN_TEST(test_acquired_printers_outlast_removal);
+  return UNITY_END();
+}
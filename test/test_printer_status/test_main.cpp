@@ -0,0 +1,107 @@
+// Printer status polling alongside print data, against the simulated printer
+//
+//   pio test -e native -f test_printer_status
+
+#include <Arduino.h>
+#include <unity.h>
+
+#include <atomic>
+#include <thread>
+
+#include "PrinterRegistry.hpp"
+
+#include "FakePrinter.hpp"
+
+static const usb_ep_desc_t IN_EP_DESC = {7, 5, FakePrinter::IN_EP, USB_BM_ATTRIBUTES_XFER_BULK, 64, 0};
+static const usb_ep_desc_t OUT_EP_DESC = {7, 5, FakePrinter::OUT_EP, USB_BM_ATTRIBUTES_XFER_BULK, 64, 0};
+
+static FakePrinter *device;
+static PrinterRegistry *printers;
+static printer_slot_t *slot;
+
+static void attach(const fake_printer_config_t &config) {
+  device = new FakePrinter(config);
+  slot = printers->add(nullptr, device, 0, &IN_EP_DESC, &OUT_EP_DESC, ORIGINAL_PRINTI);
+  TEST_ASSERT_NOT_NULL(slot);
+}
+
+// A raster job of rows rows that ends with the marker of job
+static void print_raster_job(uint32_t job, size_t rows) {
+  std::string data = "\x1b@";
+  data += std::string("\x1dv0\x00\x30\x00", 6);
+  data += (char) (rows & 0xff);
+  data += (char) (rows >> 8);
+  data += std::string(48 * rows, '\x5a');
+  data += "#job-" + std::to_string(job) + "#";
+  slot->job_pipeline->write((const uint8_t *) data.data(), data.length());
+  slot->job_pipeline->endJob();
+}
+
+void setUp() {
+  printers = new PrinterRegistry();
+}
+
+void tearDown() {
+  slot->job_pipeline->drain();
+  slot->printer->flush();
+  printers->remove(device);
+  delete printers;
+  delete device;
+}
+
+void test_realtime_status_only_between_jobs() {
+  // Without GET_PORT_STATUS, DLE EOT 2 is the only way to learn the status
+  fake_printer_config_t config = FAKE_PRINTER_DEFAULTS;
+  config.port_status = false;
+  config.drain_rate = 64000;
+  attach(config);
+
+  // loop() polls all the while
+  std::atomic<bool> stop(false);
+  std::thread poller([&]() {
+    while (!stop) {
+      printers->anyReady();
+      delay(1);
+    }
+  });
+  for (uint32_t job = 1; job <= 6; job++) {
+    print_raster_job(job, 400);
+    TEST_ASSERT_TRUE(device->waitForJob(job, 5000) >= 0);
+    delay(PRINTER_REALTIME_STATUS_MS / 2);
+  }
+  stop = true;
+  poller.join();
+
+  fake_printer_stats_t stats = device->getStats();
+  TEST_ASSERT_TRUE(stats.status_requests > 0);
+  TEST_ASSERT_EQUAL_UINT32(0, stats.status_requests_mid_command);
+  TEST_ASSERT_EQUAL_UINT32(stats.status_requests, slot->printer->getStats().realtime_status_polls);
+}
+
+void test_paper_out_holds_back_the_job() {
+  attach(FAKE_PRINTER_DEFAULTS);
+  device->setPaperOut(true);
+  uint32_t start = millis();
+  while (slot->printer->getState() != PRINTER_STATE_PAPER_OUT && millis() - start < 2000) {
+    printers->anyReady();
+    delay(10);
+  }
+  TEST_ASSERT_EQUAL(PRINTER_STATE_PAPER_OUT, slot->printer->getState());
+
+  print_raster_job(1, 24);
+  delay(PRINTER_STATUS_POLL_MS * 2);
+  // Nothing but DLE EOT 2 asking whether there is paper again
+  fake_printer_stats_t stats = device->getStats();
+  TEST_ASSERT_EQUAL_UINT64(3 * stats.status_requests, stats.bytes_received);
+
+  device->setPaperOut(false);
+  TEST_ASSERT_TRUE(device->waitForJob(1, 5000) >= 0);
+  TEST_ASSERT_EQUAL(PRINTER_STATE_READY, slot->printer->getState());
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_realtime_status_only_between_jobs);
+  RUN_TEST(test_paper_out_holds_back_the_job);
+  return UNITY_END();
+}
@@ -0,0 +1,159 @@
+// Jobs fetched the way loop() does it, announced over the push channel or waited for with a long
+// poll, from the moment the server has a job to the moment it came out of the printer
+//
+//   pio test -e native -f test_push_channel
+
+#include <Arduino.h>
+#include <unity.h>
+
+#include <atomic>
+#include <thread>
+
+#include "ApiClient.hpp"
+#include "PrinterRegistry.hpp"
+#include "PrintJob.hpp"
+#include "PushChannel.hpp"
+
+#include "Benchmark.hpp"
+#include "FakePrinter.hpp"
+#include "JobServer.hpp"
+
+static const usb_ep_desc_t IN_EP_DESC = {7, 5, FakePrinter::IN_EP, USB_BM_ATTRIBUTES_XFER_BULK, 64, 0};
+static const usb_ep_desc_t OUT_EP_DESC = {7, 5, FakePrinter::OUT_EP, USB_BM_ATTRIBUTES_XFER_BULK, 64, 0};
+
+// How long the server holds a poll on an empty queue, short so that the device notices the end of
+// a test soon
+static const uint32_t LONG_POLL_MS = 200;
+
+static JobServer *server;
+static FakePrinter *device;
+static PrinterRegistry *printers;
+static printer_slot_t *slot;
+
+static std::atomic<bool> stopping;
+static std::thread fetcher;
+
+// The job fetching part of loop(), with timeouts scaled down to the long poll here
+static void fetch_jobs(bool use_push) {
+  ApiClient api("127.0.0.1", server->getPort());
+  api.begin();
+  PushChannel push("127.0.0.1:" + String(server->getPort()));
+  bool push_drain_queue = true;
+
+  while (!stopping) {
+    if (use_push) {
+      if (push.isOpen() || push.open("/events/test")) {
+        if (!push_drain_queue && !push.waitForJob(LONG_POLL_MS)) {
+          push_drain_queue = !push.isOpen();
+          continue;
+        }
+      } else {
+        push_drain_queue = true;
+      }
+    }
+
+    int response_code = api.get("/nextinqueue/test", 10 * LONG_POLL_MS);
+    if (response_code == 200) {
+      print_job(*printers, api.response(), trace_begin_job());
+    }
+    api.end();
+    push_drain_queue = response_code == 200;
+  }
+  push.close();
+}
+
+static void start_fetching(bool use_push) {
+  stopping = false;
+  fetcher = std::thread(fetch_jobs, use_push);
+}
+
+static void stop_fetching() {
+  stopping = true;
+  fetcher.join();
+}
+
+// Queue jobs a while apart and measure how long each took from the server to paper
+static benchmark_result_t run(const char *name, uint32_t jobs) {
+  // Let the device settle into waiting first
+  delay(LONG_POLL_MS);
+  Benchmark benchmark(name, esp_timer_get_time());
+  for (uint32_t i = 0; i < jobs; i++) {
+    job_server_job_t job = JOB_SERVER_TEXT_JOB;
+    job.body = "Job " + std::to_string(i) + "\n";
+    uint32_t id = server->add(job);
+    int64_t printed_us = device->waitForJob(id, 10 * 1000);
+    TEST_ASSERT_TRUE_MESSAGE(printed_us >= 0, "Job did not come out of the printer");
+    benchmark.job(server->addedUs(id), printed_us, job.body.length());
+    // Somewhere in the middle of the next wait
+    delay(37 + i % 5 * 13);
+  }
+  return benchmark.report();
+}
+
+void setUp() {
+  server = new JobServer();
+  fake_printer_config_t config = FAKE_PRINTER_DEFAULTS;
+  config.drain_rate = 4000000;
+  config.buffer_bytes = 1 << 20;
+  device = new FakePrinter(config);
+  printers = new PrinterRegistry();
+  slot = printers->add(nullptr, device, 0, &IN_EP_DESC, &OUT_EP_DESC, ORIGINAL_PRINTI);
+  TEST_ASSERT_NOT_NULL(slot);
+  slot->printer->setPrinterBufferSize(config.buffer_bytes);
+}
+
+void tearDown() {
+  slot->job_pipeline->drain();
+  slot->printer->flush();
+  printers->remove(device);
+  delete printers;
+  delete device;
+  delete server;
+}
+
+void test_push_against_long_poll_latency() {
+  server->setLongPoll(LONG_POLL_MS);
+  start_fetching(false);
+  benchmark_result_t long_poll = run("long poll", 20);
+  stop_fetching();
+  uint32_t long_poll_requests = server->getRequests();
+
+  // The device only asks once a job is announced, an empty queue answers right away
+  server->setLongPoll(0);
+  start_fetching(true);
+  benchmark_result_t push = run("push", 20);
+  TEST_ASSERT_EQUAL(1, server->eventChannels());
+  stop_fetching();
+  uint32_t push_requests = server->getRequests() - long_poll_requests;
+
+  printf("push p50 %+.1f ms against long poll, %u requests against %u\n", push.p50_ms - long_poll.p50_ms,
+         push_requests, long_poll_requests);
+  // One fetch for the job and one that finds the queue empty, but no requests while waiting
+  TEST_ASSERT_TRUE(push_requests <= 2 * 20 + 2);
+  TEST_ASSERT_TRUE(long_poll.p95_ms < 500);
+  TEST_ASSERT_TRUE(push.p95_ms < 500);
+}
+
+void test_dropped_channel_falls_back_to_polling() {
+  server->setLongPoll(LONG_POLL_MS);
+  start_fetching(true);
+  run("push", 3);
+  TEST_ASSERT_EQUAL(1, server->eventChannels());
+
+  // Announcements are gone with the channel, the device doesn't try it again for a while and
+  // polls meanwhile
+  server->closeEvents();
+  delay(LONG_POLL_MS);
+  TEST_ASSERT_EQUAL(0, server->eventChannels());
+  benchmark_result_t polled = run("fallback", 3);
+  TEST_ASSERT_EQUAL(0, server->eventChannels());
+  TEST_ASSERT_TRUE(polled.p95_ms < 500);
+  stop_fetching();
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_push_against_long_poll_latency);
+  RUN_TEST(test_dropped_channel_falls_back_to_polling);
+  return UNITY_END();
+}
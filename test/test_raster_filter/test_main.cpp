@@ -0,0 +1,121 @@
+// RasterFilter on ESC/POS jobs, well formed and not
+//
+//   pio test -e native -f test_raster_filter
+
+#include <Arduino.h>
+#include <unity.h>
+
+#include "ESC_POS_Printer/ESC_POS_Printer.h"
+#include "RasterFilter.hpp"
+
+#include "CapturePrint.hpp"
+
+static CapturePrint *out;
+static ESC_POS_Printer *printer;
+
+static std::string raster_header(uint8_t mode, uint16_t row_bytes, uint16_t rows) {
+  std::string header("\x1dv0", 3);
+  header += (char) mode;
+  header += (char) (row_bytes & 0xff);
+  header += (char) (row_bytes >> 8);
+  header += (char) (rows & 0xff);
+  header += (char) (rows >> 8);
+  return header;
+}
+
+// Filter job, written in pieces of piece bytes, returns what reached the printer
+static std::string filter(const std::string &job, size_t piece = 7) {
+  RasterFilter raster_filter(printer);
+  for (size_t i = 0; i < job.length(); i += piece) {
+    std::string part = job.substr(i, piece);
+    raster_filter.write((const uint8_t *) part.data(), part.length());
+  }
+  raster_filter.finish();
+  return out->str();
+}
+
+void setUp() {
+  out = new CapturePrint();
+  printer = new ESC_POS_Printer(out);
+}
+
+void tearDown() {
+  delete printer;
+  delete out;
+}
+
+void test_text_passes_unchanged() {
+  std::string job = "\x1b@Hello\n\x1b" "a\x01World\n";
+  TEST_ASSERT_TRUE(filter(job) == job);
+}
+
+void test_blank_rows_become_feeds() {
+  std::string job = raster_header(0, 2, 24);
+  job += std::string(2 * 4, '\xff');
+  job += std::string(2 * 16, '\0');
+  job += std::string(2 * 4, '\xff');
+  std::string printed = filter(job, 5);
+  // Two rasters of 4 rows with a feed of 16 rows in between
+  std::string expected = raster_header(0, 2, 4) + std::string(8, '\xff') + "\x1bJ\x10" +
+                         raster_header(0, 2, 4) + std::string(8, '\xff');
+  TEST_ASSERT_EQUAL(expected.length(), printed.length());
+  TEST_ASSERT_TRUE(printed == expected);
+}
+
+void test_empty_raster_header_is_dropped() {
+  std::string job = raster_header(0, 0, 8) + "A" + raster_header(0, 48, 0) + "B\n";
+  TEST_ASSERT_TRUE(filter(job) == "AB\n");
+}
+
+void test_raster_header_out_of_spec_is_dropped() {
+  // Bad mode, what follows can't be told from image data, up to the next command
+  std::string job = raster_header(0x7f, 2, 2) + std::string("\xff\xff\xff\xff", 4) + "\x1b@ok\n";
+  TEST_ASSERT_TRUE(filter(job) == "\xff\xff\xff\xff\x1b@ok\n");
+  printer->commit();
+  out->clear();
+  // Over 4095 rows
+  job = raster_header(0, 1, 5000) + "\x1b@ok\n";
+  TEST_ASSERT_TRUE(filter(job) == "\x1b@ok\n");
+}
+
+void test_wide_raster_passes_with_its_data() {
+  // Too wide to take apart, header and data go out as they are even if the data has ESC in it
+  std::string data(64 * 2, '\x1b');
+  std::string job = raster_header(0, 64, 2) + data + "x";
+  TEST_ASSERT_TRUE(filter(job) == raster_header(0, 64, 2) + data + "x");
+}
+
+void test_unknown_command_resyncs_at_next_command() {
+  // ESC 0x01 is no command, the raster after it is still taken apart
+  std::string job = std::string("\x1b\x01zz", 4) + raster_header(0, 1, 16) + std::string(16, '\0') + "end\n";
+  std::string printed = filter(job);
+  TEST_ASSERT_TRUE(printed == std::string("\x1b\x01zz", 4) + "\x1bJ\x10" + "end\n");
+}
+
+void test_unknown_command_ending_in_escape() {
+  // The ESC that made GS 0x1b unknown starts the next command
+  std::string job = std::string("\x1d\x1b@x", 4);
+  TEST_ASSERT_TRUE(filter(job) == job);
+}
+
+void test_parameter_blocks_are_skipped() {
+  // ESC ( A and GS * with parameter and bitmap data that looks like a raster command, neither is
+  // taken for one
+  std::string job = std::string("\x1b(A\x08\x00", 5) + raster_header(0, 0, 0);
+  job += std::string("\x1d*\x01\x01", 4) + raster_header(0, 0, 0);
+  job += "x";
+  TEST_ASSERT_TRUE(filter(job, 3) == job);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_text_passes_unchanged);
+  RUN_TEST(test_blank_rows_become_feeds);
+  RUN_TEST(test_empty_raster_header_is_dropped);
+  RUN_TEST(test_raster_header_out_of_spec_is_dropped);
+  RUN_TEST(test_wide_raster_passes_with_its_data);
+  RUN_TEST(test_unknown_command_resyncs_at_next_command);
+  RUN_TEST(test_unknown_command_ending_in_escape);
+  RUN_TEST(test_parameter_blocks_are_skipped);
+  return UNITY_END();
+}
@@ -0,0 +1,143 @@
+// Template rendering of the config page, and what it saves over the strreplace() copy it replaced
+//
+//   pio test -e native -f test_template
+
+#include <Arduino.h>
+#include <unity.h>
+
+#include <fstream>
+#include <sstream>
+
+#include "Template.hpp"
+
+// strreplace() from the string_helper.h that Template replaced, for comparison. Replaces the first
+// s1 in s in place, s must have room for the result.
+static char *strreplace(char *s, const char *s1, const char *s2) {
+  char *p = strstr(s, s1);
+  if (p != NULL) {
+    size_t len1 = strlen(s1);
+    size_t len2 = strlen(s2);
+    if (len1 != len2)
+      memmove(p + len2, p + len1, strlen(p + len1) + 1);
+    memcpy(p, s2, len2);
+  }
+  return s;
+}
+
+static const char *PRINTI_NAME = "kitchen";
+static const char *SSID = "Home & Garden";
+static const char *PASSKEY = "correct horse battery staple";
+
+static std::string config_html;
+
+static String value(const char *name) {
+  if (strcmp(name, "PRINTI_NAME") == 0 || strcmp(name, "PRINTI_NAME_TITLE") == 0) {
+    return PRINTI_NAME;
+  } else if (strcmp(name, "SSID") == 0) {
+    return SSID;
+  } else if (strcmp(name, "PASSKEY") == 0) {
+    return PASSKEY;
+  }
+  return String();
+}
+
+// The config page as the old handler built it: a copy of the whole page, the values put in one
+// after another, then sent as one String. Returns the bytes it had to allocate.
+static size_t send_with_strreplace(WebServer &server, const std::string &page) {
+  // The old handler allocated the page length only, which longer values overflowed
+  size_t len = page.length() + strlen(PRINTI_NAME) * 2 + strlen(SSID) + strlen(PASSKEY) + 1;
+  char *html = (char *) malloc(len);
+  memcpy(html, page.data(), page.length());
+  html[page.length()] = '\0';
+  strreplace(html, "{{PRINTI_NAME}}", PRINTI_NAME);
+  strreplace(html, "{{PRINTI_NAME_TITLE}}", PRINTI_NAME);
+  strreplace(html, "{{SSID}}", SSID);
+  strreplace(html, "{{PASSKEY}}", PASSKEY);
+  String body(html);
+  server.send(200, "text/html", body);
+  free(html);
+  return len + body.length() + 1;
+}
+
+// Average microseconds per call of f over iterations calls
+template<typename F>
+static double time_us(int iterations, F f) {
+  int64_t start_us = esp_timer_get_time();
+  for (int i = 0; i < iterations; i++) {
+    f();
+  }
+  return (double) (esp_timer_get_time() - start_us) / iterations;
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+void test_placeholders_are_replaced_and_escaped() {
+  std::string page = "<h1>{{PRINTI_NAME}}</h1><input value=\"{{SSID}}\">{{UNKNOWN}}";
+  Template page_template(page.data(), page.length());
+  WebServer server;
+  page_template.send(server, 200, "text/html", value);
+  TEST_ASSERT_EQUAL(200, server.sentCode());
+  TEST_ASSERT_EQUAL_STRING("<h1>kitchen</h1><input value=\"Home &amp; Garden\">", server.sentBody().c_str());
+}
+
+void test_braces_that_are_no_placeholder_are_kept() {
+  std::string page = "a {{ not a placeholder because it is far too long to be a name }} b {{SSID";
+  Template page_template(page.data(), page.length());
+  WebServer server;
+  page_template.send(server, 200, "text/html", value);
+  TEST_ASSERT_EQUAL_STRING(page.c_str(), server.sentBody().c_str());
+}
+
+void test_config_page_renders_as_before() {
+  Template page_template(config_html.data(), config_html.length());
+  WebServer templated;
+  page_template.send(templated, 200, "text/html", value);
+  WebServer replaced;
+  send_with_strreplace(replaced, config_html);
+  // Only the escaped & differs
+  std::string expected = replaced.sentBody().c_str();
+  expected.replace(expected.find("Home & Garden"), strlen(SSID), "Home &amp; Garden");
+  TEST_ASSERT_EQUAL(expected.length(), templated.sentBody().length());
+  TEST_ASSERT_TRUE(expected == templated.sentBody().c_str());
+}
+
+void test_benchmark_against_strreplace() {
+  const int iterations = 2000;
+  size_t copied = 0;
+  double strreplace_us = time_us(iterations, [&]() {
+    WebServer server;
+    copied = send_with_strreplace(server, config_html);
+  });
+  Template page_template(config_html.data(), config_html.length());
+  size_t pieces = 0;
+  double template_us = time_us(iterations, [&]() {
+    WebServer server;
+    page_template.send(server, 200, "text/html", value);
+    pieces = server.sentPieces();
+  });
+  printf("config page of %u bytes: strreplace %.1f us and %u bytes allocated, template %.1f us in %u pieces "
+         "and nothing allocated but the values\n",
+         (unsigned) config_html.length(), strreplace_us, (unsigned) copied, template_us, (unsigned) pieces);
+}
+
+int main(int argc, char **argv) {
+  std::string path = __FILE__;
+  path = path.substr(0, path.find_last_of('/')) + "/../../resources/config.html";
+  std::ifstream file(path, std::ios::binary);
+  std::stringstream contents;
+  contents << file.rdbuf();
+  config_html = contents.str();
+
+  UNITY_BEGIN();
+  RUN_TEST(test_placeholders_are_replaced_and_escaped);
+  RUN_TEST(test_braces_that_are_no_placeholder_are_kept);
+  if (config_html.empty()) {
+    printf("%s not found, skipping the config page\n", path.c_str());
+  } else {
+    RUN_TEST(test_config_page_renders_as_before);
+    RUN_TEST(test_benchmark_against_strreplace);
+  }
+  return UNITY_END();
+}
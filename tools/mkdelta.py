@@ -0,0 +1,196 @@
+#!/usr/bin/env python
+"""
+Make a delta OTA patch from one firmware image to another, for `src/DeltaPatch.hpp`.
+
+    python tools/mkdelta.py old-firmware.bin new-firmware.bin [out-dir]
+
+The patch is written zlib-compressed next to the new image (or into *out-dir*) as
+`<new image>.from-<old version>`, which is where the device looks for it:
+the URL of the full image plus `.from-` and the version it is running. Put it on
+the server alongside the full image; devices running any other version keep
+downloading the full image.
+
+Both images must be the ones devices actually run, i.e. after `patchappinfos.py`
+stamped them, as the patch only applies to an image with exactly the same hash.
+
+The patch is applied again here and checked before it is written.
+"""
+import hashlib
+import io
+import os
+import struct
+import sys
+import zlib
+
+from typing import List, Tuple
+
+
+#: Offset of `esp_app_desc_t.version` in an image: image header (24) + segment
+#: header (8) + magic, secure version and reserved words (16).
+APP_DESC_VERSION_OFFSET = 48
+APP_DESC_VERSION_LEN = 32
+#: Bytes of the new image looked up in the old one to start a match.
+SEED_LEN = 12
+#: Old image positions indexed for seeds, every SEED_STRIDE bytes.
+#: A match at least SEED_LEN + SEED_STRIDE - 1 long is always found.
+SEED_STRIDE = 4
+#: Matches shorter than this aren't worth an operation.
+MIN_MATCH = 16
+#: Window in which an approximate match has to keep agreeing on at least half
+#: the bytes. Code that only moved differs in the addresses it refers to,
+#: which an ADD operation encodes as small, well compressing differences.
+FUZZY_WINDOW = 16
+
+Op = Tuple  # ("C", offset, length) | ("A", offset, bytes) | ("I", bytes)
+
+
+def app_version(image: bytes) -> bytes:
+    return image[APP_DESC_VERSION_OFFSET : APP_DESC_VERSION_OFFSET + APP_DESC_VERSION_LEN]
+
+
+def build_index(old: bytes) -> dict:
+    index = {}
+    for i in range(0, len(old) - SEED_LEN + 1, SEED_STRIDE):
+        index.setdefault(old[i : i + SEED_LEN], i)
+    return index
+
+
+def find_seed(old: bytes, new: bytes, index: dict, j: int) -> Tuple[int, int]:
+    """:return: 2-tuple of (old offset, new offset) of an exact seed at or just after j, or None"""
+    for k in range(SEED_STRIDE):
+        i = index.get(new[j + k : j + k + SEED_LEN])
+        if i is not None:
+            return i, j + k
+    return None
+
+
+def extend(old: bytes, new: bytes, i: int, j: int) -> int:
+    """:return: length of the approximate match of old[i:] and new[j:]"""
+    n = 0
+    best = 0
+    agree = 0
+    limit = min(len(old) - i, len(new) - j)
+    while n < limit:
+        agree += old[i + n] == new[j + n]
+        if n >= FUZZY_WINDOW:
+            agree -= old[i + n - FUZZY_WINDOW] == new[j + n - FUZZY_WINDOW]
+            if agree * 2 < FUZZY_WINDOW:
+                break
+        n += 1
+        if old[i + n - 1] == new[j + n - 1]:
+            # Never end on a mismatch
+            best = n
+    return best
+
+
+def diff(old: bytes, new: bytes) -> List[Op]:
+    index = build_index(old)
+    ops = []
+    literal_start = 0
+    j = 0
+    # Continuing where the last match ended in the old image is the most likely match
+    last_delta = 0
+    while j < len(new):
+        candidates = []
+        if 0 <= j + last_delta < len(old):
+            candidates.append((j + last_delta, j))
+        seed = find_seed(old, new, index, j)
+        if seed is not None:
+            candidates.append(seed)
+
+        best = None
+        for i, start in candidates:
+            n = extend(old, new, i, start)
+            if n >= MIN_MATCH and (best is None or start + n > best[1] + best[2]):
+                best = (i, start, n)
+        if best is None:
+            j += 1
+            continue
+
+        i, start, n = best
+        if start > literal_start:
+            ops.append(("I", new[literal_start:start]))
+        differences = bytes((new[start + k] - old[i + k]) & 0xFF for k in range(n))
+        if any(differences):
+            ops.append(("A", i, differences))
+        else:
+            ops.append(("C", i, n))
+        j = literal_start = start + n
+        last_delta = i - start
+    if literal_start < len(new):
+        ops.append(("I", new[literal_start:]))
+    return ops
+
+
+def encode(old: bytes, new: bytes, ops: List[Op]) -> bytes:
+    out = io.BytesIO()
+    out.write(b"PDLT" + bytes([1, 0, 0, 0]))
+    out.write(struct.pack("<II", len(old), len(new)))
+    out.write(app_version(new))
+    out.write(hashlib.sha256(old).digest())
+    out.write(hashlib.sha256(new).digest())
+    for op in ops:
+        if op[0] == "C":
+            out.write(b"C" + struct.pack("<II", op[1], op[2]))
+        elif op[0] == "A":
+            out.write(b"A" + struct.pack("<II", op[1], len(op[2])) + op[2])
+        else:
+            out.write(b"I" + struct.pack("<I", len(op[1])) + op[1])
+    out.write(b"E")
+    return out.getvalue()
+
+
+def apply(old: bytes, patch: bytes) -> bytes:
+    """Apply an uncompressed patch the way the device does, for checking."""
+    assert patch[:5] == b"PDLT\x01"
+    source_size, target_size = struct.unpack_from("<II", patch, 8)
+    assert hashlib.sha256(old).digest() == patch[48:80] and source_size == len(old)
+    out = bytearray()
+    p = 112
+    while patch[p : p + 1] != b"E":
+        op = patch[p : p + 1]
+        if op in (b"C", b"A"):
+            offset, length = struct.unpack_from("<II", patch, p + 1)
+            p += 9
+            if op == b"C":
+                out += old[offset : offset + length]
+            else:
+                out += bytes((old[offset + k] + patch[p + k]) & 0xFF for k in range(length))
+                p += length
+        else:
+            (length,) = struct.unpack_from("<I", patch, p + 1)
+            p += 5
+            out += patch[p : p + length]
+            p += length
+    assert len(out) == target_size and hashlib.sha256(out).digest() == patch[80:112]
+    return bytes(out)
+
+
+def main(argv):
+    if len(argv) not in (3, 4):
+        sys.exit(__doc__)
+    with io.open(argv[1], "rb") as fd:
+        old = fd.read()
+    with io.open(argv[2], "rb") as fd:
+        new = fd.read()
+    out_dir = argv[3] if len(argv) == 4 else os.path.dirname(argv[2])
+
+    ops = diff(old, new)
+    patch = encode(old, new, ops)
+    apply(old, patch)
+    compressed = zlib.compress(patch, 9)
+
+    old_version = app_version(old).rstrip(b"\0").decode()
+    out_path = os.path.join(out_dir, f"{os.path.basename(argv[2])}.from-{old_version}")
+    with io.open(out_path, "wb") as fd:
+        fd.write(compressed)
+
+    copied = sum(op[2] if op[0] == "C" else len(op[2]) for op in ops if op[0] != "I")
+    print(
+        f"{out_path}: {len(compressed)} bytes instead of {len(zlib.compress(new, 9))} compressed,"
+        f" {copied} of {len(new)} bytes taken from {old_version}"
+    )
+
+
+if __name__ == "__main__":
+    main(sys.argv)
@@ -0,0 +1,159 @@
+"""
+A *platformio* PRE-script to prepare the static files of the config page.
+
+Every asset listed in `WEB_ASSETS` is
+
+- subset to the glyphs the page can show, for fonts, if `fontTools` is installed
+  (`pip install fonttools`), otherwise the font is used whole,
+- gzip-compressed,
+- hashed, the hash becomes the asset's `ETag`,
+
+and written as a byte array into `${BUILD_DIR}/webassets/webassets.h`, which is
+put on the include path. The sizes before and after are printed on every build.
+
+`config.html` is not handled here, it is filled in at runtime by `Template.hpp`
+and stays embedded raw.
+"""
+import gzip
+import hashlib
+import io
+import os
+import string
+
+from typing import List, Tuple
+
+
+#: (resource file, URL path, content type) of every asset served compressed.
+WEB_ASSETS = [
+    ("resources/logo.svg", "/logo.svg", "image/svg+xml"),
+    ("resources/courgette.ttf", "/courgette.ttf", "font/ttf"),
+]
+#: Pages whose text decides which glyphs fonts keep.
+FONT_TEXT_SOURCES = ["resources/config.html"]
+#: Kept in fonts on top of the page text, the printer name shown in the title
+#: is whatever the user typed.
+FONT_EXTRA_TEXT = string.printable + "".join(chr(c) for c in range(0xA0, 0x100))
+#: The generated header, relative to `${BUILD_DIR}`.
+HEADER_PATH = os.path.join("webassets", "webassets.h")
+
+
+def subset_font(data: bytes, text: str) -> Tuple[bytes, str]:
+    """
+    :return: 2-tuple of (font, how it was subset)
+    """
+    try:
+        from fontTools import subset
+        from fontTools.ttLib import TTFont
+    except ImportError:
+        return data, "not subset, fontTools missing"
+
+    font = TTFont(io.BytesIO(data))
+    subsetter = subset.Subsetter()
+    subsetter.populate(text=text)
+    subsetter.subset(font)
+    out = io.BytesIO()
+    font.save(out)
+    return out.getvalue(), f"subset to {len(set(text))} characters"
+
+
+def c_identifier(path: str) -> str:
+    return "".join(c if c.isalnum() else "_" for c in os.path.basename(path))
+
+
+def build_assets(project_dir: str) -> Tuple[str, List[str]]:
+    """
+    :return: 2-tuple of (header contents, report lines)
+    """
+    font_text = FONT_EXTRA_TEXT
+    for source in FONT_TEXT_SOURCES:
+        with io.open(os.path.join(project_dir, source), "rt", encoding="utf-8") as fd:
+            font_text += fd.read()
+
+    arrays = []
+    entries = []
+    report = []
+    total_raw = total_gz = 0
+    for source, url, content_type in WEB_ASSETS:
+        with io.open(os.path.join(project_dir, source), "rb") as fd:
+            raw = fd.read()
+        data, note = raw, ""
+        if content_type.startswith("font/"):
+            data, note = subset_font(raw, font_text)
+            note = f" ({note})"
+        # mtime=0 so that unchanged assets give identical bytes and hashes
+        compressed = gzip.compress(data, compresslevel=9, mtime=0)
+        etag = hashlib.sha256(compressed).hexdigest()[:16]
+
+        name = c_identifier(source)
+        rows = [
+            "  " + ",".join(str(b) for b in compressed[i : i + 24]) + ","
+            for i in range(0, len(compressed), 24)
+        ]
+        arrays.append(f"static const uint8_t webasset_{name}[] = {{\n" + "\n".join(rows) + "\n};")
+        entries.append(
+            f'  {{"{url}", "{content_type}", webasset_{name}, sizeof(webasset_{name}), "\\"{etag}\\""}},'
+        )
+        report.append(f"  {url}: {len(raw)} -> {len(data)} -> {len(compressed)} bytes gzipped{note}")
+        total_raw += len(raw)
+        total_gz += len(compressed)
+
+    report.append(
+        f"  total: {total_raw} -> {total_gz} bytes, {total_raw - total_gz} bytes of flash saved"
+    )
+    header = "\n".join(
+        [
+            "// Generated by tools/webassets.py, do not edit",
+            "#pragma once",
+            "",
+            "#include <stddef.h>",
+            "#include <stdint.h>",
+            "",
+            "typedef struct {",
+            "  const char *path;",
+            "  const char *content_type;",
+            "  // gzip-compressed",
+            "  const uint8_t *data;",
+            "  size_t len;",
+            "  // Quoted, as sent in the ETag header",
+            "  const char *etag;",
+            "} webasset_t;",
+            "",
+            *arrays,
+            "",
+            "static const webasset_t WEB_ASSETS[] = {",
+            *entries,
+            "};",
+            "",
+            f"static const size_t WEB_ASSET_COUNT = {len(WEB_ASSETS)};",
+            "",
+        ]
+    )
+    return header, report
+
+
+def write_if_changed(path: str, contents: str):
+    """Leave the file alone when nothing changed, so sources including it aren't rebuilt."""
+    try:
+        with io.open(path, "rt") as fd:
+            if fd.read() == contents:
+                return
+    except FileNotFoundError:
+        pass
+    os.makedirs(os.path.dirname(path), exist_ok=True)
+    with io.open(path, "wt") as fd:
+        fd.write(contents)
+
+
+def generate_web_assets(env):
+    header, report = build_assets(env.subst("$PROJECT_DIR"))
+    header_path = os.path.join(env.subst("$BUILD_DIR"), HEADER_PATH)
+    write_if_changed(header_path, header)
+    print("WEBASSETS: raw -> prepared -> compressed\n" + "\n".join(report))
+
+    env.Append(CPPPATH=[os.path.dirname(header_path)])
+
+
+if __name__ == "SCons.Script":
+    Import("env")
+
+    generate_web_assets(env)